@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2013 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "jedec.h"
+#include "spi.h"
+
+#define MFR_ATMEL     0x1F
+#define MFR_SST       0xBF
+
+static const char *manufacturer(uint8 id) {
+	switch ( id ) {
+	case 0x01: return "Spansion";
+	case 0x1F: return "Atmel";
+	case 0x20: return "Micron";
+	case 0x9D: return "ISSI";
+	case 0xBF: return "SST";
+	case 0xC2: return "Macronix";
+	case 0xC8: return "GigaDevice";
+	case 0xEF: return "Winbond";
+	default: return NULL;
+	}
+}
+
+static void setName(struct Geometry *geom, uint32 bytes, const char *kind) {
+	const char *const mfr = manufacturer(geom->id[0]);
+	char mfrHex[8];
+	if ( !mfr ) {
+		sprintf(mfrHex, "%02X", geom->id[0]);
+	}
+	if ( bytes >= 0x20000 ) {
+		sprintf(geom->name, "%s %uMbit %s", mfr ? mfr : mfrHex, bytes >> 17, kind);
+	} else {
+		sprintf(geom->name, "%s %uKbit %s", mfr ? mfr : mfrHex, bytes >> 7, kind);
+	}
+}
+
+// The D-series DataFlash parts, by the density code in the bottom five bits of the second ID byte,
+// in their default (non power-of-two) page size
+//
+static const struct {
+	uint8 density;
+	uint32 numPages;
+	uint32 pageSize;
+	uint32 pageShift;
+	bool singleBuffer;
+} dataFlashes[] = {
+	{0x02,  512,  264,  9, true},   // AT45DB011D
+	{0x03, 1024,  264,  9, false},  // AT45DB021D
+	{0x04, 2048,  264,  9, false},  // AT45DB041D
+	{0x05, 4096,  264,  9, false},  // AT45DB081D
+	{0x06, 4096,  528, 10, false},  // AT45DB161D
+	{0x07, 8192,  528, 10, false},  // AT45DB321D
+	{0x08, 8192, 1056, 11, false}   // AT45DB642D
+};
+
+bool jedecDataFlash(const uint8 *id, uint8 status, struct Geometry *geom) {
+	uint32 i;
+	if ( id[0] != MFR_ATMEL || (id[1] >> 5) != 0x01 ) {
+		return false;
+	}
+	for ( i = 0; i < sizeof(dataFlashes) / sizeof(*dataFlashes); i++ ) {
+		if ( dataFlashes[i].density == (id[1] & 0x1F) ) {
+			break;
+		}
+	}
+	if ( i == sizeof(dataFlashes) / sizeof(*dataFlashes) ) {
+		return false;
+	}
+	memset(geom, 0, sizeof(*geom));
+	memcpy(geom->id, id, 3);
+	geom->isDataFlash = true;
+	geom->numPages = dataFlashes[i].numPages;
+	geom->singleBuffer = dataFlashes[i].singleBuffer;
+	if ( status & 0x01 ) {
+		// Power-of-two pages are addressed by byte, so the shift is just the page size's
+		geom->pageShift = dataFlashes[i].pageShift - 1;
+		geom->pageSize = 1U << geom->pageShift;
+	} else {
+		geom->pageShift = dataFlashes[i].pageShift;
+		geom->pageSize = dataFlashes[i].pageSize;
+	}
+
+	// Only the AT45DQ parts have the 3B/6B reads, and nothing in the ID tells them from the AT45DB
+	// parts, so a DataFlash is always read on one line. The DQ's quad read would also need the QE
+	// bit in its configuration register, which flashprog leaves alone.
+	geom->ioModes = 0x00;
+	setName(geom, geom->numPages << (dataFlashes[i].pageShift - 1), "DataFlash");
+	return true;
+}
+
+void jedecDataFlashGiven(uint32 pageSize, uint32 pageShift, struct Geometry *geom) {
+	memset(geom, 0, sizeof(*geom));
+	strcpy(geom->name, "DataFlash");
+	geom->isDataFlash = true;
+	geom->pageSize = pageSize;
+	geom->pageShift = pageShift;
+	geom->ioModes = 0x00;  // see jedecDataFlash()
+}
+
+bool jedecSfdpHeader(const uint8 *header, uint32 *bfptAddr, uint32 *bfptLen) {
+	if ( memcmp(header, "SFDP", 4) || header[5] != 0x01 ) {
+		return false;
+	}
+	if ( header[8] != 0x00 || header[10] != 0x01 || header[11] < 9 ) {
+		return false;  // JESD216 says the first table is the basic one, of at least nine DWORDs
+	}
+	*bfptAddr = header[12] | (header[13] << 8) | ((uint32)header[14] << 16);
+	*bfptLen = 4 * header[11];
+	if ( *bfptLen > BFPT_MAX ) {
+		*bfptLen = BFPT_MAX;
+	}
+	return true;
+}
+
+static uint32 dword(const struct Geometry *geom, uint32 n) {
+	const uint8 *const p = geom->bfpt + 4 * (n - 1);
+	return (4 * n <= geom->bfptLen) ? p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32)p[3] << 24) : 0;
+}
+
+static void addErase(struct Geometry *geom, uint32 size, uint8 cmd) {
+	uint32 i = geom->numErase;
+	while ( i && geom->erase[i-1].size > size ) {
+		geom->erase[i] = geom->erase[i-1];
+		i--;
+	}
+	geom->erase[i].size = size;
+	geom->erase[i].cmd = cmd;
+	geom->numErase++;
+}
+
+bool jedecSfdpParse(const uint8 *id, struct Geometry *geom) {
+	const uint32 dw1 = dword(geom, 1), dw2 = dword(geom, 2), dw3 = dword(geom, 3), dw4 = dword(geom, 4);
+	const uint32 dw8 = dword(geom, 8), dw9 = dword(geom, 9), dw11 = dword(geom, 11);
+	const uint32 dw15 = dword(geom, 15);
+	uint32 bytes, i, eraseType;
+	if ( ((dw1 >> 17) & 0x03) == 0x02 ) {
+		return false;  // four-byte addresses only
+	}
+	if ( dw2 & 0x80000000 ) {
+		bytes = ((dw2 & 0x7FFFFFFF) >= 35) ? 0xFFFFFFFF : (uint32)((1ULL << (dw2 & 0x7FFFFFFF)) / 8);
+	} else {
+		bytes = (uint32)(((uint64)dw2 + 1) / 8);
+	}
+	memcpy(geom->id, id, 3);
+	geom->isDataFlash = false;
+	geom->pageSize = (geom->bfptLen >= 44) ? 1U << ((dw11 >> 4) & 0x0F) : 256;
+	geom->pageShift = 0;
+	setName(geom, bytes, "SPI flash");
+	if ( bytes > ADDR_MAX ) {
+		bytes = ADDR_MAX;  // the rest needs four-byte addresses
+	}
+	geom->numPages = bytes / geom->pageSize;
+	geom->singleBuffer = false;
+
+	// Erase types 1-4, each with log2 of its size and its command, then the 4KiB erase in DWORD 1 if
+	// the table has none of them
+	geom->numErase = 0;
+	for ( i = 0; i < MAX_ERASE_TYPES; i++ ) {
+		eraseType = ((i < 2) ? dw8 : dw9) >> (16 * (i & 1));
+		if ( (eraseType & 0xFF) >= 8 && (eraseType & 0xFF) < 32 ) {
+			addErase(geom, 1U << (eraseType & 0xFF), (uint8)(eraseType >> 8));
+		}
+	}
+	if ( !geom->numErase && (dw1 & 0x03) == 0x01 ) {
+		addErase(geom, 0x1000, (uint8)(dw1 >> 8));
+	}
+	if ( !geom->numErase || geom->pageSize < 16 || geom->pageSize > geom->erase[0].size || !geom->numPages ) {
+		return false;
+	}
+
+	// readArray() sends eight dummy clocks as an FF byte, so the wide reads are only used if that is
+	// what they want, with no mode clocks. The quad read also needs the part to have no quad enable
+	// bit (JESD216A, DWORD 15), since flashprog leaves the status registers alone.
+	geom->ioModes = 0x00;
+	if ( (dw1 & (1 << 16)) && (dw4 & 0xFF) == 0x08 ) {
+		geom->ioModes |= IO_X2;
+		geom->dualCmd = (uint8)(dw4 >> 8);
+	}
+	if ( (dw1 & (1 << 22)) && ((dw3 >> 16) & 0xFF) == 0x08 && geom->bfptLen >= 60 && !((dw15 >> 20) & 0x07) ) {
+		geom->ioModes |= IO_X4;
+		geom->quadCmd = (uint8)(dw3 >> 24);
+	}
+	return true;
+}
+
+bool jedecFromId(const uint8 *id, struct Geometry *geom) {
+	if ( id[0] == MFR_ATMEL || id[0] == MFR_SST || id[2] < 0x10 || id[2] > 0x19 ) {
+		return false;  // Atmel and SST number their parts differently
+	}
+	memset(geom, 0, sizeof(*geom));
+	memcpy(geom->id, id, 3);
+	geom->pageSize = 256;
+	setName(geom, 1U << id[2], "SPI flash");
+	geom->numPages = ((id[2] > 24) ? ADDR_MAX : 1U << id[2]) / geom->pageSize;
+	addErase(geom, 0x1000, 0x20);
+	addErase(geom, 0x10000, 0xD8);
+	return true;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2013 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef JEDEC_H
+#define JEDEC_H
+
+#include <makestuff.h>
+
+#define SFDP_HEADER_SIZE 16   // the SFDP header and the first parameter header
+#define BFPT_MAX         80   // the 20 DWORDs of a JESD216D basic flash parameter table
+#define MAX_ERASE_TYPES  4
+#define ADDR_MAX         0x1000000  // three-byte addressing reaches 16MiB
+
+// What flashprog needs to know about a flash part: found from its JEDEC ID and, for a 25-series
+// part, its SFDP tables, or given with -s for a DataFlash which can't be identified.
+//
+struct EraseType {
+	uint32 size;
+	uint8 cmd;
+};
+
+struct Geometry {
+	uint8 id[3];
+	char name[48];
+	bool isDataFlash;     // AT45 command set, rather than 25-series
+	uint32 pageSize;
+	uint32 pageShift;     // DataFlash: pages are addressed as pageNum << pageShift
+	uint32 numPages;      // zero if unknown
+	bool singleBuffer;    // DataFlash with only SRAM buffer 1
+	struct EraseType erase[MAX_ERASE_TYPES];  // 25-series, smallest first
+	uint32 numErase;
+	uint8 ioModes;        // IO_X2 and/or IO_X4, for the dual- and quad-output reads
+	uint8 dualCmd;
+	uint8 quadCmd;
+	uint32 bfptAddr;      // the basic flash parameter table as read, if there is one
+	uint32 bfptLen;
+	uint8 bfpt[BFPT_MAX];
+};
+
+// Describe a DataFlash (manufacturer 1F, family 001) from its JEDEC ID and the status register,
+// whose bit 0 says whether it has been configured for power-of-two pages. Returns false for any
+// other part.
+//
+bool jedecDataFlash(const uint8 *id, uint8 status, struct Geometry *geom);
+
+// Describe a DataFlash which can't be identified, from the page size and page-address shift given
+// with -s. Its capacity is unknown, so nothing is checked against it.
+//
+void jedecDataFlashGiven(uint32 pageSize, uint32 pageShift, struct Geometry *geom);
+
+// Find the basic flash parameter table from the SFDP header and the first parameter header. Returns
+// false if the part has no SFDP, or the first table is not the basic one.
+//
+bool jedecSfdpHeader(const uint8 *header, uint32 *bfptAddr, uint32 *bfptLen);
+
+// Describe a 25-series part from its JEDEC ID and basic flash parameter table (geom->bfpt and
+// geom->bfptLen). Returns false if the table describes something flashprog can't drive.
+//
+bool jedecSfdpParse(const uint8 *id, struct Geometry *geom);
+
+// Describe a 25-series part with no SFDP from its JEDEC ID alone: most manufacturers give log2 of
+// the capacity in the third byte, and all such parts have 256-byte pages, 4KiB sector erase (20)
+// and 64KiB block erase (D8). The faster reads are left alone, since not all of them have them.
+// Returns false if the capacity byte doesn't look like one.
+//
+bool jedecFromId(const uint8 *id, struct Geometry *geom);
+
+#endif
@@ -16,179 +16,1844 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #include <libfpgalink.h>
 #include <liberror.h>
 #include "args.h"
+#include "jedec.h"
+#include "spi.h"
+#include "prof.h"
 
-#define TURBO    (1<<0)
-#define ENABLE   (1<<1)
-#define SUPPRESS (1<<2)
+// With several boards, each is programmed by its own thread, so anything here which belongs to a
+// board is per thread (as is all of libspitalk's state).
+#ifdef WIN32
+	#define THREAD_LOCAL __declspec(thread)
+#else
+	#define THREAD_LOCAL __thread
+#endif
 
-static struct FLContext *handle = NULL;
-static uint8 config = TURBO;
+// The chip-select bits of the part(s) the commands below talk to. Commands which drive nothing
+// back on MISO (buffer writes, programs and compares) may go to several parts at once, since the
+// parts are on the same bus, but anything which reads must select only one.
+//
+static THREAD_LOCAL uint8 selected = CHIPSEL;
+
+// What the part(s) are, which decides the command set: a DataFlash, or a 25-series part
+//
+static THREAD_LOCAL const struct Geometry *geometry = NULL;
+
+// With several boards, each board's messages begin with its VID:PID:DID
+//
+static THREAD_LOCAL const char *boardName = NULL;
+
+// Each board's progress is written by its own thread and read by runFarm()'s progress report, so
+// with several boards it is only touched with the farm's lock held
+//
+static struct {
+	#ifdef WIN32
+		CRITICAL_SECTION lock;
+	#else
+		pthread_mutex_t lock;
+	#endif
+} farm;
 
-static inline FLStatus setConfig(uint8 mask, uint8 val, uint8 prevCount, const char **error) {
-	uint8 buf[256], i;
-	for ( i = 0; i < prevCount; i++ ) {
-		buf[i] = config;
+#ifdef WIN32
+	#define LOCK()   EnterCriticalSection(&farm.lock)
+	#define UNLOCK() LeaveCriticalSection(&farm.lock)
+#else
+	#define LOCK()   pthread_mutex_lock(&farm.lock)
+	#define UNLOCK() pthread_mutex_unlock(&farm.lock)
+#endif
+
+static void setProgress(uint32 *field, uint32 value) {
+	if ( boardName ) {
+		LOCK();
+		*field = value;
+		UNLOCK();
+	} else {
+		*field = value;
+	}
+}
+
+static void say(FILE *stream, const char *format, ...) {
+	char line[256];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	if ( boardName ) {
+		fprintf(stream, "%s: %s", boardName, line);
+	} else {
+		fputs(line, stream);
 	}
-	config = (uint8)(config & ~mask);
-	config |= val;
-	buf[i++] = config;
-	return flWriteChannel(handle, 1000, 0x01, i, buf, error);
+}
+
+static double wallTime(void) {
+	#ifdef WIN32
+		return GetTickCount() / 1000.0;
+	#else
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return tv.tv_sec + tv.tv_usec / 1000000.0;
+	#endif
 }
 
 #define CMD_BUF1_FLASH 0x83
+#define CMD_BUF2_FLASH 0x86
 #define CMD_BUF1_WRITE 0x84
+#define CMD_BUF2_WRITE 0x87
 #define CMD_BUF1_READ  0xD1
 #define CMD_STATUS     0xD7
 #define CMD_READ       0x03
+#define CMD_BUF1_CMP   0x60
+#define CMD_BUF2_CMP   0x61
+#define CMD_ID         0x9F
+#define CMD_SECURITY   0x77
+#define CMD_SFDP       0x5A
+
+// 25-series commands
+#define CMD_WRITE_EN   0x06
+#define CMD_WRITE_SR   0x01
+#define CMD_READ_SR    0x05
+#define CMD_PROGRAM    0x02
+#define CMD_UNIQUE_ID  0x4B
 
 #define BM_READY       0x80
+#define BM_COMP        0x40
+#define BM_BUSY        0x01  // 25-series
+#define BM_PROTECT     0x3C  // 25-series block protect bits
+
+#define READY_BYTES    0x0FFFFF  // status reads before giving up: about 350ms at 24MHz
+#define ERASE_BYTES    0xFFFFFF  // about 5.6s, for a 25-series block erase
 
 typedef enum {
 	FLASH_SUCCESS,
 	FLASH_FPGALINK,
 	FLASH_ALLOC,
-	FLASH_FILE
+	FLASH_FILE,
+	FLASH_TIMEOUT,
+	FLASH_CLOCK,
+	FLASH_VERIFY,
+	FLASH_NO_ID,
+	FLASH_UNKNOWN,
+	FLASH_MISMATCH,
+	FLASH_PROTECTED
 } FlashStatus;
 
+// Queue a command (and any data following it) with the chip selected, then deselect it. The
+// command may be gathered from several buffers; those marked byRef go over USB as they are, so a
+// page of data can be sent straight from the input file's mapping, without first copying it in
+// after the command bytes. Like everything queued, it is sent by the next spiFlush() (or the next
+// waitReady() or readCommand()).
+//
+struct Segment {
+	const uint8 *data;
+	uint32 count;
+	bool byRef;
+};
+
+static FlashStatus sendSegments(const struct Segment *segs, uint32 numSegs, const char **error) {
+	FlashStatus retVal = FLASH_SUCCESS;
+	FLStatus status;
+	uint32 i;
+	spiConfig(CHIPSEL_MASK | SUPPRESS, selected | SUPPRESS);
+	for ( i = 0; i < numSegs; i++ ) {
+		if ( segs[i].byRef ) {
+			spiQueueRef(segs[i].data, segs[i].count, NULL);
+		} else {
+			spiQueue(segs[i].data, segs[i].count, NULL);
+		}
+	}
+	spiConfig(CHIPSEL_MASK, 0x00);
+	status = spiStatus(error);
+	CHECK_STATUS(status, FLASH_FPGALINK, cleanup, "sendCommand()");
+cleanup:
+	return retVal;
+}
+
+static FlashStatus sendCommand(const uint8 *buf, uint32 count, const char **error) {
+	struct Segment seg;
+	seg.data = buf;
+	seg.count = count;
+	seg.byRef = false;
+	return sendSegments(&seg, 1, error);
+}
+
+// Poll the status register until the top bit is set, and return the final status byte if
+// statusByte is not NULL. The status register may be read continuously, so if the FPGA has the
+// poll engine it can do the whole loop itself, and give up after about 350ms at 24MHz:
+//   w1 07;w0 D7;w2 FF80800FFFFF;w1 01;r0 1
+//
+// Otherwise the status is clocked in batches until it's ready (see spiWaitFor()):
+//   w1 05;w0 D7FFFFFF...;r0 <batch>;...;w1 01
+//
+// A 25-series part has its status register at 05 instead, and is ready when bit 0 is clear; an
+// erase may take longer, so pollBytes says how many status reads to allow:
+//   w1 07;w0 05;w2 FF0100FFFFFF;w1 01;r0 1
+//
+// Either way, anything queued before it goes in the same USB transactions.
+//
+static FlashStatus waitReadyFor(uint32 pollBytes, uint8 *statusByte, const char **error) {
+	FlashStatus retVal = FLASH_SUCCESS;
+	FLStatus status;
+	const uint8 cmd = geometry->isDataFlash ? CMD_STATUS : CMD_READ_SR;
+	const uint8 mask = geometry->isDataFlash ? BM_READY : BM_BUSY;
+	const uint8 match = geometry->isDataFlash ? BM_READY : 0x00;
+	const bool usePoll = (spiFeatures() & FEATURE_POLL) ? true : false;
+	uint8 result = (uint8)~match;
+	spiConfig(CHIPSEL_MASK | SUPPRESS, usePoll ? selected | SUPPRESS : selected);
+	spiQueue(&cmd, 1, NULL);
+	spiPoll(mask, match, pollBytes, &result);
+	spiConfig(CHIPSEL_MASK | SUPPRESS, 0x00);
+	status = spiFlush();
+	if ( !status ) {
+		status = spiStatus(error);
+	}
+	CHECK_STATUS(status, FLASH_FPGALINK, cleanup, "waitReady()");
+	CHECK_STATUS(
+		(result & mask) != match, FLASH_TIMEOUT, cleanup,
+		"waitReady(): Timed out waiting for the flash to become ready"
+	);
+	if ( statusByte ) {
+		*statusByte = result;
+	}
+cleanup:
+	return retVal;
+}
+
+static FlashStatus waitReady(uint8 *statusByte, const char **error) {
+	return waitReadyFor(READY_BYTES, statusByte, error);
+}
+
+// Send a command, then read back count bytes. For example, to read the start of SRAM buffer 1:
+//   w1 07;w0 D1000000;w1 03;w0 FFFFFFFF;w1 01;r0 4
+//
+static FlashStatus readCommand(const uint8 *cmd, uint32 cmdLen, uint8 *buf, uint32 count, const char **error) {
+	FlashStatus retVal = FLASH_SUCCESS;
+	FLStatus status;
+	spiConfig(CHIPSEL_MASK | SUPPRESS, selected | SUPPRESS);
+	spiQueue(cmd, cmdLen, NULL);
+	spiConfig(SUPPRESS, 0x00);
+	spiFill(0xFF, count, buf);
+	spiConfig(CHIPSEL_MASK, 0x00);
+	spiFlush();
+	status = spiStatus(error);
+	CHECK_STATUS(status, FLASH_FPGALINK, cleanup, "readCommand()");
+cleanup:
+	return retVal;
+}
+
+static FlashStatus readBuffer(uint8 *buf, uint32 count, const char **error) {
+	static const uint8 cmd[4] = {CMD_BUF1_READ, 0x00, 0x00, 0x00};
+	return readCommand(cmd, 4, buf, count, error);
+}
+
+// Step the TURBO clock up from NEGOTIATE_START towards sysClk/2, reading something known back from
+// each of the parts in selects a few times at each step. Stop at the first mismatch, and settle on
+// the last divider which worked for all of them. A DataFlash has a pattern written to its SRAM
+// buffer 1 and read back; a 25-series part has no buffer, so its basic flash parameter table (read
+// at NEGOTIATE_START when it was identified) is read back, or failing that its JEDEC ID. Either way
+// the flash array is left alone.
+//
+#define NEGOTIATE_START 15  // 1.5MHz @48MHz
+#define NEGOTIATE_TRIES 4
+
+static FlashStatus negotiateClock(uint8 selects, uint8 *divider, const char **error) {
+	FlashStatus retVal = FLASH_SUCCESS, status;
+	static const uint8 idCmd[1] = {CMD_ID};
+	const uint8 sfdpCmd[5] = {
+		CMD_SFDP, (uint8)(geometry->bfptAddr >> 16), (uint8)(geometry->bfptAddr >> 8),
+		(uint8)geometry->bfptAddr, 0x00
+	};
+	uint32 pageSize = geometry->pageSize;
+	uint8 *const pattern = malloc(pageSize+4);
+	uint8 *const readback = malloc(pageSize);
+	int div, best = -1;
+	uint32 i, attempt;
+	bool isGood = true;
+	FLStatus flStatus;
+	CHECK_STATUS(!pattern || !readback, FLASH_ALLOC, cleanup, "negotiateClock(): Allocation error");
+	if ( pageSize > spiBatchMax() ) {
+		pageSize = spiBatchMax();  // keep each readback to one round trip
+	}
+	for ( div = NEGOTIATE_START; div >= 0 && isGood; div-- ) {
+		spiSetDivider((uint8)div);
+		flStatus = spiStatus(error);
+		CHECK_STATUS(flStatus, FLASH_FPGALINK, cleanup, "negotiateClock()");
+		for ( attempt = 0; attempt < NEGOTIATE_TRIES && isGood; attempt++ ) {
+			for ( selected = CHIPSEL; selected && isGood; selected = (uint8)(selected << 1) ) {
+				if ( !(selects & selected) ) {
+					continue;
+				}
+				if ( geometry->isDataFlash ) {
+					pattern[0] = CMD_BUF1_WRITE;
+					pattern[1] = 0x00;
+					pattern[2] = 0x00;
+					pattern[3] = 0x00;
+					for ( i = 0; i < pageSize; i++ ) {
+						pattern[i+4] = (uint8)((i * 167 + 13 * attempt) ^ (i >> 3));
+					}
+					status = sendCommand(pattern, pageSize+4, error);
+					CHECK_STATUS(status, status, cleanup, "negotiateClock()");
+					status = readBuffer(readback, pageSize, error);
+					CHECK_STATUS(status, status, cleanup, "negotiateClock()");
+					isGood = memcmp(readback, pattern+4, pageSize) ? false : true;
+				} else if ( geometry->bfptLen ) {
+					status = readCommand(sfdpCmd, 5, readback, geometry->bfptLen, error);
+					CHECK_STATUS(status, status, cleanup, "negotiateClock()");
+					isGood = memcmp(readback, geometry->bfpt, geometry->bfptLen) ? false : true;
+				} else {
+					status = readCommand(idCmd, 1, readback, 3, error);
+					CHECK_STATUS(status, status, cleanup, "negotiateClock()");
+					isGood = memcmp(readback, geometry->id, 3) ? false : true;
+				}
+			}
+		}
+		if ( isGood ) {
+			best = div;
+		}
+	}
+	CHECK_STATUS(
+		best < 0, FLASH_CLOCK, cleanup,
+		"negotiateClock(): Readback fails even with divider %d", NEGOTIATE_START
+	);
+	spiSetDivider((uint8)best);
+	flStatus = spiStatus(error);
+	CHECK_STATUS(flStatus, FLASH_FPGALINK, cleanup, "negotiateClock()");
+	*divider = (uint8)best;
+cleanup:
+	free(readback);
+	free(pattern);
+	return retVal;
+}
+
+// The page digest cache remembers what was last written to each page of a particular part, so that
+// a repeat run can skip the pages which already hold the right data without reading them back. It
+// is a text file with a line per page:
+//   <deviceKey> <pageSize> <pageNum> <digest>
+// holding the pages of any number of parts. The device key is the JEDEC ID and a hash of the
+// factory-programmed unique ID (in a DataFlash's security register). The cache trusts that nothing
+// else has written the flash since; if something might have, run without it, or use -V, which
+// clears the entries for any pages which fail.
+//
+#define KEY_MAX 32
+
+struct PageCache {
+	const char *fileName;
+	char key[KEY_MAX];
+	uint32 pageSize;
+	uint32 numPages;
+	uint64 *digests;  // zero for pages of unknown content
+};
+
+// FNV-1a of count bytes of data padded with FF to pageSize, with zero reserved for unknown pages
+//
+static uint64 pageDigest(const uint8 *data, uint32 count, uint32 pageSize) {
+	uint64 hash = 0xCBF29CE484222325ULL;
+	uint32 i;
+	for ( i = 0; i < pageSize; i++ ) {
+		hash = (hash ^ (i < count ? data[i] : 0xFF)) * 0x100000001B3ULL;
+	}
+	return hash ? hash : 1;
+}
+
+// Read the JEDEC ID and the unique ID: the factory-programmed half of a DataFlash's security
+// register, or the 64-bit unique ID of a 25-series part, which follows four don't-care bytes:
+//   w1 07;w0 9F;w1 0303030303030303030303030303030301;w0 FFFFFF;w1 0101010101010101010101010101010105;r0 3
+//   w1 07;w0 77000000;w1 0303030303030303030303030303030301;w0 FFFF...;w1 0101010101010101010101010101010105;r0 128
+//   w1 07;w0 4B00000000;w1 03;w0 FFFFFFFFFFFFFFFF;w1 01;r0 8
+//
+static FlashStatus readDeviceKey(char *key, const char **error) {
+	FlashStatus retVal = FLASH_SUCCESS, status;
+	static const uint8 idCmd[1] = {CMD_ID};
+	static const uint8 securityCmd[4] = {CMD_SECURITY, 0x00, 0x00, 0x00};
+	static const uint8 uniqueCmd[5] = {CMD_UNIQUE_ID, 0x00, 0x00, 0x00, 0x00};
+	uint8 id[3], security[128];
+	const uint8 *const unique = geometry->isDataFlash ? security + 64 : security;
+	const uint32 uniqueSize = geometry->isDataFlash ? 64 : 8;
+	uint32 i;
+	status = readCommand(idCmd, 1, id, 3, error);
+	CHECK_STATUS(status, status, cleanup, "readDeviceKey()");
+	if ( geometry->isDataFlash ) {
+		status = readCommand(securityCmd, 4, security, 128, error);
+	} else {
+		status = readCommand(uniqueCmd, 5, security, uniqueSize, error);
+	}
+	CHECK_STATUS(status, status, cleanup, "readDeviceKey()");
+	for ( i = 1; i < uniqueSize && unique[i] == unique[0]; i++ );
+	CHECK_STATUS(
+		i == uniqueSize, FLASH_NO_ID, cleanup,
+		"readDeviceKey(): The flash has no unique ID, so its pages cannot be cached"
+	);
+	sprintf(
+		key, "%02X%02X%02X-%016llX", id[0], id[1], id[2],
+		(unsigned long long)pageDigest(unique, uniqueSize, uniqueSize)
+	);
+cleanup:
+	return retVal;
+}
+
+static FlashStatus cacheLoad(struct PageCache *cache, const char **error) {
+	FlashStatus retVal = FLASH_SUCCESS;
+	FILE *file = NULL;
+	char line[128], key[KEY_MAX];
+	unsigned int pageSize, pageNum;
+	unsigned long long digest;
+	cache->digests = calloc(cache->numPages ? cache->numPages : 1, sizeof(uint64));
+	CHECK_STATUS(!cache->digests, FLASH_ALLOC, cleanup, "cacheLoad(): Allocation error");
+	file = fopen(cache->fileName, "r");
+	if ( !file ) {
+		return FLASH_SUCCESS;  // nothing cached yet
+	}
+	while ( fgets(line, sizeof(line), file) ) {
+		if (
+			sscanf(line, "%31s %u %u %llx", key, &pageSize, &pageNum, &digest) == 4 &&
+			!strcmp(key, cache->key) && pageSize == cache->pageSize && pageNum < cache->numPages )
+		{
+			cache->digests[pageNum] = digest;
+		}
+	}
+cleanup:
+	if ( file ) {
+		fclose(file);
+	}
+	return retVal;
+}
+
+// Rewrite the cache file, keeping the other parts' lines, and this part's lines for pages beyond
+// the image, which haven't been touched.
+//
+static FlashStatus cacheSave(const struct PageCache *cache, const char **error) {
+	FlashStatus retVal = FLASH_SUCCESS;
+	FILE *file = fopen(cache->fileName, "rb");
+	char *old = NULL, *line, *next;
+	char key[KEY_MAX];
+	unsigned int pageSize, pageNum;
+	long length = 0;
+	uint32 i;
+	if ( file ) {
+		fseek(file, 0, SEEK_END);
+		length = ftell(file);
+		fseek(file, 0, SEEK_SET);
+		old = malloc(length > 0 ? (size_t)length + 1 : 1);
+		CHECK_STATUS(!old, FLASH_ALLOC, cleanup, "cacheSave(): Allocation error");
+		length = (long)fread(old, 1, length > 0 ? (size_t)length : 0, file);
+		old[length] = '\0';
+		fclose(file);
+	}
+	file = fopen(cache->fileName, "w");
+	CHECK_STATUS(!file, FLASH_FILE, cleanup, "cacheSave(): Unable to write to %s", cache->fileName);
+	for ( line = old; line && *line; line = next ) {
+		next = strchr(line, '\n');
+		next = next ? next + 1 : line + strlen(line);
+		if (
+			sscanf(line, "%31s %u %u", key, &pageSize, &pageNum) == 3 && !strcmp(key, cache->key) &&
+			(pageSize != cache->pageSize || pageNum < cache->numPages) )
+		{
+			continue;
+		}
+		fwrite(line, 1, (size_t)(next - line), file);
+	}
+	for ( i = 0; i < cache->numPages; i++ ) {
+		if ( cache->digests[i] ) {
+			fprintf(
+				file, "%s %u %u %016llX\n", cache->key, cache->pageSize, i,
+				(unsigned long long)cache->digests[i]
+			);
+		}
+	}
+	CHECK_STATUS(ferror(file), FLASH_FILE, cleanup, "cacheSave(): Unable to write to %s", cache->fileName);
+cleanup:
+	if ( file ) {
+		fclose(file);
+	}
+	free(old);
+	return retVal;
+}
+
+// A flash part on one of the chip-selects, with its own page cache, and the program it may have in
+// progress
+//
+#define MAX_PARTS SPI_MAX_DEVS
+
+struct Part {
+	uint8 dev;
+	struct PageCache cache;  // no digests unless caching
+	bool isBusy;
+	bool busyBufTwo;
+	uint32 busyPage;
+	uint64 busyDigest;
+	uint64 busyStart;
+	uint32 numWritten;
+};
+
+static uint8 partSelects(const struct Part *parts, uint32 numParts, uint32 which) {
+	uint8 selects = 0x00;
+	uint32 i;
+	for ( i = 0; i < numParts; i++ ) {
+		if ( which & (1U << i) ) {
+			selects |= (uint8)CHIPSEL_DEV(parts[i].dev);
+		}
+	}
+	return selects;
+}
+
+// Wait for a part's program to finish, and note what is now in the page.
+//
+static FlashStatus finishProgram(struct Part *part, const char **error) {
+	FlashStatus retVal = FLASH_SUCCESS, status;
+	selected = (uint8)CHIPSEL_DEV(part->dev);
+	status = waitReady(NULL, error);
+	CHECK_STATUS(status, status, cleanup, "finishProgram()");
+	profRecord(PROF_PAGE_PROGRAM, part->busyStart, part->busyPage);
+	if ( part->cache.digests ) {
+		part->cache.digests[part->busyPage] = part->busyDigest;
+	}
+	part->isBusy = false;
+cleanup:
+	return retVal;
+}
+
+// Identify the part on the selected chip-select. A DataFlash is known from its JEDEC ID, and its
+// status register says whether it has power-of-two pages:
+//   w1 07;w0 9F;w1 03;w0 FFFFFF;w1 01;r0 3
+//   w1 07;w0 D7;w1 03;w0 FF;w1 01;r0 1
+//
+// Anything else is taken to be a 25-series part, described by the basic flash parameter table
+// which the SFDP header points to, or if it has none, by its JEDEC ID:
+//   w1 07;w0 5A00000000;w1 03;w0 FFFF...;w1 01;r0 16
+//   w1 07;w0 5A00008000;w1 03;w0 FFFF...;w1 01;r0 64
+//
+static FlashStatus probe(struct Geometry *geom, const char **error) {
+	FlashStatus retVal = FLASH_SUCCESS, status;
+	static const uint8 idCmd[1] = {CMD_ID};
+	static const uint8 statusCmd[1] = {CMD_STATUS};
+	uint8 sfdpCmd[5] = {CMD_SFDP, 0x00, 0x00, 0x00, 0x00};
+	uint8 id[3], statusByte, header[SFDP_HEADER_SIZE];
+	memset(geom, 0, sizeof(*geom));
+	status = readCommand(idCmd, 1, id, 3, error);
+	CHECK_STATUS(status, status, cleanup, "probe()");
+	CHECK_STATUS(
+		(id[0] == 0x00 && id[1] == 0x00 && id[2] == 0x00) || (id[0] == 0xFF && id[1] == 0xFF && id[2] == 0xFF),
+		FLASH_UNKNOWN, cleanup, "probe(): Nothing answers the JEDEC ID command"
+	);
+	if ( id[0] == 0x1F && (id[1] >> 5) == 0x01 ) {
+		status = readCommand(statusCmd, 1, &statusByte, 1, error);
+		CHECK_STATUS(status, status, cleanup, "probe()");
+		CHECK_STATUS(
+			!jedecDataFlash(id, statusByte, geom), FLASH_UNKNOWN, cleanup,
+			"probe(): Unknown DataFlash %02X%02X%02X", id[0], id[1], id[2]
+		);
+		return FLASH_SUCCESS;
+	}
+	status = readCommand(sfdpCmd, 5, header, SFDP_HEADER_SIZE, error);
+	CHECK_STATUS(status, status, cleanup, "probe()");
+	if ( jedecSfdpHeader(header, &geom->bfptAddr, &geom->bfptLen) ) {
+		sfdpCmd[1] = (uint8)(geom->bfptAddr >> 16);
+		sfdpCmd[2] = (uint8)(geom->bfptAddr >> 8);
+		sfdpCmd[3] = (uint8)geom->bfptAddr;
+		status = readCommand(sfdpCmd, 5, geom->bfpt, geom->bfptLen, error);
+		CHECK_STATUS(status, status, cleanup, "probe()");
+		CHECK_STATUS(
+			!jedecSfdpParse(id, geom), FLASH_UNKNOWN, cleanup,
+			"probe(): The SFDP table of flash %02X%02X%02X describes a part flashprog cannot drive",
+			id[0], id[1], id[2]
+		);
+	} else {
+		CHECK_STATUS(
+			!jedecFromId(id, geom), FLASH_UNKNOWN, cleanup,
+			"probe(): Flash %02X%02X%02X has no SFDP table, and its ID doesn't give its size",
+			id[0], id[1], id[2]
+		);
+	}
+cleanup:
+	return retVal;
+}
+
+// Identify the parts on all of the chip-selects, which must be the same.
+//
+static FlashStatus identify(const struct Part *parts, uint32 numParts, struct Geometry *geom, const char **error) {
+	FlashStatus retVal = FLASH_SUCCESS, status;
+	struct Geometry other;
+	uint32 i;
+	for ( i = 0; i < numParts; i++ ) {
+		selected = (uint8)CHIPSEL_DEV(parts[i].dev);
+		status = probe(i ? &other : geom, error);
+		CHECK_STATUS(status, status, cleanup, "identify()");
+		CHECK_STATUS(
+			i && (memcmp(other.id, geom->id, 3) || other.pageSize != geom->pageSize), FLASH_MISMATCH, cleanup,
+			"identify(): CS%u (%s, %u-byte pages) and CS%u (%s, %u-byte pages) differ",
+			parts[0].dev, geom->name, geom->pageSize, parts[i].dev, other.name, other.pageSize
+		);
+	}
+cleanup:
+	return retVal;
+}
+
 // First write a page to one of the SRAM buffers:
 //   w1 07;w0 84000000;w0 "random.dat";w1 0707070707070707070707070707070705
 //
 // Now kick off a write of the SRAM buffer into the flash array:
 //   w1 07;w0 83000000;w1 0505
 //
-// Now poll the status register until the top bit is cleared:
-//   do {
-//     w1 07;w0 D7;w1 02;w0 FF;w1 05;r0 1
-//   } while ( !(statusByte & READY) );
+// Now poll the status register until the top bit is set (see waitReady()).
+//
+// The part will accept writes to one SRAM buffer whilst the other is being programmed into the
+// array, so by default pages alternate between buffer 1 and buffer 2, and the next page goes over
+// USB whilst the previous one is programmed. The status is only polled before kicking off the next
+// program. Parts with only one buffer (e.g AT45DB011D) need singleBuffer, which waits for each
+// program to finish before loading the next page.
+//
+// With compare, each page is compared with the buffer before it is programmed:
+//   w1 07;w0 60000400;w1 0505
+// and when the COMP bit of the status after it is clear, they match, so the program is skipped.
+// The compare takes about a hundredth of the time of a program. With a cache, pages it says are
+// already there aren't even sent.
 //
-FlashStatus flash(const char *fileName, uint32 pageSize, uint32 pageShift, const char **error) {
+// With several parts, each page is written to the buffers of all those which need it at once, by
+// selecting them all, and likewise compared and programmed, so they program in parallel, and only
+// the status polls go to each part separately:
+//   w1 0F;w0 84000000;w0 "random.dat";w1 0F0F...0303030307;w0 D7;w2 FF80800FFFFF;w1 0303030B;...
+//
+// The page data goes straight from the image, and the last page is padded with FF. The page count
+// is kept up to date as it goes, so a farm's progress can be watched from another thread; a dot
+// per page is printed only when there is one board.
+//
+FlashStatus flash(
+	const uint8 *image, uint32 size, uint32 pageSize, uint32 pageShift, bool singleBuffer,
+	bool compare, struct Part *parts, uint32 numParts, uint32 *numPages, const char **error)
+{
 	FlashStatus retVal = FLASH_SUCCESS, status;
-	uint16 i;
-	uint32 pageNum = 0;
-	size_t count;
-	union {
-		uint32 i;
-		uint8 b[4];
-	} u;
-	FILE *file;
-	uint8 *const tmp = malloc(pageSize+4);
-	CHECK_STATUS(!tmp, FLASH_ALLOC, cleanup, "flash(): Allocation error");
-	file = fopen(fileName, "rb");
-	CHECK_STATUS(!file, FLASH_FILE, cleanup, "flash(): Unable to read from %s", fileName);
+	uint32 pageNum = 0, offset = 0, which, i;
+	uint64 digest = 0;
+	bool bufTwo = false;
+	uint8 statusByte;
+	uint8 cmd[4];
+	struct Segment segs[3];
+	uint32 address;
+	uint8 *const padding = malloc(pageSize);
+	CHECK_STATUS(!padding, FLASH_ALLOC, cleanup, "flash(): Allocation error");
+	memset(padding, 0xFF, pageSize);
+	segs[0].data = cmd;
+	segs[0].count = 4;
+	segs[0].byRef = false;
+	segs[1].byRef = true;
+	segs[2].data = padding;
+	segs[2].byRef = false;
 
-	printf("Flashing");
-	count = fread(tmp+4, 1, pageSize, file);
-	while ( count ) {
-		// Write to buffer 1...
+	if ( !boardName ) {
+		printf("Flashing");
+	}
+	while ( offset < size ) {
+		const uint32 count = (size - offset < pageSize) ? size - offset : pageSize;
+		segs[1].data = image + offset;
+		segs[1].count = count;
+		segs[2].count = pageSize - count;
+		offset += count;
+
+		// See which parts need the page...
 		//
-		status = setConfig(
-			ENABLE | SUPPRESS,  // mask
-			ENABLE | SUPPRESS,  // value
-			0,                  // prevCount
-			error
-		);
-		CHECK_STATUS(status, FLASH_FPGALINK, cleanup, "flash()");
-		
-		tmp[0] = CMD_BUF1_WRITE;
-		tmp[1] = 0x00;
-		tmp[2] = 0x00;
-		tmp[3] = 0x00;
-		status = flWriteChannel(handle, 1000, 0x00, pageSize+4, tmp, error);
-		CHECK_STATUS(status, FLASH_FPGALINK, cleanup, "flash()");
-		
-		status = setConfig(
-			ENABLE,  // mask
-			0x00,    // value
-			16,      // prevCount
-			error
-		);
-		CHECK_STATUS(status, FLASH_FPGALINK, cleanup, "flash()");
+		if ( parts[0].cache.digests ) {
+			digest = pageDigest(segs[1].data, count, pageSize);
+		}
+		which = 0;
+		for ( i = 0; i < numParts; i++ ) {
+			if ( !parts[i].cache.digests || parts[i].cache.digests[pageNum] != digest ) {
+				which |= 1U << i;
+			}
+		}
+		if ( !which ) {
+			if ( !boardName ) {
+				printf("-");
+			}
+			setProgress(numPages, ++pageNum);
+			continue;
+		}
+
+		// ...write to the free buffer, first waiting for any part which skipped the last page, and
+		// so may still be programming from it...
+		//
+		for ( i = 0; i < numParts; i++ ) {
+			if ( (which & (1U << i)) && parts[i].isBusy && parts[i].busyBufTwo == bufTwo ) {
+				status = finishProgram(parts + i, error);
+				CHECK_STATUS(status, status, cleanup, "flash()");
+			}
+		}
+		cmd[0] = bufTwo ? CMD_BUF2_WRITE : CMD_BUF1_WRITE;
+		cmd[1] = 0x00;
+		cmd[2] = 0x00;
+		cmd[3] = 0x00;
+		selected = partSelects(parts, numParts, which);
+		status = sendSegments(segs, 3, error);
+		CHECK_STATUS(status, status, cleanup, "flash()");
 		
-		// Kick off flash of buffer 1 data...
-		//		
-		status = setConfig(
-			ENABLE,  // mask
-			ENABLE,  // value
-			0,       // prevCount
-			error
-		);
-		CHECK_STATUS(status, FLASH_FPGALINK, cleanup, "flash()");
+		// ...wait for the previous page's program to finish...
+		//
+		for ( i = 0; i < numParts; i++ ) {
+			if ( (which & (1U << i)) && parts[i].isBusy ) {
+				status = finishProgram(parts + i, error);
+				CHECK_STATUS(status, status, cleanup, "flash()");
+			}
+		}
+		address = pageNum << pageShift;
+		cmd[1] = (uint8)(address >> 16);
+		cmd[2] = (uint8)(address >> 8);
+		cmd[3] = (uint8)address;
+
+		// ...skip the page on the parts it already matches...
+		//
+		if ( compare ) {
+			cmd[0] = bufTwo ? CMD_BUF2_CMP : CMD_BUF1_CMP;
+			selected = partSelects(parts, numParts, which);
+			status = sendCommand(cmd, 4, error);
+			CHECK_STATUS(status, status, cleanup, "flash()");
+			for ( i = 0; i < numParts; i++ ) {
+				if ( !(which & (1U << i)) ) {
+					continue;
+				}
+				selected = (uint8)CHIPSEL_DEV(parts[i].dev);
+				status = waitReady(&statusByte, error);
+				CHECK_STATUS(status, status, cleanup, "flash()");
+				if ( !(statusByte & BM_COMP) ) {
+					if ( parts[i].cache.digests ) {
+						parts[i].cache.digests[pageNum] = digest;
+					}
+					which &= ~(1U << i);
+				}
+			}
+			if ( !which ) {
+				if ( !boardName ) {
+					printf("-");
+					fflush(stdout);
+				}
+				setProgress(numPages, ++pageNum);
+				continue;
+			}
+		}
 		
-		u.i = pageNum << pageShift;
-		tmp[0] = CMD_BUF1_FLASH;
-		tmp[1] = u.b[2];  // TODO: this assumes little-endian machine
-		tmp[2] = u.b[1];
-		tmp[3] = u.b[0];
-		status = flWriteChannel(handle, 1000, 0x00, 4, tmp, error);
-		CHECK_STATUS(status, FLASH_FPGALINK, cleanup, "flash()");
+		// ...then kick off flash of the buffer data
+		//
+		for ( i = 0; i < numParts; i++ ) {
+			if ( which & (1U << i) ) {
+				if ( parts[i].cache.digests ) {
+					parts[i].cache.digests[pageNum] = 0;  // unknown until the program is done
+				}
+				parts[i].isBusy = true;
+				parts[i].busyBufTwo = bufTwo;
+				parts[i].busyPage = pageNum;
+				parts[i].busyDigest = digest;
+				parts[i].busyStart = profNow();
+				parts[i].numWritten++;
+			}
+		}
+		cmd[0] = bufTwo ? CMD_BUF2_FLASH : CMD_BUF1_FLASH;
+		selected = partSelects(parts, numParts, which);
+		status = sendCommand(cmd, 4, error);
+		CHECK_STATUS(status, status, cleanup, "flash()");
 		
-		status = setConfig(
-			ENABLE,  // mask
-			0x00,    // value
-			16,      // prevCount
-			error
+		if ( singleBuffer ) {
+			for ( i = 0; i < numParts; i++ ) {
+				if ( parts[i].isBusy ) {
+					status = finishProgram(parts + i, error);
+					CHECK_STATUS(status, status, cleanup, "flash()");
+				}
+			}
+		} else {
+			bufTwo = !bufTwo;
+		}
+		if ( !boardName ) {
+			printf(".");
+			fflush(stdout);
+		}
+		setProgress(numPages, ++pageNum);
+	}
+	
+	// Wait for the last pages to finish
+	//
+	for ( i = 0; i < numParts; i++ ) {
+		if ( parts[i].isBusy ) {
+			status = finishProgram(parts + i, error);
+			CHECK_STATUS(status, status, cleanup, "flash()");
+		}
+	}
+	if ( !boardName ) {
+		printf("\n");
+	}
+cleanup:
+	setProgress(numPages, pageNum);
+	free(padding);
+	return retVal;
+}
+
+// Read size bytes of the array from address with one continuous read, handing them to sink as they
+// arrive. The readback is clocked in chunks of half the receive FIFO, and each chunk is sent before
+// the one before it is collected and handed over, so that the USB read and the sink's work on one
+// chunk overlap the clocking of the next:
+//   w1 07;w0 03000000;w1 03;w0 FFFF...;w0 FFFF...;r0 <chunk>;w0 FFFF...;r0 <chunk>;...;w1 01;r0 <chunk>
+//
+// With two or four lines it is a dual- or quad-output read instead, which has a don't-care byte
+// after the address, and then clocks the data in over IO1..IO0 or IO3..IO0, two or four times as
+// fast:
+//   w1 07;w0 6B00000000;w6 06;w1 03;w0 FFFF...;...;w1 01;w6 00;r0 <chunk>
+//
+// The address is a byte address on a 25-series part, or pageNum << pageShift on a DataFlash.
+//
+typedef FlashStatus (*ReadSink)(void *context, const uint8 *data, uint32 offset, uint32 count, const char **error);
+
+static FlashStatus readArray(
+	uint32 address, uint32 size, uint32 lines, ReadSink sink, void *context, const char **error)
+{
+	FlashStatus retVal = FLASH_SUCCESS, status;
+	FLStatus flStatus;
+	const uint32 chunkSize = spiBatchMax() / 2;
+	const uint8 ioMode = (lines == 4) ? IO_X4 : (lines == 2) ? IO_X2 : IO_X1;
+	const uint8 cmd[5] = {
+		(lines == 4) ? geometry->quadCmd : (lines == 2) ? geometry->dualCmd : CMD_READ,
+		(uint8)(address >> 16), (uint8)(address >> 8), (uint8)address, 0x00
+	};
+	uint8 *const readback = malloc(2 * chunkSize);
+	uint8 *slot = readback, *prevSlot = readback + chunkSize, *tmp;
+	uint32 queued = 0, collected = 0, inFlight = 0, count;
+	CHECK_STATUS(!readback, FLASH_ALLOC, cleanup, "readArray(): Allocation error");
+
+	spiConfig(CHIPSEL_MASK | SUPPRESS, selected | SUPPRESS);
+	spiQueue(cmd, (ioMode == IO_X1) ? 4 : 5, NULL);
+	spiSetIo(ioMode | IO_IN);
+	spiConfig(SUPPRESS, 0x00);
+	while ( collected < size ) {
+		// Send the next chunk, deselecting after the last one...
+		//
+		count = 0;
+		if ( queued < size ) {
+			count = (size - queued < chunkSize) ? size - queued : chunkSize;
+			spiFill(0xFF, count, slot);
+			queued += count;
+			if ( queued == size ) {
+				spiConfig(CHIPSEL_MASK, 0x00);
+				spiSetIo(IO_X1);
+			}
+			spiSend();
+		}
+
+		// ...then collect the one before it and hand it over
+		//
+		if ( inFlight ) {
+			spiCollect(inFlight);
+			flStatus = spiStatus(error);
+			CHECK_STATUS(flStatus, FLASH_FPGALINK, cleanup, "readArray()");
+			status = sink(context, prevSlot, collected, inFlight, error);
+			CHECK_STATUS(status, status, cleanup, "readArray()");
+			collected += inFlight;
+		}
+		inFlight = count;
+		tmp = prevSlot;
+		prevSlot = slot;
+		slot = tmp;
+	}
+cleanup:
+	free(readback);
+	return retVal;
+}
+
+// Compare the array with the image as it arrives, forgetting the cached digest of any page which
+// differs.
+//
+#define VERIFY_REPORT 8  // differing pages to list
+
+struct Verify {
+	const uint8 *image;
+	uint32 pageSize;
+	struct PageCache *cache;
+	uint32 badPages;
+	uint32 firstBad;
+	uint32 lastBad;
+};
+
+static FlashStatus verifyChunk(void *context, const uint8 *data, uint32 offset, uint32 count, const char **error) {
+	struct Verify *const v = (struct Verify *)context;
+	uint32 i;
+	(void)error;
+	if ( !memcmp(data, v->image + offset, count) ) {
+		return FLASH_SUCCESS;
+	}
+	for ( i = 0; i < count; i++ ) {
+		const uint32 page = (offset + i) / v->pageSize;
+		if ( data[i] != v->image[offset + i] && (!v->badPages || page != v->lastBad) ) {
+			if ( v->badPages < VERIFY_REPORT ) {
+				say(stdout, "  Page %u differs at byte %u\n", page, (offset + i) % v->pageSize);
+			}
+			if ( !v->badPages ) {
+				v->firstBad = page;
+			}
+			if ( v->cache ) {
+				v->cache->digests[page] = 0;
+			}
+			v->lastBad = page;
+			v->badPages++;
+		}
+	}
+	return FLASH_SUCCESS;
+}
+
+static FlashStatus verify(
+	const uint8 *image, uint32 size, uint32 pageSize, struct PageCache *cache, uint32 lines,
+	const char **error)
+{
+	FlashStatus retVal = FLASH_SUCCESS, status;
+	struct Verify v;
+	memset(&v, 0, sizeof(v));
+	v.image = image;
+	v.pageSize = pageSize;
+	v.cache = cache;
+	status = readArray(0, size, lines, verifyChunk, &v, error);
+	CHECK_STATUS(status, status, cleanup, "verify()");
+	CHECK_STATUS(
+		v.badPages, FLASH_VERIFY, cleanup,
+		"verify(): %u pages differ from the image, the first being page %u", v.badPages, v.firstBad
+	);
+cleanup:
+	return retVal;
+}
+
+// Read the array back into a file.
+//
+static FlashStatus saveChunk(void *context, const uint8 *data, uint32 offset, uint32 count, const char **error) {
+	FlashStatus retVal = FLASH_SUCCESS;
+	(void)offset;
+	CHECK_STATUS(
+		fwrite(data, 1, count, (FILE *)context) != count, FLASH_FILE, cleanup,
+		"saveChunk(): Unable to write the readback");
+cleanup:
+	return retVal;
+}
+
+static FlashStatus readBack(const char *fileName, uint32 size, uint32 lines, const char **error) {
+	FlashStatus retVal = FLASH_SUCCESS, status;
+	FILE *const file = fopen(fileName, "wb");
+	CHECK_STATUS(!file, FLASH_FILE, cleanup, "readBack(): Unable to write to %s", fileName);
+	status = readArray(0, size, lines, saveChunk, file, error);
+	CHECK_STATUS(status, status, cleanup, "readBack()");
+cleanup:
+	if ( file ) {
+		fclose(file);
+	}
+	return retVal;
+}
+
+// See whether a stretch of the array already holds the image (padded with FF), or at least could be
+// made to without an erase, because programming would only need to clear bits.
+//
+struct Compare {
+	const uint8 *image;
+	uint32 size;
+	uint32 address;
+	bool isSame;
+	bool isProgrammable;
+};
+
+static FlashStatus compareChunk(void *context, const uint8 *data, uint32 offset, uint32 count, const char **error) {
+	struct Compare *const c = (struct Compare *)context;
+	uint32 i, address;
+	uint8 want;
+	(void)error;
+	for ( i = 0; i < count; i++ ) {
+		address = c->address + offset + i;
+		want = (address < c->size) ? c->image[address] : 0xFF;
+		if ( data[i] != want ) {
+			c->isSame = false;
+			if ( (data[i] & want) != want ) {
+				c->isProgrammable = false;
+			}
+		}
+	}
+	return FLASH_SUCCESS;
+}
+
+// Queue a write enable, then a command which needs one, to the selected part(s).
+//
+static FlashStatus sendEnabled(const struct Segment *segs, uint32 numSegs, const char **error) {
+	FlashStatus retVal = FLASH_SUCCESS, status;
+	static const uint8 cmd = CMD_WRITE_EN;
+	status = sendCommand(&cmd, 1, error);
+	CHECK_STATUS(status, status, cleanup, "sendEnabled()");
+	status = sendSegments(segs, numSegs, error);
+	CHECK_STATUS(status, status, cleanup, "sendEnabled()");
+cleanup:
+	return retVal;
+}
+
+// Clear the block protect bits of any part which powered up with them set, since otherwise its
+// erases and programs would be silently ignored:
+//   w1 07;w0 05;w1 03;w0 FF;w1 01;r0 1
+//   w1 07;w0 06;w1 07;w0 0100;w1 0303030307;w0 05;w2 FF0100FFFFFF;w1 0303030B;r0 1
+//
+static FlashStatus unprotect(struct Part *parts, uint32 numParts, const char **error) {
+	FlashStatus retVal = FLASH_SUCCESS, status;
+	static const uint8 readCmd[1] = {CMD_READ_SR};
+	static const uint8 writeCmd[2] = {CMD_WRITE_SR, 0x00};
+	struct Segment seg;
+	uint8 statusByte;
+	uint32 i;
+	seg.data = writeCmd;
+	seg.count = 2;
+	seg.byRef = false;
+	for ( i = 0; i < numParts; i++ ) {
+		selected = (uint8)CHIPSEL_DEV(parts[i].dev);
+		status = readCommand(readCmd, 1, &statusByte, 1, error);
+		CHECK_STATUS(status, status, cleanup, "unprotect()");
+		if ( !(statusByte & BM_PROTECT) ) {
+			continue;
+		}
+		say(stdout, "Clearing the block protection of CS%u (status %02X)\n", parts[i].dev, statusByte);
+		status = sendEnabled(&seg, 1, error);
+		CHECK_STATUS(status, status, cleanup, "unprotect()");
+		status = waitReadyFor(ERASE_BYTES, &statusByte, error);
+		CHECK_STATUS(status, status, cleanup, "unprotect()");
+		CHECK_STATUS(
+			statusByte & BM_PROTECT, FLASH_PROTECTED, cleanup,
+			"unprotect(): CS%u is still protected (status %02X); is its WP pin low?", parts[i].dev, statusByte
 		);
-		CHECK_STATUS(status, FLASH_FPGALINK, cleanup, "flash()");
-		
-		// Read status byte until done
+	}
+cleanup:
+	return retVal;
+}
+
+// A 25-series part has no SRAM buffers, and must be erased a sector or a block at a time before its
+// pages are programmed, each command after a write enable. So each stretch of the image is erased:
+//   w1 07;w0 06;w1 07;w0 D8000000;w1 0303030307;w0 05;w2 FF0100FFFFFF;w1 0303030B;r0 1
+//
+// and then each of its pages programmed, and the status polled until the program is done:
+//   w1 07;w0 06;w1 07;w0 02000000;w0 "random.dat";w1 0303030307;w0 05;w2 FF0100FFFFFF;w1 0303030B;r0 1
+//
+// The image is padded with FF to the end of its last sector (the smallest erase). Without -d or -C,
+// each stretch is as big as the biggest erase which fits there, so a 64KiB block takes one erase
+// rather than sixteen. With them, it goes a sector at a time, so as to skip the sectors which are
+// already right: with -C, those whose pages' digests all match the cache; with -d, those which read
+// back the same as the image. A sector which -d finds only needs bits cleared is programmed without
+// being erased first. Pages which are all FF are never programmed, since the erase left them so.
+//
+// As in flash(), the erases and programs go to all the parts which need them at once, and only the
+// status polls go to each part in turn; likewise the page count is kept up to date, and a dot per
+// stretch (or a dash for one skipped) is printed when there is only one board.
+//
+FlashStatus flashNor(
+	const uint8 *image, uint32 size, bool compare, struct Part *parts, uint32 numParts,
+	uint32 *numPages, const char **error)
+{
+	FlashStatus retVal = FLASH_SUCCESS, status;
+	const uint32 pageSize = geometry->pageSize;
+	const uint32 sectorSize = geometry->erase[0].size;
+	const uint32 span = (size + sectorSize - 1) / sectorSize * sectorSize;
+	const uint32 imagePages = (size + pageSize - 1) / pageSize;
+	const bool bySector = compare || parts[0].cache.digests;
+	const uint32 maxPages = geometry->erase[geometry->numErase - 1].size / pageSize;
+	uint32 address, blockSize = sectorSize, firstPage, endPage, page, count, which, eraseWhich, e, i;
+	uint8 cmd[4];
+	struct Segment segs[3];
+	struct Compare cmp;
+	uint64 opStart;
+	uint64 *const digests = malloc(maxPages * sizeof(uint64));
+	uint8 *const padding = malloc(pageSize);
+	CHECK_STATUS(!digests || !padding, FLASH_ALLOC, cleanup, "flashNor(): Allocation error");
+	memset(padding, 0xFF, pageSize);
+	segs[0].data = cmd;
+	segs[0].count = 4;
+	segs[0].byRef = false;
+	segs[1].byRef = true;
+	segs[2].data = padding;
+	segs[2].byRef = false;
+	status = unprotect(parts, numParts, error);
+	CHECK_STATUS(status, status, cleanup, "flashNor()");
+
+	if ( !boardName ) {
+		printf("Flashing");
+	}
+	for ( address = 0; address < span; address += blockSize ) {
+		// Use the biggest erase which fits...
 		//
-		i = 0;
-		do {
-			status = setConfig(
-				ENABLE | SUPPRESS,  // mask
-				ENABLE,             // value
-				0,                  // prevCount
-				error
-			);
-			CHECK_STATUS(status, FLASH_FPGALINK, cleanup, "flash()");
-			
-			tmp[0] = CMD_STATUS;
-			tmp[1] = 0x00;
-			status = flWriteChannel(handle, 1000, 0x00, 2, tmp, error);
-			CHECK_STATUS(status, FLASH_FPGALINK, cleanup, "flash()");
-			
-			status = setConfig(
-				ENABLE,  // mask
-				0x00,    // value
-				16,      // prevCount
-				error
+		for ( e = bySector ? 0 : geometry->numErase - 1; e; e-- ) {
+			if ( !(address % geometry->erase[e].size) && address + geometry->erase[e].size <= span ) {
+				break;
+			}
+		}
+		blockSize = geometry->erase[e].size;
+		firstPage = address / pageSize;
+		endPage = (address + blockSize) / pageSize;
+
+		// ...see which parts need it...
+		//
+		which = (1U << numParts) - 1;
+		eraseWhich = which;
+		if ( parts[0].cache.digests ) {
+			for ( page = firstPage; page < endPage; page++ ) {
+				count = (page * pageSize < size) ? size - page * pageSize : 0;
+				digests[page - firstPage] = pageDigest(image + page * pageSize, count < pageSize ? count : pageSize, pageSize);
+			}
+		}
+		for ( i = 0; i < numParts; i++ ) {
+			if ( parts[i].cache.digests ) {
+				for ( page = firstPage; page < endPage && parts[i].cache.digests[page] == digests[page - firstPage]; page++ );
+				if ( page == endPage ) {
+					which &= ~(1U << i);
+					continue;
+				}
+			}
+			if ( compare ) {
+				memset(&cmp, 0, sizeof(cmp));
+				cmp.image = image;
+				cmp.size = size;
+				cmp.address = address;
+				cmp.isSame = true;
+				cmp.isProgrammable = true;
+				selected = (uint8)CHIPSEL_DEV(parts[i].dev);
+				status = readArray(address, blockSize, 1, compareChunk, &cmp, error);
+				CHECK_STATUS(status, status, cleanup, "flashNor()");
+				if ( cmp.isSame ) {
+					if ( parts[i].cache.digests ) {
+						memcpy(parts[i].cache.digests + firstPage, digests, (endPage - firstPage) * sizeof(uint64));
+					}
+					which &= ~(1U << i);
+				} else if ( cmp.isProgrammable ) {
+					eraseWhich &= ~(1U << i);
+				}
+			}
+		}
+		eraseWhich &= which;
+		setProgress(numPages, (endPage < imagePages) ? endPage : imagePages);
+		if ( !which ) {
+			if ( !boardName ) {
+				printf("-");
+				fflush(stdout);
+			}
+			continue;
+		}
+		for ( i = 0; i < numParts; i++ ) {
+			if ( (which & (1U << i)) && parts[i].cache.digests ) {
+				memset(parts[i].cache.digests + firstPage, 0, (endPage - firstPage) * sizeof(uint64));
+			}
+		}
+
+		// ...erase it...
+		//
+		if ( eraseWhich ) {
+			cmd[0] = geometry->erase[e].cmd;
+			cmd[1] = (uint8)(address >> 16);
+			cmd[2] = (uint8)(address >> 8);
+			cmd[3] = (uint8)address;
+			selected = partSelects(parts, numParts, eraseWhich);
+			opStart = profNow();
+			status = sendEnabled(segs, 1, error);
+			CHECK_STATUS(status, status, cleanup, "flashNor()");
+			for ( i = 0; i < numParts; i++ ) {
+				if ( eraseWhich & (1U << i) ) {
+					selected = (uint8)CHIPSEL_DEV(parts[i].dev);
+					status = waitReadyFor(ERASE_BYTES, NULL, error);
+					CHECK_STATUS(status, status, cleanup, "flashNor()");
+				}
+			}
+			profRecord(PROF_ERASE, opStart, address);
+		}
+
+		// ...then program each of its pages which isn't blank
+		//
+		for ( page = firstPage; page < endPage && page < imagePages; page++ ) {
+			count = size - page * pageSize;
+			if ( count > pageSize ) {
+				count = pageSize;
+			}
+			segs[1].data = image + page * pageSize;
+			segs[1].count = count;
+			segs[2].count = pageSize - count;
+			for ( i = 0; i < count && segs[1].data[i] == 0xFF; i++ );
+			if ( i == count ) {
+				continue;
+			}
+			cmd[0] = CMD_PROGRAM;
+			cmd[1] = (uint8)((page * pageSize) >> 16);
+			cmd[2] = (uint8)((page * pageSize) >> 8);
+			cmd[3] = (uint8)(page * pageSize);
+			selected = partSelects(parts, numParts, which);
+			opStart = profNow();
+			status = sendEnabled(segs, 3, error);
+			CHECK_STATUS(status, status, cleanup, "flashNor()");
+			for ( i = 0; i < numParts; i++ ) {
+				if ( which & (1U << i) ) {
+					selected = (uint8)CHIPSEL_DEV(parts[i].dev);
+					status = waitReady(NULL, error);
+					CHECK_STATUS(status, status, cleanup, "flashNor()");
+					parts[i].numWritten++;
+				}
+			}
+			profRecord(PROF_PAGE_PROGRAM, opStart, page);
+		}
+		for ( i = 0; i < numParts; i++ ) {
+			if ( (which & (1U << i)) && parts[i].cache.digests ) {
+				memcpy(parts[i].cache.digests + firstPage, digests, (endPage - firstPage) * sizeof(uint64));
+			}
+		}
+		if ( !boardName ) {
+			printf(".");
+			fflush(stdout);
+		}
+	}
+	if ( !boardName ) {
+		printf("\n");
+	}
+cleanup:
+	free(padding);
+	free(digests);
+	return retVal;
+}
+
+// Map the input file into memory, so that flash() and verify() can send and compare its pages
+// where they are, without reading it into a buffer first. Anything which can't be mapped (e.g. a
+// pipe) is read instead.
+//
+static bool isMapped = false;
+
+static FlashStatus mapFile(const char *fileName, const uint8 **image, uint32 *size, const char **error) {
+	FlashStatus retVal = FLASH_SUCCESS;
+	FILE *file = NULL;
+	uint8 *buf;
+	uint32 length = 0, chunk;
+	*image = NULL;
+	*size = 0;
+	isMapped = false;
+	#ifdef WIN32
+	{
+		HANDLE hFile = CreateFileA(
+			fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if ( hFile != INVALID_HANDLE_VALUE ) {
+			const DWORD fileSize = GetFileSize(hFile, NULL);
+			HANDLE hMap = (fileSize && fileSize != INVALID_FILE_SIZE) ?
+				CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+			if ( hMap ) {
+				*image = (const uint8 *)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+				CloseHandle(hMap);  // the view keeps the mapping open
+			}
+			CloseHandle(hFile);
+			if ( *image ) {
+				*size = fileSize;
+				isMapped = true;
+				return FLASH_SUCCESS;
+			}
+		}
+	}
+	#else
+	{
+		const int fd = open(fileName, O_RDONLY);
+		struct stat st;
+		if ( fd >= 0 ) {
+			if ( !fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= 0xFFFFFFFF ) {
+				void *const p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if ( p != MAP_FAILED ) {
+					madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+					*image = (const uint8 *)p;
+					*size = (uint32)st.st_size;
+					isMapped = true;
+				}
+			}
+			close(fd);
+			if ( isMapped ) {
+				return FLASH_SUCCESS;
+			}
+		}
+	}
+	#endif
+	file = fopen(fileName, "rb");
+	CHECK_STATUS(!file, FLASH_FILE, cleanup, "mapFile(): Unable to read from %s", fileName);
+	buf = malloc(65536);
+	CHECK_STATUS(!buf, FLASH_ALLOC, cleanup, "mapFile(): Allocation error");
+	*image = buf;
+	while ( (chunk = (uint32)fread(buf + length, 1, 65536, file)) > 0 ) {
+		length += chunk;
+		buf = realloc(buf, length + 65536);
+		CHECK_STATUS(!buf, FLASH_ALLOC, cleanup, "mapFile(): Allocation error");
+		*image = buf;
+	}
+	CHECK_STATUS(ferror(file), FLASH_FILE, cleanup, "mapFile(): Unable to read from %s", fileName);
+	*size = length;
+cleanup:
+	if ( file ) {
+		fclose(file);
+	}
+	return retVal;
+}
+
+static void unmapFile(const uint8 *image, uint32 size) {
+	if ( !isMapped ) {
+		free((void *)image);
+		return;
+	}
+	#ifdef WIN32
+		(void)size;
+		UnmapViewOfFile(image);
+	#else
+		munmap((void *)image, size);
+	#endif
+}
+
+// Several FPGALink devices (boards) may be programmed at once, each by its own thread with its own
+// handle, but all from the one mapping of the image.
+//
+#define MAX_BOARDS 16
+#define VP_MAX     16  // "VVVV:PPPP:DDDD" and a terminator
+
+// What to do to each board, shared read-only by all of them
+//
+struct Job {
+	const char *progConfig;
+	const char *dividerStr;
+	uint8 divider;       // from -c, if dividerStr is set
+	bool negotiate;
+	bool isAsync;
+	const uint8 *image;  // NULL if there is nothing to flash
+	uint32 imageSize;
+	uint32 pageSize;     // DataFlash geometry from -s, or zero
+	uint32 pageShift;
+	bool singleBuffer;
+	bool compare;
+	bool doVerify;
+	const char *cacheFile;
+	uint32 readLines;    // data lines for verify() and readBack(): 1, 2 or 4
+	const char *readFile;
+	uint32 readPages;    // zero to read back as much as the image
+};
+
+struct Board {
+	char vp[VP_MAX];
+	const struct Job *job;
+	struct FLContext *handle;
+	struct Part parts[MAX_PARTS];
+	uint32 numParts;
+	struct Geometry geometry;
+	uint32 totalPages;  // pages in the image
+	uint32 numPages;    // pages flashed so far
+	uint32 numWritten;
+	bool isDone;
+	double seconds;
+	struct SpiCounters usb;
+	struct ProfStats prof;
+	uint8 features;
+	uint32 fifoSize;
+	bool isAsync;
+	uint8 divider;
+	int retVal;
+	const char *error;
+	#ifdef WIN32
+		HANDLE thread;
+	#else
+		pthread_t thread;
+	#endif
+};
+
+// Write the timing and USB transaction counts of the flash() (and verify()) of each board as JSON.
+// With several boards, the totals are followed by each board's own figures.
+//
+static FlashStatus writeBench(
+	const char *benchFile, const struct Job *job, const struct Board *boards, uint32 numBoards,
+	double seconds, const char **error)
+{
+	FlashStatus retVal = FLASH_SUCCESS;
+	struct SpiCounters usb;
+	struct ProfStats prof;
+	uint32 numWritten = 0, i, j;
+	const uint32 numPages = boards[0].numPages;
+	const double pages = numPages ? (double)numPages * numBoards : 1;
+	FILE *json = NULL;
+	memset(&usb, 0, sizeof(usb));
+	memset(&prof, 0, sizeof(prof));
+	for ( i = 0; i < numBoards; i++ ) {
+		for ( j = 0; j < SPI_NUM_CHANNELS; j++ ) {
+			usb.chans[j].writes += boards[i].usb.chans[j].writes;
+			usb.chans[j].reads += boards[i].usb.chans[j].reads;
+			usb.chans[j].bytesWritten += boards[i].usb.chans[j].bytesWritten;
+			usb.chans[j].bytesRead += boards[i].usb.chans[j].bytesRead;
+		}
+		profAdd(&prof, &boards[i].prof);
+		usb.writes += boards[i].usb.writes;
+		usb.reads += boards[i].usb.reads;
+		usb.bytesWritten += boards[i].usb.bytesWritten;
+		usb.bytesRead += boards[i].usb.bytesRead;
+		numWritten += boards[i].numWritten;
+	}
+	if ( seconds <= 0.0 ) {
+		seconds = 1e-9;
+	}
+	json = fopen(benchFile, "w");
+	CHECK_STATUS(!json, FLASH_FILE, cleanup, "writeBench(): Unable to write to %s", benchFile);
+	fprintf(json, "{\n");
+	fprintf(json, "  \"tool\": \"flashprog\",\n");
+	fprintf(json, "  \"part\": \"%s\",\n", boards[0].geometry.name);
+	fprintf(json, "  \"pageSize\": %u,\n", boards[0].geometry.pageSize);
+	fprintf(
+		json, "  \"singleBuffer\": %s,\n",
+		(job->singleBuffer || boards[0].geometry.singleBuffer) ? "true" : "false");
+	fprintf(json, "  \"verified\": %s,\n", job->doVerify ? "true" : "false");
+	fprintf(json, "  \"features\": %u,\n", boards[0].features);
+	fprintf(json, "  \"fifoSize\": %u,\n", boards[0].fifoSize);
+	fprintf(json, "  \"async\": %s,\n", boards[0].isAsync ? "true" : "false");
+	fprintf(json, "  \"divider\": %u,\n", boards[0].divider);
+	fprintf(json, "  \"readLines\": %u,\n", job->readLines);
+	fprintf(json, "  \"parts\": %u,\n", boards[0].numParts);
+	fprintf(json, "  \"boards\": %u,\n", numBoards);
+	fprintf(json, "  \"pages\": %u,\n", numPages);
+	fprintf(json, "  \"pagesWritten\": %u,\n", numWritten);
+	fprintf(json, "  \"seconds\": %.6f,\n", seconds);
+	fprintf(json, "  \"pagesPerSec\": %.1f,\n", numPages * numBoards / seconds);
+	fprintf(json, "  \"kbps\": %.1f,\n", (double)numPages * numBoards * boards[0].geometry.pageSize / seconds / 1000.0);
+	fprintf(
+		json, "  \"usb\": {\"writes\": %u, \"reads\": %u, \"bytesWritten\": %llu, \"bytesRead\": %llu},\n",
+		usb.writes, usb.reads,
+		(unsigned long long)usb.bytesWritten, (unsigned long long)usb.bytesRead
+	);
+	fprintf(json, "  \"usbPerPage\": %.2f,\n", (usb.writes + usb.reads) / pages);
+	fprintf(json, "  \"channels\": ");
+	profWriteChannels(json, &usb, "  ");
+	fprintf(json, ",\n  \"ops\": ");
+	profWriteJson(json, &prof, "  ");
+	if ( numBoards > 1 ) {
+		fprintf(json, ",\n  \"perBoard\": [\n");
+		for ( i = 0; i < numBoards; i++ ) {
+			const double boardSeconds = (boards[i].seconds > 0.0) ? boards[i].seconds : 1e-9;
+			fprintf(
+				json, "    {\"vp\": \"%s\", \"pagesWritten\": %u, \"seconds\": %.6f, \"kbps\": %.1f}%s\n",
+				boards[i].vp, boards[i].numWritten, boards[i].seconds,
+				(double)boards[i].numWritten * boards[i].geometry.pageSize / boardSeconds / 1000.0,
+				(i + 1 < numBoards) ? "," : ""
 			);
-			CHECK_STATUS(status, FLASH_FPGALINK, cleanup, "flash()");
-			
-			status = flReadChannel(handle, 1000, 0x00, 2, tmp, error);
-			CHECK_STATUS(status, FLASH_FPGALINK, cleanup, "flash()");
-			i++;
-		} while ( !(tmp[1] & BM_READY) );
-		printf(".");
-		fflush(stdout);
-		
-		pageNum++;
-		count = fread(tmp+4, 1, pageSize, file);
+		}
+		fprintf(json, "  ]");
 	}
-	printf("\n");
+	fprintf(json, "\n}\n");
 cleanup:
-	free(tmp);
+	if ( json ) {
+		fclose(json);
+	}
 	return retVal;
 }
 
+// Parse a list of chip-selects, like "0,2,3", one part on each.
+//
+static bool parseParts(const char *str, struct Part *parts, uint32 *numParts) {
+	char *end;
+	uint32 i, n = 0;
+	do {
+		const unsigned long dev = strtoul(str, &end, 10);
+		if ( end == str || dev >= SPI_MAX_DEVS ) {
+			return false;
+		}
+		for ( i = 0; i < n; i++ ) {
+			if ( parts[i].dev == dev ) {
+				return false;
+			}
+		}
+		parts[n++].dev = (uint8)dev;
+		str = end + 1;
+	} while ( *end == ',' );
+	*numParts = n;
+	return *end == '\0';
+}
+
+// Parse a list of FPGALink devices, like "1d50:602b:0000,1d50:602b:0001". A device ID of "*", as
+// in "1d50:602b:*", stands for every device with that VID:PID which is connected.
+//
+static bool parseBoards(const char *str, struct Board *boards, uint32 *numBoards) {
+	const char *end;
+	uint32 n = 0, len, did;
+	bool flag;
+	do {
+		end = strchr(str, ',');
+		len = end ? (uint32)(end - str) : (uint32)strlen(str);
+		if ( len == 0 || len >= VP_MAX ) {
+			return false;
+		}
+		if ( len > 2 && !strncmp(str + len - 2, ":*", 2) ) {
+			if ( len + 3 >= VP_MAX ) {
+				return false;
+			}
+			for ( did = 0; did < 0x10000 && n < MAX_BOARDS; did++ ) {
+				sprintf(boards[n].vp, "%.*s:%04X", (int)(len - 2), str, did);
+				if ( flIsDeviceAvailable(boards[n].vp, &flag, NULL) == FL_SUCCESS && flag ) {
+					n++;
+				} else if ( did >= MAX_BOARDS ) {
+					break;  // device IDs may have gaps, but not big ones
+				}
+			}
+		} else if ( n < MAX_BOARDS ) {
+			memcpy(boards[n].vp, str, len);
+			boards[n].vp[len] = '\0';
+			n++;
+		} else {
+			return false;
+		}
+		str = end + 1;
+	} while ( end );
+	*numBoards = n;
+	return true;
+}
+
+// Flash and verify each part of a board, and note how long it took.
+//
+static int flashBoard(struct Board *board, uint32 readLines) {
+	const struct Job *const job = board->job;
+	const char **const error = &board->error;
+	struct Part *const parts = board->parts;
+	const uint32 numParts = board->numParts;
+	const struct Geometry *const geom = &board->geometry;
+	const uint32 unit = geom->isDataFlash ? geom->pageSize : geom->erase[0].size;
+	int retVal = 0;
+	FlashStatus flashStatus;
+	struct SpiCounters before;
+	const double startTime = wallTime();
+	uint32 i, badParts = 0;
+
+	// A 25-series part's cache covers whole sectors, since flashNor() skips them a sector at a time
+	spiGetCounters(&before);
+	profReset();
+	for ( i = 0; i < numParts && job->cacheFile; i++ ) {
+		parts[i].cache.fileName = job->cacheFile;
+		parts[i].cache.pageSize = geom->pageSize;
+		parts[i].cache.numPages = (job->imageSize + unit - 1) / unit * (unit / geom->pageSize);
+		selected = (uint8)CHIPSEL_DEV(parts[i].dev);
+		flashStatus = readDeviceKey(parts[i].cache.key, error);
+		if ( flashStatus ) { FAIL(31, cleanup); }
+		flashStatus = cacheLoad(&parts[i].cache, error);
+		if ( flashStatus ) { FAIL(32, cleanup); }
+	}
+	flashStatus = geom->isDataFlash ?
+		flash(
+			job->image, job->imageSize, geom->pageSize, geom->pageShift,
+			job->singleBuffer || geom->singleBuffer, job->compare, parts, numParts, &board->numPages, error) :
+		flashNor(job->image, job->imageSize, job->compare, parts, numParts, &board->numPages, error);
+	if ( flashStatus ) {
+		FAIL(23, cleanup);
+	} else if ( numParts == 1 ) {
+		say(stdout, "Wrote %u of %u pages\n", parts[0].numWritten, board->numPages);
+	} else {
+		for ( i = 0; i < numParts; i++ ) {
+			say(stdout, "Wrote %u of %u pages to CS%u\n", parts[i].numWritten, board->numPages, parts[i].dev);
+		}
+	}
+	for ( i = 0; i < numParts; i++ ) {
+		board->numWritten += parts[i].numWritten;
+	}
+
+	// Verify every part, even after one has failed, so they are all reported
+	for ( i = 0; i < numParts && job->doVerify; i++ ) {
+		if ( numParts == 1 ) {
+			say(stdout, "Verifying...\n");
+		} else {
+			say(stdout, "Verifying CS%u...\n", parts[i].dev);
+		}
+		selected = (uint8)CHIPSEL_DEV(parts[i].dev);
+		flashStatus = verify(
+			job->image, job->imageSize, geom->pageSize,
+			parts[i].cache.digests ? &parts[i].cache : NULL, readLines, error);
+		if ( flashStatus == FLASH_VERIFY ) {
+			say(stderr, "%s\n", *error);
+			flFreeError(*error);
+			*error = NULL;
+			badParts++;
+		} else if ( flashStatus ) {
+			FAIL(30, cleanup);
+		} else {
+			say(stdout, "Verified %u bytes\n", job->imageSize);
+		}
+	}
+	if ( badParts ) {
+		FAIL(30, cleanup);
+	}
+	board->seconds = wallTime() - startTime;
+	spiGetCounters(&board->usb);
+	board->usb.writes -= before.writes;
+	board->usb.reads -= before.reads;
+	board->usb.bytesWritten -= before.bytesWritten;
+	board->usb.bytesRead -= before.bytesRead;
+	for ( i = 0; i < SPI_NUM_CHANNELS; i++ ) {
+		board->usb.chans[i].writes -= before.chans[i].writes;
+		board->usb.chans[i].reads -= before.chans[i].reads;
+		board->usb.chans[i].bytesWritten -= before.chans[i].bytesWritten;
+		board->usb.chans[i].bytesRead -= before.chans[i].bytesRead;
+	}
+	profGet(&board->prof);
+	board->features = spiFeatures();
+	board->fifoSize = spiBatchMax();
+	board->isAsync = spiIsAsync();
+	board->divider = spiGetDivider();
+cleanup:
+	return retVal;
+}
+
+// Everything done to one board once it is open: load the FPGA, identify the flash, set up the SPI
+// clock, then flash and verify each part, and read the first one back. The page caches are loaded
+// here, but saved by the caller, so that no two boards write the cache file at once.
+//
+static int runBoard(struct Board *board) {
+	const struct Job *const job = board->job;
+	const char **const error = &board->error;
+	struct Part *const parts = board->parts;
+	const uint32 numParts = board->numParts;
+	int retVal = 0;
+	FLStatus status;
+	FlashStatus flashStatus;
+	double startTime;
+	uint8 divider;
+	uint32 readLines = job->readLines, readSize;
+	struct Geometry *const geom = &board->geometry;
+
+	if ( job->progConfig ) {
+		say(stdout, "Executing programming configuration \"%s\"...\n", job->progConfig);
+		if ( flIsNeroCapable(board->handle) ) {
+			status = flProgram(board->handle, job->progConfig, NULL, error);
+			CHECK_STATUS(status, 21, cleanup);
+		} else {
+			errRender(error, "Program operation requested but device does not support NeroProg");
+			FAIL(17, cleanup);
+		}
+	}
+	status = flFifoMode(board->handle, 0x01, error);
+	CHECK_STATUS(status, 22, cleanup);
+
+	// See what the FPGA supports: the poll engine, clock divider and FIFO size
+	profName(boardName ? boardName : "flashprog");
+	spiInit(board->handle, TURBO);
+	if ( job->isAsync && !spiSetAsync(true) ) {
+		say(stderr, "Unable to start the USB I/O thread; carrying on without it\n");
+	}
+	status = spiStatus(error);
+	CHECK_STATUS(status, 25, cleanup);
+
+	// Identify the flash at a safe clock, since a part which can't keep up would give a bad ID
+	if ( (job->dividerStr || job->negotiate) && !(spiFeatures() & FEATURE_CLKDIV) ) {
+		say(stdout, "FPGA has no clock divider; using the fixed fast clock\n");
+	} else if ( job->dividerStr ) {
+		spiSetDivider(job->divider);
+		status = spiStatus(error);
+		CHECK_STATUS(status, 26, cleanup);
+	} else if ( job->negotiate ) {
+		spiSetDivider(NEGOTIATE_START);
+		status = spiStatus(error);
+		CHECK_STATUS(status, 27, cleanup);
+	}
+	if ( !job->image && !job->readFile && !job->negotiate ) {
+		goto cleanup;
+	}
+	if ( !flIsCommCapable(board->handle) ) {
+		errRender(error, "Flash operation requested but device does not support CommFPGA");
+		FAIL(24, cleanup);
+	}
+	flashStatus = identify(parts, numParts, geom, error);
+	if ( flashStatus == FLASH_UNKNOWN && job->pageSize ) {
+		say(stderr, "%s\n", *error);
+		flFreeError(*error);
+		*error = NULL;
+		say(stdout, "Taking it to be a DataFlash with %u-byte pages, as -s says\n", job->pageSize);
+		jedecDataFlashGiven(job->pageSize, job->pageShift, geom);
+	} else if ( flashStatus ) {
+		FAIL(43, cleanup);
+	} else if (
+		job->pageSize && (!geom->isDataFlash || geom->pageSize != job->pageSize || geom->pageShift != job->pageShift) )
+	{
+		errRender(
+			error, "The flash (%s) has %u-byte pages, but -s says %u:%u",
+			geom->name, geom->pageSize, job->pageSize, job->pageShift);
+		FAIL(42, cleanup);
+	}
+	geometry = geom;
+	if ( geom->numPages ) {
+		say(
+			stdout, "Found %s (%02X%02X%02X): %u pages of %u bytes\n",
+			geom->name, geom->id[0], geom->id[1], geom->id[2], geom->numPages, geom->pageSize);
+	}
+	if ( job->image && geom->numPages && job->imageSize > geom->numPages * geom->pageSize ) {
+		errRender(
+			error, "The image is %u bytes, but the %s only holds %u",
+			job->imageSize, geom->name, geom->numPages * geom->pageSize);
+		FAIL(44, cleanup);
+	}
+	setProgress(&board->totalPages, (job->imageSize + geom->pageSize - 1) / geom->pageSize);
+	if ( job->negotiate && (spiFeatures() & FEATURE_CLKDIV) && !job->dividerStr ) {
+		flashStatus = negotiateClock(partSelects(parts, numParts, ~0U), &divider, error);
+		if ( flashStatus ) { FAIL(27, cleanup); }
+		say(stdout, "Fastest reliable clock divider is %d (sysClk/%d)\n", divider, 2 * (divider + 1));
+	}
+	if ( readLines > 1 && !(spiIoModes() & ((readLines == 4) ? IO_X4 : IO_X2)) ) {
+		say(stdout, "FPGA is not wired for %u-line reads; using one\n", readLines);
+		readLines = 1;
+	} else if ( readLines > 1 && !(geom->ioModes & ((readLines == 4) ? IO_X4 : IO_X2)) ) {
+		say(stdout, "The %s has no %u-line read; using one\n", geom->name, readLines);
+		readLines = 1;
+	}
+	if ( job->image ) {
+		retVal = flashBoard(board, readLines);
+		if ( retVal ) {
+			goto cleanup;
+		}
+	}
+	if ( job->readFile ) {
+		readSize = job->readPages ? job->readPages * geom->pageSize : job->imageSize;
+		say(stdout, "Reading %u bytes into %s...\n", readSize, job->readFile);
+		startTime = wallTime();
+		selected = (uint8)CHIPSEL_DEV(parts[0].dev);
+		flashStatus = readBack(job->readFile, readSize, readLines, error);
+		if ( flashStatus ) { FAIL(38, cleanup); }
+		startTime = wallTime() - startTime;
+		say(
+			stdout, "Read %u bytes in %.3fs (%.1f kB/s)\n", readSize, startTime,
+			readSize / 1000.0 / (startTime > 0.0 ? startTime : 1e-9));
+	}
+cleanup:
+	spiSetAsync(false);
+	return retVal;
+}
+
+#ifdef WIN32
+static DWORD WINAPI boardThread(LPVOID arg) {
+#else
+static void *boardThread(void *arg) {
+#endif
+	struct Board *const board = (struct Board *)arg;
+	boardName = board->vp;
+	if ( flOpen(board->vp, &board->handle, &board->error) ) {
+		board->retVal = 20;
+	} else {
+		board->retVal = runBoard(board);
+	}
+	flClose(board->handle);
+	board->handle = NULL;
+	LOCK();
+	board->isDone = true;
+	UNLOCK();
+	return 0;
+}
+
+// Program all of the boards at once, printing each one's progress every second whilst they are
+// busy, then how each one did, and the overall throughput.
+//
+#define PROGRESS_MS 1000
+#define POLL_MS     50
+
+static void runFarm(struct Board *boards, uint32 numBoards, const struct Job *job, double *seconds) {
+	const double startTime = wallTime();
+	uint32 numDone, numGood = 0, elapsed = 0, i;
+	double totalKB = 0.0;
+	printf("Programming %u boards...\n", numBoards);
+	#ifdef WIN32
+		InitializeCriticalSection(&farm.lock);
+	#else
+		pthread_mutex_init(&farm.lock, NULL);
+	#endif
+	for ( i = 0; i < numBoards; i++ ) {
+		#ifdef WIN32
+			boards[i].thread = CreateThread(NULL, 0, boardThread, boards + i, 0, NULL);
+			if ( !boards[i].thread ) {
+		#else
+			if ( pthread_create(&boards[i].thread, NULL, boardThread, boards + i) ) {
+		#endif
+				errRender(&boards[i].error, "Unable to start a thread for %s", boards[i].vp);
+				boards[i].retVal = 37;
+				boards[i].isDone = true;
+			}
+	}
+	do {
+		flSleep(POLL_MS);
+		elapsed += POLL_MS;
+		LOCK();
+		for ( numDone = 0, i = 0; i < numBoards; i++ ) {
+			numDone += boards[i].isDone ? 1 : 0;
+		}
+		if ( elapsed >= PROGRESS_MS && numDone < numBoards ) {
+			printf("Progress:");
+			for ( i = 0; i < numBoards; i++ ) {
+				if ( boards[i].isDone ) {
+					printf(" [%s done]", boards[i].vp);
+				} else {
+					printf(" [%s %u/%u]", boards[i].vp, boards[i].numPages, boards[i].totalPages);
+				}
+			}
+			printf("\n");
+			fflush(stdout);
+			elapsed = 0;
+		}
+		UNLOCK();
+	} while ( numDone < numBoards );
+	for ( i = 0; i < numBoards; i++ ) {
+		if ( boards[i].retVal == 37 ) {
+			continue;
+		}
+		#ifdef WIN32
+			WaitForSingleObject(boards[i].thread, INFINITE);
+			CloseHandle(boards[i].thread);
+		#else
+			pthread_join(boards[i].thread, NULL);
+		#endif
+	}
+	#ifdef WIN32
+		DeleteCriticalSection(&farm.lock);
+	#else
+		pthread_mutex_destroy(&farm.lock);
+	#endif
+	*seconds = wallTime() - startTime;
+	for ( i = 0; i < numBoards; i++ ) {
+		const struct Board *const b = boards + i;
+		if ( b->retVal ) {
+			printf("  %s: failed (%d)\n", b->vp, b->retVal);
+		} else if ( job->image ) {
+			const double kb = (double)b->numWritten * b->geometry.pageSize / 1000.0;
+			printf(
+				"  %s: wrote %u of %u pages in %.3fs (%.1f kB/s)\n",
+				b->vp, b->numWritten, b->numPages * b->numParts, b->seconds, kb / (b->seconds > 0.0 ? b->seconds : 1e-9)
+			);
+			totalKB += kb;
+			numGood++;
+		} else {
+			printf("  %s: done\n", b->vp);
+			numGood++;
+		}
+	}
+	printf(
+		"%u of %u boards succeeded in %.3fs (%.1f kB/s in all)\n",
+		numGood, numBoards, *seconds, totalKB / (*seconds > 0.0 ? *seconds : 1e-9)
+	);
+}
+
 int main(int argc, const char *argv[]) {
 	int retVal = 0;
 	FLStatus status;
 	FlashStatus flashStatus;
 	const char *error = NULL;
 	bool flag;
-	bool isNeroCapable, isCommCapable;
-	const char *vp = NULL, *ivp = NULL, *progConfig = NULL;
+	const char *vp = NULL, *ivp = NULL;
 	//const char *portConfig = NULL;
 	const char *flashSize = NULL;
 	const char *fileName = NULL;
+	const char *selectStr = NULL, *linesStr = NULL, *readPages = NULL;
+	struct Job job;
+	struct Part parts[MAX_PARTS];
+	static struct Board boards[MAX_BOARDS];
+	uint32 numParts = 1, numBoards = 0, i, j;
+	const uint8 *image = NULL;
+	uint32 imageSize = 0;
+	const char *benchFile = NULL, *traceFile = NULL;
+	double seconds = 0.0;
 	const char *const prog = argv[0];
-	uint32 pageSize = 0;
-	uint32 pageShift = 0;
 
+	memset(&job, 0, sizeof(job));
+	job.readLines = 1;
+	memset(parts, 0, sizeof(parts));
 	printf("SPI-Flash Example Copyright (C) 2013 Chris McClelland\n\n");
 	argv++;
 	argc--;
@@ -212,11 +1877,50 @@ int main(int argc, const char *argv[]) {
 			GET_ARG("s", flashSize, 5, cleanup);
 			break;
 		case 'p':
-			GET_ARG("p", progConfig, 6, cleanup);
+			GET_ARG("p", job.progConfig, 6, cleanup);
 			break;
 		case 'f':
 			GET_ARG("f", fileName, 7, cleanup);
 			break;
+		case '1':
+			job.singleBuffer = true;
+			break;
+		case 'c':
+			GET_ARG("c", job.dividerStr, 7, cleanup);
+			break;
+		case 'a':
+			job.negotiate = true;
+			break;
+		case 'A':
+			job.isAsync = true;
+			break;
+		case 'V':
+			job.doVerify = true;
+			break;
+		case 'd':
+			job.compare = true;
+			break;
+		case 'C':
+			GET_ARG("C", job.cacheFile, 7, cleanup);
+			break;
+		case 'S':
+			GET_ARG("S", selectStr, 7, cleanup);
+			break;
+		case 'B':
+			GET_ARG("B", benchFile, 7, cleanup);
+			break;
+		case 'W':
+			GET_ARG("W", linesStr, 7, cleanup);
+			break;
+		case 'r':
+			GET_ARG("r", job.readFile, 7, cleanup);
+			break;
+		case 'n':
+			GET_ARG("n", readPages, 7, cleanup);
+			break;
+		case 'T':
+			GET_ARG("T", traceFile, 7, cleanup);
+			break;
 		default:
 			invalid(prog, argv[0][1]);
 			FAIL(8, cleanup);
@@ -228,108 +1932,204 @@ int main(int argc, const char *argv[]) {
 		missing(prog, "v <VID:PID>");
 		FAIL(9, cleanup);
 	}
-	if ( !flashSize ) {
-		missing(prog, "s <size:shift>");
-		FAIL(10, cleanup);
-	}
-	pageSize = (uint32)strtoul(flashSize, (char**)&flashSize, 10);
-	if ( !pageSize ) {
-		fprintf(stderr, "The flash size should look like <528:10>\n");
-		FAIL(11, cleanup);
+	if ( flashSize ) {
+		job.pageSize = (uint32)strtoul(flashSize, (char**)&flashSize, 10);
+		if ( !job.pageSize ) {
+			fprintf(stderr, "The flash size should look like <528:10>\n");
+			FAIL(11, cleanup);
+		}
+		if ( *flashSize != ':' ) {
+			fprintf(stderr, "The flash size should look like <528:10>\n");
+			FAIL(12, cleanup);
+		}
+		job.pageShift = (uint32)strtoul(flashSize+1, (char**)&flashSize, 10);
+		if ( !job.pageShift ) {
+			fprintf(stderr, "The flash size should look like <528:10>\n");
+			FAIL(13, cleanup);
+		}
+		if ( *flashSize != '\0' ) {
+			fprintf(stderr, "The flash size should look like <528:10>\n");
+			FAIL(14, cleanup);
+		}
 	}
-	if ( *flashSize != ':' ) {
-		fprintf(stderr, "The flash size should look like <528:10>\n");
-		FAIL(12, cleanup);
+
+	if ( selectStr && !parseParts(selectStr, parts, &numParts) ) {
+		fprintf(stderr, "The chip-selects should look like <0> or <0,1,2>, each below %d\n", SPI_MAX_DEVS);
+		FAIL(34, cleanup);
 	}
-	pageShift = (uint32)strtoul(flashSize+1, (char**)&flashSize, 10);
-	if ( !pageShift ) {
-		fprintf(stderr, "The flash size should look like <528:10>\n");
-		FAIL(13, cleanup);
+
+	if ( job.dividerStr ) {
+		char *end;
+		const unsigned long n = strtoul(job.dividerStr, &end, 0);
+		if ( end == job.dividerStr || *end || n > 255 ) {
+			fprintf(stderr, "The clock divider should be a number from 0 to 255\n");
+			FAIL(46, cleanup);
+		}
+		job.divider = (uint8)n;
 	}
-	if ( *flashSize != '\0' ) {
-		fprintf(stderr, "The flash size should look like <528:10>\n");
-		FAIL(14, cleanup);
+
+	if ( linesStr ) {
+		job.readLines = (uint32)strtoul(linesStr, NULL, 10);
+		if ( job.readLines != 1 && job.readLines != 2 && job.readLines != 4 ) {
+			fprintf(stderr, "Reads can use 1, 2 or 4 data lines\n");
+			FAIL(39, cleanup);
+		}
 	}
 
-	printf("pageSize = %d\npageShift = %d\n", pageSize, pageShift);
+	if ( job.pageSize ) {
+		printf("pageSize = %d\npageShift = %d\n", job.pageSize, job.pageShift);
+	}
 
 	status = flInitialise(0, &error);
 	CHECK_STATUS(status, 15, cleanup);
-	
-	printf("Attempting to open connection to FPGALink device %s...\n", vp);
-	status = flOpen(vp, &handle, NULL);
-	if ( status ) {
-		if ( ivp ) {
-			int count = 60;
-			printf("Loading firmware into %s...\n", ivp);
-			status = flLoadStandardFirmware(ivp, vp, &error);
-			CHECK_STATUS(status, 16, cleanup);
-			
-			printf("Awaiting renumeration");
-			flSleep(1000);
-			do {
-				printf(".");
-				fflush(stdout);
-				status = flIsDeviceAvailable(vp, &flag, &error);
-				CHECK_STATUS(status, 17, cleanup);
-				flSleep(100);
-				count--;
-			} while ( !flag && count );
-			printf("\n");
-			if ( !flag ) {
-				fprintf(stderr, "FPGALink device did not renumerate properly as %s\n", vp);
-				FAIL(18, cleanup);
-			}
-			
-			printf("Attempting to open connection to FPGLink device %s again...\n", vp);
-			status = flOpen(vp, &handle, &error);
-			CHECK_STATUS(status, 19, cleanup);
-		} else {
-			fprintf(stderr, "Could not open FPGALink device at %s and no initial VID:PID was supplied\n", vp);
-			FAIL(20, cleanup);
+
+	if ( !parseBoards(vp, boards, &numBoards) ) {
+		fprintf(stderr, "The devices should look like <VID:PID>, <VID:PID:DID,...> or <VID:PID:*>, at most %d\n", MAX_BOARDS);
+		FAIL(35, cleanup);
+	}
+	if ( !numBoards ) {
+		fprintf(stderr, "No FPGALink device matches %s\n", vp);
+		FAIL(35, cleanup);
+	}
+	if ( numBoards > 1 && ivp ) {
+		fprintf(stderr, "Firmware can only be loaded into one device; load it into each first\n");
+		FAIL(36, cleanup);
+	}
+	if ( numBoards > 1 && job.readFile ) {
+		fprintf(stderr, "Only one device can be read back into a file\n");
+		FAIL(41, cleanup);
+	}
+	if ( fileName ) {
+		flashStatus = mapFile(fileName, &image, &imageSize, &error);
+		if ( flashStatus ) { FAIL(29, cleanup); }
+		job.image = image;
+		job.imageSize = imageSize;
+	}
+	if ( job.readFile ) {
+		job.readPages = readPages ? (uint32)strtoul(readPages, NULL, 10) : 0;
+		if ( !job.readPages && !imageSize ) {
+			fprintf(stderr, "Say how many pages to read back with -n, or give the image with -f\n");
+			FAIL(40, cleanup);
 		}
 	}
+	if ( traceFile && !profTraceOpen(traceFile) ) {
+		fprintf(stderr, "Unable to write to %s\n", traceFile);
+		FAIL(45, cleanup);
+	}
+	for ( i = 0; i < numBoards; i++ ) {
+		boards[i].job = &job;
+		memcpy(boards[i].parts, parts, sizeof(parts));
+		boards[i].numParts = numParts;
+	}
 
-	isNeroCapable = flIsNeroCapable(handle);
-	isCommCapable = flIsCommCapable(handle);
-	if ( progConfig ) {
-		printf("Executing programming configuration \"%s\"...\n", progConfig);
-		if ( isNeroCapable ) {
-			status = flProgram(handle, progConfig, NULL, &error);
-			CHECK_STATUS(status, 21, cleanup);
-		} else {
-			fprintf(stderr, "Program operation requested but device does not support NeroProg\n");
-			FAIL(17, cleanup);
+	if ( numBoards == 1 ) {
+		vp = boards[0].vp;
+		printf("Attempting to open connection to FPGALink device %s...\n", vp);
+		status = flOpen(vp, &boards[0].handle, NULL);
+		if ( status ) {
+			if ( ivp ) {
+				int count = 60;
+				printf("Loading firmware into %s...\n", ivp);
+				status = flLoadStandardFirmware(ivp, vp, &error);
+				CHECK_STATUS(status, 16, cleanup);
+				
+				printf("Awaiting renumeration");
+				flSleep(1000);
+				do {
+					printf(".");
+					fflush(stdout);
+					status = flIsDeviceAvailable(vp, &flag, &error);
+					CHECK_STATUS(status, 17, cleanup);
+					flSleep(100);
+					count--;
+				} while ( !flag && count );
+				printf("\n");
+				if ( !flag ) {
+					fprintf(stderr, "FPGALink device did not renumerate properly as %s\n", vp);
+					FAIL(18, cleanup);
+				}
+				
+				printf("Attempting to open connection to FPGLink device %s again...\n", vp);
+				status = flOpen(vp, &boards[0].handle, &error);
+				CHECK_STATUS(status, 19, cleanup);
+			} else {
+				fprintf(stderr, "Could not open FPGALink device at %s and no initial VID:PID was supplied\n", vp);
+				FAIL(20, cleanup);
+			}
 		}
+		boards[0].retVal = runBoard(boards);
+		seconds = boards[0].seconds;
+	} else {
+		runFarm(boards, numBoards, &job, &seconds);
+	}
+	for ( i = 0; i < numBoards && !retVal; i++ ) {
+		retVal = boards[i].retVal;
 	}
-	status = flFifoMode(handle, 0x01, &error);
-	CHECK_STATUS(status, 22, cleanup);
 
-	if ( fileName ) {
-		if ( isCommCapable ) {
-			flashStatus = flash(fileName, pageSize, pageShift, &error);
-			if ( flashStatus ) { FAIL(23, cleanup); }
-		} else {
-			fprintf(stderr, "Flash operation requested but device does not support CommFPGA\n");
-			FAIL(24, cleanup);
+	// Save what is now known about the pages even if something failed part-way
+	for ( i = 0; i < numBoards && job.cacheFile; i++ ) {
+		for ( j = 0; j < numParts; j++ ) {
+			const char *cacheError = NULL;
+			if ( boards[i].parts[j].cache.digests && cacheSave(&boards[i].parts[j].cache, &cacheError) ) {
+				fprintf(stderr, "%s\n", cacheError);
+				flFreeError(cacheError);
+				if ( !retVal ) { FAIL(33, cleanup); }
+			}
 		}
 	}
+	if ( retVal ) {
+		goto cleanup;
+	}
+	if ( benchFile && image ) {
+		flashStatus = writeBench(benchFile, &job, boards, numBoards, seconds, &error);
+		if ( flashStatus ) { FAIL(28, cleanup); }
+		printf("Flashed %u pages in %.3fs; results written to %s\n", boards[0].numPages, seconds, benchFile);
+	}
 cleanup:
+	for ( i = 0; i < numBoards; i++ ) {
+		for ( j = 0; j < numParts; j++ ) {
+			free(boards[i].parts[j].cache.digests);
+		}
+		if ( boards[i].error ) {
+			if ( numBoards > 1 ) {
+				fprintf(stderr, "%s: %s\n", boards[i].vp, boards[i].error);
+			} else {
+				fprintf(stderr, "%s\n", boards[i].error);
+			}
+			flFreeError(boards[i].error);
+		}
+	}
+	unmapFile(image, imageSize);
 	if ( error ) {
 		fprintf(stderr, "%s\n", error);
 		flFreeError(error);
 	}
-	flClose(handle);
+	flClose(boards[0].handle);
+	profTraceClose();
 	return retVal;
 }
 
 void usage(const char *prog) {
-	printf("Usage: %s [-h] [-i <VID:PID>] -v <VID:PID> [-p <progConfig>]\n         -s <size:shift> -f <binFile>\n\n", prog);
+	printf("Usage: %s [-h] [-i <VID:PID>] -v <VID:PID> [-p <progConfig>]\n         [-s <size:shift>] -f <binFile> [-1] [-V] [-d] [-C <cacheFile>]\n         [-S <cs>[,<cs>...]] [-c <divider> | -a] [-A] [-B <jsonFile>]\n         [-r <readFile> [-n <numPages>]] [-W <lines>] [-T <traceFile>]\n\n", prog);
 	printf("Load FX2LP firmware, load the FPGA, interact with the FPGA.\n\n");
 	printf("  -i <VID:PID>     initial vendor and product ID of the FPGALink device\n");
 	printf("  -v <VID:PID>     renumerated vendor and product ID of the FPGALink device\n");
-	printf("  -s <size:shift>  set the page size and page-address shift\n");
+	printf("                   (or a list of VID:PID:DID, or VID:PID:* for every board, all flashed at once)\n");
+	printf("  -s <size:shift>  DataFlash page size and page-address shift, if the part can't be identified\n");
 	printf("  -p <progConfig>  configuration and programming file\n");
 	printf("  -f <flashFile>   file to load into flash\n");
+	printf("  -1               use only SRAM buffer 1 (for single-buffer parts)\n");
+	printf("  -V               read the flash back after writing it, and check it against the file\n");
+	printf("  -d               compare each page with the flash first, and only write those which differ\n");
+	printf("  -C <cacheFile>   skip pages which this file says were already written to this part\n");
+	printf("  -S <cs>[,<cs>..] chip-select(s) of the flash part(s), all written in one pass (default 0)\n");
+	printf("  -c <divider>     SPI clock at sysClk/(2*(divider+1))\n");
+	printf("  -a               find the fastest reliable SPI clock\n");
+	printf("  -A               do USB I/O on a separate thread, overlapping it with host work\n");
+	printf("  -B <jsonFile>    time the flash operation and write the results as JSON\n");
+	printf("  -r <readFile>    read the flash back into a file, after writing it if -f is given\n");
+	printf("  -n <numPages>    pages to read back with -r (default the size of the -f file)\n");
+	printf("  -W <lines>       data lines for reads: 2 or 4 for dual- or quad-output reads (default 1)\n");
+	printf("  -T <traceFile>   trace every USB transaction, poll, page program and erase to a Chrome/Perfetto trace\n");
 	printf("  -h               print this help and exit\n");
 }
@@ -0,0 +1,296 @@
+/*
+ * Copyright (C) 2013 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "private.h"
+
+// Atmel AT45DB161D DataFlash in 528-byte page mode, backed by a binary image file which is
+// loaded on creation and written back on destruction. It also has the dual- and quad-output
+// array reads (3B and 6B) of the AT45DQ161. Environment knobs (typical datasheet values by
+// default):
+//   FLEMU_AT45_TEP_US  - buffer to main memory page program with built-in erase
+//   FLEMU_AT45_TP_US   - buffer to main memory page program without built-in erase
+//   FLEMU_AT45_TPE_US  - page erase
+//   FLEMU_AT45_TXFR_US - main memory page to buffer transfer/compare
+//
+#define NUM_PAGES   4096
+#define PAGE_SIZE   528
+#define PAGE_SHIFT  10
+#define DENSITY     0x2C   // status bits 5:2 = 1011 (16Mbit)
+#define SECURITY    128    // 64 user-programmable bytes, then 64 factory-programmed ID bytes
+
+#define ST_READY    0x80
+#define ST_COMP     0x40
+
+struct DataFlash {
+	struct Device dev;
+	char *fileName;
+	uint8 *array;
+	uint8 buffer[2][PAGE_SIZE];
+	uint8 security[SECURITY];
+	uint64 tEP, tP, tPE, tXFR;
+	uint64 busyUntil;
+	int busyBuffer;     // buffer in use by the self-timed operation, or -1
+	bool isMismatch;
+
+	// Per-select command state
+	uint8 opcode;
+	uint32 count;       // bytes received since CS asserted
+	uint32 address;
+	uint32 dummies;     // don't-care bytes between address and data
+	uint32 page;
+	uint32 offset;
+};
+
+static bool isBusy(const struct DataFlash *df, uint64 now) {
+	return now < df->busyUntil;
+}
+
+static uint8 statusByte(const struct DataFlash *df, uint64 now) {
+	return (uint8)((isBusy(df, now) ? 0x00 : ST_READY) | (df->isMismatch ? ST_COMP : 0x00) | DENSITY);
+}
+
+// While busy, the part accepts only status reads and accesses to the buffer not in use.
+//
+static bool isAllowed(const struct DataFlash *df, uint8 opcode, uint64 now) {
+	int buf;
+	if ( !isBusy(df, now) || opcode == 0xD7 ) {
+		return true;
+	}
+	switch ( opcode ) {
+	case 0x84: case 0xD1: case 0xD4: buf = 0; break;
+	case 0x87: case 0xD3: case 0xD6: buf = 1; break;
+	default: return false;
+	}
+	return buf != df->busyBuffer;
+}
+
+static uint8 *pagePtr(const struct DataFlash *df, uint32 page) {
+	return df->array + (page % NUM_PAGES) * PAGE_SIZE;
+}
+
+// Decode the 24-bit address: page in the upper bits, byte offset in the lower PAGE_SHIFT bits.
+//
+static void decodeAddress(struct DataFlash *df) {
+	df->page = (df->address >> PAGE_SHIFT) % NUM_PAGES;
+	df->offset = (df->address & ((1<<PAGE_SHIFT)-1)) % PAGE_SIZE;
+}
+
+// Data lines used for the data phase of a command; everything else goes over MOSI and MISO.
+//
+static uint32 dataLines(uint8 opcode) {
+	switch ( opcode ) {
+	case 0x3B: return 2;
+	case 0x6B: return 4;
+	default: return 1;
+	}
+}
+
+static uint8 at45Exchange(struct Device *self, uint8 mosi, uint32 lines, uint64 now) {
+	struct DataFlash *df = (struct DataFlash *)self;
+	uint8 miso = 0xFF;
+	const uint32 n = df->count++;
+	if ( n == 0 ) {
+		df->opcode = (lines == 1 && isAllowed(df, mosi, now)) ? mosi : 0x00;
+		df->address = 0;
+		switch ( df->opcode ) {
+		case 0x0B: case 0x3B: case 0x6B: df->dummies = 1; break;
+		case 0xD4: case 0xD6: df->dummies = 1; break;
+		case 0xE8: df->dummies = 4; break;
+		default: df->dummies = 0;
+		}
+		return miso;
+	}
+	switch ( df->opcode ) {
+	case 0xD7:
+		// Status register may be read continuously
+		return statusByte(df, now);
+	case 0x9F:
+		{
+			static const uint8 id[] = {0x1F, 0x26, 0x00, 0x01, 0x00};
+			return (n <= sizeof(id)) ? id[n-1] : 0x00;
+		}
+	case 0x00:
+		return miso;
+	}
+	if ( lines != (n <= 3 + df->dummies ? 1 : dataLines(df->opcode)) ) {
+		// The part and the host disagree about which lines carry what, so the command is garbage
+		df->opcode = 0x00;
+		return (uint8)(mosi ^ 0x5A);
+	}
+	if ( n <= 3 ) {
+		df->address = (df->address << 8) | mosi;
+		if ( n == 3 ) {
+			decodeAddress(df);
+		}
+		return miso;
+	}
+	if ( n <= 3 + df->dummies ) {
+		return miso;
+	}
+	switch ( df->opcode ) {
+	case 0x77:
+		// Security register read, after three don't-care bytes
+		miso = df->security[(n - 4) % SECURITY];
+		break;
+	case 0x84:
+	case 0x87:
+		// Buffer write; wraps within the buffer
+		df->buffer[df->opcode == 0x87][df->offset] = mosi;
+		df->offset = (df->offset + 1) % PAGE_SIZE;
+		break;
+	case 0xD1:
+	case 0xD3:
+	case 0xD4:
+	case 0xD6:
+		// Buffer read; wraps within the buffer
+		miso = df->buffer[df->opcode == 0xD3 || df->opcode == 0xD6][df->offset];
+		df->offset = (df->offset + 1) % PAGE_SIZE;
+		break;
+	case 0x03:
+	case 0x0B:
+	case 0x3B:
+	case 0x6B:
+	case 0xE8:
+		// Continuous array read; runs on from one page into the next
+		miso = pagePtr(df, df->page)[df->offset++];
+		if ( df->offset == PAGE_SIZE ) {
+			df->offset = 0;
+			df->page = (df->page + 1) % NUM_PAGES;
+		}
+		break;
+	case 0xD2:
+		// Main memory page read; wraps within the page
+		if ( n > 3 + 4 ) {
+			miso = pagePtr(df, df->page)[df->offset];
+			df->offset = (df->offset + 1) % PAGE_SIZE;
+		}
+		break;
+	}
+	return miso;
+}
+
+// Self-timed operations begin on the rising edge of CS.
+//
+static void at45Select(struct Device *self, bool isSelected, uint64 now) {
+	struct DataFlash *df = (struct DataFlash *)self;
+	if ( isSelected ) {
+		df->count = 0;
+		df->opcode = 0x00;
+		return;
+	}
+	if ( df->count < 4 ) {
+		return;
+	}
+	switch ( df->opcode ) {
+	case 0x83:
+	case 0x86:
+		memcpy(pagePtr(df, df->page), df->buffer[df->opcode == 0x86], PAGE_SIZE);
+		df->busyUntil = now + df->tEP;
+		df->busyBuffer = (df->opcode == 0x86);
+		break;
+	case 0x88:
+	case 0x89:
+		{
+			const uint8 *src = df->buffer[df->opcode == 0x89];
+			uint8 *dst = pagePtr(df, df->page);
+			uint32 i;
+			for ( i = 0; i < PAGE_SIZE; i++ ) {
+				dst[i] &= src[i];
+			}
+			df->busyUntil = now + df->tP;
+			df->busyBuffer = (df->opcode == 0x89);
+		}
+		break;
+	case 0x81:
+		memset(pagePtr(df, df->page), 0xFF, PAGE_SIZE);
+		df->busyUntil = now + df->tPE;
+		df->busyBuffer = -1;
+		break;
+	case 0x53:
+	case 0x55:
+		memcpy(df->buffer[df->opcode == 0x55], pagePtr(df, df->page), PAGE_SIZE);
+		df->busyUntil = now + df->tXFR;
+		df->busyBuffer = (df->opcode == 0x55);
+		break;
+	case 0x60:
+	case 0x61:
+		df->isMismatch = memcmp(df->buffer[df->opcode == 0x61], pagePtr(df, df->page), PAGE_SIZE) ? true : false;
+		df->busyUntil = now + df->tXFR;
+		df->busyBuffer = (df->opcode == 0x61);
+		break;
+	}
+	df->opcode = 0x00;
+}
+
+static void at45Destroy(struct Device *self) {
+	struct DataFlash *df = (struct DataFlash *)self;
+	FILE *file = fopen(df->fileName, "wb");
+	if ( file ) {
+		fwrite(df->array, 1, NUM_PAGES * PAGE_SIZE, file);
+		fclose(file);
+	}
+	free(df->array);
+	free(df->fileName);
+	free(df);
+}
+
+struct Device *at45Create(const char *imageFile, const char **error) {
+	struct DataFlash *df = calloc(1, sizeof(struct DataFlash));
+	FILE *file;
+	df->dev.select = at45Select;
+	df->dev.exchange = at45Exchange;
+	df->dev.destroy = at45Destroy;
+	df->fileName = malloc(strlen(imageFile) + 1);
+	strcpy(df->fileName, imageFile);
+	df->array = malloc(NUM_PAGES * PAGE_SIZE);
+	memset(df->array, 0xFF, NUM_PAGES * PAGE_SIZE);
+	memset(df->buffer, 0xFF, sizeof(df->buffer));
+	file = fopen(imageFile, "rb");
+	if ( file ) {
+		if ( fread(df->array, 1, NUM_PAGES * PAGE_SIZE, file) == 0 && ferror(file) ) {
+			emuRender(error, "at45Create(): Unable to read from %s", imageFile);
+			fclose(file);
+			free(df->array);
+			free(df->fileName);
+			free(df);
+			return NULL;
+		}
+		fclose(file);
+	}
+	df->tEP = 1000ULL * envInt("FLEMU_AT45_TEP_US", 17000);
+	df->tP = 1000ULL * envInt("FLEMU_AT45_TP_US", 3000);
+	df->tPE = 1000ULL * envInt("FLEMU_AT45_TPE_US", 15000);
+	df->tXFR = 1000ULL * envInt("FLEMU_AT45_TXFR_US", 200);
+	df->busyBuffer = -1;
+
+	// The factory-programmed half of the security register is unique to each part, so derive it
+	// from the image file name; the user-programmable half is left erased
+	memset(df->security, 0xFF, SECURITY / 2);
+	{
+		uint32 seed = 2166136261U, i;
+		for ( i = 0; imageFile[i]; i++ ) {
+			seed = (seed ^ (uint8)imageFile[i]) * 16777619U;
+		}
+		for ( i = SECURITY / 2; i < SECURITY; i++ ) {
+			seed = seed * 1103515245 + 12345;
+			df->security[i] = (uint8)(seed >> 16);
+		}
+	}
+	return &df->dev;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2013 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef FLEMU_H
+#define FLEMU_H
+
+#include <makestuff.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// Channels for which the emulator keeps separate transaction counts.
+	#define FLEMU_NUM_CHANNELS 8
+
+	// Statistics gathered by the emulator since flOpen(). Every flReadChannel() and
+	// flWriteChannel() is one USB transaction.
+	struct FLEmuStats {
+		uint64 emulatedNs;                        // emulated time, including USB latency
+		uint64 spiBytes;                          // bytes clocked on the SPI bus
+		uint64 pollCommands;                      // channel 2 poll commands executed
+		uint64 pollBytes;                         // bytes clocked by the poll engine
+		uint64 writes[FLEMU_NUM_CHANNELS];        // flWriteChannel() calls, per channel
+		uint64 bytesWritten[FLEMU_NUM_CHANNELS];
+		uint64 reads[FLEMU_NUM_CHANNELS];         // flReadChannel() calls, per channel
+		uint64 bytesRead[FLEMU_NUM_CHANNELS];
+	};
+
+	struct FLContext;
+
+	/**
+	 * Get the statistics gathered on an emulated FPGALink connection. This is an extension which
+	 * the real libfpgalink lacks; the same numbers are written as JSON to the file named by the
+	 * FLEMU_STATS environment variable when the connection is closed.
+	 *
+	 * @param handle The handle returned by flOpen().
+	 * @returns A pointer to the live statistics, valid until flClose().
+	 */
+	DLLEXPORT(const struct FLEmuStats *) flemuGetStats(struct FLContext *handle);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
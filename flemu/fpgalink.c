@@ -0,0 +1,609 @@
+/*
+ * Copyright (C) 2013 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/time.h>
+#endif
+#include <libfpgalink.h>
+#include "flemu.h"
+#include "private.h"
+
+// Emulates an FPGALink device running spi_talk_rtl.vhdl, with models of the SPI peripherals
+// attached to its chip-selects. Each peripheral is configured with an environment variable
+// FLEMU_CS<n>=<model>:<imageFile>, where <model> is "sd", "at45" or "w25q". Other knobs:
+//   FLEMU_NUM_DEVS    - the NUM_DEVS generic (default 2)
+//   FLEMU_FIFO_DEPTH  - receive FIFO depth in bytes (default 2048); a power of two
+//   FLEMU_FEATURES    - feature bits reported on channel 2; 0 emulates the original bitstream
+//   FLEMU_USB_US      - per-transaction USB latency in microseconds (default 250)
+//   FLEMU_SPI_MAX_KHZ - fastest SPI clock the wiring supports; above it MISO arrives a bit late
+//   FLEMU_MISO_ERRORS - flip a random MISO bit in about one byte in this many (default 0: never)
+//   FLEMU_REALTIME    - 1 to sleep so that wall-clock time tracks emulated time, and count host
+//                       time between calls as idle
+//   FLEMU_STATS       - file to which JSON statistics are written by flClose() ("-" for stderr)
+//   FLEMU_BOARDS      - number of boards, opened as VID:PID:DDDD with DDDD from 0000 (default 1)
+//   FLEMU_IO_WIDTH    - the IO_WIDTH generic: data lines wired to the peripherals (1, 2 or 4)
+//
+// With several boards, a "%d" in a FLEMU_CS<n> file name or in FLEMU_STATS is replaced by the board
+// number, so each board has its own peripherals.
+//
+#define MAX_DEVS        6
+#define USB_BYTE_NS     30      // ~33MB/s sustained over the FX2
+#define SLOW_BYTE_NS    20000   // 8 bits at 400kHz
+#define FAST_BYTE_NS    333     // 8 bits at 24MHz
+#define FAST_KHZ        24000
+
+// Config register bits, as in spi_talk_rtl.vhdl
+#define TURBO           (1<<0)
+#define SUPPRESS        (1<<1)
+#define CHIPSEL         2
+
+// Channel 2 feature bits, as in spi_talk_rtl.vhdl
+#define FEAT_ID         0xA0
+#define FEAT_POLL       (1<<0)
+#define FEAT_CLKDIV     (1<<1)
+#define FEAT_FIFOSZ     (1<<2)
+#define FEAT_CRC        (1<<3)
+#define FEAT_ALL        (FEAT_POLL | FEAT_CLKDIV | FEAT_FIFOSZ | FEAT_CRC)
+
+#define POLL_CMD_LEN    6
+
+// Channel 5 CRC engine mode bits, as in spi_talk_rtl.vhdl
+#define CRC_RX          (1<<0)
+#define CRC_TX          (1<<1)
+#define CRC_REPORT      (1<<7)
+#define CRC_BLOCK_SIZE  512
+
+// Channel 6 data line modes, as in spi_talk_rtl.vhdl
+#define IO_ID           0xC0
+#define IO_X2           0x01
+#define IO_X4           0x02
+#define IO_WIDTH_MASK   0x03
+#define IO_MODE_MASK    0x07
+
+struct FLContext {
+	uint32 numDevs;
+	struct Device *devs[MAX_DEVS];
+	uint8 config;
+	uint8 features;
+	uint8 divider;
+	uint32 maxKHz;
+	uint8 ioWired;   // IO_X2 and/or IO_X4, as IO_WIDTH allows
+	uint8 ioMode;
+
+	// Receive FIFO
+	uint8 *fifo;
+	uint32 fifoDepth, fifoHead, fifoLen;
+
+	// Poll engine command being assembled
+	uint8 pollCmd[POLL_CMD_LEN];
+	uint32 pollLen;
+
+	// CRC engine: bytes remaining in the current received and transmitted blocks (zero whilst
+	// waiting for a start token), the CRCs so far, and the block counts since the last report
+	uint8 crcMode;
+	uint32 rxCrcCount, txCrcCount;
+	uint16 rxCrc, txCrc;
+	uint8 crcGood, crcBad;
+
+	// MISO error injection
+	uint32 misoErrors;
+	uint32 misoSeed;
+
+	// Emulated time and statistics
+	uint64 usbLatency;
+	uint32 board;
+	bool isRealTime;
+	uint64 wallStart;
+	uint64 wallLast;
+	struct FLEmuStats stats;
+};
+
+uint32 envInt(const char *name, uint32 defValue) {
+	const char *const value = getenv(name);
+	return (value && *value) ? (uint32)strtoul(value, NULL, 0) : defValue;
+}
+
+void emuRender(const char **error, const char *format, ...) {
+	if ( error ) {
+		char *const msg = malloc(256);
+		va_list vl;
+		va_start(vl, format);
+		vsnprintf(msg, 256, format, vl);
+		va_end(vl);
+		*error = msg;
+	}
+}
+
+static uint64 wallClock(void) {
+	#ifdef WIN32
+		return (uint64)GetTickCount() * 1000000ULL;
+	#else
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return (uint64)tv.tv_sec * 1000000000ULL + (uint64)tv.tv_usec * 1000ULL;
+	#endif
+}
+
+// In real time, the time the host spends between calls is time the bus is idle.
+//
+static void realTimeIdle(struct FLContext *handle) {
+	if ( handle->isRealTime && handle->wallLast ) {
+		handle->stats.emulatedNs += wallClock() - handle->wallLast;
+	}
+}
+
+static void realTimeSync(struct FLContext *handle) {
+	if ( handle->isRealTime ) {
+		const uint64 target = handle->wallStart + handle->stats.emulatedNs;
+		const uint64 now = wallClock();
+		if ( target > now ) {
+			#ifdef WIN32
+				Sleep((DWORD)((target - now) / 1000000));
+			#else
+				usleep((useconds_t)((target - now) / 1000));
+			#endif
+		}
+		handle->wallLast = wallClock();
+	}
+}
+
+static uint16 crc16(uint16 crc, uint8 byte) {
+	uint32 i;
+	crc ^= (uint16)(byte << 8);
+	for ( i = 0; i < 8; i++ ) {
+		crc = (crc & 0x8000) ? (uint16)((crc << 1) ^ 0x1021) : (uint16)(crc << 1);
+	}
+	return crc;
+}
+
+// Watch a byte clocked in (unless suppressed): from a start token, the next 514 bytes (the data
+// and its CRC) should have a zero CRC16.
+//
+static void crcReceive(struct FLContext *handle, uint8 miso) {
+	if ( !(handle->crcMode & CRC_RX) ) {
+		return;
+	}
+	if ( !handle->rxCrcCount ) {
+		if ( miso == 0xFE ) {
+			handle->rxCrc = 0x0000;
+			handle->rxCrcCount = CRC_BLOCK_SIZE + 2;
+		}
+	} else {
+		handle->rxCrc = crc16(handle->rxCrc, miso);
+		if ( !--handle->rxCrcCount ) {
+			if ( !handle->rxCrc && !handle->crcBad ) {
+				handle->crcGood++;
+			} else if ( handle->crcBad != 0xFF ) {
+				handle->crcBad++;
+			}
+		}
+	}
+}
+
+// Watch a byte about to be sent on channel 0, and replace the two bytes after each block's data
+// with its CRC16.
+//
+static uint8 crcTransmit(struct FLContext *handle, uint8 mosi) {
+	if ( !(handle->crcMode & CRC_TX) ) {
+		return mosi;
+	}
+	if ( !handle->txCrcCount ) {
+		if ( mosi == 0xFE || mosi == 0xFC ) {
+			handle->txCrc = 0x0000;
+			handle->txCrcCount = CRC_BLOCK_SIZE + 2;
+		}
+	} else if ( handle->txCrcCount-- > 2 ) {
+		handle->txCrc = crc16(handle->txCrc, mosi);
+	} else {
+		mosi = (uint8)(handle->txCrcCount ? handle->txCrc >> 8 : handle->txCrc);
+	}
+	return mosi;
+}
+
+static bool isSelected(const struct FLContext *handle, uint32 dev) {
+	return (handle->config >> (CHIPSEL + dev)) & 1;
+}
+
+// Clock one byte out on MOSI (or over two or four data lines, taking a half or a quarter of the
+// time); the returned MISO byte is the wired-AND of all selected devices.
+//
+static uint8 spiExchange(struct FLContext *handle, uint8 mosi, uint32 lines, uint64 *now) {
+	const bool turbo = (handle->config & TURBO) ? true : false;
+	uint8 miso = 0xFF;
+	uint32 i;
+	*now += (turbo ? FAST_BYTE_NS * (handle->divider + 1U) : SLOW_BYTE_NS) / lines;
+	for ( i = 0; i < handle->numDevs; i++ ) {
+		if ( handle->devs[i] && isSelected(handle, i) ) {
+			miso &= handle->devs[i]->exchange(handle->devs[i], mosi, lines, *now);
+		}
+	}
+	handle->stats.spiBytes++;
+	if ( turbo && handle->maxKHz && FAST_KHZ / (handle->divider + 1U) > handle->maxKHz ) {
+		// Too fast for the wiring: each bit is sampled before it arrives
+		miso = (uint8)((miso >> 1) | 0x80);
+	}
+	if ( handle->misoErrors ) {
+		handle->misoSeed = handle->misoSeed * 1103515245 + 12345;
+		if ( (handle->misoSeed >> 8) % handle->misoErrors == 0 ) {
+			miso ^= (uint8)(1 << ((handle->misoSeed >> 4) & 7));
+		}
+	}
+	return miso;
+}
+
+static bool fifoPush(struct FLContext *handle, uint8 byte) {
+	if ( handle->fifoLen == handle->fifoDepth ) {
+		return false;
+	}
+	handle->fifo[(handle->fifoHead + handle->fifoLen++) % handle->fifoDepth] = byte;
+	return true;
+}
+
+static void setConfig(struct FLContext *handle, uint8 value, uint64 now) {
+	const uint8 mask = (uint8)((1 << (handle->numDevs + CHIPSEL)) - 1);
+	const uint8 prev = handle->config;
+	uint32 i;
+	handle->config = value & mask;
+	for ( i = 0; i < handle->numDevs; i++ ) {
+		const bool was = (prev >> (CHIPSEL + i)) & 1;
+		const bool is = isSelected(handle, i);
+		if ( handle->devs[i] && was != is ) {
+			handle->devs[i]->select(handle->devs[i], is, now);
+		}
+	}
+}
+
+// Clock the poll byte until (miso & mask) == match or the count expires, then push the final
+// byte into the receive FIFO regardless of SUPPRESS.
+//
+static bool runPoll(struct FLContext *handle, uint64 *now) {
+	const uint8 pollByte = handle->pollCmd[0];
+	const uint8 mask = handle->pollCmd[1];
+	const uint8 match = handle->pollCmd[2];
+	uint32 count =
+		((uint32)handle->pollCmd[3] << 16) | ((uint32)handle->pollCmd[4] << 8) | handle->pollCmd[5];
+	uint8 miso;
+	handle->stats.pollCommands++;
+	do {
+		miso = spiExchange(handle, pollByte, 1, now);
+		crcReceive(handle, miso);
+		handle->stats.pollBytes++;
+	} while ( (miso & mask) != match && count && --count );
+	return fifoPush(handle, miso);
+}
+
+static struct Device *createDevice(const char *spec, const char **error) {
+	const char *const colon = strchr(spec, ':');
+	if ( colon ) {
+		const size_t len = (size_t)(colon - spec);
+		if ( len == 2 && !strncmp(spec, "sd", 2) ) {
+			return sdCreate(colon + 1, error);
+		} else if ( len == 4 && !strncmp(spec, "at45", 4) ) {
+			return at45Create(colon + 1, error);
+		} else if ( len == 4 && !strncmp(spec, "w25q", 4) ) {
+			return w25qCreate(colon + 1, error);
+		}
+	}
+	emuRender(error, "createDevice(): Cannot parse device spec \"%s\"", spec);
+	return NULL;
+}
+
+DLLEXPORT(FLStatus) flInitialise(int debugLevel, const char **error) {
+	(void)debugLevel;
+	(void)error;
+	return FL_SUCCESS;
+}
+
+DLLEXPORT(void) flFreeError(const char *err) {
+	free((void*)err);
+}
+
+// The board number is the device ID in "VVVV:PPPP:DDDD", or zero if there is none.
+//
+static uint32 boardNumber(const char *vp) {
+	const char *const colon = strchr(vp, ':');
+	const char *const did = colon ? strchr(colon + 1, ':') : NULL;
+	return did ? (uint32)strtoul(did + 1, NULL, 16) : 0;
+}
+
+// Copy a file name, replacing any "%d" with the board number.
+//
+static void boardPath(char *buf, size_t size, const char *path, uint32 board) {
+	const char *const pct = strstr(path, "%d");
+	if ( pct ) {
+		snprintf(buf, size, "%.*s%u%s", (int)(pct - path), path, board, pct + 2);
+	} else {
+		snprintf(buf, size, "%s", path);
+	}
+}
+
+DLLEXPORT(FLStatus) flIsDeviceAvailable(const char *vp, bool *isAvailable, const char **error) {
+	(void)error;
+	*isAvailable = boardNumber(vp) < envInt("FLEMU_BOARDS", 1);
+	return FL_SUCCESS;
+}
+
+DLLEXPORT(FLStatus) flOpen(const char *vp, struct FLContext **handle, const char **error) {
+	struct FLContext *newHandle;
+	const uint32 board = boardNumber(vp);
+	uint32 i;
+	char name[16], path[FILENAME_MAX];
+	if ( board >= envInt("FLEMU_BOARDS", 1) ) {
+		emuRender(error, "flOpen(): There is no board %04X", board);
+		return FL_USB_ERR;
+	}
+	newHandle = calloc(1, sizeof(struct FLContext));
+	if ( !newHandle ) {
+		emuRender(error, "flOpen(): Allocation error");
+		return FL_ALLOC_ERR;
+	}
+	newHandle->board = board;
+	newHandle->numDevs = envInt("FLEMU_NUM_DEVS", 2);
+	if ( newHandle->numDevs > MAX_DEVS ) {
+		newHandle->numDevs = MAX_DEVS;
+	}
+	newHandle->features = (uint8)envInt("FLEMU_FEATURES", FEAT_ALL);
+	newHandle->fifoDepth = envInt("FLEMU_FIFO_DEPTH", 2048);
+	newHandle->fifo = malloc(newHandle->fifoDepth);
+	newHandle->usbLatency = 1000ULL * envInt("FLEMU_USB_US", 250);
+	newHandle->maxKHz = envInt("FLEMU_SPI_MAX_KHZ", 0);
+	i = envInt("FLEMU_IO_WIDTH", 1);
+	newHandle->ioWired = (uint8)((i >= 2 ? IO_X2 : 0) | (i >= 4 ? IO_X4 : 0));
+	newHandle->misoErrors = envInt("FLEMU_MISO_ERRORS", 0);
+	newHandle->misoSeed = 1;
+	newHandle->isRealTime = envInt("FLEMU_REALTIME", 0) ? true : false;
+	newHandle->wallStart = wallClock();
+	for ( i = 0; i < newHandle->numDevs; i++ ) {
+		const char *spec;
+		sprintf(name, "FLEMU_CS%d", i);
+		spec = getenv(name);
+		if ( spec && *spec ) {
+			boardPath(path, sizeof(path), spec, board);
+			newHandle->devs[i] = createDevice(path, error);
+			if ( !newHandle->devs[i] ) {
+				flClose(newHandle);
+				return FL_FILE_ERR;
+			}
+		}
+	}
+	*handle = newHandle;
+	return FL_SUCCESS;
+}
+
+static void writeStats(const struct FLContext *handle) {
+	const char *const statsEnv = getenv("FLEMU_STATS");
+	const struct FLEmuStats *s = &handle->stats;
+	char statsFile[FILENAME_MAX];
+	FILE *file;
+	uint32 i;
+	if ( !statsEnv || !*statsEnv ) {
+		return;
+	}
+	boardPath(statsFile, sizeof(statsFile), statsEnv, handle->board);
+	file = strcmp(statsFile, "-") ? fopen(statsFile, "w") : stderr;
+	if ( !file ) {
+		return;
+	}
+	fprintf(file, "{\n  \"emulatedNs\": %llu,\n  \"spiBytes\": %llu,\n",
+		(unsigned long long)s->emulatedNs, (unsigned long long)s->spiBytes);
+	fprintf(file, "  \"pollCommands\": %llu,\n  \"pollBytes\": %llu,\n",
+		(unsigned long long)s->pollCommands, (unsigned long long)s->pollBytes);
+	fprintf(file, "  \"channels\": [\n");
+	for ( i = 0; i < FLEMU_NUM_CHANNELS; i++ ) {
+		fprintf(file,
+			"    {\"writes\": %llu, \"bytesWritten\": %llu, \"reads\": %llu, \"bytesRead\": %llu}%s\n",
+			(unsigned long long)s->writes[i], (unsigned long long)s->bytesWritten[i],
+			(unsigned long long)s->reads[i], (unsigned long long)s->bytesRead[i],
+			(i == FLEMU_NUM_CHANNELS - 1) ? "" : ",");
+	}
+	fprintf(file, "  ]\n}\n");
+	if ( file != stderr ) {
+		fclose(file);
+	}
+}
+
+DLLEXPORT(void) flClose(struct FLContext *handle) {
+	uint32 i;
+	if ( !handle ) {
+		return;
+	}
+	writeStats(handle);
+	for ( i = 0; i < handle->numDevs; i++ ) {
+		if ( handle->devs[i] ) {
+			handle->devs[i]->destroy(handle->devs[i]);
+		}
+	}
+	free(handle->fifo);
+	free(handle);
+}
+
+DLLEXPORT(bool) flIsNeroCapable(struct FLContext *handle) {
+	(void)handle;
+	return true;
+}
+
+DLLEXPORT(bool) flIsCommCapable(struct FLContext *handle) {
+	(void)handle;
+	return true;
+}
+
+DLLEXPORT(FLStatus) flFifoMode(struct FLContext *handle, bool fifoMode, const char **error) {
+	(void)handle;
+	(void)fifoMode;
+	(void)error;
+	return FL_SUCCESS;
+}
+
+DLLEXPORT(FLStatus) flLoadStandardFirmware(const char *curVidPid, const char *newVidPid, const char **error) {
+	(void)curVidPid;
+	(void)newVidPid;
+	(void)error;
+	return FL_SUCCESS;
+}
+
+DLLEXPORT(FLStatus) flPortConfig(struct FLContext *handle, const char *portConfig, const char **error) {
+	(void)handle;
+	(void)portConfig;
+	(void)error;
+	return FL_SUCCESS;
+}
+
+DLLEXPORT(FLStatus) flProgram(struct FLContext *handle, const char *progConfig, const char *progFile, const char **error) {
+	(void)handle;
+	(void)progConfig;
+	(void)progFile;
+	(void)error;
+	return FL_SUCCESS;
+}
+
+DLLEXPORT(void) flSleep(uint32 ms) {
+	#ifdef WIN32
+		Sleep(ms);
+	#else
+		usleep(1000*ms);
+	#endif
+}
+
+// The FX2 streams host writes through to the FPGA, so the SPI clocking of a write overlaps the
+// USB transfer: the write completes when the slower of the two finishes.
+//
+DLLEXPORT(FLStatus) flWriteChannel(
+	struct FLContext *handle, uint32 timeout, uint8 chan, uint32 count, const uint8 *data,
+	const char **error)
+{
+	uint64 start, now;
+	uint32 i;
+	realTimeIdle(handle);
+	start = handle->stats.emulatedNs + handle->usbLatency;
+	now = start;
+	(void)timeout;
+	if ( chan < FLEMU_NUM_CHANNELS ) {
+		handle->stats.writes[chan]++;
+		handle->stats.bytesWritten[chan] += count;
+	}
+	for ( i = 0; i < count; i++ ) {
+		const uint8 byte = data[i];
+		if ( chan == 0x00 ) {
+			const uint32 lines =
+				(handle->ioMode & IO_X4) ? 4 :
+				(handle->ioMode & IO_X2) ? 2 : 1;
+			const uint8 miso = spiExchange(handle, crcTransmit(handle, byte), lines, &now);
+			if ( handle->config & SUPPRESS ) {
+				continue;
+			}
+			crcReceive(handle, miso);
+			if ( !fifoPush(handle, miso) ) {
+				emuRender(error, "flWriteChannel(): Timeout: receive FIFO full after %d bytes", i);
+				return FL_USB_ERR;
+			}
+		} else if ( chan == 0x02 && handle->features ) {
+			handle->pollCmd[handle->pollLen++] = byte;
+			if ( handle->pollLen == POLL_CMD_LEN ) {
+				handle->pollLen = 0;
+				if ( !runPoll(handle, &now) ) {
+					emuRender(error, "flWriteChannel(): Timeout: receive FIFO full during poll");
+					return FL_USB_ERR;
+				}
+			}
+		} else if ( chan == 0x03 && (handle->features & FEAT_CLKDIV) ) {
+			handle->divider = byte;
+		} else if ( chan == 0x05 && (handle->features & FEAT_CRC) ) {
+			if ( byte & CRC_REPORT ) {
+				if ( !fifoPush(handle, handle->crcGood) || !fifoPush(handle, handle->crcBad) ) {
+					emuRender(error, "flWriteChannel(): Timeout: receive FIFO full during CRC report");
+					return FL_USB_ERR;
+				}
+			}
+			if ( (byte & CRC_REPORT) || !(byte & CRC_RX) ) {
+				handle->crcGood = handle->crcBad = 0;
+			}
+			if ( !(byte & CRC_RX) ) {
+				handle->rxCrcCount = 0;
+			}
+			if ( !(byte & CRC_TX) ) {
+				handle->txCrcCount = 0;
+			}
+			handle->crcMode = byte & (CRC_RX | CRC_TX);
+		} else if ( chan == 0x06 && handle->features ) {
+			// Widths the board isn't wired for select one line
+			const uint8 width = byte & IO_WIDTH_MASK;
+			handle->ioMode = (width == IO_X2 || width == IO_X4) && (handle->ioWired & width) ?
+				byte & IO_MODE_MASK : 0x00;
+		} else if ( chan == 0x01 || !handle->features ) {
+			setConfig(handle, byte, now);
+		}
+	}
+	if ( now < start + (uint64)count * USB_BYTE_NS ) {
+		now = start + (uint64)count * USB_BYTE_NS;
+	}
+	handle->stats.emulatedNs = now;
+	realTimeSync(handle);
+	return FL_SUCCESS;
+}
+
+DLLEXPORT(FLStatus) flReadChannel(
+	struct FLContext *handle, uint32 timeout, uint8 chan, uint32 count, uint8 *buf,
+	const char **error)
+{
+	uint32 i;
+	(void)timeout;
+	if ( chan < FLEMU_NUM_CHANNELS ) {
+		handle->stats.reads[chan]++;
+		handle->stats.bytesRead[chan] += count;
+	}
+	realTimeIdle(handle);
+	handle->stats.emulatedNs += handle->usbLatency + (uint64)count * USB_BYTE_NS;
+	if ( chan == 0x00 ) {
+		if ( handle->fifoLen < count ) {
+			emuRender(
+				error, "flReadChannel(): Timeout: wanted %d bytes but the receive FIFO has only %d",
+				count, handle->fifoLen);
+			return FL_USB_ERR;
+		}
+		for ( i = 0; i < count; i++ ) {
+			buf[i] = handle->fifo[handle->fifoHead];
+			handle->fifoHead = (handle->fifoHead + 1) % handle->fifoDepth;
+		}
+		handle->fifoLen -= count;
+	} else if ( chan == 0x04 && (handle->features & FEAT_FIFOSZ) ) {
+		uint8 depth = 0;
+		while ( (2UL << depth) <= handle->fifoDepth ) {
+			depth++;
+		}
+		memset(buf, depth, count);
+	} else {
+		const uint8 value =
+			(chan == 0x02 && handle->features) ? (uint8)(FEAT_ID | handle->features) :
+			(chan == 0x03 && (handle->features & FEAT_CLKDIV)) ? handle->divider :
+			(chan == 0x05 && (handle->features & FEAT_CRC)) ? handle->crcMode :
+			(chan == 0x06 && handle->features) ? (uint8)(IO_ID | handle->ioWired) :
+			handle->config;
+		memset(buf, value, count);
+	}
+	realTimeSync(handle);
+	return FL_SUCCESS;
+}
+
+DLLEXPORT(const struct FLEmuStats *) flemuGetStats(struct FLContext *handle) {
+	return &handle->stats;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2013 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PRIVATE_H
+#define PRIVATE_H
+
+#include <makestuff.h>
+
+// A peripheral hanging off one of the spi_talk chip-selects. The emulator calls select() on each
+// edge of the peripheral's CS line, and exchange() once per byte clocked while it is selected.
+// The "now" parameter is the emulated time in nanoseconds, used to model busy periods. The
+// "lines" parameter is the number of data lines the byte was clocked over (1, 2 or 4); a device
+// which expected another number sees (or returns) garbage.
+//
+struct Device {
+	void (*select)(struct Device *self, bool isSelected, uint64 now);
+	uint8 (*exchange)(struct Device *self, uint8 mosi, uint32 lines, uint64 now);
+	void (*destroy)(struct Device *self);
+};
+
+// Device models; each returns NULL and renders an error if the backing file cannot be used.
+//
+struct Device *sdCreate(const char *imageFile, const char **error);
+struct Device *at45Create(const char *imageFile, const char **error);
+struct Device *w25qCreate(const char *imageFile, const char **error);
+
+// Helpers shared by the device models.
+//
+uint32 envInt(const char *name, uint32 defValue);
+void emuRender(const char **error, const char *format, ...);
+
+#endif
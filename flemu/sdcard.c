@@ -0,0 +1,522 @@
+/*
+ * Copyright (C) 2013 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "private.h"
+
+// SD-card in SPI mode, backed by a raw image file. Environment knobs:
+//   FLEMU_SD_HC      - 1 for a high-capacity (block-addressed) card; defaults to 1 above 2GiB
+//   FLEMU_SD_V1      - 1 for a version 1.x card which rejects CMD8
+//   FLEMU_SD_NCR     - gap bytes between a command and its response (1-8)
+//   FLEMU_SD_INIT_US - time from the first ACMD41 to the card leaving the idle state
+//   FLEMU_SD_TACC_US - read access time before each data token
+//   FLEMU_SD_TPROG_US - program time after each written block
+//
+#define BLOCK_SIZE 512
+
+#define R1_IDLE         (1<<0)
+#define R1_ILLEGAL      (1<<2)
+#define R1_CRC_ERROR    (1<<3)
+#define R1_ADDRESS      (1<<5)
+#define R1_PARAMETER    (1<<6)
+
+#define TOKEN_START     0xFE
+#define TOKEN_MULTI     0xFC
+#define TOKEN_STOP      0xFD
+
+typedef enum {
+	PH_NONE,        // clocking out 0xFF
+	PH_READ,        // clocking out data blocks
+	PH_BUSY,        // clocking out 0x00 until busyUntil
+	PH_WRITE        // accepting data blocks from the host
+} Phase;
+
+struct SdCard {
+	struct Device dev;
+	FILE *file;
+	uint32 numBlocks;
+	bool isHighCapacity;
+	bool isVersion1;
+	uint32 ncr;
+	uint64 initTime, accessTime, progTime;
+
+	// Card state
+	bool isIdle;
+	bool isAppCmd;
+	bool isCrcOn;
+	uint64 initDone;
+
+	// Command input
+	uint8 cmd[6];
+	uint32 cmdLen;
+
+	// Response queue, drained before the current phase produces anything
+	uint8 queue[32];
+	uint32 qHead, qLen;
+
+	// Data phase
+	Phase phase;
+	bool isMultiple;
+	uint32 lba;
+	uint64 readyAt;
+	uint64 busyUntil;
+	uint8 block[BLOCK_SIZE+3];  // token + data + CRC16
+	uint32 blockLen, blockPos;
+	bool blockValid;
+
+	// Write reception
+	bool isWriteMultiple;
+	uint8 wrBuf[BLOCK_SIZE+2];
+	uint32 wrPos;
+	bool wrInBlock;
+};
+
+static uint8 crc7(const uint8 *data, uint32 length) {
+	uint8 crc = 0;
+	uint32 i;
+	int j;
+	for ( i = 0; i < length; i++ ) {
+		uint8 byte = data[i];
+		for ( j = 0; j < 8; j++ ) {
+			crc = (uint8)(crc << 1);
+			if ( (byte ^ crc) & 0x80 ) {
+				crc ^= 0x09;
+			}
+			byte = (uint8)(byte << 1);
+		}
+	}
+	return (uint8)((crc << 1) | 1);
+}
+
+static uint16 crc16(const uint8 *data, uint32 length) {
+	uint16 crc = 0;
+	uint32 i;
+	int j;
+	for ( i = 0; i < length; i++ ) {
+		crc ^= (uint16)(data[i] << 8);
+		for ( j = 0; j < 8; j++ ) {
+			crc = (crc & 0x8000) ? (uint16)((crc << 1) ^ 0x1021) : (uint16)(crc << 1);
+		}
+	}
+	return crc;
+}
+
+static void enqueue(struct SdCard *sd, const uint8 *data, uint32 length) {
+	uint32 i;
+	for ( i = 0; i < length && sd->qLen < sizeof(sd->queue); i++ ) {
+		sd->queue[(sd->qHead + sd->qLen++) % sizeof(sd->queue)] = data[i];
+	}
+}
+
+static void respond(struct SdCard *sd, const uint8 *data, uint32 length) {
+	uint32 i;
+	sd->qHead = sd->qLen = 0;
+	for ( i = 0; i < sd->ncr; i++ ) {
+		enqueue(sd, (const uint8 *)"\xFF", 1);
+	}
+	enqueue(sd, data, length);
+}
+
+static uint8 r1(const struct SdCard *sd, uint8 flags) {
+	return (uint8)((sd->isIdle ? R1_IDLE : 0) | flags);
+}
+
+// Load an on-card data block (sector or register) into the transmit buffer, with token and CRC.
+//
+static void loadBlock(struct SdCard *sd, const uint8 *data, uint32 length) {
+	const uint16 crc = crc16(data, length);
+	sd->block[0] = TOKEN_START;
+	memcpy(sd->block + 1, data, length);
+	sd->block[length+1] = (uint8)(crc >> 8);
+	sd->block[length+2] = (uint8)crc;
+	sd->blockLen = length + 3;
+	sd->blockPos = 0;
+	sd->blockValid = true;
+}
+
+static bool readSector(struct SdCard *sd, uint32 lba, uint8 *buf) {
+	if ( lba >= sd->numBlocks ) {
+		return false;
+	}
+	if ( fseeko(sd->file, (off_t)lba * BLOCK_SIZE, SEEK_SET) || fread(buf, 1, BLOCK_SIZE, sd->file) != BLOCK_SIZE ) {
+		memset(buf, 0x00, BLOCK_SIZE);
+	}
+	return true;
+}
+
+static bool writeSector(struct SdCard *sd, uint32 lba, const uint8 *buf) {
+	if ( lba >= sd->numBlocks ) {
+		return false;
+	}
+	if ( fseeko(sd->file, (off_t)lba * BLOCK_SIZE, SEEK_SET) || fwrite(buf, 1, BLOCK_SIZE, sd->file) != BLOCK_SIZE ) {
+		return false;
+	}
+	return true;
+}
+
+static void makeCsd(const struct SdCard *sd, uint8 *csd) {
+	memset(csd, 0, 16);
+	if ( sd->isHighCapacity ) {
+		// CSD version 2.0: capacity = (C_SIZE+1) * 512KiB
+		const uint32 cSize = sd->numBlocks / 1024 - 1;
+		csd[0] = 0x40;
+		csd[1] = 0x0E;
+		csd[3] = 0x32;
+		csd[4] = 0x5B;
+		csd[5] = 0x59;
+		csd[7] = (uint8)((cSize >> 16) & 0x3F);
+		csd[8] = (uint8)(cSize >> 8);
+		csd[9] = (uint8)cSize;
+		csd[10] = 0x7F;
+		csd[11] = 0x80;
+		csd[12] = 0x0A;
+		csd[13] = 0x40;
+	} else {
+		// CSD version 1.0: capacity = (C_SIZE+1) * 2^(C_SIZE_MULT+2) * 2^READ_BL_LEN
+		uint32 mult = 0, cSize;
+		while ( mult < 7 && (sd->numBlocks >> (mult + 2)) > 4096 ) {
+			mult++;
+		}
+		cSize = (sd->numBlocks >> (mult + 2)) - 1;
+		if ( cSize > 4095 ) {
+			cSize = 4095;
+		}
+		csd[0] = 0x00;
+		csd[1] = 0x26;
+		csd[3] = 0x32;
+		csd[4] = 0x5F;
+		csd[5] = 0x59;  // READ_BL_LEN = 9
+		csd[6] = (uint8)(0x80 | (cSize >> 10));
+		csd[7] = (uint8)(cSize >> 2);
+		csd[8] = (uint8)((cSize << 6) | 0x2D);
+		csd[9] = (uint8)(0xB4 | (mult >> 1));
+		csd[10] = (uint8)(((mult & 1) << 7) | 0x7F);
+		csd[11] = 0x80;
+		csd[12] = 0x0A;
+		csd[13] = 0x40;
+	}
+	csd[15] = crc7(csd, 15);
+}
+
+static void execute(struct SdCard *sd, uint64 now) {
+	const uint8 index = sd->cmd[0] & 0x3F;
+	const uint32 arg = ((uint32)sd->cmd[1] << 24) | ((uint32)sd->cmd[2] << 16) | ((uint32)sd->cmd[3] << 8) | sd->cmd[4];
+	const bool isAppCmd = sd->isAppCmd;
+	const bool crcOk = (crc7(sd->cmd, 5) == sd->cmd[5]);
+	uint8 resp[8];
+	sd->isAppCmd = false;
+
+	// CMD0 and CMD8 are always CRC-checked; everything else only when CMD59 enabled it
+	if ( !crcOk && (sd->isCrcOn || index == 0 || index == 8) ) {
+		resp[0] = r1(sd, R1_CRC_ERROR);
+		respond(sd, resp, 1);
+		return;
+	}
+	if ( isAppCmd && index == 41 ) {
+		if ( !sd->initDone ) {
+			sd->initDone = now + sd->initTime;
+		}
+		if ( now >= sd->initDone && (!sd->isHighCapacity || (arg & (1<<30))) ) {
+			sd->isIdle = false;
+		}
+		resp[0] = r1(sd, 0);
+		respond(sd, resp, 1);
+		return;
+	}
+	switch ( index ) {
+	case 0:
+		sd->isIdle = true;
+		sd->isCrcOn = false;
+		sd->initDone = 0;
+		sd->phase = PH_NONE;
+		resp[0] = R1_IDLE;
+		respond(sd, resp, 1);
+		break;
+	case 1:
+		if ( sd->isHighCapacity ) {
+			resp[0] = r1(sd, R1_ILLEGAL);
+		} else {
+			if ( !sd->initDone ) {
+				sd->initDone = now + sd->initTime;
+			}
+			if ( now >= sd->initDone ) {
+				sd->isIdle = false;
+			}
+			resp[0] = r1(sd, 0);
+		}
+		respond(sd, resp, 1);
+		break;
+	case 8:
+		if ( sd->isVersion1 ) {
+			resp[0] = r1(sd, R1_ILLEGAL);
+			respond(sd, resp, 1);
+		} else {
+			resp[0] = r1(sd, 0);
+			resp[1] = 0x00;
+			resp[2] = 0x00;
+			resp[3] = (uint8)((arg >> 8) & 0x0F);
+			resp[4] = (uint8)arg;
+			respond(sd, resp, 5);
+		}
+		break;
+	case 9:
+	case 10:
+		if ( sd->isIdle ) {
+			resp[0] = r1(sd, R1_ILLEGAL);
+			respond(sd, resp, 1);
+		} else {
+			uint8 reg[16];
+			if ( index == 9 ) {
+				makeCsd(sd, reg);
+			} else {
+				memcpy(reg, "\x03SDEMU\x10\x12\x34\x56\x78\x00\xD1\x00", 15);
+				reg[15] = crc7(reg, 15);
+			}
+			resp[0] = r1(sd, 0);
+			respond(sd, resp, 1);
+			loadBlock(sd, reg, 16);
+			sd->phase = PH_READ;
+			sd->isMultiple = false;
+			sd->readyAt = now + sd->accessTime;
+		}
+		break;
+	case 12:
+		sd->phase = PH_BUSY;
+		sd->busyUntil = now + 2000;
+		sd->blockValid = false;
+		resp[0] = 0xFF;  // stuff byte
+		resp[1] = r1(sd, 0);
+		respond(sd, resp, 2);
+		break;
+	case 13:
+		resp[0] = r1(sd, 0);
+		resp[1] = 0x00;
+		respond(sd, resp, 2);
+		break;
+	case 16:
+		resp[0] = r1(sd, arg == BLOCK_SIZE ? 0 : R1_PARAMETER);
+		respond(sd, resp, 1);
+		break;
+	case 17:
+	case 18:
+	case 24:
+	case 25:
+		{
+			const uint32 lba = sd->isHighCapacity ? arg : arg / BLOCK_SIZE;
+			if ( sd->isIdle ) {
+				resp[0] = r1(sd, R1_ILLEGAL);
+			} else if ( (!sd->isHighCapacity && (arg % BLOCK_SIZE)) || lba >= sd->numBlocks ) {
+				resp[0] = r1(sd, R1_ADDRESS);
+			} else {
+				resp[0] = r1(sd, 0);
+				sd->lba = lba;
+				sd->blockValid = false;
+				if ( index == 17 || index == 18 ) {
+					sd->phase = PH_READ;
+					sd->isMultiple = (index == 18);
+					sd->readyAt = now + sd->accessTime;
+				} else {
+					sd->phase = PH_WRITE;
+					sd->isWriteMultiple = (index == 25);
+					sd->wrInBlock = false;
+				}
+			}
+			respond(sd, resp, 1);
+		}
+		break;
+	case 55:
+		sd->isAppCmd = true;
+		resp[0] = r1(sd, 0);
+		respond(sd, resp, 1);
+		break;
+	case 58:
+		resp[0] = r1(sd, 0);
+		resp[1] = (uint8)((sd->isIdle ? 0x00 : 0x80) | (!sd->isIdle && sd->isHighCapacity ? 0x40 : 0x00));
+		resp[2] = 0xFF;
+		resp[3] = 0x80;
+		resp[4] = 0x00;
+		respond(sd, resp, 5);
+		break;
+	case 59:
+		sd->isCrcOn = (arg & 1) ? true : false;
+		resp[0] = r1(sd, 0);
+		respond(sd, resp, 1);
+		break;
+	default:
+		resp[0] = r1(sd, R1_ILLEGAL);
+		respond(sd, resp, 1);
+	}
+}
+
+// Accept one byte of a host-to-card data block while in PH_WRITE.
+//
+static void writeByte(struct SdCard *sd, uint8 mosi, uint64 now) {
+	if ( !sd->wrInBlock ) {
+		if ( mosi == TOKEN_START || (sd->isWriteMultiple && mosi == TOKEN_MULTI) ) {
+			sd->wrInBlock = true;
+			sd->wrPos = 0;
+		} else if ( sd->isWriteMultiple && mosi == TOKEN_STOP ) {
+			sd->phase = PH_BUSY;
+			sd->busyUntil = now + sd->progTime / 4;
+			enqueue(sd, (const uint8 *)"\xFF", 1);
+		}
+		return;
+	}
+	sd->wrBuf[sd->wrPos++] = mosi;
+	if ( sd->wrPos == BLOCK_SIZE + 2 ) {
+		const uint16 crc = (uint16)((sd->wrBuf[BLOCK_SIZE] << 8) | sd->wrBuf[BLOCK_SIZE+1]);
+		uint8 token;
+		sd->wrInBlock = false;
+		if ( sd->isCrcOn && crc != crc16(sd->wrBuf, BLOCK_SIZE) ) {
+			token = 0x0B;
+		} else if ( !writeSector(sd, sd->lba, sd->wrBuf) ) {
+			token = 0x0D;
+		} else {
+			token = 0x05;
+			sd->lba++;
+		}
+		sd->qHead = sd->qLen = 0;
+		enqueue(sd, &token, 1);
+		sd->busyUntil = now + sd->progTime;
+		if ( !sd->isWriteMultiple || token != 0x05 ) {
+			sd->phase = PH_BUSY;
+		}
+	}
+}
+
+static uint8 output(struct SdCard *sd, uint64 now) {
+	if ( sd->qLen ) {
+		const uint8 byte = sd->queue[sd->qHead];
+		sd->qHead = (sd->qHead + 1) % sizeof(sd->queue);
+		sd->qLen--;
+		return byte;
+	}
+	switch ( sd->phase ) {
+	case PH_READ:
+		if ( now < sd->readyAt ) {
+			return 0xFF;
+		}
+		if ( !sd->blockValid ) {
+			uint8 data[BLOCK_SIZE];
+			if ( !readSector(sd, sd->lba, data) ) {
+				// Out of range: data error token
+				sd->phase = PH_NONE;
+				return 0x08;
+			}
+			loadBlock(sd, data, BLOCK_SIZE);
+		}
+		{
+			const uint8 byte = sd->block[sd->blockPos++];
+			if ( sd->blockPos == sd->blockLen ) {
+				sd->blockValid = false;
+				if ( sd->isMultiple ) {
+					sd->lba++;
+					sd->readyAt = now + sd->accessTime / 4;
+				} else {
+					sd->phase = PH_NONE;
+				}
+			}
+			return byte;
+		}
+	case PH_BUSY:
+		if ( now < sd->busyUntil ) {
+			return 0x00;
+		}
+		sd->phase = PH_NONE;
+		return 0xFF;
+	case PH_WRITE:
+		return (now < sd->busyUntil) ? 0x00 : 0xFF;
+	default:
+		return 0xFF;
+	}
+}
+
+static uint8 sdExchange(struct Device *self, uint8 mosi, uint32 lines, uint64 now) {
+	struct SdCard *sd = (struct SdCard *)self;
+	const uint8 miso = output(sd, now);
+	(void)lines;  // in SPI mode a card has just the one data line each way
+	if ( sd->phase == PH_WRITE && !sd->qLen && now >= sd->busyUntil ) {
+		writeByte(sd, mosi, now);
+		return miso;
+	}
+	if ( sd->cmdLen == 0 ) {
+		if ( (mosi & 0xC0) == 0x40 ) {
+			sd->cmd[sd->cmdLen++] = mosi;
+		}
+	} else {
+		sd->cmd[sd->cmdLen++] = mosi;
+		if ( sd->cmdLen == 6 ) {
+			sd->cmdLen = 0;
+			if ( sd->phase == PH_READ && (sd->cmd[0] & 0x3F) != 12 ) {
+				// Only CMD12 can interrupt a data transfer
+			} else if ( sd->phase != PH_BUSY || now >= sd->busyUntil ) {
+				execute(sd, now);
+			}
+		}
+	}
+	return miso;
+}
+
+static void sdSelect(struct Device *self, bool isSelected, uint64 now) {
+	struct SdCard *sd = (struct SdCard *)self;
+	(void)now;
+	if ( !isSelected ) {
+		sd->cmdLen = 0;
+	}
+}
+
+static void sdDestroy(struct Device *self) {
+	struct SdCard *sd = (struct SdCard *)self;
+	fclose(sd->file);
+	free(sd);
+}
+
+struct Device *sdCreate(const char *imageFile, const char **error) {
+	struct SdCard *sd;
+	off_t size;
+	FILE *file = fopen(imageFile, "r+b");
+	if ( !file ) {
+		emuRender(error, "sdCreate(): Unable to open %s", imageFile);
+		return NULL;
+	}
+	fseeko(file, 0, SEEK_END);
+	size = ftello(file);
+	if ( size < BLOCK_SIZE ) {
+		emuRender(error, "sdCreate(): Image %s is smaller than one block", imageFile);
+		fclose(file);
+		return NULL;
+	}
+	sd = calloc(1, sizeof(struct SdCard));
+	sd->dev.select = sdSelect;
+	sd->dev.exchange = sdExchange;
+	sd->dev.destroy = sdDestroy;
+	sd->file = file;
+	sd->numBlocks = (uint32)(size / BLOCK_SIZE);
+	sd->isHighCapacity = envInt("FLEMU_SD_HC", size > 0x80000000LL) ? true : false;
+	sd->isVersion1 = envInt("FLEMU_SD_V1", 0) ? true : false;
+	sd->ncr = envInt("FLEMU_SD_NCR", 1);
+	if ( sd->ncr < 1 || sd->ncr > 8 ) {
+		sd->ncr = 1;
+	}
+	sd->initTime = 1000ULL * envInt("FLEMU_SD_INIT_US", 20000);
+	sd->accessTime = 1000ULL * envInt("FLEMU_SD_TACC_US", 200);
+	sd->progTime = 1000ULL * envInt("FLEMU_SD_TPROG_US", 500);
+	sd->isIdle = true;
+	return &sd->dev;
+}
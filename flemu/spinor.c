@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) 2013 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "private.h"
+
+// Winbond W25Q32JV 25-series NOR flash: 4MiB in 256-byte pages, with 4KiB, 32KiB and 64KiB
+// erases, the dual- and quad-output reads (3B and 6B), a 64-bit unique ID and a JESD216B SFDP
+// table. It is backed by a binary image file which is loaded on creation and written back on
+// destruction. Any of the block protect bits in the status register protects the whole array.
+// Environment knobs (typical datasheet values by default):
+//   FLEMU_W25Q_TPP_US   - page program
+//   FLEMU_W25Q_TSE_US   - 4KiB sector erase
+//   FLEMU_W25Q_TBE32_US - 32KiB block erase
+//   FLEMU_W25Q_TBE64_US - 64KiB block erase
+//   FLEMU_W25Q_SR       - status register at power-up (default 0x00: unprotected)
+//   FLEMU_W25Q_SFDP     - 0 for an older part with no SFDP table
+//
+#define ARRAY_SIZE  0x400000
+#define PAGE_SIZE   256
+#define SFDP_SIZE   256
+#define UID_SIZE    8
+#define BFPT_ADDR   0x80
+
+#define ST_WIP      0x01
+#define ST_WEL      0x02
+#define ST_BP       0x1C    // BP2:0
+#define ST_WRITABLE 0xFC    // bits which 01 writes
+
+struct SpiNor {
+	struct Device dev;
+	char *fileName;
+	uint8 *array;
+	uint8 page[PAGE_SIZE];
+	bool pageDirty[PAGE_SIZE];
+	uint8 sfdp[SFDP_SIZE];
+	uint8 uid[UID_SIZE];
+	uint64 tPP, tSE, tBE32, tBE64, tW;
+	uint64 busyUntil;
+	uint8 status;
+
+	// Per-select command state
+	uint8 opcode;
+	uint32 count;       // bytes received since CS asserted
+	uint32 address;
+	uint32 dummies;     // don't-care bytes between address and data
+	uint8 newStatus;
+};
+
+// The basic flash parameter table, as a W25Q32JV has it
+//
+static const uint32 bfpt[] = {
+	0xFFF920E5,  // 4KiB erase is 20; 1-1-2, 1-2-2, 1-4-4 and 1-1-4 reads; three-byte addresses
+	0x01FFFFFF,  // 32Mbit
+	0x6B08EB44,  // 1-1-4 read is 6B with eight dummy clocks; 1-4-4 read is EB
+	0xBB423B08,  // 1-1-2 read is 3B with eight dummy clocks; 1-2-2 read is BB
+	0xFFFFFFFE,  // no 2-2-2 or 4-4-4
+	0xFF00FFFF,
+	0xFF00FFFF,
+	0x520F200C,  // erase types 1 and 2: 4KiB (20) and 32KiB (52)
+	0x0000D810,  // erase type 3: 64KiB (D8)
+	0x00000000,
+	0x00000081,  // 256-byte pages
+	0x00000000,
+	0x00000000,
+	0x00000000,
+	0xFF8FFFFF,  // no quad enable bit to set
+	0x00000000
+};
+
+static bool isBusy(const struct SpiNor *nor, uint64 now) {
+	return now < nor->busyUntil;
+}
+
+static uint8 statusByte(const struct SpiNor *nor, uint64 now) {
+	return (uint8)((nor->status & ~ST_WIP) | (isBusy(nor, now) ? ST_WIP : 0x00));
+}
+
+// Data lines used for the data phase of a command; everything else goes over MOSI and MISO.
+//
+static uint32 dataLines(uint8 opcode) {
+	switch ( opcode ) {
+	case 0x3B: return 2;
+	case 0x6B: return 4;
+	default: return 1;
+	}
+}
+
+static uint8 norExchange(struct Device *self, uint8 mosi, uint32 lines, uint64 now) {
+	struct SpiNor *nor = (struct SpiNor *)self;
+	uint8 miso = 0xFF;
+	const uint32 n = nor->count++;
+	if ( n == 0 ) {
+		// While busy, the part accepts only status reads
+		nor->opcode = (lines == 1 && (!isBusy(nor, now) || mosi == 0x05)) ? mosi : 0x00;
+		nor->address = 0;
+		switch ( nor->opcode ) {
+		case 0x0B: case 0x3B: case 0x6B: case 0x5A: nor->dummies = 1; break;
+		case 0x4B: nor->dummies = 1; break;  // and three more in place of an address
+		default: nor->dummies = 0;
+		}
+		return miso;
+	}
+	switch ( nor->opcode ) {
+	case 0x05:
+		// Status register may be read continuously
+		return statusByte(nor, now);
+	case 0x01:
+		if ( n == 1 ) {
+			nor->newStatus = mosi;
+		}
+		return miso;
+	case 0x9F:
+		{
+			static const uint8 id[] = {0xEF, 0x40, 0x16};
+			return (n <= sizeof(id)) ? id[n-1] : 0x00;
+		}
+	case 0x00:
+	case 0x06:
+	case 0x04:
+		return miso;
+	}
+	if ( lines != (n <= 3 + nor->dummies ? 1 : dataLines(nor->opcode)) ) {
+		// The part and the host disagree about which lines carry what, so the command is garbage
+		nor->opcode = 0x00;
+		return (uint8)(mosi ^ 0x5A);
+	}
+	if ( n <= 3 ) {
+		nor->address = ((nor->address << 8) | mosi) % ARRAY_SIZE;
+		return miso;
+	}
+	if ( n <= 3 + nor->dummies ) {
+		return miso;
+	}
+	switch ( nor->opcode ) {
+	case 0x03:
+	case 0x0B:
+	case 0x3B:
+	case 0x6B:
+		// Array read; runs on through the whole array
+		miso = nor->array[nor->address];
+		nor->address = (nor->address + 1) % ARRAY_SIZE;
+		break;
+	case 0x02:
+		// Page program; the address wraps within the page, and the bytes are programmed when CS rises
+		nor->page[nor->address % PAGE_SIZE] = mosi;
+		nor->pageDirty[nor->address % PAGE_SIZE] = true;
+		nor->address = (nor->address & ~(PAGE_SIZE - 1)) | ((nor->address + 1) % PAGE_SIZE);
+		break;
+	case 0x5A:
+		miso = nor->sfdp[nor->address % SFDP_SIZE];
+		nor->address++;
+		break;
+	case 0x4B:
+		miso = nor->uid[(n - 5) % UID_SIZE];
+		break;
+	}
+	return miso;
+}
+
+// Self-timed operations begin on the rising edge of CS, and need the write enable latch to have
+// been set by a 06 beforehand; they clear it when they begin.
+//
+static void norSelect(struct Device *self, bool isSelected, uint64 now) {
+	struct SpiNor *nor = (struct SpiNor *)self;
+	const bool isEnabled = (nor->status & ST_WEL) ? true : false;
+	const bool isProtected = (nor->status & ST_BP) ? true : false;
+	uint32 i, size = 0;
+	if ( isSelected ) {
+		nor->count = 0;
+		nor->opcode = 0x00;
+		memset(nor->pageDirty, 0, sizeof(nor->pageDirty));
+		return;
+	}
+	switch ( nor->opcode ) {
+	case 0x06:
+		nor->status |= ST_WEL;
+		break;
+	case 0x04:
+		nor->status &= ~ST_WEL;
+		break;
+	case 0x01:
+		if ( isEnabled && nor->count >= 2 ) {
+			nor->status = (uint8)(nor->newStatus & ST_WRITABLE);
+			nor->busyUntil = now + nor->tW;
+		}
+		nor->status &= ~ST_WEL;
+		break;
+	case 0x02:
+		if ( isEnabled && !isProtected && nor->count > 4 ) {
+			uint8 *const dst = nor->array + (nor->address & ~(PAGE_SIZE - 1));
+			for ( i = 0; i < PAGE_SIZE; i++ ) {
+				if ( nor->pageDirty[i] ) {
+					dst[i] &= nor->page[i];
+				}
+			}
+			nor->busyUntil = now + nor->tPP;
+		}
+		nor->status &= ~ST_WEL;
+		break;
+	case 0x20: size = 0x1000; break;
+	case 0x52: size = 0x8000; break;
+	case 0xD8: size = 0x10000; break;
+	case 0x60:
+	case 0xC7:
+		if ( isEnabled && !isProtected ) {
+			memset(nor->array, 0xFF, ARRAY_SIZE);
+			nor->busyUntil = now + 64 * nor->tBE64;
+		}
+		nor->status &= ~ST_WEL;
+		break;
+	}
+	if ( size ) {
+		if ( isEnabled && !isProtected && nor->count >= 4 ) {
+			memset(nor->array + (nor->address & ~(size - 1)), 0xFF, size);
+			nor->busyUntil = now + (size == 0x1000 ? nor->tSE : size == 0x8000 ? nor->tBE32 : nor->tBE64);
+		}
+		nor->status &= ~ST_WEL;
+	}
+	nor->opcode = 0x00;
+}
+
+static void norDestroy(struct Device *self) {
+	struct SpiNor *nor = (struct SpiNor *)self;
+	FILE *file = fopen(nor->fileName, "wb");
+	if ( file ) {
+		fwrite(nor->array, 1, ARRAY_SIZE, file);
+		fclose(file);
+	}
+	free(nor->array);
+	free(nor->fileName);
+	free(nor);
+}
+
+struct Device *w25qCreate(const char *imageFile, const char **error) {
+	struct SpiNor *nor = calloc(1, sizeof(struct SpiNor));
+	FILE *file;
+	uint32 i;
+	nor->dev.select = norSelect;
+	nor->dev.exchange = norExchange;
+	nor->dev.destroy = norDestroy;
+	nor->fileName = malloc(strlen(imageFile) + 1);
+	strcpy(nor->fileName, imageFile);
+	nor->array = malloc(ARRAY_SIZE);
+	memset(nor->array, 0xFF, ARRAY_SIZE);
+	file = fopen(imageFile, "rb");
+	if ( file ) {
+		if ( fread(nor->array, 1, ARRAY_SIZE, file) == 0 && ferror(file) ) {
+			emuRender(error, "w25qCreate(): Unable to read from %s", imageFile);
+			fclose(file);
+			free(nor->array);
+			free(nor->fileName);
+			free(nor);
+			return NULL;
+		}
+		fclose(file);
+	}
+	nor->tPP = 1000ULL * envInt("FLEMU_W25Q_TPP_US", 400);
+	nor->tSE = 1000ULL * envInt("FLEMU_W25Q_TSE_US", 45000);
+	nor->tBE32 = 1000ULL * envInt("FLEMU_W25Q_TBE32_US", 120000);
+	nor->tBE64 = 1000ULL * envInt("FLEMU_W25Q_TBE64_US", 150000);
+	nor->tW = 10000000ULL;
+	nor->status = (uint8)(envInt("FLEMU_W25Q_SR", 0x00) & ST_WRITABLE);
+
+	// The SFDP header has one parameter header, for the basic table at BFPT_ADDR; the rest is erased
+	memset(nor->sfdp, 0xFF, SFDP_SIZE);
+	if ( envInt("FLEMU_W25Q_SFDP", 1) ) {
+		static const uint8 header[] = {
+			'S', 'F', 'D', 'P', 0x06, 0x01, 0x00, 0xFF,
+			0x00, 0x06, 0x01, sizeof(bfpt) / 4, BFPT_ADDR, 0x00, 0x00, 0xFF
+		};
+		memcpy(nor->sfdp, header, sizeof(header));
+		for ( i = 0; i < sizeof(bfpt) / 4; i++ ) {
+			nor->sfdp[BFPT_ADDR + 4*i] = (uint8)bfpt[i];
+			nor->sfdp[BFPT_ADDR + 4*i + 1] = (uint8)(bfpt[i] >> 8);
+			nor->sfdp[BFPT_ADDR + 4*i + 2] = (uint8)(bfpt[i] >> 16);
+			nor->sfdp[BFPT_ADDR + 4*i + 3] = (uint8)(bfpt[i] >> 24);
+		}
+	}
+
+	// The unique ID is derived from the image file name, so each file is a distinct part
+	{
+		uint32 seed = 2166136261U;
+		for ( i = 0; imageFile[i]; i++ ) {
+			seed = (seed ^ (uint8)imageFile[i]) * 16777619U;
+		}
+		for ( i = 0; i < UID_SIZE; i++ ) {
+			seed = seed * 1103515245 + 12345;
+			nor->uid[i] = (uint8)(seed >> 16);
+		}
+	}
+	return &nor->dev;
+}
@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2013 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+#include "prof.h"
+
+#ifdef WIN32
+	#define THREAD_LOCAL __declspec(thread)
+	#define LOCK()       EnterCriticalSection(&trace.lock)
+	#define UNLOCK()     LeaveCriticalSection(&trace.lock)
+#else
+	#define THREAD_LOCAL __thread
+	#define LOCK()       pthread_mutex_lock(&trace.lock)
+	#define UNLOCK()     pthread_mutex_unlock(&trace.lock)
+#endif
+
+static const char *const opNames[PROF_NUM_OPS] = {
+	"usbWrite", "usbRead", "poll", "sdCommand", "blockRead", "blockWrite", "pageProgram", "erase"
+};
+
+static THREAD_LOCAL struct ProfStats ownStats;
+static THREAD_LOCAL struct ProfStats *sharedStats = NULL;  // the owner's, for the USB I/O thread
+static THREAD_LOCAL uint32 track = 0;                      // this thread's track in the trace
+
+// The trace is shared by all threads, so writes to it are serialised
+static struct {
+	FILE *file;
+	uint64 start;
+	uint32 numTracks;
+	#ifdef WIN32
+		CRITICAL_SECTION lock;
+	#else
+		pthread_mutex_t lock;
+	#endif
+} trace;
+
+uint64 profNow(void) {
+	#ifdef WIN32
+		LARGE_INTEGER freq, now;
+		QueryPerformanceFrequency(&freq);
+		QueryPerformanceCounter(&now);
+		return
+			(uint64)(now.QuadPart / freq.QuadPart) * 1000000000ULL +
+			(uint64)(now.QuadPart % freq.QuadPart) * 1000000000ULL / (uint64)freq.QuadPart;
+	#else
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64)ts.tv_sec * 1000000000ULL + (uint64)ts.tv_nsec;
+	#endif
+}
+
+// Give this thread a track of its own. Call with the lock held.
+//
+static void newTrack(const char *name) {
+	track = ++trace.numTracks;
+	if ( name ) {
+		fprintf(
+			trace.file, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": \"%s\"}}",
+			track, name);
+	}
+}
+
+void profRecord(uint8 op, uint64 start, uint32 arg) {
+	struct ProfHistogram *const h = (sharedStats ? sharedStats : &ownStats)->ops + op;
+	const uint64 ns = profNow() - start;
+	uint64 us = ns / 1000;
+	uint32 bucket = 0;
+	while ( us && bucket < PROF_BUCKETS - 1 ) {
+		us >>= 1;
+		bucket++;
+	}
+	h->count++;
+	h->totalNs += ns;
+	if ( ns > h->maxNs ) {
+		h->maxNs = ns;
+	}
+	h->buckets[bucket]++;
+	if ( trace.file ) {
+		LOCK();
+		if ( !track ) {
+			newTrack(NULL);
+		}
+		fprintf(
+			trace.file,
+			",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"arg\": %u}}",
+			opNames[op], track, (double)(int64)(start - trace.start) / 1000.0, ns / 1000.0, arg);
+		UNLOCK();
+	}
+}
+
+void profGet(struct ProfStats *stats) {
+	*stats = ownStats;
+}
+
+void profReset(void) {
+	memset(&ownStats, 0, sizeof(ownStats));
+}
+
+void profAdd(struct ProfStats *total, const struct ProfStats *stats) {
+	uint32 i, j;
+	for ( i = 0; i < PROF_NUM_OPS; i++ ) {
+		struct ProfHistogram *const t = total->ops + i;
+		const struct ProfHistogram *const s = stats->ops + i;
+		t->count += s->count;
+		t->totalNs += s->totalNs;
+		if ( s->maxNs > t->maxNs ) {
+			t->maxNs = s->maxNs;
+		}
+		for ( j = 0; j < PROF_BUCKETS; j++ ) {
+			t->buckets[j] += s->buckets[j];
+		}
+	}
+}
+
+struct ProfStats *profShare(void) {
+	return sharedStats ? sharedStats : &ownStats;
+}
+
+void profAttach(struct ProfStats *stats, const char *name) {
+	sharedStats = stats;
+	profName(name);
+}
+
+void profWriteJson(FILE *json, const struct ProfStats *stats, const char *indent) {
+	const struct ProfHistogram *h;
+	uint32 i, j, numBuckets;
+	bool isFirst = true;
+	fprintf(json, "{");
+	for ( i = 0; i < PROF_NUM_OPS; i++ ) {
+		h = stats->ops + i;
+		if ( !h->count ) {
+			continue;
+		}
+		for ( numBuckets = PROF_BUCKETS; !h->buckets[numBuckets - 1]; numBuckets-- );
+		fprintf(
+			json, "%s\n%s  \"%s\": {\"count\": %u, \"totalUs\": %.1f, \"avgUs\": %.1f, \"maxUs\": %.1f, \"buckets\": [",
+			isFirst ? "" : ",", indent, opNames[i], h->count,
+			h->totalNs / 1000.0, (double)h->totalNs / h->count / 1000.0, h->maxNs / 1000.0);
+		for ( j = 0; j < numBuckets; j++ ) {
+			fprintf(json, j ? ", %u" : "%u", h->buckets[j]);
+		}
+		fprintf(json, "]}");
+		isFirst = false;
+	}
+	fprintf(json, isFirst ? "}" : "\n%s}", indent);
+}
+
+void profWriteChannels(FILE *json, const struct SpiCounters *usb, const char *indent) {
+	const struct SpiChannelCounters *c;
+	uint32 i;
+	bool isFirst = true;
+	fprintf(json, "[");
+	for ( i = 0; i < SPI_NUM_CHANNELS; i++ ) {
+		c = usb->chans + i;
+		if ( !c->writes && !c->reads ) {
+			continue;
+		}
+		fprintf(
+			json,
+			"%s\n%s  {\"chan\": %u, \"writes\": %u, \"reads\": %u, \"bytesWritten\": %llu, \"bytesRead\": %llu}",
+			isFirst ? "" : ",", indent, i, c->writes, c->reads,
+			(unsigned long long)c->bytesWritten, (unsigned long long)c->bytesRead);
+		isFirst = false;
+	}
+	fprintf(json, isFirst ? "]" : "\n%s]", indent);
+}
+
+bool profTraceOpen(const char *fileName) {
+	trace.file = fopen(fileName, "w");
+	if ( !trace.file ) {
+		return false;
+	}
+	#ifdef WIN32
+		InitializeCriticalSection(&trace.lock);
+	#else
+		pthread_mutex_init(&trace.lock, NULL);
+	#endif
+	trace.start = profNow();
+	trace.numTracks = 0;
+	fprintf(
+		trace.file,
+		"{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n"
+		"{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"spi_talk\"}}");
+	return true;
+}
+
+void profTraceClose(void) {
+	if ( trace.file ) {
+		fprintf(trace.file, "\n]}\n");
+		fclose(trace.file);
+		trace.file = NULL;
+		#ifdef WIN32
+			DeleteCriticalSection(&trace.lock);
+		#else
+			pthread_mutex_destroy(&trace.lock);
+		#endif
+	}
+}
+
+void profName(const char *name) {
+	if ( trace.file && !track ) {
+		LOCK();
+		newTrack(name);
+		UNLOCK();
+	}
+}
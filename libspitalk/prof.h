@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2013 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PROF_H
+#define PROF_H
+
+#include <stdio.h>
+#include <makestuff.h>
+#include "spi.h"
+
+// The operations which are timed. The USB ones are timed by libspitalk around every
+// flWriteChannel() and flReadChannel(), and the poll loops in spiWaitFor(); the rest by sdread and
+// flashprog, each from issuing the command to finding it done.
+//
+#define PROF_USB_WRITE    0
+#define PROF_USB_READ     1
+#define PROF_POLL         2   // spiWaitFor(): clocking the card or flash until it answers
+#define PROF_SD_COMMAND   3   // an SD command, to its R1 response
+#define PROF_BLOCK_READ   4   // an SD read command, to the end of its data
+#define PROF_BLOCK_WRITE  5   // an SD write command, to the end of its busy period
+#define PROF_PAGE_PROGRAM 6   // a flash page program, to ready
+#define PROF_ERASE        7   // a flash sector or block erase, to ready
+#define PROF_NUM_OPS      8
+
+// Bucket 0 counts operations under 1us, and bucket n those from 2^(n-1)us to under 2^n us; the
+// last also counts anything longer.
+//
+#define PROF_BUCKETS      24
+
+struct ProfHistogram {
+	uint32 count;
+	uint64 totalNs;
+	uint64 maxNs;
+	uint32 buckets[PROF_BUCKETS];
+};
+
+struct ProfStats {
+	struct ProfHistogram ops[PROF_NUM_OPS];
+};
+
+// Nanoseconds from some arbitrary point, for passing to profRecord() when the operation is done.
+//
+uint64 profNow(void);
+
+// Add the time since start to op's histogram, and if a trace is being written, write the operation
+// to it too, with arg (a command, block count or page number, say). Each thread has its own
+// histograms, like the rest of libspitalk's state, so this takes no lock unless tracing.
+//
+void profRecord(uint8 op, uint64 start, uint32 arg);
+
+// Get (or reset) this thread's histograms. The USB I/O thread of spiSetAsync() adds to its owner's,
+// so they should only be read once everything has been flushed.
+//
+void profGet(struct ProfStats *stats);
+void profReset(void);
+void profAdd(struct ProfStats *total, const struct ProfStats *stats);
+
+// Have this thread add to another's histograms, and name it in the trace. Used by the USB I/O
+// thread, which gets its owner's histograms from profShare().
+//
+struct ProfStats *profShare(void);
+void profAttach(struct ProfStats *stats, const char *name);
+
+// Write the histograms as a JSON object, with an entry for each operation which happened, or the
+// per-channel USB transaction counts as an array, with an entry for each channel which was used.
+//
+void profWriteJson(FILE *json, const struct ProfStats *stats, const char *indent);
+void profWriteChannels(FILE *json, const struct SpiCounters *usb, const char *indent);
+
+// Write every operation recorded from now on by any thread to a Chrome trace (JSON Object Format,
+// which Perfetto also reads), each thread on its own track, named by profName() if it is called
+// before the thread records anything. Open the trace before starting any threads which will use it,
+// and close it after they have finished.
+//
+bool profTraceOpen(const char *fileName);
+void profTraceClose(void);
+void profName(const char *name);
+
+#endif
@@ -0,0 +1,875 @@
+/*
+ * Copyright (C) 2013 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#include "spi.h"
+#include "prof.h"
+
+#define MAX_CAPTURES 64
+#define POLL_MAX     0xFFFFFF
+#define TIMEOUT      1000
+#define SETTLE_BYTES 16   // config bytes the FPGA takes in the time one byte is clocked at sysClk/2
+#define SLOW_DIVIDER 59   // spiClk = sysClk/120 when TURBO is clear
+#define CS_HIGH      4    // config bytes for which a deselect is held before the next select
+#define NUM_OPS      8    // USB transactions the I/O thread may have queued
+#define OP_READ      0xFF
+
+// All of the state is per thread, so several threads can each drive their own FPGALink device
+#ifdef WIN32
+	#define THREAD_LOCAL __declspec(thread)
+#else
+	#define THREAD_LOCAL __thread
+#endif
+
+static THREAD_LOCAL struct FLContext *handle = NULL;
+static THREAD_LOCAL uint8 config = 0x00;
+static THREAD_LOCAL uint8 features = 0x00;
+static THREAD_LOCAL uint8 divider = 0x00;
+static THREAD_LOCAL uint8 ioModes = 0x00;
+static THREAD_LOCAL uint8 ioMode = IO_X1;
+static THREAD_LOCAL uint32 batchMax = SPI_FIFO_DEFAULT;
+static THREAD_LOCAL FLStatus lastStatus = FL_SUCCESS;
+static THREAD_LOCAL const char *lastError = NULL;
+static THREAD_LOCAL struct SpiCounters counters;
+
+// Bytes queued for one channel but not yet written. Writes to the same channel as the last are
+// appended, so a run of config changes, or of data bytes, costs only one flWriteChannel().
+static THREAD_LOCAL uint8 txBuf[SPI_FIFO_MAX];
+static THREAD_LOCAL uint32 txLen = 0;
+static THREAD_LOCAL uint8 txChan = 0x00;
+
+// Data bytes have been queued since the last config or divider change, so the next one must give
+// the last of them time to be clocked before it takes effect
+static THREAD_LOCAL bool isClocking = false;
+
+// Responses owed by the FIFO, for bytes already written, and the worst-case time the FPGA may
+// spend polling before they are all available
+static THREAD_LOCAL uint32 rxOwed = 0;
+static THREAD_LOCAL uint32 pollTime = 0;
+static THREAD_LOCAL uint8 rxBuf[SPI_FIFO_MAX];
+
+// Where to deliver the responses to queued bytes, relative to the start of the next read
+struct Capture {
+	uint32 offset;
+	uint32 count;
+	uint8 *dest;
+};
+static THREAD_LOCAL struct Capture captures[MAX_CAPTURES];
+static THREAD_LOCAL uint32 numCaptures = 0;
+
+// Response stream bytes already clocked in but not yet consumed, and a batch clocked in ahead of
+// them, for spiPeekAhead(). The two buffers swap, so the pointers are set up by spiInit().
+static THREAD_LOCAL uint8 streamBufs[2][SPI_FIFO_MAX];
+static THREAD_LOCAL uint8 *streamBuf = NULL;
+static THREAD_LOCAL uint32 streamHead = 0;
+static THREAD_LOCAL uint32 streamLen = 0;
+static THREAD_LOCAL uint8 *aheadBuf = NULL;
+static THREAD_LOCAL uint32 aheadLen = 0;
+
+// In asynchronous mode the FPGALink calls are made by an I/O thread, in order, from a ring of
+// operations. A write is handed over as soon as it's queued, and the read of the responses it is
+// owed is handed over right behind it, so the thread can get on with them whilst the host works
+// on something else. The thread delivers the responses itself, and the host only waits when it
+// needs them. Since the thread finishes each read before starting the next write, the receive
+// FIFO never holds more than one submission's responses. Everything the two threads share is in
+// struct Async, which only exists in asynchronous mode.
+//
+struct Op {
+	uint8 chan;           // channel written, or OP_READ
+	uint32 count;
+	uint32 timeout;
+	const uint8 *data;    // for writes: buf, or the caller's buffer for spiQueueRef()
+	uint64 rxEnd;         // for reads: rxSubmitted once this read was handed over
+	uint32 numCaptures;
+	struct Capture captures[MAX_CAPTURES];
+	uint8 buf[SPI_FIFO_MAX];
+};
+
+struct Async {
+	struct FLContext *handle;
+	struct ProfStats *prof;  // the owner's, to which the USB transactions are added
+	bool isStopping;
+	uint32 opHead;        // operations handed over
+	uint32 opTail;        // operations completed
+	uint64 rxDelivered;   // response bytes read and delivered
+	FLStatus status;
+	const char *error;
+	#ifdef WIN32
+		HANDLE thread;
+		CRITICAL_SECTION lock;
+		CONDITION_VARIABLE opReady, opDone;
+	#else
+		pthread_t thread;
+		pthread_mutex_t lock;
+		pthread_cond_t opReady, opDone;
+	#endif
+	struct Op ops[NUM_OPS];
+};
+static THREAD_LOCAL struct Async *async = NULL;
+static THREAD_LOCAL uint64 rxSubmitted = 0;   // response bytes handed over to be read
+static THREAD_LOCAL uint64 rxCollected = 0;   // response bytes collected by spiCollect()/spiFlush()
+
+#ifdef WIN32
+	#define LOCK(a)          EnterCriticalSection(&(a)->lock)
+	#define UNLOCK(a)        LeaveCriticalSection(&(a)->lock)
+	#define WAIT(a, cond)    SleepConditionVariableCS(&(a)->cond, &(a)->lock, INFINITE)
+	#define SIGNAL(a, cond)  WakeAllConditionVariable(&(a)->cond)
+#else
+	#define LOCK(a)          pthread_mutex_lock(&(a)->lock)
+	#define UNLOCK(a)        pthread_mutex_unlock(&(a)->lock)
+	#define WAIT(a, cond)    pthread_cond_wait(&(a)->cond, &(a)->lock)
+	#define SIGNAL(a, cond)  pthread_cond_broadcast(&(a)->cond)
+#endif
+
+#ifdef WIN32
+static DWORD WINAPI ioThread(LPVOID arg) {
+#else
+static void *ioThread(void *arg) {
+#endif
+	struct Async *const a = (struct Async *)arg;
+	struct Op *op;
+	FLStatus status;
+	const char *error;
+	uint32 i;
+	uint64 start;
+	profAttach(a->prof, "USB I/O");
+	LOCK(a);
+	for ( ; ; ) {
+		while ( a->opTail == a->opHead && !a->isStopping ) {
+			WAIT(a, opReady);
+		}
+		if ( a->opTail == a->opHead ) {
+			break;
+		}
+		op = a->ops + a->opTail % NUM_OPS;
+		status = a->status;
+		error = NULL;
+		UNLOCK(a);
+		if ( !status ) {
+			start = profNow();
+			if ( op->chan == OP_READ ) {
+				status = flReadChannel(a->handle, op->timeout, 0x00, op->count, op->buf, &error);
+				profRecord(PROF_USB_READ, start, op->count);
+				for ( i = 0; i < op->numCaptures && !status; i++ ) {
+					memcpy(op->captures[i].dest, op->buf + op->captures[i].offset, op->captures[i].count);
+				}
+			} else {
+				status = flWriteChannel(a->handle, TIMEOUT, op->chan, op->count, op->data, &error);
+				profRecord(PROF_USB_WRITE, start, op->count);
+			}
+		}
+		LOCK(a);
+		if ( status && !a->status ) {
+			a->status = status;
+			a->error = error;
+		} else if ( error ) {
+			flFreeError(error);
+		}
+		if ( op->chan == OP_READ ) {
+			a->rxDelivered = op->rxEnd;
+		}
+		a->opTail++;
+		SIGNAL(a, opDone);
+	}
+	UNLOCK(a);
+	return 0;
+}
+
+// Pick up a failure in the I/O thread. Call with the lock held.
+//
+static void asyncCheck(void) {
+	if ( async->status && !lastStatus ) {
+		lastStatus = async->status;
+		lastError = async->error;
+		async->error = NULL;
+	}
+}
+
+// Get the next free operation, waiting for the I/O thread to finish one if necessary.
+//
+static struct Op *opBegin(void) {
+	LOCK(async);
+	while ( async->opHead - async->opTail == NUM_OPS ) {
+		WAIT(async, opDone);
+	}
+	asyncCheck();
+	UNLOCK(async);
+	return async->ops + async->opHead % NUM_OPS;
+}
+
+static void opSubmit(void) {
+	LOCK(async);
+	async->opHead++;
+	SIGNAL(async, opReady);
+	UNLOCK(async);
+}
+
+// Wait until the responses have been delivered up to rxTarget.
+//
+static FLStatus opWait(uint64 rxTarget) {
+	LOCK(async);
+	while ( async->rxDelivered < rxTarget && !async->status ) {
+		WAIT(async, opDone);
+	}
+	asyncCheck();
+	UNLOCK(async);
+	return lastStatus;
+}
+
+// Wait until the I/O thread has nothing left to do.
+//
+static FLStatus opDrain(void) {
+	LOCK(async);
+	while ( async->opTail != async->opHead ) {
+		WAIT(async, opDone);
+	}
+	asyncCheck();
+	UNLOCK(async);
+	return lastStatus;
+}
+
+// Every FPGALink call goes through these, so the USB transactions can be counted and timed. In
+// asynchronous mode writes are handed to the I/O thread, copied unless isRef, in which case data
+// must stay valid until the next spiFlush().
+//
+static FLStatus usbWrite(uint8 chan, uint32 count, const uint8 *data, bool isRef) {
+	uint64 start;
+	counters.writes++;
+	counters.bytesWritten += count;
+	counters.chans[chan % SPI_NUM_CHANNELS].writes++;
+	counters.chans[chan % SPI_NUM_CHANNELS].bytesWritten += count;
+	if ( async ) {
+		struct Op *const op = opBegin();
+		if ( !lastStatus ) {
+			op->chan = chan;
+			op->count = count;
+			if ( isRef ) {
+				op->data = data;
+			} else {
+				memcpy(op->buf, data, count);
+				op->data = op->buf;
+			}
+			opSubmit();
+		}
+		return lastStatus;
+	}
+	start = profNow();
+	lastStatus = flWriteChannel(handle, TIMEOUT, chan, count, data, &lastError);
+	profRecord(PROF_USB_WRITE, start, count);
+	return lastStatus;
+}
+
+static FLStatus usbRead(uint32 timeout, uint8 chan, uint32 count, uint8 *buf) {
+	const uint64 start = profNow();
+	counters.reads++;
+	counters.bytesRead += count;
+	counters.chans[chan % SPI_NUM_CHANNELS].reads++;
+	counters.chans[chan % SPI_NUM_CHANNELS].bytesRead += count;
+	lastStatus = flReadChannel(handle, timeout, chan, count, buf, &lastError);
+	profRecord(PROF_USB_READ, start, count);
+	return lastStatus;
+}
+
+// Hand the read of everything owed, with the captures, to the I/O thread.
+//
+static void submitRead(void) {
+	struct Op *op;
+	if ( !rxOwed || lastStatus ) {
+		return;
+	}
+	op = opBegin();
+	if ( lastStatus ) {
+		return;
+	}
+	counters.reads++;
+	counters.bytesRead += rxOwed;
+	counters.chans[0].reads++;
+	counters.chans[0].bytesRead += rxOwed;
+	op->chan = OP_READ;
+	op->count = rxOwed;
+	op->timeout = TIMEOUT + pollTime;
+	op->numCaptures = numCaptures;
+	memcpy(op->captures, captures, numCaptures * sizeof(struct Capture));
+	rxSubmitted += rxOwed;
+	op->rxEnd = rxSubmitted;
+	opSubmit();
+	rxOwed = 0;
+	pollTime = 0;
+	numCaptures = 0;
+}
+
+static inline uint32 pending(void) {
+	return (txChan || (config & SUPPRESS)) ? rxOwed : rxOwed + txLen;
+}
+
+static FLStatus writeQueue(void) {
+	if ( txLen && !lastStatus ) {
+		usbWrite(txChan, txLen, txBuf, false);
+		if ( !txChan && !(config & SUPPRESS) ) {
+			rxOwed += txLen;
+		}
+	}
+	txLen = 0;
+	return lastStatus;
+}
+
+// Free up the FIFO and the captures: in asynchronous mode there is no need to wait for the
+// responses, since the I/O thread reads them before it writes anything else.
+//
+static void makeRoom(void) {
+	if ( async ) {
+		spiSend();
+	} else {
+		spiFlush();
+	}
+}
+
+// Start (or carry on) queueing bytes for a channel, with room for at least count of them.
+//
+static void beginWrite(uint8 chan, uint32 count) {
+	if ( txLen && (txChan != chan || txLen + count > SPI_FIFO_MAX) ) {
+		writeQueue();
+	}
+	txChan = chan;
+}
+
+static void discardStream(void) {
+	streamLen = 0;
+	aheadLen = 0;
+}
+
+// Queue a write of a config or divider register, first repeating its old value for long enough
+// that any data bytes before it are clocked out under the old settings.
+//
+static void queueRegister(uint8 chan, uint8 oldValue, uint8 newValue, uint32 repeat) {
+	uint32 settle = 0;
+	if ( isClocking ) {
+		settle = SETTLE_BYTES * (((config & TURBO) ? divider : SLOW_DIVIDER) + 1U);
+		if ( settle > SPI_FIFO_MAX / 2 ) {
+			settle = SPI_FIFO_MAX / 2;
+		}
+		isClocking = false;
+	}
+	beginWrite(chan, settle + repeat);
+	memset(txBuf + txLen, oldValue, settle);
+	txLen += settle;
+	memset(txBuf + txLen, newValue, repeat);
+	txLen += repeat;
+}
+
+static void capture(uint32 offset, uint32 count, uint8 *dest) {
+	captures[numCaptures].offset = offset;
+	captures[numCaptures].count = count;
+	captures[numCaptures].dest = dest;
+	numCaptures++;
+}
+
+static void enqueue(const uint8 *data, uint8 fill, uint32 count, uint8 *response) {
+	beginWrite(0x00, 0);
+	while ( count && !lastStatus ) {
+		uint32 room = batchMax - ((config & SUPPRESS) ? txLen : pending());
+		uint32 chunk = (count < room) ? count : room;
+		if ( !chunk || (response && numCaptures == MAX_CAPTURES) ) {
+			makeRoom();
+			continue;
+		}
+		if ( data ) {
+			memcpy(txBuf + txLen, data, chunk);
+			data += chunk;
+		} else {
+			memset(txBuf + txLen, fill, chunk);
+		}
+		if ( response && !(config & SUPPRESS) ) {
+			capture(pending(), chunk, response);
+			response += chunk;
+		}
+		txLen += chunk;
+		count -= chunk;
+		isClocking = true;
+	}
+}
+
+void spiQueue(const uint8 *data, uint32 count, uint8 *response) {
+	discardStream();
+	enqueue(data, 0x00, count, response);
+}
+
+void spiFill(uint8 byte, uint32 count, uint8 *response) {
+	discardStream();
+	enqueue(NULL, byte, count, response);
+}
+
+void spiQueueRef(const uint8 *data, uint32 count, uint8 *response) {
+	discardStream();
+	while ( count && !lastStatus ) {
+		uint32 room, chunk;
+		if ( writeQueue() ) {
+			break;
+		}
+		room = (config & SUPPRESS) ? count : batchMax - rxOwed;
+		chunk = (count < room) ? count : room;
+		if ( !chunk || (response && numCaptures == MAX_CAPTURES) ) {
+			makeRoom();
+			continue;
+		}
+		if ( usbWrite(0x00, chunk, data, true) ) {
+			break;
+		}
+		if ( !(config & SUPPRESS) ) {
+			if ( response ) {
+				capture(rxOwed, chunk, response);
+				response += chunk;
+			}
+			rxOwed += chunk;
+		}
+		data += chunk;
+		count -= chunk;
+		isClocking = true;
+	}
+}
+
+FLStatus spiSend(void) {
+	writeQueue();
+	if ( async ) {
+		submitRead();
+	}
+	return lastStatus;
+}
+
+FLStatus spiCollect(uint32 count) {
+	uint32 i, j;
+	if ( async ) {
+		spiSend();
+		rxCollected += count;
+		if ( rxCollected > rxSubmitted ) {
+			rxCollected = rxSubmitted;
+		}
+		return opWait(rxCollected);
+	}
+	if ( writeQueue() ) {
+		return lastStatus;
+	}
+	if ( count > rxOwed ) {
+		count = rxOwed;
+	}
+	if ( !count ) {
+		return FL_SUCCESS;
+	}
+	if ( usbRead(TIMEOUT + pollTime, 0x00, count, rxBuf) ) {
+		return lastStatus;
+	}
+
+	// Deliver the responses which have arrived, and move the rest up
+	for ( i = j = 0; i < numCaptures; i++ ) {
+		struct Capture c = captures[i];
+		if ( c.offset < count ) {
+			const uint32 avail = count - c.offset;
+			const uint32 chunk = (c.count < avail) ? c.count : avail;
+			memcpy(c.dest, rxBuf + c.offset, chunk);
+			c.offset = count;
+			c.count -= chunk;
+			c.dest += chunk;
+		}
+		if ( c.count ) {
+			c.offset -= count;
+			captures[j++] = c;
+		}
+	}
+	numCaptures = j;
+	rxOwed -= count;
+	if ( !rxOwed ) {
+		pollTime = 0;
+	}
+	return FL_SUCCESS;
+}
+
+FLStatus spiFlush(void) {
+	if ( async ) {
+		spiSend();
+		rxCollected = rxSubmitted;
+		return opDrain();
+	}
+	return spiCollect(SPI_FIFO_MAX);
+}
+
+// Move the batch clocked in ahead into the stream, once it has arrived.
+//
+static bool takeAhead(void) {
+	uint8 *const tmp = streamBuf;
+	const uint32 count = aheadLen;
+	if ( !aheadLen || spiFlush() ) {
+		return false;
+	}
+	streamBuf = aheadBuf;
+	aheadBuf = tmp;
+	streamHead = 0;
+	streamLen = count;
+	aheadLen = 0;
+	return true;
+}
+
+FLStatus spiRecv(uint8 *buf, uint32 count) {
+	while ( count && !lastStatus ) {
+		if ( streamLen || takeAhead() ) {
+			const uint32 chunk = (count < streamLen) ? count : streamLen;
+			memcpy(buf, streamBuf + streamHead, chunk);
+			streamHead += chunk;
+			streamLen -= chunk;
+			buf += chunk;
+			count -= chunk;
+		} else {
+			const uint32 chunk = (count < batchMax) ? count : batchMax;
+			spiFill(0xFF, chunk, buf);
+			spiFlush();
+			buf += chunk;
+			count -= chunk;
+		}
+	}
+	return lastStatus;
+}
+
+// Have the FPGA clock the poll byte until the response matches, and push the last response into
+// the FIFO. The result is delivered by the next spiFlush(), like any other queued response.
+//
+static void queuePoll(uint8 pollByte, uint8 mask, uint8 match, uint32 maxBytes, uint8 *result) {
+	uint8 cmd[6];
+	if ( pending() == batchMax || numCaptures == MAX_CAPTURES ) {
+		makeRoom();
+	}
+	if ( writeQueue() ) {
+		return;
+	}
+	discardStream();
+	isClocking = true;
+	cmd[0] = pollByte;
+	cmd[1] = mask;
+	cmd[2] = match;
+	cmd[3] = (uint8)(maxBytes >> 16);
+	cmd[4] = (uint8)(maxBytes >> 8);
+	cmd[5] = (uint8)maxBytes;
+	if ( usbWrite(0x02, 6, cmd, false) ) {
+		return;
+	}
+	capture(rxOwed, 1, result);
+	rxOwed++;
+	pollTime += (config & TURBO) ? maxBytes * (divider + 1U) / 3000 : maxBytes / 50;  // ms
+}
+
+// At 400kHz a batch of 64 bytes takes about as long as a USB round trip; at 24MHz a whole
+// FIFO's worth does. Start small and grow, so short waits don't clock too far ahead. Once the
+// first batch has come back without a match, the wait is a long one, so let the FPGA finish it.
+//
+FLStatus spiWaitFor(uint8 mask, uint8 match, uint32 maxBytes, uint8 *result) {
+	const uint32 maxBatch = (config & TURBO) ? batchMax : 64;
+	const uint64 start = profNow();
+	uint32 batch = (config & TURBO) ? 64 : 8;
+	bool clocked = false;
+	uint8 byte = 0xFF;
+	while ( maxBytes && !lastStatus ) {
+		if ( !streamLen && !takeAhead() ) {
+			if ( clocked && (features & FEATURE_POLL) ) {
+				queuePoll(0xFF, mask, match, (maxBytes < POLL_MAX) ? maxBytes : POLL_MAX, &byte);
+				spiFlush();
+				break;
+			}
+			clocked = true;
+			spiFill(0xFF, batch, streamBuf);
+			if ( spiFlush() ) {
+				break;
+			}
+			streamHead = 0;
+			streamLen = batch;
+			if ( batch < maxBatch ) {
+				batch <<= 1;
+			}
+		}
+		byte = streamBuf[streamHead++];
+		streamLen--;
+		maxBytes--;
+		if ( (byte & mask) == match ) {
+			break;
+		}
+	}
+	profRecord(PROF_POLL, start, clocked);
+	*result = byte;
+	return lastStatus;
+}
+
+void spiPoll(uint8 mask, uint8 match, uint32 maxBytes, uint8 *result) {
+	if ( maxBytes > POLL_MAX ) {
+		maxBytes = POLL_MAX;
+	}
+	if ( features & FEATURE_POLL ) {
+		queuePoll(0xFF, mask, match, maxBytes, result);
+	} else {
+		spiWaitFor(mask, match, maxBytes, result);
+	}
+}
+
+void spiCrc(uint8 mode, uint8 *report) {
+	if ( !(features & FEATURE_CRC) ) {
+		return;
+	}
+	if ( (mode & CRC_REPORT) && (pending() + 2 > batchMax || numCaptures == MAX_CAPTURES) ) {
+		makeRoom();
+	}
+	if ( writeQueue() || usbWrite(0x05, 1, &mode, false) ) {
+		return;
+	}
+	if ( mode & CRC_REPORT ) {
+		capture(rxOwed, 2, report);
+		rxOwed += 2;
+	}
+}
+
+FLStatus spiPeek(uint32 batch, const uint8 **data, uint32 *count) {
+	if ( !streamLen && !takeAhead() && !lastStatus ) {
+		if ( batch > batchMax ) {
+			batch = batchMax;
+		}
+		spiFill(0xFF, batch, streamBuf);
+		if ( !spiFlush() ) {
+			streamHead = 0;
+			streamLen = batch;
+		}
+	}
+	*data = streamBuf + streamHead;
+	*count = streamLen;
+	return lastStatus;
+}
+
+FLStatus spiPeekAhead(uint32 batch, uint32 needed, const uint8 **data, uint32 *count) {
+	uint32 first = 0;
+	if ( batch > batchMax ) {
+		batch = batchMax;
+	}
+	if ( !streamLen && !takeAhead() && !lastStatus ) {
+		first = batch;
+		enqueue(NULL, 0xFF, first, streamBuf);
+		if ( async ) {
+			spiSend();
+		}
+	}
+
+	// Get the FPGA clocking in the next batch whilst the caller parses this one. Synchronously it
+	// goes in the same write as this one, if there is one, and is read back next time.
+	if ( !aheadLen && !lastStatus && needed > streamLen + first ) {
+		const uint32 room = batchMax - pending();
+		aheadLen = (batch < room) ? batch : room;
+		if ( aheadLen ) {
+			enqueue(NULL, 0xFF, aheadLen, aheadBuf);
+			spiSend();
+		}
+	}
+	if ( first && !spiCollect(first) ) {
+		streamHead = 0;
+		streamLen = first;
+	}
+	*data = streamBuf + streamHead;
+	*count = streamLen;
+	return lastStatus;
+}
+
+void spiConsume(uint32 count) {
+	if ( count > streamLen ) {
+		count = streamLen;
+	}
+	streamHead += count;
+	streamLen -= count;
+}
+
+FLStatus spiConfig(uint8 mask, uint8 value) {
+	const uint8 oldConfig = config;
+	const uint8 newConfig = (uint8)((config & ~mask) | value);
+	if ( lastStatus ) {
+		return lastStatus;
+	}
+	discardStream();
+	queueRegister(0x01, oldConfig, newConfig, (oldConfig & ~newConfig & CHIPSEL_MASK) ? CS_HIGH : 1);
+	config = newConfig;
+	return lastStatus;
+}
+
+FLStatus spiSetDivider(uint8 newDivider) {
+	if ( !(features & FEATURE_CLKDIV) || lastStatus ) {
+		return lastStatus;
+	}
+	discardStream();
+	queueRegister(0x03, divider, newDivider, 1);
+	divider = newDivider;
+	return lastStatus;
+}
+
+uint8 spiGetDivider(void) {
+	return divider;
+}
+
+FLStatus spiSetIo(uint8 newMode) {
+	if ( !(ioModes & (newMode & (IO_X2 | IO_X4))) ) {
+		newMode = IO_X1;
+	}
+	if ( newMode == ioMode || lastStatus ) {
+		return lastStatus;
+	}
+	discardStream();
+	beginWrite(0x06, 1);
+	txBuf[txLen++] = newMode;
+	ioMode = newMode;
+	return lastStatus;
+}
+
+uint8 spiIoModes(void) {
+	return ioModes;
+}
+
+bool spiSetAsync(bool enable) {
+	struct Async *a = async;
+	if ( enable == (a != NULL) ) {
+		return true;
+	}
+	spiFlush();
+	if ( enable ) {
+		a = (struct Async *)calloc(1, sizeof(struct Async));
+		if ( !a ) {
+			return false;
+		}
+		a->handle = handle;
+		a->prof = profShare();
+		a->status = FL_SUCCESS;
+		rxSubmitted = rxCollected = 0;
+		#ifdef WIN32
+			InitializeCriticalSection(&a->lock);
+			InitializeConditionVariable(&a->opReady);
+			InitializeConditionVariable(&a->opDone);
+			a->thread = CreateThread(NULL, 0, ioThread, a, 0, NULL);
+			if ( !a->thread ) {
+				DeleteCriticalSection(&a->lock);
+				free(a);
+				return false;
+			}
+		#else
+			pthread_mutex_init(&a->lock, NULL);
+			pthread_cond_init(&a->opReady, NULL);
+			pthread_cond_init(&a->opDone, NULL);
+			if ( pthread_create(&a->thread, NULL, ioThread, a) ) {
+				pthread_cond_destroy(&a->opDone);
+				pthread_cond_destroy(&a->opReady);
+				pthread_mutex_destroy(&a->lock);
+				free(a);
+				return false;
+			}
+		#endif
+		async = a;
+	} else {
+		LOCK(a);
+		a->isStopping = true;
+		SIGNAL(a, opReady);
+		UNLOCK(a);
+		#ifdef WIN32
+			WaitForSingleObject(a->thread, INFINITE);
+			CloseHandle(a->thread);
+			DeleteCriticalSection(&a->lock);
+		#else
+			pthread_join(a->thread, NULL);
+			pthread_cond_destroy(&a->opDone);
+			pthread_cond_destroy(&a->opReady);
+			pthread_mutex_destroy(&a->lock);
+		#endif
+		if ( a->error ) {
+			flFreeError(a->error);
+		}
+		free(a);
+		async = NULL;
+	}
+	return true;
+}
+
+bool spiIsAsync(void) {
+	return async != NULL;
+}
+
+void spiInit(struct FLContext *newHandle, uint8 newConfig) {
+	spiSetAsync(false);
+	handle = newHandle;
+	streamBuf = streamBufs[0];
+	aheadBuf = streamBufs[1];
+	config = newConfig;
+	lastStatus = FL_SUCCESS;
+	lastError = NULL;
+	memset(&counters, 0, sizeof(counters));
+	profReset();
+	txLen = rxOwed = pollTime = numCaptures = streamLen = aheadLen = 0;
+	txChan = 0x00;
+	isClocking = false;
+	divider = 0x00;
+	if ( usbRead(TIMEOUT, 0x02, 1, &features) || (features & FEATURE_MASK) != FEATURE_ID ) {
+		features = 0x00;
+	}
+	if ( features & FEATURE_CLKDIV ) {
+		usbRead(TIMEOUT, 0x03, 1, &divider);
+	}
+	ioMode = IO_X1;
+	ioModes = 0x00;
+	if ( features && !usbRead(TIMEOUT, 0x06, 1, &ioModes) && (ioModes & IO_MASK) == IO_ID ) {
+		ioModes &= IO_X2 | IO_X4;
+		if ( ioModes ) {
+			usbWrite(0x06, 1, &ioMode, false);  // in case the last user left it wide
+		}
+	} else {
+		ioModes = 0x00;
+	}
+	batchMax = SPI_FIFO_DEFAULT;
+	if ( (features & FEATURE_FIFOSZ) && !lastStatus ) {
+		uint8 depth;
+		if ( !usbRead(TIMEOUT, 0x04, 1, &depth) && depth < 32 ) {
+			batchMax = 1UL << depth;
+			if ( batchMax > SPI_FIFO_MAX ) {
+				batchMax = SPI_FIFO_MAX;
+			}
+		}
+	}
+}
+
+uint8 spiFeatures(void) {
+	return features;
+}
+
+uint32 spiBatchMax(void) {
+	return batchMax;
+}
+
+void spiGetCounters(struct SpiCounters *result) {
+	*result = counters;
+}
+
+FLStatus spiStatus(const char **error) {
+	if ( async ) {
+		LOCK(async);
+		asyncCheck();
+		UNLOCK(async);
+	}
+	if ( error ) {
+		*error = lastError;
+		lastError = NULL;
+	}
+	return lastStatus;
+}
@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2013 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SPI_H
+#define SPI_H
+
+#include <libfpgalink.h>
+
+// Config register bits (channel 1), as defined in spi_talk_rtl.vhdl
+#define TURBO        (1<<0)
+#define SUPPRESS     (1<<1)
+#define CHIPSEL      (1<<2)
+#define CHIPSEL_MASK 0xFC
+
+// The chip-select bit for spiCS_out(dev). There is room in the config register for six, though the
+// FPGA only drives the NUM_DEVS of them it was built with; selecting any other selects nothing.
+#define SPI_MAX_DEVS    6
+#define CHIPSEL_DEV(dev) (CHIPSEL << (dev))
+
+// Feature byte (channel 2 read): FEATURE_ID | supported features. Older bitstreams return the
+// config register on channel 2, which never has FEATURE_ID set.
+#define FEATURE_ID     0xA0
+#define FEATURE_MASK   0xF0
+#define FEATURE_POLL   (1<<0)
+#define FEATURE_CLKDIV (1<<1)
+#define FEATURE_FIFOSZ (1<<2)
+#define FEATURE_CRC    (1<<3)
+
+// Data line modes (channel 6 write), as defined in spi_talk_rtl.vhdl: channel 0 bytes go over one
+// line each way (MOSI and MISO), or two or four bits at a time over IO1..IO0 or IO3..IO0. With
+// IO_IN, the lines are released and each byte is clocked in from the peripheral instead.
+#define IO_X1 0x00
+#define IO_X2 0x01
+#define IO_X4 0x02
+#define IO_IN (1<<2)
+
+// Channel 6 read: IO_ID | the wide modes the board is wired for (IO_X2 and/or IO_X4). Older
+// bitstreams return the config register, which never has IO_ID set whilst nothing is selected.
+#define IO_ID   0xC0
+#define IO_MASK 0xF0
+
+// CRC engine mode bits (channel 5 write), as defined in spi_talk_rtl.vhdl
+#define CRC_RX     (1<<0)
+#define CRC_TX     (1<<1)
+#define CRC_REPORT (1<<7)
+
+// Every byte clocked with SUPPRESS clear lands in the receive FIFO, and the FPGA stops accepting
+// channel 0 writes when the FIFO is full. Since the host cannot issue a read until its write
+// completes, at most a FIFO's worth of bytes may be clocked between reads. The FIFO size is set by
+// the FIFO_DEPTH generic, which the FPGA reports on channel 4; older bitstreams don't, and have a
+// 1024-byte FIFO. The host buffers are sized for the biggest FIFO we will use.
+//
+#define SPI_FIFO_DEFAULT 1024
+#define SPI_FIFO_MAX     16384
+
+// Transaction builder shared by sdread and flashprog: queue bytes to be clocked out, optionally
+// registering a buffer to receive the bytes clocked in at the same time, interleaved with config
+// and divider changes. Nothing goes over USB until spiFlush(), which sends the queue and collects
+// all responses with one flReadChannel(). Consecutive writes to the same channel are coalesced, so
+// a command with the chip selected before it and deselected after it costs three flWriteChannel()
+// calls (and a following command only two more). The queue is flushed automatically if it would
+// exceed spiBatchMax().
+//
+void spiQueue(const uint8 *data, uint32 count, uint8 *response);
+void spiFill(uint8 byte, uint32 count, uint8 *response);
+FLStatus spiFlush(void);
+
+// Like spiQueue(), but the bytes go over USB straight from data, in a flWriteChannel() of their
+// own, rather than being copied into the queue. Worthwhile only for long runs, since the extra USB
+// transaction costs far more than copying a few hundred bytes.
+//
+void spiQueueRef(const uint8 *data, uint32 count, uint8 *response);
+
+// The two halves of spiFlush(), for pipelining: spiSend() sends the queue without waiting for the
+// responses, and spiCollect() waits for the responses to the first count bytes still owed, and
+// delivers them. So long as no more than spiBatchMax() bytes are owed at once, the host can
+// compare one batch whilst the FPGA clocks the next.
+//
+FLStatus spiSend(void);
+FLStatus spiCollect(uint32 count);
+
+// Response stream: the bytes clocked in whilst clocking out 0xFF. Bytes are clocked in batches,
+// and any surplus is held back for the next call, so scanning for a token and then reading the
+// data that follows it costs a single round trip in the common case. The stream is discarded
+// whenever something else is queued or the config changes.
+//
+FLStatus spiRecv(uint8 *buf, uint32 count);
+
+// Clock 0xFF until the response byte satisfies (byte & mask) == match, or maxBytes have been
+// clocked, and return the last byte. The first batch comes from the response stream, so a short
+// wait costs one round trip and leaves what follows in the stream. If the FPGA has the poll engine
+// the rest of a longer wait is done there, costing one more round trip however long it takes.
+//
+FLStatus spiWaitFor(uint8 mask, uint8 match, uint32 maxBytes, uint8 *result);
+
+// Queue a wait like spiWaitFor(), for the FPGA's poll engine to carry out. Like the response to a
+// queued byte, the result is delivered by the next spiFlush(), and it is delivered even if SUPPRESS
+// is set, so long runs of writes with waits in between need no reads until the end. Without the
+// poll engine this flushes and does spiWaitFor() instead, so SUPPRESS must then be clear.
+//
+void spiPoll(uint8 mask, uint8 match, uint32 maxBytes, uint8 *result);
+
+// Set the FPGA's CRC engine mode, if it has one. With CRC_RX it checks the CRC16 of every 512-byte
+// data block clocked in (from its FE start token), and with CRC_TX it replaces the two bytes after
+// every 512-byte data block sent (from its FE or FC start token) with the block's CRC16. With
+// CRC_REPORT, the number of good blocks received since the last report before the first bad one,
+// and the number from the first bad one on, are delivered to report[0] and report[1] by the next
+// spiFlush(), like a queued response. Since no bytes are clocked, the response stream is kept.
+//
+void spiCrc(uint8 mode, uint8 *report);
+
+// Zero-copy access to the response stream, for parsers: get the bytes already clocked in (first
+// clocking in another batch bytes if there are none), and then mark some of them consumed.
+//
+FLStatus spiPeek(uint32 batch, const uint8 **data, uint32 *count);
+void spiConsume(uint32 count);
+
+// Like spiPeek(), for a parser which will consume at least needed more bytes of the stream: if
+// that is more than it already has, the next batch is clocked in whilst the caller parses this
+// one. As with spiPeek(), no more than a batch is clocked beyond what the caller turns out to need,
+// and any surplus is discarded with the stream, so needed must not be an overestimate.
+//
+FLStatus spiPeekAhead(uint32 batch, uint32 needed, const uint8 **data, uint32 *count);
+
+// Queue an update of the config register, after the bytes already queued. The FPGA acts on config
+// writes as soon as it has started clocking the byte before, so if bytes have been queued since
+// the last change, the old value is repeated for long enough (at the current clock rate) for the
+// last of them to finish under the old settings. A deselect is held for a few bytes, so that CS
+// stays high for long enough if the next command's select follows it in the same write.
+//
+FLStatus spiConfig(uint8 mask, uint8 value);
+
+// Set the clock divider used in TURBO mode, if the FPGA has one: spiClk = sysClk/(2*(divider+1)).
+// Like spiConfig(), this is queued.
+//
+FLStatus spiSetDivider(uint8 divider);
+uint8 spiGetDivider(void);
+
+// Set the data lines used for the channel 0 bytes queued after this, e.g. IO_X4 | IO_IN for the
+// data phase of a quad-output flash read, and back to IO_X1 once it is deselected. Like
+// spiConfig(), this is queued, but since the FPGA latches the mode at the start of each byte,
+// nothing need be repeated. Modes the board isn't wired for (see spiIoModes()) select IO_X1.
+//
+FLStatus spiSetIo(uint8 mode);
+uint8 spiIoModes(void);
+
+// Bind to an FPGALink connection, with the given initial config register value, and read the
+// feature byte to see what the FPGA supports, and the receive FIFO size, which bounds the number of
+// bytes which may be clocked between reads (spiBatchMax()).
+//
+void spiInit(struct FLContext *handle, uint8 config);
+uint8 spiFeatures(void);
+uint32 spiBatchMax(void);
+
+// In asynchronous mode the FPGALink calls are made by an I/O thread, so spiSend() returns as soon
+// as the queue has been handed over, and the responses are delivered by the thread as they arrive.
+// The host only blocks in spiCollect() and spiFlush() (and in anything which needs a response to
+// carry on, like spiWaitFor()), so it can get on with the last batch whilst the next one is on the
+// wire. Response buffers must not be touched between queueing and collecting. Switching modes
+// flushes, and the thread must be stopped before the FPGALink handle is closed.
+//
+bool spiSetAsync(bool enable);
+bool spiIsAsync(void);
+
+// USB transactions since spiInit(): every flWriteChannel() and flReadChannel() is one. They are
+// counted in all, and for each channel. Each is also timed (see prof.h).
+//
+#define SPI_NUM_CHANNELS 8
+
+struct SpiChannelCounters {
+	uint32 writes;
+	uint32 reads;
+	uint64 bytesWritten;
+	uint64 bytesRead;
+};
+
+struct SpiCounters {
+	uint32 writes;
+	uint32 reads;
+	uint64 bytesWritten;
+	uint64 bytesRead;
+	struct SpiChannelCounters chans[SPI_NUM_CHANNELS];
+};
+void spiGetCounters(struct SpiCounters *counters);
+
+// Errors are sticky: once an FPGALink call fails, all subsequent operations fail with the same
+// status until spiInit(). This returns the first failure, and passes ownership of its error
+// message to the caller.
+//
+FLStatus spiStatus(const char **error);
+
+#endif
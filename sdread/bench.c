@@ -0,0 +1,359 @@
+/*
+ * Copyright (C) 2013 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+#include "bench.h"
+#include "spi.h"
+#include "sd.h"
+#include "prof.h"
+
+#define LATENCY_SAMPLES 32
+#define RANDOM_OPS      64
+#define RANDOM_BLOCKS   8  // 4KiB
+#define SCATTER_LBAS    64
+
+// Sequential transfers are done with each of these numbers of blocks per command
+static const uint32 xferSizes[] = {1, 8, 64, 512};
+#define NUM_SIZES (sizeof(xferSizes) / sizeof(*xferSizes))
+
+// Timings and USB transaction counts for a run of identical operations
+struct Result {
+	uint32 blocks;
+	uint32 ops;
+	double seconds;
+	double minSeconds;
+	double maxSeconds;
+	struct SpiCounters usb;
+};
+
+double wallTime(void) {
+	#ifdef WIN32
+		return GetTickCount() / 1000.0;
+	#else
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return tv.tv_sec + tv.tv_usec / 1000000.0;
+	#endif
+}
+
+static void resultBegin(struct Result *result, uint32 blocks) {
+	memset(result, 0, sizeof(*result));
+	result->blocks = blocks;
+	spiGetCounters(&result->usb);
+}
+
+static void resultRecord(struct Result *result, double seconds) {
+	if ( !result->ops || seconds < result->minSeconds ) {
+		result->minSeconds = seconds;
+	}
+	if ( seconds > result->maxSeconds ) {
+		result->maxSeconds = seconds;
+	}
+	result->seconds += seconds;
+	result->ops++;
+}
+
+static void resultEnd(struct Result *result) {
+	struct SpiCounters now;
+	spiGetCounters(&now);
+	result->usb.writes = now.writes - result->usb.writes;
+	result->usb.reads = now.reads - result->usb.reads;
+	result->usb.bytesWritten = now.bytesWritten - result->usb.bytesWritten;
+	result->usb.bytesRead = now.bytesRead - result->usb.bytesRead;
+}
+
+static void resultPrint(FILE *json, const struct Result *result) {
+	const double bytes = (double)result->ops * result->blocks * BYTES_PER_SECTOR;
+	const double ops = result->ops ? result->ops : 1;
+	const double seconds = (result->seconds > 0.0) ? result->seconds : 1e-9;
+	fprintf(
+		json,
+		"{\"blocks\": %u, \"ops\": %u, \"seconds\": %.6f, \"mbps\": %.3f, \"iops\": %.1f, "
+		"\"minUs\": %.1f, \"avgUs\": %.1f, \"maxUs\": %.1f, "
+		"\"usb\": {\"writes\": %u, \"reads\": %u, \"bytesWritten\": %llu, \"bytesRead\": %llu}, "
+		"\"usbPerOp\": %.2f}",
+		result->blocks, result->ops, result->seconds,
+		bytes / seconds / 1000000.0, result->ops / seconds,
+		result->minSeconds * 1e6, result->seconds / ops * 1e6, result->maxSeconds * 1e6,
+		result->usb.writes, result->usb.reads,
+		(unsigned long long)result->usb.bytesWritten, (unsigned long long)result->usb.bytesRead,
+		(result->usb.writes + result->usb.reads) / ops
+	);
+}
+
+static void resultPrintList(FILE *json, const struct Result *results, uint32 count) {
+	uint32 i;
+	fprintf(json, "[\n");
+	for ( i = 0; i < count; i++ ) {
+		fprintf(json, "    ");
+		resultPrint(json, results + i);
+		fprintf(json, (i + 1 < count) ? ",\n" : "\n");
+	}
+	fprintf(json, "  ]");
+}
+
+// One read or write command, of one or more blocks
+//
+static uint8 readOp(uint32 lba, uint8 *buffer, uint32 numBlocks) {
+	uint8 returnCode;
+	if ( numBlocks == 1 ) {
+		returnCode = sdReadSingleBlockBegin(lba);
+		if ( returnCode == SD_SUCCESS ) {
+			sdGetBytes(buffer, BYTES_PER_SECTOR);
+			returnCode = sdReadBlocksEnd();
+		}
+	} else {
+		returnCode = sdReadMultipleBlocksBegin(lba);
+		if ( returnCode == SD_SUCCESS ) {
+			returnCode = sdReadBlocks(buffer, numBlocks);
+			sdReadBlocksEnd();
+		}
+	}
+	return spiStatus(NULL) ? SD_READBLOCK_DATA_ERROR : returnCode;
+}
+
+static uint8 writeOp(uint32 lba, const uint8 *buffer, uint32 numBlocks) {
+	uint8 returnCode;
+	if ( numBlocks == 1 ) {
+		returnCode = sdWriteSingleBlock(lba, buffer);
+	} else {
+		returnCode = sdWriteMultipleBlocksBegin(lba);
+		if ( returnCode == SD_SUCCESS ) {
+			const uint8 endCode = sdWriteBlocks(buffer, numBlocks);
+			returnCode = sdWriteBlocksEnd();
+			if ( endCode != SD_SUCCESS ) {
+				returnCode = endCode;
+			}
+		}
+	}
+	return spiStatus(NULL) ? SD_WRITEBLOCK_DATA_ERROR : returnCode;
+}
+
+// Time each of a run of sequential commands of xferSize blocks over the region
+//
+static bool seqRun(struct Result *result, bool isWrite, uint8 *data, uint32 lba, uint32 numBlocks, uint32 xferSize) {
+	uint32 offset;
+	double startTime;
+	uint8 returnCode;
+	resultBegin(result, xferSize);
+	for ( offset = 0; offset + xferSize <= numBlocks; offset += xferSize ) {
+		startTime = wallTime();
+		returnCode = isWrite ?
+			writeOp(lba + offset, data + offset * BYTES_PER_SECTOR, xferSize) :
+			readOp(lba + offset, data + offset * BYTES_PER_SECTOR, xferSize);
+		if ( returnCode != SD_SUCCESS ) {
+			return false;
+		}
+		resultRecord(result, wallTime() - startTime);
+	}
+	resultEnd(result);
+	return true;
+}
+
+// Command latency is from issuing CMD17 to getting the first byte of the block. The samples are
+// spread over the region, so they don't all come from the card's cache.
+//
+static bool latencyRun(struct Result *result, uint32 lba, uint32 numBlocks) {
+	uint32 i;
+	double startTime;
+	resultBegin(result, 1);
+	for ( i = 0; i < LATENCY_SAMPLES; i++ ) {
+		startTime = wallTime();
+		if ( sdReadSingleBlockBegin(lba + (i * 97) % numBlocks) != SD_SUCCESS ) {
+			return false;
+		}
+		sdGetByte();
+		resultRecord(result, wallTime() - startTime);
+		sdReadBlocksEnd();
+		if ( spiStatus(NULL) ) {
+			return false;
+		}
+	}
+	resultEnd(result);
+	return true;
+}
+
+// Random 4KiB reads at 4KiB-aligned offsets within the region. The sequence is always the same,
+// so that runs are comparable.
+//
+static bool randomRun(struct Result *result, uint8 *buffer, uint32 lba, uint32 numBlocks) {
+	const uint32 numChunks = numBlocks / RANDOM_BLOCKS;
+	uint32 seed = 1, i;
+	double startTime;
+	resultBegin(result, RANDOM_BLOCKS);
+	for ( i = 0; i < RANDOM_OPS; i++ ) {
+		seed = seed * 1103515245 + 12345;
+		startTime = wallTime();
+		if ( readOp(lba + ((seed >> 8) % numChunks) * RANDOM_BLOCKS, buffer, RANDOM_BLOCKS) != SD_SUCCESS ) {
+			return false;
+		}
+		resultRecord(result, wallTime() - startTime);
+	}
+	resultEnd(result);
+	return true;
+}
+
+// Random single blocks, first with a command each, and then the same blocks as one scattered read,
+// which merges those close together into runs. The two must agree.
+//
+static bool scatterRun(
+	struct Result *single, struct Result *batched, uint32 *numRuns, uint8 *data, uint32 lba, uint32 numBlocks)
+{
+	uint32 lbas[SCATTER_LBAS];
+	uint32 seed = 1, i;
+	double startTime;
+	for ( i = 0; i < SCATTER_LBAS; i++ ) {
+		seed = seed * 1103515245 + 12345;
+		lbas[i] = lba + (seed >> 8) % numBlocks;
+	}
+	resultBegin(single, 1);
+	for ( i = 0; i < SCATTER_LBAS; i++ ) {
+		startTime = wallTime();
+		if ( readOp(lbas[i], data + i * BYTES_PER_SECTOR, 1) != SD_SUCCESS ) {
+			return false;
+		}
+		resultRecord(single, wallTime() - startTime);
+	}
+	resultEnd(single);
+	resultBegin(batched, SCATTER_LBAS);
+	startTime = wallTime();
+	if ( sdReadScattered(lbas, SCATTER_LBAS, data + SCATTER_LBAS * BYTES_PER_SECTOR, numRuns) != SD_SUCCESS ) {
+		return false;
+	}
+	resultRecord(batched, wallTime() - startTime);
+	resultEnd(batched);
+	if ( memcmp(data, data + SCATTER_LBAS * BYTES_PER_SECTOR, SCATTER_LBAS * BYTES_PER_SECTOR) ) {
+		fprintf(stderr, "The scattered read disagrees with the single-block reads\n");
+		return false;
+	}
+	return true;
+}
+
+bool sdBench(FILE *info, const char *jsonFile, uint32 lba, uint32 numBlocks) {
+	const bool toStdout = !strcmp(jsonFile, "-");
+	struct Result latency, seqRead[NUM_SIZES], seqWrite[NUM_SIZES], randomRead, singleRead, scatteredRead;
+	uint8 scratch[RANDOM_BLOCKS * BYTES_PER_SECTOR];
+	static uint8 scatterData[2 * SCATTER_LBAS * BYTES_PER_SECTOR];
+	struct SpiCounters usb, now;
+	struct ProfStats prof;
+	uint32 numSizes, numRuns, i;
+	FILE *json = NULL;
+	uint8 *data = NULL;
+	bool retVal = false;
+	if ( numBlocks < RANDOM_BLOCKS ) {
+		fprintf(stderr, "The benchmark needs at least %d blocks\n", RANDOM_BLOCKS);
+		return false;
+	}
+	for ( numSizes = 0; numSizes < NUM_SIZES && xferSizes[numSizes] <= numBlocks; numSizes++ );
+	data = malloc(numBlocks * BYTES_PER_SECTOR);
+	if ( !data ) {
+		fprintf(stderr, "Unable to allocate %u blocks\n", numBlocks);
+		return false;
+	}
+	fprintf(info, "Benchmarking %u SD card blocks from 0x%08X...\n", numBlocks, lba);
+	spiGetCounters(&usb);
+	profReset();
+
+	if ( !latencyRun(&latency, lba, numBlocks) ) {
+		goto cleanup;
+	}
+	fprintf(info, "  CMD17 latency: %.1fus average\n", latency.seconds / latency.ops * 1e6);
+	for ( i = 0; i < numSizes; i++ ) {
+		if ( !seqRun(seqRead + i, false, data, lba, numBlocks, xferSizes[i]) ) {
+			goto cleanup;
+		}
+		fprintf(
+			info, "  Sequential read, %u blocks/command: %.2f MB/s\n", xferSizes[i],
+			(double)seqRead[i].ops * xferSizes[i] * BYTES_PER_SECTOR / seqRead[i].seconds / 1000000.0
+		);
+	}
+	for ( i = 0; i < numSizes; i++ ) {
+		if ( !seqRun(seqWrite + i, true, data, lba, numBlocks, xferSizes[i]) ) {
+			goto cleanup;
+		}
+		fprintf(
+			info, "  Sequential write, %u blocks/command: %.2f MB/s\n", xferSizes[i],
+			(double)seqWrite[i].ops * xferSizes[i] * BYTES_PER_SECTOR / seqWrite[i].seconds / 1000000.0
+		);
+	}
+	if ( !randomRun(&randomRead, scratch, lba, numBlocks) ) {
+		goto cleanup;
+	}
+	fprintf(info, "  Random 4KiB read: %.1f IOPS\n", randomRead.ops / randomRead.seconds);
+	if ( !scatterRun(&singleRead, &scatteredRead, &numRuns, scatterData, lba, numBlocks) ) {
+		goto cleanup;
+	}
+	fprintf(
+		info, "  Random 512-byte read: %.1f IOPS one at a time, %.1f IOPS scattered (%u blocks in %u runs)\n",
+		singleRead.ops / singleRead.seconds, SCATTER_LBAS / scatteredRead.seconds, SCATTER_LBAS, numRuns);
+	profGet(&prof);
+	spiGetCounters(&now);
+	for ( i = 0; i < SPI_NUM_CHANNELS; i++ ) {
+		usb.chans[i].writes = now.chans[i].writes - usb.chans[i].writes;
+		usb.chans[i].reads = now.chans[i].reads - usb.chans[i].reads;
+		usb.chans[i].bytesWritten = now.chans[i].bytesWritten - usb.chans[i].bytesWritten;
+		usb.chans[i].bytesRead = now.chans[i].bytesRead - usb.chans[i].bytesRead;
+	}
+
+	json = toStdout ? stdout : fopen(jsonFile, "w");
+	if ( !json ) {
+		fprintf(stderr, "Unable to write to %s\n", jsonFile);
+		goto cleanup;
+	}
+	fprintf(json, "{\n");
+	fprintf(json, "  \"tool\": \"sdread\",\n");
+	fprintf(json, "  \"card\": \"%s\",\n", sdIsHighCapacity() ? "high-capacity" : "standard-capacity");
+	fprintf(json, "  \"features\": %u,\n", spiFeatures());
+	fprintf(json, "  \"fifoSize\": %u,\n", spiBatchMax());
+	fprintf(json, "  \"async\": %s,\n", spiIsAsync() ? "true" : "false");
+	fprintf(json, "  \"divider\": %u,\n", spiGetDivider());
+	fprintf(json, "  \"crc\": %s,\n", sdIsCrcOn() ? "true" : "false");
+	fprintf(json, "  \"lba\": %u,\n", lba);
+	fprintf(json, "  \"numBlocks\": %u,\n", numBlocks);
+	fprintf(json, "  \"latency\": ");
+	resultPrint(json, &latency);
+	fprintf(json, ",\n  \"seqRead\": ");
+	resultPrintList(json, seqRead, numSizes);
+	fprintf(json, ",\n  \"seqWrite\": ");
+	resultPrintList(json, seqWrite, numSizes);
+	fprintf(json, ",\n  \"randomRead4k\": ");
+	resultPrint(json, &randomRead);
+	fprintf(json, ",\n  \"randomRead512\": ");
+	resultPrint(json, &singleRead);
+	fprintf(json, ",\n  \"scatteredRead512\": ");
+	resultPrint(json, &scatteredRead);
+	fprintf(json, ",\n  \"scatteredRuns\": %u", numRuns);
+	fprintf(json, ",\n  \"channels\": ");
+	profWriteChannels(json, &usb, "  ");
+	fprintf(json, ",\n  \"ops\": ");
+	profWriteJson(json, &prof, "  ");
+	fprintf(json, "\n}\n");
+	retVal = true;
+cleanup:
+	if ( json && !toStdout ) {
+		fclose(json);
+	} else if ( json ) {
+		fflush(json);
+	}
+	free(data);
+	return retVal;
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2013 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <makestuff.h>
+
+// Seconds since some arbitrary point, for timing transfers.
+//
+double wallTime(void);
+
+// Benchmark the card over numBlocks blocks starting at lba, and write the results as JSON to
+// jsonFile ("-" for stdout), with progress going to info. The region is read, and then rewritten
+// with its own contents, so it must not be in use by anything else, but its data is preserved.
+//
+bool sdBench(FILE *info, const char *jsonFile, uint32 lba, uint32 numBlocks);
+
+#endif
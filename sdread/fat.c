@@ -0,0 +1,516 @@
+/*
+ * Copyright (C) 2013 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include "fat.h"
+#include "sd.h"
+
+#define ENTRY_SIZE       32
+#define ENTRIES_SHIFT    4     // sixteen directory entries per sector
+#define XFER_BLOCKS      64
+
+#define ATTR_VOLUME_ID   0x08
+#define ATTR_DIRECTORY   0x10
+#define ATTR_LONG_NAME   0x0F
+
+#define EXFAT_FILE       0x85
+#define EXFAT_STREAM     0xC0
+#define EXFAT_NAME       0xC1
+#define EXFAT_IN_USE     0x80
+#define EXFAT_NO_CHAIN   0x02
+
+static uint16 le16(const uint8 *p) {
+	return (uint16)(p[0] | (p[1] << 8));
+}
+
+static uint32 le32(const uint8 *p) {
+	return (uint32)p[0] | ((uint32)p[1] << 8) | ((uint32)p[2] << 16) | ((uint32)p[3] << 24);
+}
+
+static uint64 le64(const uint8 *p) {
+	return (uint64)le32(p) | ((uint64)le32(p + 4) << 32);
+}
+
+static bool readSector(uint32 lba, uint8 *buffer) {
+	sdReadSingleBlockBegin(lba);
+	sdGetBytes(buffer, BYTES_PER_SECTOR);
+	return sdReadBlocksEnd() == SD_SUCCESS;
+}
+
+static uint32 clusterLba(const struct FatVolume *vol, uint32 cluster) {
+	return vol->heapLba + ((cluster - 2) << vol->clusterShift);
+}
+
+static bool isValidCluster(const struct FatVolume *vol, uint32 cluster) {
+	return cluster >= 2 && cluster - 2 < vol->numClusters;
+}
+
+// See whether a sector is a FAT32 or exFAT boot sector, and if so, find the FAT, the cluster heap
+// and the root directory. A FAT32 volume is told from FAT12 and FAT16 by its BPB having no root
+// directory entries and no 16-bit FAT size.
+//
+static bool parseBootSector(struct FatVolume *vol, uint32 lba, const uint8 *sector) {
+	uint32 sectorsPerCluster, fatSectors, totalSectors;
+	if ( sector[510] != 0x55 || sector[511] != 0xAA ) {
+		return false;
+	}
+	memset(vol, 0, sizeof(*vol));
+	vol->partitionLba = lba;
+	if ( !memcmp(sector + 3, "EXFAT   ", 8) ) {
+		if ( sector[108] != LOG2_BYTES_PER_SECTOR || sector[109] > 25 ) {
+			return false;
+		}
+		vol->isExFat = true;
+		vol->fatLba = lba + le32(sector + 80);
+		vol->heapLba = lba + le32(sector + 88);
+		vol->numClusters = le32(sector + 92);
+		vol->rootCluster = le32(sector + 96);
+		vol->clusterShift = sector[109];
+	} else {
+		sectorsPerCluster = sector[13];
+		fatSectors = le32(sector + 36);
+		totalSectors = le16(sector + 19) ? le16(sector + 19) : le32(sector + 32);
+		if (
+			le16(sector + 11) != BYTES_PER_SECTOR || !sectorsPerCluster ||
+			(sectorsPerCluster & (sectorsPerCluster - 1)) || !sector[16] ||
+			le16(sector + 17) || le16(sector + 22) || !fatSectors )
+		{
+			return false;
+		}
+		while ( (1U << vol->clusterShift) < sectorsPerCluster ) {
+			vol->clusterShift++;
+		}
+		vol->fatLba = lba + le16(sector + 14);
+		vol->heapLba = vol->fatLba + sector[16] * fatSectors;
+		if ( totalSectors <= vol->heapLba - lba ) {
+			return false;
+		}
+		vol->numClusters = (totalSectors - (vol->heapLba - lba)) >> vol->clusterShift;
+		vol->rootCluster = le32(sector + 44);
+	}
+	return isValidCluster(vol, vol->rootCluster);
+}
+
+bool fatMount(struct FatVolume *vol) {
+	uint8 mbr[BYTES_PER_SECTOR], sector[BYTES_PER_SECTOR];
+	const uint8 *part;
+	uint32 i, lba;
+	if ( !readSector(0, mbr) ) {
+		fprintf(stderr, "Unable to read block 0\n");
+		return false;
+	}
+	if ( parseBootSector(vol, 0, mbr) ) {
+		return true;
+	}
+	if ( mbr[510] != 0x55 || mbr[511] != 0xAA ) {
+		fprintf(stderr, "Block 0 is neither an MBR nor a FAT32 or exFAT boot sector\n");
+		return false;
+	}
+	for ( i = 0; i < 4; i++ ) {
+		part = mbr + 446 + 16 * i;
+		lba = le32(part + 8);
+		if ( part[4] == 0xEE ) {
+			fprintf(stderr, "The card is partitioned with GPT, which isn't supported\n");
+			return false;
+		}
+		if ( !part[4] || !lba ) {
+			continue;
+		}
+		if ( !readSector(lba, sector) ) {
+			fprintf(stderr, "Unable to read block 0x%08X\n", lba);
+			return false;
+		}
+		if ( parseBootSector(vol, lba, sector) ) {
+			return true;
+		}
+	}
+	fprintf(stderr, "No FAT32 or exFAT partition found\n");
+	return false;
+}
+
+// Walk a cluster chain a run at a time: each run is as many clusters as carry straight on from the
+// first, so that it can be read with one multiple-block read. The FAT is read through the sector
+// cache, so each of its sectors is fetched once, and the readahead makes long chains cheap to walk.
+//
+struct Chain {
+	const struct FatVolume *vol;
+	uint32 next;       // the first cluster of the next run, or zero at the end of the chain
+	bool noChain;
+	uint32 remaining;  // with noChain, the clusters in the one run
+	uint32 steps;
+	bool isBad;
+};
+
+static void chainBegin(struct Chain *chain, const struct FatVolume *vol, const struct FatEntry *entry) {
+	const uint32 clusterBytes = BYTES_PER_SECTOR << vol->clusterShift;
+	chain->vol = vol;
+	chain->next = entry->firstCluster;
+	chain->noChain = entry->noChain;
+	chain->remaining = (uint32)((entry->size + clusterBytes - 1) / clusterBytes);
+	chain->steps = 0;
+	chain->isBad = false;
+}
+
+static uint32 fatNext(const struct FatVolume *vol, uint32 cluster) {
+	uint32 next;
+	sdReadSingleBlockBegin(vol->fatLba + (cluster >> (LOG2_BYTES_PER_SECTOR - 2)));
+	sdSkip((uint16)((cluster & ((BYTES_PER_SECTOR >> 2) - 1)) << 2));
+	next = sdGetLong();
+	if ( sdReadBlocksEnd() != SD_SUCCESS ) {
+		return 0;  // free, so the chain is taken to be bad
+	}
+	return vol->isExFat ? next : next & 0x0FFFFFFF;
+}
+
+static uint32 chainRun(struct Chain *chain, uint32 *first) {
+	const struct FatVolume *const vol = chain->vol;
+	uint32 cluster = chain->next, next, count = 1;
+	if ( !cluster ) {
+		return 0;
+	}
+	if ( !isValidCluster(vol, cluster) ) {
+		chain->isBad = true;
+		return 0;
+	}
+	*first = cluster;
+	if ( chain->noChain ) {
+		chain->next = 0;
+		if ( chain->remaining > vol->numClusters - (cluster - 2) ) {
+			chain->isBad = true;
+			return 0;
+		}
+		return chain->remaining;
+	}
+	for ( ; ; ) {
+		next = fatNext(vol, cluster);
+		if ( ++chain->steps > vol->numClusters ) {
+			chain->isBad = true;  // it must loop
+			return 0;
+		}
+		if ( next != cluster + 1 || !isValidCluster(vol, next) ) {
+			break;
+		}
+		cluster = next;
+		count++;
+	}
+	if ( vol->isExFat ? next == 0xFFFFFFFF : next >= 0x0FFFFFF8 ) {
+		chain->next = 0;
+	} else if ( isValidCluster(vol, next) ) {
+		chain->next = next;
+	} else {
+		chain->isBad = true;  // free or bad cluster
+		return 0;
+	}
+	return count;
+}
+
+// Directory scanning. Each 32-byte entry is read with the byte accessors, and the entries making up
+// one file are put together: on FAT32, long-name entries (in reverse order, checked against the
+// checksum of the short name which follows them); on exFAT, a file entry followed by its stream
+// extension and file name entries. Names are kept as ASCII, with anything else as '?'.
+//
+typedef bool (*EntryFunc)(void *context, const struct FatEntry *entry);  // true to stop
+
+struct DirScan {
+	EntryFunc func;
+	void *context;
+	bool isStopped;
+	struct FatEntry entry;
+	uint8 lfnSeq;        // FAT32: the long-name entry expected next, or zero
+	uint8 lfnSum;
+	uint32 secondaries;  // exFAT: entries left in the current set
+	uint32 nameLength;
+	uint32 nameChars;
+};
+
+static void putChar(char *name, uint32 pos, uint16 ch) {
+	if ( pos < FAT_NAME_MAX - 1 ) {
+		name[pos] = (ch >= 0x20 && ch < 0x7F) ? (char)ch : '?';
+	}
+}
+
+static void shortName(const uint8 *raw, char *name) {
+	uint32 i, len = 0, base;
+	for ( i = 0; i < 8 && raw[i] != ' '; i++ ) {
+		const uint8 ch = (i == 0 && raw[0] == 0x05) ? 0xE5 : raw[i];  // 05 stands for E5
+		name[len++] = (char)((raw[12] & 0x08 && ch >= 'A' && ch <= 'Z') ? ch + 32 : ch);
+	}
+	base = len;
+	for ( i = 8; i < 11 && raw[i] != ' '; i++ ) {
+		if ( len == base ) {
+			name[len++] = '.';
+		}
+		name[len++] = (char)((raw[12] & 0x10 && raw[i] >= 'A' && raw[i] <= 'Z') ? raw[i] + 32 : raw[i]);
+	}
+	name[len] = '\0';
+}
+
+static bool fat32Entry(struct DirScan *scan, const uint8 *raw) {
+	static const uint8 lfnOffsets[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+	struct FatEntry *const entry = &scan->entry;
+	uint32 i, pos;
+	uint8 sum;
+	if ( raw[0] == 0x00 ) {
+		return true;  // end of directory
+	}
+	if ( raw[0] == 0xE5 ) {
+		scan->lfnSeq = 0;
+		return false;
+	}
+	if ( (raw[11] & 0x3F) == ATTR_LONG_NAME ) {
+		if ( raw[0] & 0x40 ) {
+			scan->lfnSeq = raw[0] & 0x1F;
+			scan->lfnSum = raw[13];
+			memset(entry->name, 0, FAT_NAME_MAX);
+		} else if ( !scan->lfnSeq || (raw[0] & 0x1F) != scan->lfnSeq - 1 || raw[13] != scan->lfnSum ) {
+			scan->lfnSeq = 0;
+			return false;
+		} else {
+			scan->lfnSeq--;
+		}
+		for ( i = 0; i < 13 && scan->lfnSeq; i++ ) {
+			const uint16 ch = le16(raw + lfnOffsets[i]);
+			pos = (uint32)(scan->lfnSeq - 1) * 13 + i;
+			if ( ch == 0x0000 || ch == 0xFFFF ) {
+				break;
+			}
+			putChar(entry->name, pos, ch);
+		}
+		return false;
+	}
+	if ( (raw[11] & ATTR_VOLUME_ID) || raw[0] == '.' ) {
+		scan->lfnSeq = 0;
+		return false;
+	}
+	for ( sum = 0, i = 0; i < 11; i++ ) {
+		sum = (uint8)(((sum & 1) << 7) + (sum >> 1) + raw[i]);
+	}
+	if ( scan->lfnSeq != 1 || sum != scan->lfnSum || !entry->name[0] ) {
+		shortName(raw, entry->name);
+	}
+	scan->lfnSeq = 0;
+	entry->isDir = (raw[11] & ATTR_DIRECTORY) ? true : false;
+	entry->noChain = false;
+	entry->firstCluster = ((uint32)le16(raw + 20) << 16) | le16(raw + 26);
+	entry->size = entry->isDir ? 0 : le32(raw + 28);
+	scan->isStopped = scan->func(scan->context, entry);
+	return scan->isStopped;
+}
+
+static bool exFatEntry(struct DirScan *scan, const uint8 *raw) {
+	struct FatEntry *const entry = &scan->entry;
+	uint32 i;
+	if ( raw[0] == 0x00 ) {
+		return true;  // end of directory
+	}
+	if ( !(raw[0] & EXFAT_IN_USE) ) {
+		scan->secondaries = 0;
+		return false;
+	}
+	if ( raw[0] == EXFAT_FILE ) {
+		memset(entry, 0, sizeof(*entry));
+		entry->isDir = (le16(raw + 4) & ATTR_DIRECTORY) ? true : false;
+		scan->secondaries = raw[1];
+		scan->nameLength = 0;
+		scan->nameChars = 0;
+		return false;
+	}
+	if ( !(raw[0] & 0x40) ) {
+		scan->secondaries = 0;  // a primary entry of some other kind (bitmap, up-case table, label)
+		return false;
+	}
+	if ( !scan->secondaries ) {
+		return false;  // a stray secondary
+	}
+	if ( raw[0] == EXFAT_STREAM ) {
+		entry->noChain = (raw[1] & EXFAT_NO_CHAIN) ? true : false;
+		scan->nameLength = raw[3];
+		entry->firstCluster = le32(raw + 20);
+		entry->size = le64(raw + 24);
+	} else if ( raw[0] == EXFAT_NAME ) {
+		for ( i = 0; i < 15 && scan->nameChars < scan->nameLength; i++ ) {
+			putChar(entry->name, scan->nameChars++, le16(raw + 2 + 2 * i));
+		}
+	}
+	if ( --scan->secondaries ) {
+		return false;
+	}
+	scan->isStopped = scan->func(scan->context, entry);
+	return scan->isStopped;
+}
+
+static bool scanDir(const struct FatVolume *vol, const struct FatEntry *dir, EntryFunc func, void *context, bool *isStopped) {
+	struct Chain chain;
+	struct DirScan scan;
+	uint8 raw[ENTRY_SIZE];
+	uint32 first, count, numEntries, i;
+	bool isDone = false;
+	memset(&scan, 0, sizeof(scan));
+	scan.func = func;
+	scan.context = context;
+	chainBegin(&chain, vol, dir);
+	while ( !isDone && (count = chainRun(&chain, &first)) ) {
+		numEntries = count << (vol->clusterShift + ENTRIES_SHIFT);
+		sdReadMultipleBlocksBegin(clusterLba(vol, first));
+		for ( i = 0; i < numEntries && !isDone; i++ ) {
+			sdGetBytes(raw, ENTRY_SIZE);
+			isDone = vol->isExFat ? exFatEntry(&scan, raw) : fat32Entry(&scan, raw);
+		}
+		if ( sdReadBlocksEnd() != SD_SUCCESS ) {
+			fprintf(stderr, "Unable to read the directory %s\n", dir->name);
+			return false;
+		}
+	}
+	if ( chain.isBad ) {
+		fprintf(stderr, "The cluster chain of %s is broken\n", dir->name);
+		return false;
+	}
+	*isStopped = scan.isStopped;
+	return true;
+}
+
+static bool nameEquals(const char *name, const char *str, uint32 len) {
+	uint32 i;
+	for ( i = 0; i < len; i++ ) {
+		char a = name[i], b = str[i];
+		a = (a >= 'a' && a <= 'z') ? a - 32 : a;
+		b = (b >= 'a' && b <= 'z') ? b - 32 : b;
+		if ( a != b ) {
+			return false;
+		}
+	}
+	return name[len] == '\0';
+}
+
+struct Match {
+	const char *str;
+	uint32 len;
+	struct FatEntry *found;
+};
+
+static bool matchEntry(void *context, const struct FatEntry *entry) {
+	struct Match *const match = (struct Match *)context;
+	if ( nameEquals(entry->name, match->str, match->len) ) {
+		*match->found = *entry;
+		return true;
+	}
+	return false;
+}
+
+bool fatFind(const struct FatVolume *vol, const char *path, struct FatEntry *entry) {
+	struct FatEntry dir;
+	struct Match match;
+	bool isFound;
+	memset(&dir, 0, sizeof(dir));
+	strcpy(dir.name, "/");
+	dir.isDir = true;
+	dir.firstCluster = vol->rootCluster;
+	for ( ; ; ) {
+		while ( *path == '/' ) {
+			path++;
+		}
+		if ( !*path ) {
+			break;
+		}
+		if ( !dir.isDir ) {
+			fprintf(stderr, "%s is not a directory\n", dir.name);
+			return false;
+		}
+		match.str = path;
+		match.len = 0;
+		while ( path[match.len] && path[match.len] != '/' ) {
+			match.len++;
+		}
+		match.found = entry;
+		if ( !scanDir(vol, &dir, matchEntry, &match, &isFound) ) {
+			return false;
+		}
+		if ( !isFound ) {
+			fprintf(stderr, "There is no %.*s in %s\n", (int)match.len, path, dir.name);
+			return false;
+		}
+		dir = *entry;
+		path += match.len;
+	}
+	*entry = dir;
+	return true;
+}
+
+static bool printEntry(void *context, const struct FatEntry *entry) {
+	fprintf(
+		(FILE *)context, "%12llu  %s%s\n",
+		(unsigned long long)entry->size, entry->name, entry->isDir ? "/" : "");
+	return false;
+}
+
+bool fatList(const struct FatVolume *vol, const struct FatEntry *dir, FILE *out) {
+	bool isStopped;
+	if ( !dir->isDir ) {
+		printEntry(out, dir);
+		return true;
+	}
+	return scanDir(vol, dir, printEntry, out, &isStopped);
+}
+
+// Each run is read with the cache off, so that sdReadBlocks() keeps one multiple-block read going
+// for the whole run, clocking each batch in whilst the one before is written out. The cache is on
+// whilst the FAT is walked to find the next run.
+//
+bool fatExtract(const struct FatVolume *vol, const struct FatEntry *file, FILE *out, uint32 *numRuns) {
+	static uint8 buffer[XFER_BLOCKS * BYTES_PER_SECTOR];
+	struct Chain chain;
+	uint64 remaining = file->size;
+	uint32 first, count, blocks, chunk, bytes;
+	bool retVal = false;
+	*numRuns = 0;
+	chainBegin(&chain, vol, file);
+	while ( remaining && (count = chainRun(&chain, &first)) ) {
+		(*numRuns)++;
+		blocks = count << vol->clusterShift;
+		if ( blocks > (remaining + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR ) {
+			blocks = (uint32)((remaining + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR);
+		}
+		sdCacheEnable(false);
+		if ( sdReadMultipleBlocksBegin(clusterLba(vol, first)) != SD_SUCCESS ) {
+			goto cleanup;
+		}
+		while ( blocks ) {
+			chunk = (blocks < XFER_BLOCKS) ? blocks : XFER_BLOCKS;
+			if ( sdReadBlocks(buffer, chunk) != SD_SUCCESS ) {
+				sdReadBlocksEnd();
+				goto cleanup;
+			}
+			bytes = (remaining < chunk * BYTES_PER_SECTOR) ? (uint32)remaining : chunk * BYTES_PER_SECTOR;
+			if ( fwrite(buffer, 1, bytes, out) != bytes ) {
+				fprintf(stderr, "Unable to write %s\n", file->name);
+				sdReadBlocksEnd();
+				goto cleanup;
+			}
+			remaining -= bytes;
+			blocks -= chunk;
+		}
+		sdReadBlocksEnd();
+		sdCacheEnable(true);
+	}
+	if ( remaining ) {
+		fprintf(stderr, "The cluster chain of %s ends %llu bytes short\n", file->name, (unsigned long long)remaining);
+		goto cleanup;
+	}
+	retVal = true;
+cleanup:
+	sdCacheEnable(true);
+	return retVal;
+}
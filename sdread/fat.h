@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2013 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef FAT_H
+#define FAT_H
+
+#include <stdio.h>
+#include <makestuff.h>
+
+#define FAT_NAME_MAX 256  // 255 UTF-16 characters, each stored as one byte
+
+// Where things are on a FAT32 or exFAT volume, from its boot sector.
+//
+struct FatVolume {
+	bool isExFat;
+	uint32 partitionLba;  // the boot sector
+	uint32 fatLba;        // the first FAT
+	uint32 heapLba;       // cluster 2
+	uint32 clusterShift;  // log2 of the sectors per cluster
+	uint32 numClusters;
+	uint32 rootCluster;
+};
+
+// A file or directory, from its directory entry.
+//
+struct FatEntry {
+	char name[FAT_NAME_MAX];
+	bool isDir;
+	bool noChain;         // exFAT: the clusters are contiguous, and not in the FAT
+	uint64 size;          // zero for a FAT32 directory, whose size is its cluster chain's
+	uint32 firstCluster;
+};
+
+// Find the volume: either the card has a FAT32 or exFAT boot sector in block 0, or block 0 is an
+// MBR, and the first partition with one is used. The byte accessors are used, so these all want the
+// sector cache on (see sdCacheEnable()).
+//
+bool fatMount(struct FatVolume *vol);
+
+// Look up a path like "LOGS/UNIT7.CSV" (case-insensitively, against long or short names), or "/"
+// for the root directory.
+//
+bool fatFind(const struct FatVolume *vol, const char *path, struct FatEntry *entry);
+
+// Print each entry of a directory, with its size.
+//
+bool fatList(const struct FatVolume *vol, const struct FatEntry *dir, FILE *out);
+
+// Write a file's data, reading each contiguous run of its clusters with one multiple-block read.
+// The cache is turned off for the data, so it is left holding the FAT and directories.
+//
+bool fatExtract(const struct FatVolume *vol, const struct FatEntry *file, FILE *out, uint32 *numRuns);
+
+#endif
@@ -0,0 +1,678 @@
+/*
+ * Copyright (C) 2013 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#include "image.h"
+#include "sd.h"
+#include "bench.h"
+
+#define IMAGE_VERSION  1
+#define HEADER_SIZE    32
+#define ENTRY_SIZE     16
+#define CHUNK_BYTES    (IMAGE_CHUNK_SECTORS * BYTES_PER_SECTOR)
+#define NUM_SLOTS      32    // chunks in flight between the card and the file
+#define NO_CHUNK       0xFFFFFFFF
+
+#define KIND_ZERO      0
+#define KIND_FF        1
+#define KIND_RAW       2
+#define KIND_LZ        3
+
+#define MIN_MATCH      4
+#define MAX_OFFSET     0xFFFF
+#define HASH_BITS      12
+#define NO_POS         0xFFFFFFFF
+
+#ifdef WIN32
+	#define LOCK(c)           EnterCriticalSection(&(c)->lock)
+	#define UNLOCK(c)         LeaveCriticalSection(&(c)->lock)
+	#define WAIT(c, cond)     SleepConditionVariableCS(&(c)->cond, &(c)->lock, INFINITE)
+	#define SIGNAL(c, cond)   WakeAllConditionVariable(&(c)->cond)
+	#define START(t, fn, arg) ((*(t) = CreateThread(NULL, 0, fn, arg, 0, NULL)) != NULL)
+	#define JOIN(t)           (WaitForSingleObject(t, INFINITE), CloseHandle(t))
+	#define SEEK(f, off)      _fseeki64(f, (__int64)(off), SEEK_SET)
+	typedef HANDLE Thread;
+#else
+	#define LOCK(c)           pthread_mutex_lock(&(c)->lock)
+	#define UNLOCK(c)         pthread_mutex_unlock(&(c)->lock)
+	#define WAIT(c, cond)     pthread_cond_wait(&(c)->cond, &(c)->lock)
+	#define SIGNAL(c, cond)   pthread_cond_broadcast(&(c)->cond)
+	#define START(t, fn, arg) (pthread_create(t, NULL, fn, arg) == 0)
+	#define JOIN(t)           pthread_join(t, NULL)
+	#define SEEK(f, off)      fseeko(f, (off_t)(off), SEEK_SET)
+	typedef pthread_t Thread;
+#endif
+
+static uint32 le32(const uint8 *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32)p[3] << 24);
+}
+
+static uint64 le64(const uint8 *p) {
+	return le32(p) | ((uint64)le32(p + 4) << 32);
+}
+
+static void putLe32(uint8 *p, uint32 value) {
+	p[0] = (uint8)value;
+	p[1] = (uint8)(value >> 8);
+	p[2] = (uint8)(value >> 16);
+	p[3] = (uint8)(value >> 24);
+}
+
+static void putLe64(uint8 *p, uint64 value) {
+	putLe32(p, (uint32)value);
+	putLe32(p + 4, (uint32)(value >> 32));
+}
+
+// Chunks are compressed with an LZ77 in the style of LZ4's block format. Each sequence is a token
+// giving the number of literals (high nibble) and the match length less four (low nibble), either
+// of which carries on in extra bytes if it is 15, then the literals, then the match's two-byte
+// offset back from here. The last sequence is just literals.
+//
+static uint8 *putLength(uint8 *op, const uint8 *end, uint32 len) {
+	while ( len >= 255 ) {
+		if ( op == end ) {
+			return NULL;
+		}
+		*op++ = 255;
+		len -= 255;
+	}
+	if ( op == end ) {
+		return NULL;
+	}
+	*op++ = (uint8)len;
+	return op;
+}
+
+static uint8 *putSequence(
+	uint8 *op, const uint8 *end, const uint8 *literals, uint32 numLiterals, uint32 offset, uint32 matchLen)
+{
+	uint8 *const token = op;
+	if ( op == end ) {
+		return NULL;
+	}
+	op++;
+	*token = (uint8)(((numLiterals < 15) ? numLiterals : 15) << 4);
+	if ( numLiterals >= 15 && !(op = putLength(op, end, numLiterals - 15)) ) {
+		return NULL;
+	}
+	if ( (uint32)(end - op) < numLiterals ) {
+		return NULL;
+	}
+	memcpy(op, literals, numLiterals);
+	op += numLiterals;
+	if ( matchLen ) {
+		matchLen -= MIN_MATCH;
+		*token |= (uint8)((matchLen < 15) ? matchLen : 15);
+		if ( end - op < 2 ) {
+			return NULL;
+		}
+		*op++ = (uint8)offset;
+		*op++ = (uint8)(offset >> 8);
+		if ( matchLen >= 15 && !(op = putLength(op, end, matchLen - 15)) ) {
+			return NULL;
+		}
+	}
+	return op;
+}
+
+static uint32 hash4(const uint8 *p) {
+	return (le32(p) * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// Returns the compressed length, or zero if it would be no smaller than the original.
+//
+static uint32 lzCompress(const uint8 *src, uint32 len, uint8 *dst) {
+	uint32 table[1 << HASH_BITS];
+	const uint8 *const end = dst + len - 1;
+	uint8 *op = dst;
+	uint32 pos = 0, anchor = 0, candidate, h, matchLen;
+	memset(table, 0xFF, sizeof(table));
+	while ( pos + MIN_MATCH <= len ) {
+		h = hash4(src + pos);
+		candidate = table[h];
+		table[h] = pos;
+		if ( candidate != NO_POS && pos - candidate <= MAX_OFFSET && !memcmp(src + candidate, src + pos, MIN_MATCH) ) {
+			matchLen = MIN_MATCH;
+			while ( pos + matchLen < len && src[candidate + matchLen] == src[pos + matchLen] ) {
+				matchLen++;
+			}
+			op = putSequence(op, end, src + anchor, pos - anchor, pos - candidate, matchLen);
+			if ( !op ) {
+				return 0;
+			}
+			pos += matchLen;
+			anchor = pos;
+		} else {
+			pos++;
+		}
+	}
+	op = putSequence(op, end, src + anchor, len - anchor, 0, 0);
+	return op ? (uint32)(op - dst) : 0;
+}
+
+static bool getLength(const uint8 **ip, const uint8 *end, uint32 *len) {
+	uint8 byte;
+	do {
+		if ( *ip == end ) {
+			return false;
+		}
+		byte = *(*ip)++;
+		*len += byte;
+	} while ( byte == 255 );
+	return true;
+}
+
+// Returns false unless the compressed data is well-formed, and fills exactly dstLen bytes.
+//
+static bool lzDecompress(const uint8 *src, uint32 srcLen, uint8 *dst, uint32 dstLen) {
+	const uint8 *ip = src, *const ipEnd = src + srcLen;
+	uint8 *op = dst, *const opEnd = dst + dstLen;
+	uint32 len, offset;
+	uint8 token;
+	while ( ip < ipEnd ) {
+		token = *ip++;
+		len = token >> 4;
+		if ( len == 15 && !getLength(&ip, ipEnd, &len) ) {
+			return false;
+		}
+		if ( (uint32)(ipEnd - ip) < len || (uint32)(opEnd - op) < len ) {
+			return false;
+		}
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+		if ( ip == ipEnd ) {
+			break;
+		}
+		if ( ipEnd - ip < 2 ) {
+			return false;
+		}
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		len = token & 0x0F;
+		if ( len == 15 && !getLength(&ip, ipEnd, &len) ) {
+			return false;
+		}
+		len += MIN_MATCH;
+		if ( !offset || offset > (uint32)(op - dst) || (uint32)(opEnd - op) < len ) {
+			return false;
+		}
+		while ( len-- ) {
+			*op = op[-(int)offset];  // byte by byte, since a match may overlap itself
+			op++;
+		}
+	}
+	return op == opEnd;
+}
+
+static bool isAll(const uint8 *p, uint32 len, uint8 value) {
+	return p[0] == value && !memcmp(p, p + 1, len - 1);
+}
+
+// The capture pipeline. Chunk n goes through slot n % NUM_SLOTS: the reader fills it, a worker
+// packs it, and the writer writes it out and frees it for chunk n + NUM_SLOTS.
+//
+struct Slot {
+	bool isDone;          // packed, and waiting for the writer
+	bool isHurried;       // stored raw because the workers were behind
+	uint8 kind;
+	uint32 numSectors;
+	uint32 storedLen;
+	uint8 data[CHUNK_BYTES];
+	uint8 packed[CHUNK_BYTES];
+};
+
+struct Capture {
+	FILE *file;
+	const char *fileName;
+	uint32 numBlocks;
+	uint32 numChunks;
+	uint32 numFilled;     // chunks handed over by the reader
+	uint32 nextWork;      // the next chunk for a worker
+	uint32 numWritten;    // chunks written out, whose slots are free again
+	bool isFailed;
+	uint32 readerWaits;   // times the reader found no free slot
+	uint64 offset;        // where the writer is in the file
+	uint32 numKind[4];
+	uint32 numHurried;
+	uint8 *index;
+	#ifdef WIN32
+		CRITICAL_SECTION lock;
+		CONDITION_VARIABLE workReady, chunkDone, slotFree;
+	#else
+		pthread_mutex_t lock;
+		pthread_cond_t workReady, chunkDone, slotFree;
+	#endif
+	struct Slot slots[NUM_SLOTS];
+};
+
+// Give up, and wake everyone to notice. Call with the lock held.
+//
+static void captureFail(struct Capture *c) {
+	c->isFailed = true;
+	SIGNAL(c, workReady);
+	SIGNAL(c, chunkDone);
+	SIGNAL(c, slotFree);
+}
+
+static void packChunk(struct Slot *slot) {
+	const uint32 len = slot->numSectors * BYTES_PER_SECTOR;
+	if ( isAll(slot->data, len, 0x00) ) {
+		slot->kind = KIND_ZERO;
+		slot->storedLen = 0;
+	} else if ( isAll(slot->data, len, 0xFF) ) {
+		slot->kind = KIND_FF;
+		slot->storedLen = 0;
+	} else if ( !slot->isHurried && (slot->storedLen = lzCompress(slot->data, len, slot->packed)) ) {
+		slot->kind = KIND_LZ;
+	} else {
+		slot->kind = KIND_RAW;
+		slot->storedLen = len;
+	}
+}
+
+#ifdef WIN32
+static DWORD WINAPI workerThread(LPVOID arg) {
+#else
+static void *workerThread(void *arg) {
+#endif
+	struct Capture *const c = (struct Capture *)arg;
+	struct Slot *slot;
+	LOCK(c);
+	for ( ; ; ) {
+		while ( c->nextWork == c->numFilled && c->nextWork != c->numChunks && !c->isFailed ) {
+			WAIT(c, workReady);
+		}
+		if ( c->nextWork == c->numChunks || c->isFailed ) {
+			break;
+		}
+		slot = c->slots + c->nextWork % NUM_SLOTS;
+		c->nextWork++;
+		slot->isHurried = (c->numFilled - c->nextWork >= NUM_SLOTS / 2);
+		UNLOCK(c);
+		packChunk(slot);
+		LOCK(c);
+		slot->isDone = true;
+		SIGNAL(c, chunkDone);
+	}
+	UNLOCK(c);
+	return 0;
+}
+
+#ifdef WIN32
+static DWORD WINAPI writerThread(LPVOID arg) {
+#else
+static void *writerThread(void *arg) {
+#endif
+	struct Capture *const c = (struct Capture *)arg;
+	struct Slot *slot;
+	uint8 *entry;
+	bool isWritten;
+	LOCK(c);
+	while ( c->numWritten != c->numChunks && !c->isFailed ) {
+		slot = c->slots + c->numWritten % NUM_SLOTS;
+		if ( !slot->isDone ) {
+			WAIT(c, chunkDone);
+			continue;
+		}
+		UNLOCK(c);
+		entry = c->index + (size_t)c->numWritten * ENTRY_SIZE;
+		putLe64(entry, slot->storedLen ? c->offset : 0);
+		putLe32(entry + 8, slot->storedLen);
+		entry[12] = slot->kind;
+		isWritten = fwrite(
+			(slot->kind == KIND_LZ) ? slot->packed : slot->data, 1, slot->storedLen, c->file) == slot->storedLen;
+		c->offset += slot->storedLen;
+		c->numKind[slot->kind]++;
+		if ( slot->isHurried && slot->kind == KIND_RAW ) {
+			c->numHurried++;
+		}
+		LOCK(c);
+		if ( !isWritten ) {
+			fprintf(stderr, "Unable to write to %s\n", c->fileName);
+			captureFail(c);
+			break;
+		}
+		slot->isDone = false;
+		c->numWritten++;
+		SIGNAL(c, slotFree);
+	}
+	UNLOCK(c);
+	return 0;
+}
+
+static uint32 numCpus(void) {
+	#ifdef WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return info.dwNumberOfProcessors;
+	#else
+		const long n = sysconf(_SC_NPROCESSORS_ONLN);
+		return (n > 0) ? (uint32)n : 1;
+	#endif
+}
+
+static void putHeader(uint8 *header, uint64 totalSectors, uint32 numChunks, uint64 indexOffset) {
+	memset(header, 0x00, HEADER_SIZE);
+	memcpy(header, "SDIM", 4);
+	putLe32(header + 4, IMAGE_VERSION);
+	putLe64(header + 8, totalSectors);
+	putLe32(header + 16, IMAGE_CHUNK_SECTORS);
+	putLe32(header + 20, numChunks);
+	putLe64(header + 24, indexOffset);
+}
+
+// Stream the card into the slots on this thread, which owns the SPI connection.
+//
+static bool readCard(struct Capture *c) {
+	struct Slot *slot;
+	uint32 chunk;
+	bool retVal = false;
+	if ( sdReadMultipleBlocksBegin(0) != SD_SUCCESS ) {
+		LOCK(c);
+		captureFail(c);
+		UNLOCK(c);
+		return false;
+	}
+	for ( chunk = 0; chunk < c->numChunks; chunk++ ) {
+		slot = c->slots + chunk % NUM_SLOTS;
+		LOCK(c);
+		if ( chunk - c->numWritten == NUM_SLOTS && !c->isFailed ) {
+			c->readerWaits++;
+			do {
+				WAIT(c, slotFree);
+			} while ( chunk - c->numWritten == NUM_SLOTS && !c->isFailed );
+		}
+		if ( c->isFailed ) {
+			UNLOCK(c);
+			goto cleanup;
+		}
+		UNLOCK(c);
+		slot->numSectors = c->numBlocks - chunk * IMAGE_CHUNK_SECTORS;
+		if ( slot->numSectors > IMAGE_CHUNK_SECTORS ) {
+			slot->numSectors = IMAGE_CHUNK_SECTORS;
+		}
+		if ( sdReadBlocks(slot->data, slot->numSectors) != SD_SUCCESS ) {
+			LOCK(c);
+			captureFail(c);
+			UNLOCK(c);
+			goto cleanup;
+		}
+		LOCK(c);
+		c->numFilled++;
+		SIGNAL(c, workReady);
+		UNLOCK(c);
+	}
+	retVal = true;
+cleanup:
+	sdReadBlocksEnd();
+	return retVal;
+}
+
+bool imageCapture(FILE *info, const char *fileName, uint32 numBlocks, uint32 numWorkers) {
+	struct Capture *c;
+	Thread writer, workers[IMAGE_MAX_WORKERS];
+	uint32 numStarted = 0, i;
+	uint8 header[HEADER_SIZE];
+	double startTime, elapsed;
+	bool retVal = false;
+	if ( !numWorkers ) {
+		numWorkers = numCpus();
+	}
+	if ( numWorkers > IMAGE_MAX_WORKERS ) {
+		numWorkers = IMAGE_MAX_WORKERS;
+	}
+	c = (struct Capture *)calloc(1, sizeof(struct Capture));
+	if ( !c ) {
+		fprintf(stderr, "Unable to allocate the image buffers\n");
+		return false;
+	}
+	c->fileName = fileName;
+	c->numBlocks = numBlocks;
+	c->numChunks = (numBlocks + IMAGE_CHUNK_SECTORS - 1) / IMAGE_CHUNK_SECTORS;
+	c->offset = HEADER_SIZE;
+	c->index = (uint8 *)calloc(c->numChunks + 1, ENTRY_SIZE);
+	c->file = fopen(fileName, "wb");
+	if ( !c->index || !c->file ) {
+		fprintf(stderr, "Unable to write to %s\n", fileName);
+		goto cleanup;
+	}
+	putHeader(header, numBlocks, c->numChunks, 0);
+	if ( fwrite(header, 1, HEADER_SIZE, c->file) != HEADER_SIZE ) {
+		fprintf(stderr, "Unable to write to %s\n", fileName);
+		goto cleanup;
+	}
+	#ifdef WIN32
+		InitializeCriticalSection(&c->lock);
+		InitializeConditionVariable(&c->workReady);
+		InitializeConditionVariable(&c->chunkDone);
+		InitializeConditionVariable(&c->slotFree);
+	#else
+		pthread_mutex_init(&c->lock, NULL);
+		pthread_cond_init(&c->workReady, NULL);
+		pthread_cond_init(&c->chunkDone, NULL);
+		pthread_cond_init(&c->slotFree, NULL);
+	#endif
+	fprintf(
+		info, "Imaging %u SD card blocks to %s, with %u worker thread%s...\n",
+		numBlocks, fileName, numWorkers, (numWorkers == 1) ? "" : "s");
+	startTime = wallTime();
+	if ( !START(&writer, writerThread, c) ) {
+		fprintf(stderr, "Unable to start the writer thread\n");
+		goto destroy;
+	}
+	while ( numStarted < numWorkers && START(workers + numStarted, workerThread, c) ) {
+		numStarted++;
+	}
+	if ( numStarted ) {
+		readCard(c);
+	} else {
+		fprintf(stderr, "Unable to start any worker threads\n");
+		LOCK(c);
+		captureFail(c);
+		UNLOCK(c);
+	}
+	for ( i = 0; i < numStarted; i++ ) {
+		JOIN(workers[i]);
+	}
+	JOIN(writer);
+	elapsed = wallTime() - startTime;
+	if ( c->isFailed ) {
+		goto destroy;
+	}
+
+	// The index goes after the last chunk, and then the header can say where it is
+	putHeader(header, numBlocks, c->numChunks, c->offset);
+	if (
+		fwrite(c->index, ENTRY_SIZE, c->numChunks, c->file) != c->numChunks ||
+		fseek(c->file, 0, SEEK_SET) ||
+		fwrite(header, 1, HEADER_SIZE, c->file) != HEADER_SIZE )
+	{
+		fprintf(stderr, "Unable to write to %s\n", fileName);
+		goto destroy;
+	}
+	fprintf(
+		info, "Read %llu bytes in %.3fs (%.2f MB/s); the reader waited for a free buffer %u time%s\n",
+		(unsigned long long)numBlocks * BYTES_PER_SECTOR, elapsed,
+		(elapsed > 0.0) ? (double)numBlocks * BYTES_PER_SECTOR / elapsed / 1000000.0 : 0.0,
+		c->readerWaits, (c->readerWaits == 1) ? "" : "s");
+	fprintf(
+		info, "Chunks: %u blank, %u compressed, %u stored raw (%u of them to keep up with the card)\n",
+		c->numKind[KIND_ZERO] + c->numKind[KIND_FF], c->numKind[KIND_LZ], c->numKind[KIND_RAW],
+		c->numHurried);
+	fprintf(
+		info, "Image is %llu bytes (%.1f%% of the blocks read)\n",
+		(unsigned long long)(c->offset + (uint64)c->numChunks * ENTRY_SIZE),
+		numBlocks ? 100.0 * (c->offset + (uint64)c->numChunks * ENTRY_SIZE) / ((double)numBlocks * BYTES_PER_SECTOR) : 0.0);
+	retVal = true;
+destroy:
+	#ifdef WIN32
+		DeleteCriticalSection(&c->lock);
+	#else
+		pthread_cond_destroy(&c->slotFree);
+		pthread_cond_destroy(&c->chunkDone);
+		pthread_cond_destroy(&c->workReady);
+		pthread_mutex_destroy(&c->lock);
+	#endif
+cleanup:
+	if ( c->file ) {
+		fclose(c->file);
+	}
+	free(c->index);
+	free(c);
+	return retVal;
+}
+
+// Reading an image back, a chunk at a time
+//
+struct Image {
+	FILE *file;
+	uint64 totalSectors;
+	uint32 chunkSectors;
+	uint32 numChunks;
+	uint32 current;       // the chunk in chunk[], or NO_CHUNK
+	uint8 *index;
+	uint8 chunk[CHUNK_BYTES];
+	uint8 packed[CHUNK_BYTES];
+};
+
+struct Image *imageOpen(const char *fileName) {
+	struct Image *img = (struct Image *)calloc(1, sizeof(struct Image));
+	uint8 header[HEADER_SIZE];
+	if ( !img ) {
+		fprintf(stderr, "Unable to allocate the image buffers\n");
+		return NULL;
+	}
+	img->current = NO_CHUNK;
+	img->file = fopen(fileName, "rb");
+	if ( !img->file ) {
+		fprintf(stderr, "Unable to read from %s\n", fileName);
+		goto fail;
+	}
+	if ( fread(header, 1, HEADER_SIZE, img->file) != HEADER_SIZE || memcmp(header, "SDIM", 4) ) {
+		fprintf(stderr, "%s is not an SD card image\n", fileName);
+		goto fail;
+	}
+	if ( le32(header + 4) != IMAGE_VERSION ) {
+		fprintf(stderr, "%s is a version %u image; only version %u is supported\n", fileName, le32(header + 4), IMAGE_VERSION);
+		goto fail;
+	}
+	img->totalSectors = le64(header + 8);
+	img->chunkSectors = le32(header + 16);
+	img->numChunks = le32(header + 20);
+	if (
+		!img->chunkSectors || img->chunkSectors > IMAGE_CHUNK_SECTORS ||
+		img->numChunks != (img->totalSectors + img->chunkSectors - 1) / img->chunkSectors )
+	{
+		fprintf(stderr, "%s has a corrupt header\n", fileName);
+		goto fail;
+	}
+	img->index = (uint8 *)malloc((size_t)img->numChunks * ENTRY_SIZE + 1);
+	if (
+		!img->index || SEEK(img->file, le64(header + 24)) ||
+		fread(img->index, ENTRY_SIZE, img->numChunks, img->file) != img->numChunks )
+	{
+		fprintf(stderr, "Unable to read the index of %s\n", fileName);
+		goto fail;
+	}
+	return img;
+fail:
+	imageClose(img);
+	return NULL;
+}
+
+uint64 imageSectors(const struct Image *img) {
+	return img->totalSectors;
+}
+
+static bool loadChunk(struct Image *img, uint32 n) {
+	const uint8 *const entry = img->index + (size_t)n * ENTRY_SIZE;
+	const uint64 first = (uint64)n * img->chunkSectors;
+	const uint32 storedLen = le32(entry + 8);
+	const uint32 len = (uint32)(
+		(img->totalSectors - first < img->chunkSectors) ? img->totalSectors - first : img->chunkSectors
+	) * BYTES_PER_SECTOR;
+	bool isGood;
+	img->current = NO_CHUNK;
+	switch ( entry[12] ) {
+	case KIND_ZERO:
+	case KIND_FF:
+		memset(img->chunk, (entry[12] == KIND_ZERO) ? 0x00 : 0xFF, len);
+		isGood = !storedLen;
+		break;
+	case KIND_RAW:
+		isGood =
+			storedLen == len && !SEEK(img->file, le64(entry)) &&
+			fread(img->chunk, 1, len, img->file) == len;
+		break;
+	case KIND_LZ:
+		isGood =
+			storedLen < len && !SEEK(img->file, le64(entry)) &&
+			fread(img->packed, 1, storedLen, img->file) == storedLen &&
+			lzDecompress(img->packed, storedLen, img->chunk, len);
+		break;
+	default:
+		isGood = false;
+	}
+	if ( !isGood ) {
+		fprintf(stderr, "Chunk %u of the image is corrupt\n", n);
+		return false;
+	}
+	img->current = n;
+	return true;
+}
+
+bool imageRead(struct Image *img, uint64 lba, uint8 *buffer, uint32 numBlocks) {
+	uint32 n, first, count;
+	if ( lba > img->totalSectors || numBlocks > img->totalSectors - lba ) {
+		fprintf(stderr, "Blocks 0x%llX-0x%llX are beyond the end of the image\n",
+			(unsigned long long)lba, (unsigned long long)(lba + numBlocks - 1));
+		return false;
+	}
+	while ( numBlocks ) {
+		n = (uint32)(lba / img->chunkSectors);
+		first = (uint32)(lba % img->chunkSectors);
+		count = img->chunkSectors - first;
+		if ( count > numBlocks ) {
+			count = numBlocks;
+		}
+		if ( n != img->current && !loadChunk(img, n) ) {
+			return false;
+		}
+		memcpy(buffer, img->chunk + first * BYTES_PER_SECTOR, count * BYTES_PER_SECTOR);
+		buffer += count * BYTES_PER_SECTOR;
+		lba += count;
+		numBlocks -= count;
+	}
+	return true;
+}
+
+void imageClose(struct Image *img) {
+	if ( img ) {
+		if ( img->file ) {
+			fclose(img->file);
+		}
+		free(img->index);
+		free(img);
+	}
+}
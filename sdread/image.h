@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2013 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdio.h>
+#include <makestuff.h>
+
+// A card image is a header, the chunks of the card as stored, and an index at the end giving each
+// chunk's offset, stored length and kind, so any sector can be found without reading the rest:
+//
+//   header: "SDIM", version, total sectors (u64), sectors per chunk, chunks, index offset (u64)
+//   index:  for each chunk, its offset (u64), stored length (u32), kind (u8) and three zero bytes
+//
+// All fields are little-endian. Chunks which are all 00 or all FF are stored as nothing, and the
+// rest are compressed, or stored raw if that doesn't make them any smaller.
+//
+#define IMAGE_CHUNK_SECTORS 128   // 64KiB
+#define IMAGE_MAX_WORKERS   16
+
+struct Image;
+
+// Read numBlocks blocks from the start of the card into an image file, which must be seekable. The
+// calling thread streams the card with one multiple-block read, and hands each chunk to a pool of
+// numWorkers threads (zero for one per CPU) to be classified and compressed, and from them to a
+// thread which writes them out in order. If the workers fall behind, they store chunks raw rather
+// than hold up the card.
+//
+bool imageCapture(FILE *info, const char *fileName, uint32 numBlocks, uint32 numWorkers);
+
+// Open an image for random access, or return NULL with a message on stderr.
+//
+struct Image *imageOpen(const char *fileName);
+
+// The number of sectors in the card the image was taken from.
+//
+uint64 imageSectors(const struct Image *img);
+
+// Read sectors out of an image, decompressing only the chunks they are in.
+//
+bool imageRead(struct Image *img, uint64 lba, uint8 *buffer, uint32 numBlocks);
+
+void imageClose(struct Image *img);
+
+#endif
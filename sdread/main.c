@@ -16,299 +16,274 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 #include <libfpgalink.h>
 #include "args.h"
-
-// Header stuff
-#define SD_SUCCESS              0
-#define SD_READBLOCK_CMD_ERROR  1
-#define SD_INIT_NOT_IDLE_ERROR  2
-#define SD_INIT_TIMEOUT_ERROR   3
-
-#define LOG2_BYTES_PER_SECTOR   9
-#define BYTES_PER_SECTOR        (1<<LOG2_BYTES_PER_SECTOR)
-
-// Body stuff
-#define TOKEN_SUCCESS             0x00
-#define TOKEN_READ_CAPACITY       0xFE
-#define TOKEN_READ_SINGLE         0xFE
-#define TOKEN_READ_MULTIPLE       0xFE
-#define TOKEN_WRITE_SINGLE        0xFE
-#define TOKEN_WRITE_MULTIPLE      0xFC
-#define TOKEN_WRITE_FINISH        0xFD
-#define IN_IDLE_STATE             (1<<0)
-#define ERASE_RESET               (1<<1)
-#define ILLEGAL_COMMAND           (1<<2)
-#define COMMAND_CRC_ERROR         (1<<3)
-#define ERASE_SEQUENCE_ERROR      (1<<4)
-#define ADDRESS_ERROR             (1<<5)
-#define PARAMETER_ERROR           (1<<6)
-
-#define CMD_GO_IDLE_STATE         0
-#define CMD_SEND_OP_COND          1
-#define CMD_SEND_CSD              9
-#define CMD_STOP_TRANSMISSION     12
-#define CMD_READ_SINGLE_BLOCK     17
-#define CMD_READ_MULTIPLE_BLOCKS  18
-#define CMD_WRITE_SINGLE_BLOCK    24
-#define CMD_WRITE_MULTIPLE_BLOCKS 25
-#define CMD_APP_SEND_OP_COND      41
-#define CMD_APP_CMD               55
-
-#define SD_RETCODE_SUCCESS             0x00
-#define SD_RETCODE_NOT_IDLE            1
-#define SD_RETCODE_ERROR_INIT          2
-#define SD_RETCODE_ERROR_READ          3
-#define SD_RETCODE_ERROR_NO_DATA       4
-#define SD_RETCODE_ERROR_READ_CAPACITY 5
-#define SD_RETCODE_ERROR_WRITE         6
-#define SD_RETCODE_ERROR_NOT_READY     7
+#include "spi.h"
+#include "sd.h"
+#include "bench.h"
+#include "fat.h"
+#include "image.h"
+#include "prof.h"
 
 static struct FLContext *handle = NULL;
-static uint8 config = 0x00;
-
-#define TURBO  (1<<0)
-#define ENABLE (1<<1)
-
-static inline void enable(void) {
-	config |= ENABLE;
-	FLStatus status = flWriteChannel(handle, 1000, 0x01, 1, &config, NULL);
-}
-
-static inline void disable(void) {
-	config &= ~ENABLE;
-	FLStatus status = flWriteChannel(handle, 1000, 0x01, 1, &config, NULL);
-}
-
-static inline void fast(void) {
-	config |= TURBO;
-	FLStatus status = flWriteChannel(handle, 1000, 0x01, 1, &config, NULL);
-}
-
-static inline void slow(void) {
-	config &= ~TURBO;
-	FLStatus status = flWriteChannel(handle, 1000, 0x01, 1, &config, NULL);
-}
 
-static inline uint8 spiSendByte(uint8 byte) {
-	FLStatus status;
-	// TODO: actually handle errors here
-	status = flWriteChannel(handle, 1000, 0x00, 1, &byte, NULL);
-	status = flReadChannel(handle, 1000, 0x00, 1, &byte, NULL);
-	return byte;
-}
-
-static inline FLStatus spiSendBlock(uint8 *ioBlock) {
-	FLStatus status;
-	status = flWriteChannel(handle, 1000, 0x00, 512, ioBlock, NULL);
-	if ( status ) { return status; }
-	status = flReadChannel(handle, 1000, 0x00, 512, ioBlock, NULL);
-	return status;
-}
-
-static inline uint8 waitForNot(uint8 response) {
-	uint16 i = 0xFFFF;
-	uint8 byte;
-	do {
-		byte = spiSendByte(0xFF);
-	} while ( byte == response && --i );
-	return byte;
-}
-
-static inline uint8 waitFor(uint8 response) {
-	uint16 i = 0xFFFF;
-	uint8 byte;
-	do {
-		byte = spiSendByte(0xFF);
-	} while ( byte != response && --i );
-	return byte;
-}
-
-static void sendClocks(uint8 numClocks, uint8 byte) {
-	uint8 i;
-	for ( i = 0; i < numClocks; i++ ) {
-		spiSendByte(byte);
+void sdTest(uint32 blkNum) {
+	uint16 i;
+	uint8 block[512];
+	printf("Reading SD card block 0x%08X...\n", blkNum);
+	sdReadSingleBlockBegin(blkNum);
+	sdGetBytes(block, 512);
+	if ( sdReadBlocksEnd() != SD_SUCCESS ) {
+		printf("CRC error!\n");
 	}
+	for ( i = 0; i < 512; i++ ) {
+		printf("%c", block[i]);
+	}
+	printf("\n");
 }
 
-static uint8 sendCommand(uint8 command, uint32 param) {
-	spiSendByte(0xFF);      // dummy byte
-	spiSendByte(command | 0x40);
-	spiSendByte(param>>24);
-	spiSendByte(param>>16);
-	spiSendByte(param>>8);
-	spiSendByte(param);
-	spiSendByte(0x95);  // correct CRC for first command in SPI
-	                    // after that CRC is ignored, so no problem with
-	                    // always sending 0x95
-	spiSendByte(0xFF);  // ignore return byte
-	return waitForNot(0xFF);
-}
-
-uint8 sdInit(void) {
-	uint16 i;
-	uint8 returnCode;
-	
-	// Setup SPI @ 400kHz, deassert CS
-	//
-	disable();
-	slow();
-	
-	// Enable SPI; set as master; select Fosc/64 (250kHz). For initialization,
-	// the clock has to be between 100kHz and 400kHz
-	//
-	//SPCR = (1<<MSTR) | (1<<SPE) | (3<<SPR0);
-	//SPSR = (1<<SPI2X);
-	
-	// Hold CS high and send 256 clocks (1.024ms @250kHz) with DI low while card power stabilizes
-	//
-	sendClocks(32, 0x00);
-	
-	// Hold CS high and send 80 clocks (0.32ms @250kHz) with DI high to get the card ready to accept commands
-	//
-	sendClocks(10, 0xFF);
-	
-	// Bring CS low and send CMD0 to reset and put the card in SPI mode
-	//
-	enable();
-	if ( sendCommand(CMD_GO_IDLE_STATE, 0) != IN_IDLE_STATE ) {
-		sendClocks(2, 0xFF);
-		disable();
-		return SD_INIT_NOT_IDLE_ERROR;
+// Stream a range of blocks to a file (or to stdout if the filename is "-") using one multiple-block
+// read, and report the sustained throughput.
+//
+#define XFER_BLOCKS 64
+
+static uint8 buffer[XFER_BLOCKS * BYTES_PER_SECTOR];
+
+static bool sdDump(FILE *info, const char *fileName, uint32 lba, uint32 numBlocks) {
+	const bool toStdout = !strcmp(fileName, "-");
+	FILE *file;
+	uint32 remaining = numBlocks;
+	double startTime, elapsed;
+	bool retVal = false;
+	if ( toStdout ) {
+		#ifdef WIN32
+			_setmode(_fileno(stdout), _O_BINARY);
+		#endif
+		file = stdout;
+	} else {
+		file = fopen(fileName, "wb");
+		if ( !file ) {
+			fprintf(stderr, "Unable to write to %s\n", fileName);
+			return false;
+		}
 	}
-	
-	// Tell the card to initialize itself with ACMD41.
-	//
-	sendCommand(CMD_APP_CMD, 0);
-	returnCode = sendCommand(CMD_APP_SEND_OP_COND, 0);
-	
-	// Send CMD1 repeatedly until the initialization is complete.
-	//
-	i = 0xFFFF;
-	while ( returnCode != TOKEN_SUCCESS && --i ) {
-		returnCode = sendCommand(CMD_SEND_OP_COND, 0);
+	fprintf(info, "Reading %u SD card blocks from 0x%08X...\n", numBlocks, lba);
+	startTime = wallTime();
+	if ( sdReadMultipleBlocksBegin(lba) != SD_SUCCESS ) {
+		goto cleanup;
 	}
-	
-	sendClocks(2, 0xFF);
-	disable();
-	
-	if ( i == 0x0000 ) {
-		return SD_INIT_TIMEOUT_ERROR;
+	while ( remaining ) {
+		const uint32 chunk = (remaining < XFER_BLOCKS) ? remaining : XFER_BLOCKS;
+		if ( sdReadBlocks(buffer, chunk) != SD_SUCCESS ) {
+			sdReadBlocksEnd();
+			goto cleanup;
+		}
+		if ( fwrite(buffer, BYTES_PER_SECTOR, chunk, file) != chunk ) {
+			fprintf(stderr, "Unable to write to %s\n", fileName);
+			sdReadBlocksEnd();
+			goto cleanup;
+		}
+		remaining -= chunk;
 	}
-
-	// Enable 24MHz SPI mode
-	//fast();
-	return SD_SUCCESS;
+	sdReadBlocksEnd();
+	elapsed = wallTime() - startTime;
+	fprintf(
+		info, "Read %llu bytes in %.3fs (%.2f MB/s)\n",
+		(unsigned long long)numBlocks * BYTES_PER_SECTOR, elapsed,
+		(elapsed > 0.0) ? (double)numBlocks * BYTES_PER_SECTOR / elapsed / 1000000.0 : 0.0
+	);
+	retVal = true;
+cleanup:
+	if ( toStdout ) {
+		fflush(stdout);
+	} else {
+		fclose(file);
+	}
+	return retVal;
 }
 
-static struct SdStatus {
-	int reserved      : 16 - LOG2_BYTES_PER_SECTOR - 1;
-	int isMultiple    : 1;
-	int currentOffset : LOG2_BYTES_PER_SECTOR;
-} status = {0, 0, 0};
-
-uint8 sdGetByte(void) {
-	uint8 byte;
-	if ( !status.currentOffset ) {
-		waitFor(status.isMultiple ? TOKEN_READ_MULTIPLE : TOKEN_READ_SINGLE);
+// Copy a file out of the FAT32 or exFAT filesystem on the card (to stdout if the filename is "-"),
+// reading only its clusters, or list a directory.
+//
+static bool sdExtract(FILE *info, const char *path, const char *fileName, bool isList) {
+	const bool toStdout = !strcmp(fileName, "-");
+	FILE *file = NULL;
+	struct FatVolume vol;
+	struct FatEntry entry;
+	uint32 numRuns;
+	double startTime, elapsed;
+	bool retVal = false;
+	sdCacheEnable(true);
+	if ( !fatMount(&vol) ) {
+		goto cleanup;
 	}
-	byte = spiSendByte(0xff);
-	status.currentOffset++;
-	if ( !status.currentOffset ) {
-		sendClocks(2, 0xFF);  // Flush two CRC bytes
+	fprintf(
+		info, "Found %s volume at block 0x%08X, with %u clusters of %u bytes\n",
+		vol.isExFat ? "exFAT" : "FAT32", vol.partitionLba, vol.numClusters,
+		BYTES_PER_SECTOR << vol.clusterShift);
+	if ( !fatFind(&vol, path, &entry) ) {
+		goto cleanup;
 	}
-	return byte;
-}
-
-uint8 sdReadSingleBlockBegin(uint32 lba) {
-	uint16 timeout;
-	uint8 returnCode;
-
-	enable();
-	// Send read single block command and Logical Block Address
-	//
-	timeout = 0xFFFF;
-	while ( (returnCode = sendCommand(CMD_READ_SINGLE_BLOCK, lba<<9)) != TOKEN_SUCCESS && --timeout );
-	if ( !timeout ) {
-		sendClocks(2, 0xFF);
-		disable();
-		printf(
-			"sdReadSingleBlockBegin() encountered SD_READBLOCK_CMD_ERROR {\n  lba=0x%08X\n  returnCode=0x%02X\n}\n",
-			lba, returnCode
-		);
-		return SD_READBLOCK_CMD_ERROR;
-	}
-	status.currentOffset = 0;
-	status.isMultiple = 0;
-	return SD_SUCCESS;
-}
-
-uint8 sdReadMultipleBlocksBegin(uint32 lba) {
-	uint16 timeout;
-
-	enable();
-	// Send read multiple blocks command and Logical Block Address
-	//
-	timeout = 0xFFFF;
-	while ( sendCommand(CMD_READ_MULTIPLE_BLOCKS, lba<<9) != TOKEN_SUCCESS && --timeout );
-	if ( timeout == 0x0000 ) {
-		sendClocks(2, 0xFF);
-		disable();
-		printf("sdReadMultipleBlocksBegin() encountered SD_READBLOCK_CMD_ERROR!\n");
-		return SD_READBLOCK_CMD_ERROR;
-	}
-	status.currentOffset = 0;
-	status.isMultiple = 1;
-	return SD_SUCCESS;
-}
-
-void sdSkip(uint16 numBytes) {
-	while ( numBytes-- ) {
-		sdGetByte();
+	if ( isList ) {
+		retVal = fatList(&vol, &entry, info);
+		goto cleanup;
 	}
-}
-
-uint16 sdGetWord(void) {
-	return (uint16)sdGetByte() + ((uint16)sdGetByte() << 8);
-}
-
-uint32 sdGetLong(void) {
-	return (uint32)sdGetByte() + ((uint32)sdGetByte() << 8) + ((uint32)sdGetByte() << 16) + ((uint32)sdGetByte() << 24);
-}
-
-void sdGetBytes(uint8 *buffer, uint16 numBytes) {
-	while ( numBytes-- ) {
-		*buffer++ = sdGetByte();
+	if ( entry.isDir ) {
+		fprintf(stderr, "%s is a directory\n", path);
+		goto cleanup;
+	}
+	if ( toStdout ) {
+		#ifdef WIN32
+			_setmode(_fileno(stdout), _O_BINARY);
+		#endif
+		file = stdout;
+	} else {
+		file = fopen(fileName, "wb");
+		if ( !file ) {
+			fprintf(stderr, "Unable to write to %s\n", fileName);
+			goto cleanup;
+		}
 	}
+	fprintf(info, "Extracting %s (%llu bytes)...\n", path, (unsigned long long)entry.size);
+	startTime = wallTime();
+	if ( !fatExtract(&vol, &entry, file, &numRuns) ) {
+		goto cleanup;
+	}
+	elapsed = wallTime() - startTime;
+	fprintf(
+		info, "Read %llu bytes in %u run%s in %.3fs (%.2f MB/s)\n",
+		(unsigned long long)entry.size, numRuns, (numRuns == 1) ? "" : "s", elapsed,
+		(elapsed > 0.0) ? entry.size / elapsed / 1000000.0 : 0.0
+	);
+	retVal = true;
+cleanup:
+	if ( toStdout ) {
+		fflush(stdout);
+	} else if ( file ) {
+		fclose(file);
+	}
+	return retVal;
 }
 
-void sdReadBlocksEnd(void) {
-	if ( status.currentOffset ) {
-		sdSkip(BYTES_PER_SECTOR - status.currentOffset);
+// Turn an image made with -I back into a raw card image (to stdout if the filename is "-"). This
+// needs no card.
+//
+static bool imageUnpack(FILE *info, const char *imageFile, const char *fileName) {
+	const bool toStdout = !strcmp(fileName, "-");
+	FILE *file = NULL;
+	struct Image *img = imageOpen(imageFile);
+	uint64 lba = 0, numBlocks;
+	bool retVal = false;
+	if ( !img ) {
+		return false;
+	}
+	numBlocks = imageSectors(img);
+	if ( toStdout ) {
+		#ifdef WIN32
+			_setmode(_fileno(stdout), _O_BINARY);
+		#endif
+		file = stdout;
+	} else {
+		file = fopen(fileName, "wb");
+		if ( !file ) {
+			fprintf(stderr, "Unable to write to %s\n", fileName);
+			goto cleanup;
+		}
 	}
-	if ( status.isMultiple ) {
-		uint16 timeout = 0xFFFF;
-		while ( sendCommand(CMD_STOP_TRANSMISSION, 0) != TOKEN_SUCCESS && --timeout );
+	fprintf(info, "Unpacking %llu blocks from %s...\n", (unsigned long long)numBlocks, imageFile);
+	while ( lba < numBlocks ) {
+		const uint32 chunk = (numBlocks - lba < XFER_BLOCKS) ? (uint32)(numBlocks - lba) : XFER_BLOCKS;
+		if ( !imageRead(img, lba, buffer, chunk) ) {
+			goto cleanup;
+		}
+		if ( fwrite(buffer, BYTES_PER_SECTOR, chunk, file) != chunk ) {
+			fprintf(stderr, "Unable to write to %s\n", fileName);
+			goto cleanup;
+		}
+		lba += chunk;
+	}
+	retVal = true;
+cleanup:
+	if ( toStdout ) {
+		fflush(stdout);
+	} else if ( file ) {
+		fclose(file);
 	}
-	disable();
+	imageClose(img);
+	return retVal;
 }
 
-void sdTest(uint32 blkNum) {
-	uint16 i;
-	uint8 block[512];
-	printf("Reading SD card block 0x%08X...\n", blkNum);
-	sdReadSingleBlockBegin(blkNum);
-	waitFor(TOKEN_READ_SINGLE);
-	spiSendBlock(block);
-	sdReadBlocksEnd();
-	for ( i = 0; i < 512; i++ ) {
-		printf("%c", block[i]);
+// Write a file to consecutive blocks, zero-padding the last one. A single block is written with
+// CMD24, and anything bigger is streamed with one CMD25.
+//
+static bool sdWriteFile(FILE *info, const char *fileName, uint32 lba) {
+	FILE *file = fopen(fileName, "rb");
+	uint32 numBlocks, remaining;
+	long fileSize;
+	double startTime, elapsed;
+	bool retVal = false;
+	if ( !file ) {
+		fprintf(stderr, "Unable to read from %s\n", fileName);
+		return false;
 	}
-	sendClocks(2, 0xFF);  // Flush two CRC bytes
-	printf("\n");
+	fseek(file, 0, SEEK_END);
+	fileSize = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	numBlocks = (uint32)((fileSize + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR);
+	remaining = numBlocks;
+	fprintf(info, "Writing %u SD card blocks from 0x%08X...\n", numBlocks, lba);
+	startTime = wallTime();
+	if ( numBlocks == 1 ) {
+		memset(buffer, 0x00, BYTES_PER_SECTOR);
+		if ( fread(buffer, 1, BYTES_PER_SECTOR, file) != (size_t)fileSize ) {
+			fprintf(stderr, "Unable to read from %s\n", fileName);
+			goto cleanup;
+		}
+		if ( sdWriteSingleBlock(lba, buffer) != SD_SUCCESS ) {
+			goto cleanup;
+		}
+	} else if ( numBlocks ) {
+		if ( sdWriteMultipleBlocksBegin(lba) != SD_SUCCESS ) {
+			goto cleanup;
+		}
+		while ( remaining ) {
+			const uint32 chunk = (remaining < XFER_BLOCKS) ? remaining : XFER_BLOCKS;
+			const size_t bytesRead = fread(buffer, 1, chunk * BYTES_PER_SECTOR, file);
+			if ( bytesRead == 0 ) {
+				fprintf(stderr, "Unable to read from %s\n", fileName);
+				sdWriteBlocksEnd();
+				goto cleanup;
+			}
+			memset(buffer + bytesRead, 0x00, chunk * BYTES_PER_SECTOR - bytesRead);
+			if ( sdWriteBlocks(buffer, chunk) != SD_SUCCESS ) {
+				sdWriteBlocksEnd();
+				goto cleanup;
+			}
+			remaining -= chunk;
+		}
+		if ( sdWriteBlocksEnd() != SD_SUCCESS ) {
+			goto cleanup;
+		}
+	}
+	elapsed = wallTime() - startTime;
+	fprintf(
+		info, "Wrote %llu bytes in %.3fs (%.2f MB/s)\n",
+		(unsigned long long)numBlocks * BYTES_PER_SECTOR, elapsed,
+		(elapsed > 0.0) ? (double)numBlocks * BYTES_PER_SECTOR / elapsed / 1000000.0 : 0.0
+	);
+	retVal = true;
+cleanup:
+	fclose(file);
+	return retVal;
 }
 
 // Main stuff
+#define BENCH_BLOCKS 2048
 #define CHECK(x) if ( status != FL_SUCCESS ) { FAIL(x); }
 
 int main(int argc, const char *argv[]) {
@@ -317,13 +292,19 @@ int main(int argc, const char *argv[]) {
 	const char *error = NULL;
 	bool flag;
 	bool isNeroCapable, isCommCapable;
-	bool spiFast = false;
+	bool spiFast = false, negotiate = false, isAsync = false;
 	const char *vp = NULL, *ivp = NULL, *portConfig = NULL, *progConfig = NULL;
-	const char *blockStr = NULL;
+	const char *blockStr = NULL, *countStr = NULL, *outFile = NULL, *inFile = NULL;
+	const char *dividerStr = NULL, *benchFile = NULL, *selectStr = NULL;
+	const char *extractPath = NULL, *listPath = NULL;
+	const char *imageFile = NULL, *unpackFile = NULL, *workersStr = NULL, *traceFile = NULL;
+	uint32 numWorkers = 0;
+	uint8 divider;
 	uint32 blockNum = 0x00002672;
+	uint32 numBlocks = 1;
+	FILE *info = stdout;
 	const char *const prog = argv[0];
 
-	printf("SD-Card Hackery Example Copyright (C) 2013 Chris McClelland\n\n");
 	argv++;
 	argc--;
 	while ( argc ) {
@@ -351,9 +332,51 @@ int main(int argc, const char *argv[]) {
 		case 'f':
 			spiFast = true;
 			break;
+		case 'a':
+			negotiate = true;
+			break;
+		case 'A':
+			isAsync = true;
+			break;
+		case 'c':
+			GET_ARG("c", dividerStr, 6);
+			break;
 		case 'b':
 			GET_ARG("b", blockStr, 6);
 			break;
+		case 'n':
+			GET_ARG("n", countStr, 6);
+			break;
+		case 'o':
+			GET_ARG("o", outFile, 6);
+			break;
+		case 'w':
+			GET_ARG("w", inFile, 6);
+			break;
+		case 'B':
+			GET_ARG("B", benchFile, 6);
+			break;
+		case 'S':
+			GET_ARG("S", selectStr, 6);
+			break;
+		case 'x':
+			GET_ARG("x", extractPath, 6);
+			break;
+		case 'l':
+			GET_ARG("l", listPath, 6);
+			break;
+		case 'I':
+			GET_ARG("I", imageFile, 6);
+			break;
+		case 'j':
+			GET_ARG("j", workersStr, 6);
+			break;
+		case 'u':
+			GET_ARG("u", unpackFile, 6);
+			break;
+		case 'T':
+			GET_ARG("T", traceFile, 6);
+			break;
 		default:
 			invalid(prog, argv[0][1]);
 			FAIL(7);
@@ -361,40 +384,80 @@ int main(int argc, const char *argv[]) {
 		argv++;
 		argc--;
 	}
+
+	// When dumping to stdout, everything else goes to stderr
+	if ( (extractPath || unpackFile) && !outFile ) {
+		outFile = "-";
+	}
+	if ( (outFile && !strcmp(outFile, "-")) || (benchFile && !strcmp(benchFile, "-")) ) {
+		info = stderr;
+	}
+	fprintf(info, "SD-Card Hackery Example Copyright (C) 2013 Chris McClelland\n\n");
+	if ( unpackFile ) {
+		if ( !imageUnpack(info, unpackFile, outFile) ) {
+			FAIL(30);
+		}
+		FAIL(0);
+	}
+	if ( workersStr ) {
+		char *end;
+		const unsigned long n = strtoul(workersStr, &end, 10);
+		if ( end == workersStr || *end || !n || n > IMAGE_MAX_WORKERS ) {
+			fprintf(stderr, "The number of worker threads should be 1-%d\n", IMAGE_MAX_WORKERS);
+			FAIL(31);
+		}
+		numWorkers = (uint32)n;
+	}
+	if ( dividerStr ) {
+		char *end;
+		const unsigned long n = strtoul(dividerStr, &end, 0);
+		if ( end == dividerStr || *end || n > 255 ) {
+			fprintf(stderr, "The clock divider should be a number from 0 to 255\n");
+			FAIL(33);
+		}
+		divider = (uint8)n;
+	}
 	if ( !vp ) {
 		missing(prog, "v <VID:PID>");
 		FAIL(8);
 	}
+	if ( traceFile ) {
+		if ( !profTraceOpen(traceFile) ) {
+			fprintf(stderr, "Unable to write to %s\n", traceFile);
+			FAIL(32);
+		}
+		profName("sdread");
+	}
 
 	status = flInitialise(0, &error);
 	CHECK(9);
 	
-	printf("Attempting to open connection to FPGALink device %s...\n", vp);
+	fprintf(info, "Attempting to open connection to FPGALink device %s...\n", vp);
 	status = flOpen(vp, &handle, NULL);
 	if ( status ) {
 		if ( ivp ) {
 			int count = 60;
-			printf("Loading firmware into %s...\n", ivp);
+			fprintf(info, "Loading firmware into %s...\n", ivp);
 			status = flLoadStandardFirmware(ivp, vp, &error);
 			CHECK(10);
 			
-			printf("Awaiting renumeration");
+			fprintf(info, "Awaiting renumeration");
 			flSleep(1000);
 			do {
-				printf(".");
-				fflush(stdout);
+				fprintf(info, ".");
+				fflush(info);
 				status = flIsDeviceAvailable(vp, &flag, &error);
 				CHECK(11);
 				flSleep(100);
 				count--;
 			} while ( !flag && count );
-			printf("\n");
+			fprintf(info, "\n");
 			if ( !flag ) {
 				fprintf(stderr, "FPGALink device did not renumerate properly as %s\n", vp);
 				FAIL(12);
 			}
 			
-			printf("Attempting to open connection to FPGLink device %s again...\n", vp);
+			fprintf(info, "Attempting to open connection to FPGLink device %s again...\n", vp);
 			status = flOpen(vp, &handle, &error);
 			CHECK(13);
 		} else {
@@ -406,9 +469,23 @@ int main(int argc, const char *argv[]) {
 	if ( blockStr ) {
 		blockNum = strtoul(blockStr, NULL, 0);
 	}
+	if ( countStr ) {
+		numBlocks = strtoul(countStr, NULL, 0);
+	} else if ( benchFile ) {
+		numBlocks = BENCH_BLOCKS;
+	}
+	if ( selectStr ) {
+		char *end;
+		const unsigned long dev = strtoul(selectStr, &end, 10);
+		if ( end == selectStr || *end || dev >= SPI_MAX_DEVS ) {
+			fprintf(stderr, "The chip-select should be a number below %d\n", SPI_MAX_DEVS);
+			FAIL(26);
+		}
+		sdSetDevice((uint8)dev);
+	}
 
 	if ( portConfig ) {
-		printf("Configuring ports...\n");
+		fprintf(info, "Configuring ports...\n");
 		status = flPortConfig(handle, portConfig, &error);
 		CHECK(15);
 		flSleep(100);
@@ -417,7 +494,7 @@ int main(int argc, const char *argv[]) {
 	isNeroCapable = flIsNeroCapable(handle);
 	isCommCapable = flIsCommCapable(handle);
 	if ( progConfig ) {
-		printf("Executing programming configuration \"%s\"...\n", progConfig);
+		fprintf(info, "Executing programming configuration \"%s\"...\n", progConfig);
 		if ( isNeroCapable ) {
 			status = flProgram(handle, progConfig, NULL, &error);
 			CHECK(16);
@@ -429,29 +506,121 @@ int main(int argc, const char *argv[]) {
 	status = flFifoMode(handle, true, &error);
 	CHECK(18);
 
-	sdInit();
+	spiInit(handle, 0x00);
+	if ( isAsync && !spiSetAsync(true) ) {
+		fprintf(stderr, "Unable to start the USB I/O thread; carrying on without it\n");
+	}
+	if ( sdInit() != SD_SUCCESS ) {
+		status = spiStatus(&error);
+		CHECK(19);
+		fprintf(stderr, "SD-card initialisation failed\n");
+		FAIL(20);
+	}
+	fprintf(
+		info, "Found %s SD card%s\n", sdIsHighCapacity() ? "high-capacity" : "standard-capacity",
+		sdIsCrcOn() ? " (CRC checking on)" : "");
+	if ( dividerStr ) {
+		spiFast = true;
+		spiSetDivider(divider);
+	}
+	if ( negotiate ) {
+		spiFast = true;
+		if ( !(spiFeatures() & FEATURE_CLKDIV) ) {
+			fprintf(info, "FPGA has no clock divider; using the fixed fast clock\n");
+		} else if ( sdNegotiateClock(0, &divider) == SD_SUCCESS ) {
+			fprintf(info, "Fastest reliable clock divider is %d (sysClk/%d)\n", divider, 2 * (divider + 1));
+		} else {
+			status = spiStatus(&error);
+			CHECK(21);
+			fprintf(stderr, "Clock negotiation failed\n");
+			FAIL(24);
+		}
+	}
 	if ( spiFast ) {
-		fast();
+		spiConfig(TURBO, TURBO);
+	}
+	if ( benchFile ) {
+		if ( !sdBench(info, benchFile, blockNum, numBlocks) ) {
+			status = spiStatus(&error);
+			CHECK(21);
+			FAIL(25);
+		}
+	} else if ( inFile ) {
+		if ( !sdWriteFile(info, inFile, blockNum) ) {
+			status = spiStatus(&error);
+			CHECK(21);
+			FAIL(23);
+		}
+	} else if ( extractPath || listPath ) {
+		if ( !sdExtract(info, extractPath ? extractPath : listPath, outFile ? outFile : "-", !extractPath) ) {
+			status = spiStatus(&error);
+			CHECK(21);
+			FAIL(27);
+		}
+	} else if ( imageFile ) {
+		if ( !countStr ) {
+			if ( sdReadCapacity(&numBlocks) != SD_SUCCESS ) {
+				status = spiStatus(&error);
+				CHECK(21);
+				FAIL(28);
+			}
+		}
+		if ( !imageCapture(info, imageFile, numBlocks, numWorkers) ) {
+			status = spiStatus(&error);
+			CHECK(21);
+			FAIL(29);
+		}
+	} else if ( outFile ) {
+		if ( !sdDump(info, outFile, blockNum, numBlocks) ) {
+			status = spiStatus(&error);
+			CHECK(21);
+			FAIL(22);
+		}
+	} else {
+		sdCacheEnable(true);
+		sdTest(blockNum);
 	}
-	sdTest(blockNum);
+	status = spiStatus(&error);
+	CHECK(21);
 	
 cleanup:
 	if ( error ) {
 		fprintf(stderr, "%s\n", error);
 		flFreeError(error);
 	}
+	spiSetAsync(false);
+	profTraceClose();
 	flClose(handle);
 	return returnCode;
 }
 
 void usage(const char *prog) {
-	printf("Usage: %s [-h] [-i <VID:PID>] -v <VID:PID> [-p <progConfig>]\n\n", prog);
+	printf("Usage: %s [-h] [-i <VID:PID>] -v <VID:PID> [-p <progConfig>] [-f] [-c <divider> | -a] [-S <cs>] [-A]\n", prog);
+	printf("         [-b <block>] [-n <count> -o <file> | -w <file> | -n <count> -B <file>]\n");
+	printf("         [-x <path> [-o <file>] | -l <dir>] [-I <image> [-n <count>] [-j <threads>]]\n");
+	printf("         [-T <file>]\n");
+	printf("   or: %s -u <image> [-o <file>]\n\n", prog);
 	printf("Load FX2LP firmware, load the FPGA, interact with the FPGA.\n\n");
 	printf("  -i <VID:PID>    initial vendor and product ID of the FPGALink device\n");
 	printf("  -v <VID:PID>    renumerated vendor and product ID of the FPGALink device\n");
 	printf("  -d <portConfig> configure the ports\n");
 	printf("  -p <progConfig> configuration and programming file\n");
 	printf("  -f              enable fast SPI\n");
+	printf("  -c <divider>    fast SPI at sysClk/(2*(divider+1)); implies -f\n");
+	printf("  -a              find the fastest reliable SPI clock; implies -f\n");
+	printf("  -S <cs>         chip-select of the SD card (default 0)\n");
+	printf("  -A              do USB I/O on a separate thread, overlapping it with host work\n");
 	printf("  -b <block>      block to read from SD card\n");
+	printf("  -n <count>      number of blocks to read (with -o)\n");
+	printf("  -o <file>       write raw blocks to a file (\"-\" for stdout)\n");
+	printf("  -w <file>       write a file to the SD card, starting at the -b block\n");
+	printf("  -B <file>       benchmark -n blocks (default %d) from the -b block, rewriting them with\n", BENCH_BLOCKS);
+	printf("                  their own contents, and write the results as JSON (\"-\" for stdout)\n");
+	printf("  -x <path>       copy a file out of the card's FAT32 or exFAT filesystem (to -o, or stdout)\n");
+	printf("  -l <dir>        list a directory of the card's filesystem (\"/\" for the root)\n");
+	printf("  -I <image>      image the whole card (or -n blocks) to a sparse, compressed image file\n");
+	printf("  -j <threads>    compress the image on this many threads (default one per CPU, max %d)\n", IMAGE_MAX_WORKERS);
+	printf("  -u <image>      unpack an image made with -I into a raw card image (to -o, or stdout)\n");
+	printf("  -T <file>       trace every USB transaction, poll and SD command to a Chrome/Perfetto trace\n");
 	printf("  -h              print this help and exit\n");
 }
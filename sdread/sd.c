@@ -0,0 +1,1184 @@
+/*
+ * Copyright (C) 2013 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "spi.h"
+#include "prof.h"
+#include "sd.h"
+
+#define TOKEN_SUCCESS             0x00
+#define TOKEN_READ_CAPACITY       0xFE
+#define TOKEN_READ_SINGLE         0xFE
+#define TOKEN_READ_MULTIPLE       0xFE
+#define TOKEN_WRITE_SINGLE        0xFE
+#define TOKEN_WRITE_MULTIPLE      0xFC
+#define TOKEN_WRITE_FINISH        0xFD
+#define IN_IDLE_STATE             (1<<0)
+#define ERASE_RESET               (1<<1)
+#define ILLEGAL_COMMAND           (1<<2)
+#define COMMAND_CRC_ERROR         (1<<3)
+#define ERASE_SEQUENCE_ERROR      (1<<4)
+#define ADDRESS_ERROR             (1<<5)
+#define PARAMETER_ERROR           (1<<6)
+
+#define CMD_GO_IDLE_STATE         0
+#define CMD_SEND_OP_COND          1
+#define CMD_SEND_IF_COND          8
+#define CMD_SEND_CSD              9
+#define CMD_STOP_TRANSMISSION     12
+#define CMD_SET_BLOCKLEN          16
+#define CMD_READ_SINGLE_BLOCK     17
+#define CMD_READ_MULTIPLE_BLOCKS  18
+#define CMD_WRITE_SINGLE_BLOCK    24
+#define CMD_WRITE_MULTIPLE_BLOCKS 25
+#define CMD_APP_SEND_OP_COND      41
+#define CMD_APP_CMD               55
+#define CMD_READ_OCR              58
+#define CMD_CRC_ON_OFF            59
+
+#define IF_COND_CHECK             0x000001AA  // 2.7-3.6V, check pattern 0xAA
+#define ACMD41_HCS                (1UL<<30)   // host supports high-capacity cards
+#define OCR_CCS                   0x40        // (in the top byte) card is high-capacity
+#define OCR_BUSY                  0x80        // (in the top byte) power-up complete
+
+#define DATA_RESPONSE_MASK        0x1F
+#define DATA_ACCEPTED             0x05
+
+#define SD_RETCODE_SUCCESS             0x00
+#define SD_RETCODE_NOT_IDLE            1
+#define SD_RETCODE_ERROR_INIT          2
+#define SD_RETCODE_ERROR_READ          3
+#define SD_RETCODE_ERROR_NO_DATA       4
+#define SD_RETCODE_ERROR_READ_CAPACITY 5
+#define SD_RETCODE_ERROR_WRITE         6
+#define SD_RETCODE_ERROR_NOT_READY     7
+
+// The card may be on any of the FPGA's chip-selects, so long as nothing else is selected whilst
+// it's in use.
+//
+static uint8 chipSelect = CHIPSEL;
+
+void sdSetDevice(uint8 dev) {
+	chipSelect = (uint8)CHIPSEL_DEV(dev);
+}
+
+static inline void enable(void) {
+	spiConfig(CHIPSEL_MASK, chipSelect);
+}
+
+static inline void disable(void) {
+	spiConfig(CHIPSEL_MASK, 0x00);
+}
+
+static inline void slow(void) {
+	spiConfig(TURBO, 0x00);
+}
+
+// High-capacity (SDHC/SDXC) cards take block addresses, and standard-capacity ones byte addresses.
+//
+static bool isHighCapacity = false;
+
+static inline uint32 address(uint32 lba) {
+	return isHighCapacity ? lba : lba << LOG2_BYTES_PER_SECTOR;
+}
+
+// If the FPGA has the CRC engine, CMD59 makes the card check the CRC of every command and data
+// block, and the FPGA checks the CRC of every data block coming back. The engine is only enabled
+// for the duration of each data transfer.
+//
+static bool isCrcOn = false;
+
+static inline void crcMode(uint8 mode) {
+	if ( isCrcOn ) {
+		spiCrc(mode, NULL);
+	}
+}
+
+// With the cache on (see sdCacheEnable()), reads go through a least-recently-used set of sectors,
+// and a read begin just sets the cursor, from which the byte accessors and sdReadBlocks() carry on.
+// Anything not already cached is fetched as it is needed, in a single-block read or, when the card
+// is being read sequentially, a multiple-block read of the next readahead sectors. The readahead
+// starts at one sector, doubles for each miss which carries on from the last fetch (allowing for
+// sectors skipped over without being read), and drops back to one for any other miss. The first
+// error is kept for sdReadBlocksEnd().
+//
+#define CACHE_SECTORS  64
+#define READAHEAD_MAX  32
+
+struct CachedSector {
+	uint32 lba;
+	uint32 lastUsed;  // zero if the entry is empty
+	uint8 data[BYTES_PER_SECTOR];
+};
+
+static struct {
+	bool isOn;
+	uint32 clock;
+	struct CachedSector sectors[CACHE_SECTORS];
+	struct CachedSector *current;  // the sector under the cursor, if it is cached
+	uint32 lba;                    // the cursor
+	uint16 offset;
+	uint8 returnCode;
+	uint32 nextFetch;              // the sector after the last one fetched
+	uint32 readahead;
+} cache;
+
+static void cacheClear(void) {
+	uint32 i;
+	for ( i = 0; i < CACHE_SECTORS; i++ ) {
+		cache.sectors[i].lastUsed = 0;
+	}
+	cache.current = NULL;
+	cache.nextFetch = 0xFFFFFFFF;
+	cache.readahead = 1;
+}
+
+static inline uint8 waitFor(uint8 response) {
+	uint8 byte;
+	spiWaitFor(0xFF, response, 0xFFFF, &byte);
+	return byte;
+}
+
+static void sendClocks(uint8 numClocks, uint8 byte) {
+	spiFill(byte, numClocks, NULL);
+}
+
+// CRC7 of a command, in the form it is sent: shifted left, with the end bit set.
+//
+static uint8 crc7(const uint8 *data, uint32 count) {
+	uint8 crc = 0x00, byte, i;
+	while ( count-- ) {
+		byte = *data++;
+		for ( i = 0; i < 8; i++ ) {
+			crc = (uint8)(crc << 1);
+			if ( (byte ^ crc) & 0x80 ) {
+				crc ^= 0x09;
+			}
+			byte = (uint8)(byte << 1);
+		}
+	}
+	return (uint8)((crc << 1) | 0x01);
+}
+
+// The command, its CRC and the first response byte (which is always ignored) are queued, and the
+// R1 response is found by scanning the response stream for a byte with its top bit clear, so
+// the whole command normally costs one write and one read. Any bytes following R1 (as in R3 and
+// R7 responses) are left in the response stream, for spiRecv().
+//
+static uint8 sendCommand(uint8 command, uint32 param) {
+	const uint64 start = profNow();
+	uint8 buf[7];
+	uint8 response;
+	buf[0] = 0xFF;  // dummy byte
+	buf[1] = command | 0x40;
+	buf[2] = (uint8)(param>>24);
+	buf[3] = (uint8)(param>>16);
+	buf[4] = (uint8)(param>>8);
+	buf[5] = (uint8)param;
+	buf[6] = crc7(buf + 1, 5);  // only CMD0 and CMD8 need a valid CRC unless CMD59 enabled checking
+	spiQueue(buf, 7, NULL);
+	sendClocks(1, 0xFF);  // ignore return byte
+	spiWaitFor(0x80, 0x00, 0xFFFF, &response);
+	profRecord(PROF_SD_COMMAND, start, command);
+	return response;
+}
+
+uint8 sdInit(void) {
+	uint16 i;
+	uint8 returnCode;
+	uint8 r7[4], ocr[4];
+	bool isVersion2;
+
+	cacheClear();
+	
+	// Setup SPI @ 400kHz, deassert CS
+	//
+	disable();
+	slow();
+	
+	// Enable SPI; set as master; select Fosc/64 (250kHz). For initialization,
+	// the clock has to be between 100kHz and 400kHz
+	//
+	//SPCR = (1<<MSTR) | (1<<SPE) | (3<<SPR0);
+	//SPSR = (1<<SPI2X);
+	
+	// Hold CS high and send 256 clocks (1.024ms @250kHz) with DI low while card power stabilizes
+	//
+	sendClocks(32, 0x00);
+	
+	// Hold CS high and send 80 clocks (0.32ms @250kHz) with DI high to get the card ready to accept commands
+	//
+	sendClocks(10, 0xFF);
+	
+	// Bring CS low and send CMD0 to reset and put the card in SPI mode
+	//
+	enable();
+	if ( sendCommand(CMD_GO_IDLE_STATE, 0) != IN_IDLE_STATE ) {
+		sendClocks(2, 0xFF);
+		disable();
+		return SD_INIT_NOT_IDLE_ERROR;
+	}
+	
+	// Send CMD8 to check the voltage range. Version 1.x cards (and MMC) reject it; version 2.0 and
+	// later cards echo the argument back in an R7 response.
+	//
+	isHighCapacity = false;
+	returnCode = sendCommand(CMD_SEND_IF_COND, IF_COND_CHECK);
+	isVersion2 = !(returnCode & ILLEGAL_COMMAND);
+	if ( isVersion2 ) {
+		spiRecv(r7, 4);
+		if ( (r7[2] & 0x0F) != (uint8)(IF_COND_CHECK >> 8) || r7[3] != (uint8)IF_COND_CHECK ) {
+			sendClocks(2, 0xFF);
+			disable();
+			return SD_INIT_VOLTAGE_ERROR;
+		}
+	}
+	
+	// Tell the card to initialize itself with ACMD41, saying we support high-capacity cards if the
+	// card understood CMD8. Cards which don't understand ACMD41 (i.e MMC) need CMD1 instead.
+	//
+	i = 0xFFFF;
+	do {
+		sendCommand(CMD_APP_CMD, 0);
+		returnCode = sendCommand(CMD_APP_SEND_OP_COND, isVersion2 ? ACMD41_HCS : 0);
+	} while ( returnCode == IN_IDLE_STATE && --i );
+	if ( returnCode & ILLEGAL_COMMAND ) {
+		i = 0xFFFF;
+		do {
+			returnCode = sendCommand(CMD_SEND_OP_COND, 0);
+		} while ( returnCode != TOKEN_SUCCESS && --i );
+	}
+	if ( i == 0x0000 || returnCode != TOKEN_SUCCESS ) {
+		sendClocks(2, 0xFF);
+		disable();
+		return SD_INIT_TIMEOUT_ERROR;
+	}
+	
+	// A version 2.0 card might be high-capacity: read the OCR to find out. Otherwise make sure the
+	// block length is 512 bytes.
+	//
+	if ( isVersion2 ) {
+		sendCommand(CMD_READ_OCR, 0);
+		spiRecv(ocr, 4);
+		isHighCapacity = (ocr[0] & (OCR_BUSY | OCR_CCS)) == (OCR_BUSY | OCR_CCS);
+	}
+	if ( !isHighCapacity ) {
+		sendCommand(CMD_SET_BLOCKLEN, BYTES_PER_SECTOR);
+	}
+
+	// If the FPGA can check and generate data CRCs, turn on CRC checking in the card too
+	//
+	isCrcOn = false;
+	if ( spiFeatures() & FEATURE_CRC ) {
+		isCrcOn = sendCommand(CMD_CRC_ON_OFF, 1) == TOKEN_SUCCESS;
+	}
+	
+	sendClocks(2, 0xFF);
+	disable();
+
+	// Enable 24MHz SPI mode
+	//fast();
+	return SD_SUCCESS;
+}
+
+static struct SdStatus {
+	unsigned reserved      : 16 - LOG2_BYTES_PER_SECTOR - 1;
+	unsigned isMultiple    : 1;
+	unsigned currentOffset : LOG2_BYTES_PER_SECTOR;
+} status = {0, 0, 0};
+
+// The next block of a multiple-block read, and the number of blocks beyond those already returned
+// which the FPGA has found good. With CRC checking on, a single block is read whole, and checked,
+// before any of it is returned.
+//
+static struct {
+	uint32 blockNum;
+	uint32 checked;
+	uint32 first;         // where the read began, and when
+	uint64 start;
+	bool isBuffered;
+	uint8 block[BYTES_PER_SECTOR];
+} readStatus;
+
+// Read (or if buffer is NULL, skip) bytes from the current block(s). Within a sector the bytes
+// are fetched from the response stream in bulk; the data token is awaited at the start of each
+// sector, and the two CRC bytes are consumed at the end.
+//
+static void getBytes(uint8 *buffer, uint16 numBytes) {
+	uint8 scratch[BYTES_PER_SECTOR];
+	if ( readStatus.isBuffered ) {
+		if ( buffer ) {
+			memcpy(buffer, readStatus.block + status.currentOffset, numBytes);
+		}
+		status.currentOffset += numBytes;
+		return;
+	}
+	while ( numBytes ) {
+		uint16 chunk = (uint16)(BYTES_PER_SECTOR - status.currentOffset);
+		if ( chunk > numBytes ) {
+			chunk = numBytes;
+		}
+		if ( !status.currentOffset ) {
+			waitFor(status.isMultiple ? TOKEN_READ_MULTIPLE : TOKEN_READ_SINGLE);
+		}
+		if ( buffer ) {
+			spiRecv(buffer, chunk);
+			buffer += chunk;
+		} else {
+			spiRecv(scratch, chunk);
+		}
+		status.currentOffset += chunk;
+		if ( !status.currentOffset ) {
+			spiRecv(scratch, 2);  // Flush two CRC bytes
+		}
+		numBytes = (uint16)(numBytes - chunk);
+	}
+}
+
+static uint8 singleCommand(uint32 lba) {
+	uint16 timeout;
+	uint8 returnCode;
+
+	crcMode(CRC_RX);
+	enable();
+	// Send read single block command and Logical Block Address
+	//
+	timeout = 0xFFFF;
+	while ( (returnCode = sendCommand(CMD_READ_SINGLE_BLOCK, address(lba))) != TOKEN_SUCCESS && --timeout );
+	if ( !timeout ) {
+		sendClocks(2, 0xFF);
+		disable();
+		crcMode(0x00);
+		fprintf(
+			stderr, "sdReadSingleBlockBegin() encountered SD_READBLOCK_CMD_ERROR {\n  lba=0x%08X\n  returnCode=0x%02X\n}\n",
+			lba, returnCode
+		);
+		return SD_READBLOCK_CMD_ERROR;
+	}
+	status.currentOffset = 0;
+	status.isMultiple = 0;
+	return SD_SUCCESS;
+}
+
+// With CRC checking on, the block is clocked in and checked before it is returned, and read again
+// if it was bad.
+//
+#define CRC_RETRIES 3
+
+static uint8 readSingleBegin(uint32 lba) {
+	uint8 returnCode, report[2];
+	uint32 attempt = 0;
+	readStatus.start = profNow();
+	readStatus.isBuffered = false;
+	returnCode = singleCommand(lba);
+	while ( returnCode == SD_SUCCESS && isCrcOn ) {
+		getBytes(readStatus.block, BYTES_PER_SECTOR);
+		sendClocks(2, 0xFF);
+		disable();
+		spiCrc(CRC_REPORT, report);
+		if ( spiFlush() ) {
+			return SD_READBLOCK_DATA_ERROR;
+		}
+		if ( report[0] == 1 && !report[1] ) {
+			readStatus.isBuffered = true;
+			break;
+		}
+		if ( attempt++ == CRC_RETRIES ) {
+			fprintf(
+				stderr, "sdReadSingleBlockBegin() gave up after %d retries {\n  lba=0x%08X\n}\n", CRC_RETRIES, lba);
+			return SD_READBLOCK_CRC_ERROR;
+		}
+		returnCode = singleCommand(lba);
+	}
+	return returnCode;
+}
+
+static uint8 readMultipleBegin(uint32 lba) {
+	uint16 timeout;
+
+	readStatus.start = profNow();
+	crcMode(CRC_RX);
+	enable();
+	// Send read multiple blocks command and Logical Block Address
+	//
+	timeout = 0xFFFF;
+	while ( sendCommand(CMD_READ_MULTIPLE_BLOCKS, address(lba)) != TOKEN_SUCCESS && --timeout );
+	if ( timeout == 0x0000 ) {
+		sendClocks(2, 0xFF);
+		disable();
+		crcMode(0x00);
+		fprintf(stderr, "sdReadMultipleBlocksBegin() encountered SD_READBLOCK_CMD_ERROR!\n");
+		return SD_READBLOCK_CMD_ERROR;
+	}
+	status.currentOffset = 0;
+	status.isMultiple = 1;
+	readStatus.blockNum = lba;
+	readStatus.first = lba;
+	readStatus.checked = 0;
+	return SD_SUCCESS;
+}
+
+// Read whole blocks from a multiple-block read, starting at a block boundary. The response
+// stream is clocked in FIFO-sized batches and parsed in place: the gap before each block, its
+// data token and its CRC are stripped out, and only the data is copied. Each batch is clocked in
+// whilst the one before it is parsed, so long as the remaining blocks need it.
+//
+#define BLOCK_BYTES (1 + BYTES_PER_SECTOR + 2)  // data token, data and CRC
+
+static uint8 readBlocks(uint8 *buffer, uint32 numBlocks, uint32 *numRead) {
+	const uint8 *data;
+	uint32 count, i, needed;
+	uint32 gap = 0;
+	uint16 crcBytes = 0;
+	bool inBlock = false;
+	*numRead = 0;
+	while ( numBlocks ) {
+		needed = numBlocks * BLOCK_BYTES;
+		if ( crcBytes ) {
+			needed -= BLOCK_BYTES - crcBytes;
+		} else if ( inBlock ) {
+			needed -= 1 + status.currentOffset;
+		}
+		if ( spiPeekAhead(spiBatchMax(), needed, &data, &count) ) {
+			return SD_READBLOCK_DATA_ERROR;
+		}
+		i = 0;
+		while ( i < count && numBlocks ) {
+			if ( crcBytes ) {
+				// Skip CRC
+				i++;
+				if ( !--crcBytes ) {
+					numBlocks--;
+					(*numRead)++;
+				}
+			} else if ( inBlock ) {
+				// Copy data
+				uint32 chunk = BYTES_PER_SECTOR - status.currentOffset;
+				if ( chunk > count - i ) {
+					chunk = count - i;
+				}
+				memcpy(buffer, data + i, chunk);
+				buffer += chunk;
+				i += chunk;
+				status.currentOffset += chunk;
+				if ( !status.currentOffset ) {
+					inBlock = false;
+					crcBytes = 2;
+				}
+			} else if ( data[i] == TOKEN_READ_MULTIPLE ) {
+				i++;
+				inBlock = true;
+				gap = 0;
+			} else if ( data[i] != 0xFF || ++gap == 0xFFFF ) {
+				// Data error token, or timeout
+				spiConsume(i + 1);
+				fprintf(stderr, "sdReadBlocks() encountered SD_READBLOCK_DATA_ERROR {\n  token=0x%02X\n}\n", data[i]);
+				return SD_READBLOCK_DATA_ERROR;
+			} else {
+				i++;
+			}
+		}
+		spiConsume(i);
+	}
+	return SD_SUCCESS;
+}
+
+// With CRC checking on, the FPGA has checked each block as it was clocked in, so all that is left
+// is to fetch the counts, which costs one more round trip per call. The good count stops at the
+// first bad block, so the blocks before it are kept, and the read is restarted there. It is also
+// restarted where the engine lost count (as if a token went unnoticed) or a token was garbled. A
+// bad block among those clocked in ahead is counted now rather than when it is read, so the read
+// is restarted after this call's blocks. Each block gets CRC_RETRIES retries.
+//
+static void stopTransmission(void) {
+	uint16 timeout = 0xFFFF;
+	while ( sendCommand(CMD_STOP_TRANSMISSION, 0) != TOKEN_SUCCESS && --timeout );
+	waitFor(0xFF);  // R1b: wait until no longer busy
+	sendClocks(2, 0xFF);
+	disable();
+	crcMode(0x00);
+}
+
+static uint8 restartAt(uint32 lba) {
+	const uint32 first = readStatus.first;
+	const uint64 start = readStatus.start;
+	uint8 returnCode;
+	stopTransmission();
+	returnCode = readMultipleBegin(lba);
+	readStatus.first = first;
+	readStatus.start = start;
+	return returnCode;
+}
+
+static uint8 readBlocksChecked(uint8 *buffer, uint32 numBlocks) {
+	uint8 returnCode, report[2];
+	uint32 attempt = 0, numRead, good;
+	for ( ; ; ) {
+		returnCode = readBlocks(buffer, numBlocks, &numRead);
+		if ( !isCrcOn ) {
+			break;
+		}
+		spiCrc(CRC_RX | CRC_REPORT, report);
+		if ( spiFlush() ) {
+			return SD_READBLOCK_DATA_ERROR;
+		}
+		good = readStatus.checked + report[0];  // in a row from readStatus.blockNum
+		if ( returnCode == SD_SUCCESS && good >= numBlocks ) {
+			readStatus.blockNum += numBlocks;
+			readStatus.checked = good - numBlocks;
+			if ( report[1] ) {
+				return restartAt(readStatus.blockNum);
+			}
+			return SD_SUCCESS;
+		}
+		if ( good > numRead ) {
+			good = numRead;
+		}
+		if ( good ) {
+			buffer += good * BYTES_PER_SECTOR;
+			readStatus.blockNum += good;
+			numBlocks -= good;
+			attempt = 0;
+		}
+		if ( returnCode == SD_SUCCESS ) {
+			returnCode = SD_READBLOCK_CRC_ERROR;
+		}
+		if ( attempt++ == CRC_RETRIES ) {
+			fprintf(
+				stderr, "sdReadBlocks() gave up after %d retries {\n  lba=0x%08X\n  returnCode=%d\n}\n",
+				CRC_RETRIES, readStatus.blockNum, returnCode
+			);
+			return returnCode;
+		}
+		returnCode = restartAt(readStatus.blockNum);
+		if ( returnCode != SD_SUCCESS ) {
+			return returnCode;
+		}
+	}
+	if ( returnCode == SD_SUCCESS ) {
+		readStatus.blockNum += numBlocks;
+	}
+	return returnCode;
+}
+
+// The FPGA's block counts are only eight bits wide, so with CRC checking on, long reads are checked
+// in pieces, leaving room in the count for the blocks clocked in ahead of each.
+//
+#define CRC_MAX_BLOCKS 128
+
+static uint8 readBlocksAll(uint8 *buffer, uint32 numBlocks) {
+	uint8 returnCode = SD_SUCCESS;
+	while ( numBlocks && returnCode == SD_SUCCESS ) {
+		const uint32 chunk = (isCrcOn && numBlocks > CRC_MAX_BLOCKS) ? CRC_MAX_BLOCKS : numBlocks;
+		returnCode = readBlocksChecked(buffer, chunk);
+		buffer += chunk * BYTES_PER_SECTOR;
+		numBlocks -= chunk;
+	}
+	return returnCode;
+}
+
+static uint8 readEnd(void) {
+	if ( readStatus.isBuffered ) {
+		readStatus.isBuffered = false;
+		profRecord(PROF_BLOCK_READ, readStatus.start, 1);
+		return SD_SUCCESS;
+	}
+	if ( status.currentOffset ) {
+		getBytes(NULL, (uint16)(BYTES_PER_SECTOR - status.currentOffset));
+	}
+	if ( status.isMultiple ) {
+		stopTransmission();
+		profRecord(PROF_BLOCK_READ, readStatus.start, readStatus.blockNum - readStatus.first);
+		return SD_SUCCESS;
+	}
+	sendClocks(2, 0xFF);
+	disable();
+	profRecord(PROF_BLOCK_READ, readStatus.start, 1);
+	return SD_SUCCESS;
+}
+
+static struct CachedSector *cacheFind(uint32 lba) {
+	uint32 i;
+	for ( i = 0; i < CACHE_SECTORS; i++ ) {
+		if ( cache.sectors[i].lastUsed && cache.sectors[i].lba == lba ) {
+			cache.sectors[i].lastUsed = ++cache.clock;
+			return cache.sectors + i;
+		}
+	}
+	return NULL;
+}
+
+static struct CachedSector *cacheVictim(void) {
+	struct CachedSector *victim = cache.sectors;
+	uint32 i;
+	for ( i = 1; i < CACHE_SECTORS && victim->lastUsed; i++ ) {
+		if ( cache.sectors[i].lastUsed < victim->lastUsed ) {
+			victim = cache.sectors + i;
+		}
+	}
+	return victim;
+}
+
+static void cacheInvalidate(uint32 lba, uint32 numBlocks) {
+	uint32 i;
+	for ( i = 0; i < CACHE_SECTORS; i++ ) {
+		if ( cache.sectors[i].lba - lba < numBlocks ) {
+			cache.sectors[i].lastUsed = 0;
+		}
+	}
+	cache.current = NULL;
+}
+
+// Read numBlocks sectors from the card: one with CMD17, more with CMD18.
+//
+static uint8 fetch(uint32 lba, uint8 *buffer, uint32 numBlocks) {
+	uint8 returnCode;
+	if ( numBlocks == 1 ) {
+		returnCode = readSingleBegin(lba);
+		if ( returnCode == SD_SUCCESS ) {
+			getBytes(buffer, BYTES_PER_SECTOR);
+			returnCode = readEnd();
+		}
+	} else {
+		returnCode = readMultipleBegin(lba);
+		if ( returnCode == SD_SUCCESS ) {
+			returnCode = readBlocksAll(buffer, numBlocks);
+			stopTransmission();
+			profRecord(PROF_BLOCK_READ, readStatus.start, numBlocks);
+		}
+	}
+	return returnCode;
+}
+
+// Fetch the sector under the cursor into the cache, along with as many of the following sectors as
+// the readahead allows, stopping at the first which is already cached. A failed readahead is
+// retried as a single block, in case it was only the sectors beyond which couldn't be read (e.g.
+// past the end of the card).
+//
+static struct CachedSector *cacheMiss(void) {
+	static uint8 burst[READAHEAD_MAX * BYTES_PER_SECTOR];
+	struct CachedSector *sector = NULL;
+	uint32 count, i;
+	uint8 returnCode;
+	if ( cache.lba - cache.nextFetch < cache.readahead ) {
+		cache.readahead = (cache.readahead < READAHEAD_MAX) ? 2 * cache.readahead : READAHEAD_MAX;
+	} else {
+		cache.readahead = 1;
+	}
+	for ( count = 1; count < cache.readahead && !cacheFind(cache.lba + count); count++ );
+	returnCode = fetch(cache.lba, burst, count);
+	if ( returnCode != SD_SUCCESS && count > 1 ) {
+		count = 1;
+		returnCode = fetch(cache.lba, burst, count);
+	}
+	if ( spiStatus(NULL) && returnCode == SD_SUCCESS ) {
+		returnCode = SD_READBLOCK_DATA_ERROR;
+	}
+	if ( returnCode != SD_SUCCESS ) {
+		if ( cache.returnCode == SD_SUCCESS ) {
+			cache.returnCode = returnCode;
+		}
+		cache.readahead = 1;
+		return NULL;
+	}
+	cache.nextFetch = cache.lba + count;
+	for ( i = count; i--; ) {
+		sector = cacheVictim();
+		sector->lba = cache.lba + i;
+		sector->lastUsed = ++cache.clock;
+		memcpy(sector->data, burst + i * BYTES_PER_SECTOR, BYTES_PER_SECTOR);
+	}
+	return sector;
+}
+
+// Copy (or if buffer is NULL, skip) bytes from the cursor, fetching sectors only when bytes are
+// actually wanted from them. Bytes which can't be read are returned as FF.
+//
+static void cacheGetBytes(uint8 *buffer, uint16 numBytes) {
+	while ( numBytes ) {
+		uint16 chunk = (uint16)(BYTES_PER_SECTOR - cache.offset);
+		if ( chunk > numBytes ) {
+			chunk = numBytes;
+		}
+		if ( buffer ) {
+			if ( !cache.current ) {
+				cache.current = cacheFind(cache.lba);
+				if ( !cache.current ) {
+					cache.current = cacheMiss();
+				}
+			}
+			if ( cache.current ) {
+				memcpy(buffer, cache.current->data + cache.offset, chunk);
+			} else {
+				memset(buffer, 0xFF, chunk);
+			}
+			buffer += chunk;
+		}
+		cache.offset = (uint16)(cache.offset + chunk);
+		if ( cache.offset == BYTES_PER_SECTOR ) {
+			cache.offset = 0;
+			cache.lba++;
+			cache.current = NULL;
+		}
+		numBytes = (uint16)(numBytes - chunk);
+	}
+}
+
+// Whole blocks from the cursor: those already cached are copied, and each run of those which aren't
+// is read straight into the buffer, without displacing what is cached.
+//
+static uint8 cacheReadBlocks(uint8 *buffer, uint32 numBlocks) {
+	const struct CachedSector *sector;
+	uint32 count;
+	uint8 returnCode;
+	while ( numBlocks ) {
+		sector = cacheFind(cache.lba);
+		if ( sector ) {
+			memcpy(buffer, sector->data, BYTES_PER_SECTOR);
+			count = 1;
+		} else {
+			for ( count = 1; count < numBlocks && !cacheFind(cache.lba + count); count++ );
+			returnCode = fetch(cache.lba, buffer, count);
+			if ( returnCode != SD_SUCCESS ) {
+				if ( cache.returnCode == SD_SUCCESS ) {
+					cache.returnCode = returnCode;
+				}
+				return returnCode;
+			}
+			cache.nextFetch = cache.lba + count;
+		}
+		buffer += count * BYTES_PER_SECTOR;
+		cache.lba += count;
+		numBlocks -= count;
+	}
+	cache.current = NULL;
+	return SD_SUCCESS;
+}
+
+static uint8 cacheBegin(uint32 lba) {
+	cache.lba = lba;
+	cache.offset = 0;
+	cache.current = NULL;
+	cache.returnCode = SD_SUCCESS;
+	return SD_SUCCESS;
+}
+
+// Writes drop the sectors they overwrite even with the cache off, so it can be turned off for a
+// bulk transfer and back on again without losing what it holds.
+//
+void sdCacheEnable(bool enable) {
+	cache.isOn = enable;
+	cache.current = NULL;
+}
+
+uint8 sdReadSingleBlockBegin(uint32 lba) {
+	return cache.isOn ? cacheBegin(lba) : readSingleBegin(lba);
+}
+
+uint8 sdReadMultipleBlocksBegin(uint32 lba) {
+	return cache.isOn ? cacheBegin(lba) : readMultipleBegin(lba);
+}
+
+uint8 sdReadBlocks(uint8 *buffer, uint32 numBlocks) {
+	return cache.isOn ? cacheReadBlocks(buffer, numBlocks) : readBlocksAll(buffer, numBlocks);
+}
+
+void sdGetBytes(uint8 *buffer, uint16 numBytes) {
+	if ( cache.isOn ) {
+		cacheGetBytes(buffer, numBytes);
+	} else {
+		getBytes(buffer, numBytes);
+	}
+}
+
+uint8 sdGetByte(void) {
+	uint8 byte;
+	if ( cache.current && cache.offset < BYTES_PER_SECTOR - 1 ) {
+		return cache.current->data[cache.offset++];  // the common case, with no call
+	}
+	sdGetBytes(&byte, 1);
+	return byte;
+}
+
+void sdSkip(uint16 numBytes) {
+	sdGetBytes(NULL, numBytes);
+}
+
+uint16 sdGetWord(void) {
+	uint8 buf[2];
+	sdGetBytes(buf, 2);
+	return (uint16)(buf[0] + (buf[1] << 8));
+}
+
+uint32 sdGetLong(void) {
+	uint8 buf[4];
+	sdGetBytes(buf, 4);
+	return (uint32)buf[0] + ((uint32)buf[1] << 8) + ((uint32)buf[2] << 16) + ((uint32)buf[3] << 24);
+}
+
+uint8 sdReadBlocksEnd(void) {
+	if ( cache.isOn ) {
+		const uint8 returnCode = cache.returnCode;
+		cache.returnCode = SD_SUCCESS;
+		cache.current = NULL;
+		return returnCode;
+	}
+	return readEnd();
+}
+
+// Scattered reads: the blocks are sorted, and those close enough together are read as one run with
+// a single command, reading through gaps of up to SCATTER_GAP blocks, since clocking a few unwanted
+// blocks across costs less than the round trips of another command. Each run is read into runBuf
+// and its blocks are copied out to wherever the caller wants them. With the cache on, blocks it
+// holds are copied from it instead.
+//
+#define SCATTER_GAP      16
+#define SCATTER_RUN_MAX  64
+
+struct ScatterRequest {
+	uint32 lba;
+	uint32 index;         // where it goes in the caller's buffer
+};
+
+static int scatterCompare(const void *a, const void *b) {
+	const struct ScatterRequest *const x = (const struct ScatterRequest *)a;
+	const struct ScatterRequest *const y = (const struct ScatterRequest *)b;
+	if ( x->lba != y->lba ) {
+		return (x->lba < y->lba) ? -1 : 1;
+	}
+	return (x->index < y->index) ? -1 : (x->index > y->index);
+}
+
+uint8 sdReadScattered(const uint32 *lbas, uint32 numLbas, uint8 *buffer, uint32 *numRuns) {
+	static uint8 runBuf[SCATTER_RUN_MAX * BYTES_PER_SECTOR];
+	struct ScatterRequest *requests;
+	const struct CachedSector *sector;
+	uint32 numRequests = 0, runs = 0, first, last, i, j;
+	uint8 returnCode = SD_SUCCESS;
+	requests = (struct ScatterRequest *)malloc((numLbas ? numLbas : 1) * sizeof(struct ScatterRequest));
+	if ( !requests ) {
+		return SD_READBLOCK_CMD_ERROR;
+	}
+	for ( i = 0; i < numLbas; i++ ) {
+		sector = cache.isOn ? cacheFind(lbas[i]) : NULL;
+		if ( sector ) {
+			memcpy(buffer + i * BYTES_PER_SECTOR, sector->data, BYTES_PER_SECTOR);
+		} else {
+			requests[numRequests].lba = lbas[i];
+			requests[numRequests].index = i;
+			numRequests++;
+		}
+	}
+	qsort(requests, numRequests, sizeof(struct ScatterRequest), scatterCompare);
+	for ( i = 0; i < numRequests && returnCode == SD_SUCCESS; i = j ) {
+		first = last = requests[i].lba;
+		for (
+			j = i + 1;
+			j < numRequests && requests[j].lba - last <= SCATTER_GAP + 1 &&
+				requests[j].lba - first < SCATTER_RUN_MAX;
+			j++ )
+		{
+			last = requests[j].lba;
+		}
+		returnCode = fetch(first, runBuf, last - first + 1);
+		if ( spiStatus(NULL) && returnCode == SD_SUCCESS ) {
+			returnCode = SD_READBLOCK_DATA_ERROR;
+		}
+		for ( ; i < j && returnCode == SD_SUCCESS; i++ ) {
+			memcpy(
+				buffer + requests[i].index * BYTES_PER_SECTOR,
+				runBuf + (requests[i].lba - first) * BYTES_PER_SECTOR, BYTES_PER_SECTOR);
+		}
+		runs++;
+	}
+	free(requests);
+	if ( numRuns ) {
+		*numRuns = runs;
+	}
+	return returnCode;
+}
+
+
+// Write blocks, each as a gap byte, the data token, the data and a dummy CRC, followed by the
+// card's data response and then its busy period. With the poll engine, the whole run is clocked
+// with SUPPRESS set, and the FPGA waits for the data response and the end of the busy period after
+// each block, so all that comes back is two bytes per block, in one read per WRITE_BATCH blocks.
+// Without it, each block costs a round trip for the data response and another for the busy period.
+//
+#define WRITE_BATCH    32
+#define WRITE_BUSY_MAX 0x0FFFFF  // ~350ms at 24MHz; the spec allows 250ms
+
+static struct {
+	bool isMultiple;
+	uint32 blockNum;
+	uint32 first;         // where the write began, and when
+	uint64 start;
+} writeStatus = {false, 0, 0, 0};
+
+static uint8 writeBlocks(uint8 token, const uint8 *buffer, uint32 numBlocks) {
+	const bool offload = (spiFeatures() & FEATURE_POLL) ? true : false;
+	uint8 dataResponse[WRITE_BATCH], busy[WRITE_BATCH];
+	uint32 i, batch;
+	uint8 returnCode = SD_SUCCESS;
+	if ( offload ) {
+		spiConfig(SUPPRESS, SUPPRESS);
+	}
+	while ( numBlocks && returnCode == SD_SUCCESS ) {
+		batch = (numBlocks < WRITE_BATCH) ? numBlocks : WRITE_BATCH;
+		for ( i = 0; i < batch; i++ ) {
+			sendClocks(1, 0xFF);
+			spiQueue(&token, 1, NULL);
+			spiQueue(buffer, BYTES_PER_SECTOR, NULL);
+			sendClocks(2, 0xFF);                          // CRC (the FPGA's, if CRC is on)
+			spiPoll(0x11, 0x01, 8, dataResponse + i);     // data response is xxx0sss1
+			spiPoll(0xFF, 0xFF, WRITE_BUSY_MAX, busy + i);  // busy until 0xFF
+			buffer += BYTES_PER_SECTOR;
+		}
+		if ( spiFlush() ) {
+			returnCode = SD_WRITEBLOCK_DATA_ERROR;
+			break;
+		}
+		for ( i = 0; i < batch; i++ ) {
+			if ( (dataResponse[i] & DATA_RESPONSE_MASK) != DATA_ACCEPTED ) {
+				fprintf(
+					stderr, "writeBlocks() encountered SD_WRITEBLOCK_DATA_ERROR {\n  block=0x%08X\n  dataResponse=0x%02X\n}\n",
+					writeStatus.blockNum + i, dataResponse[i]
+				);
+				returnCode = SD_WRITEBLOCK_DATA_ERROR;
+				break;
+			}
+			if ( busy[i] != 0xFF ) {
+				fprintf(
+					stderr, "writeBlocks() encountered SD_WRITEBLOCK_BUSY_ERROR {\n  block=0x%08X\n}\n",
+					writeStatus.blockNum + i
+				);
+				returnCode = SD_WRITEBLOCK_BUSY_ERROR;
+				break;
+			}
+		}
+		writeStatus.blockNum += i;
+		numBlocks -= batch;
+	}
+	if ( offload ) {
+		spiConfig(SUPPRESS, 0x00);
+	}
+	return returnCode;
+}
+
+uint8 sdWriteSingleBlock(uint32 lba, const uint8 *buffer) {
+	const uint64 start = profNow();
+	uint8 returnCode;
+	enable();
+	returnCode = sendCommand(CMD_WRITE_SINGLE_BLOCK, address(lba));
+	if ( returnCode != TOKEN_SUCCESS ) {
+		sendClocks(2, 0xFF);
+		disable();
+		fprintf(
+			stderr, "sdWriteSingleBlock() encountered SD_WRITEBLOCK_CMD_ERROR {\n  lba=0x%08X\n  returnCode=0x%02X\n}\n",
+			lba, returnCode
+		);
+		return SD_WRITEBLOCK_CMD_ERROR;
+	}
+	writeStatus.isMultiple = false;
+	writeStatus.blockNum = lba;
+	cacheInvalidate(lba, 1);
+	crcMode(CRC_TX);
+	returnCode = writeBlocks(TOKEN_WRITE_SINGLE, buffer, 1);
+	sendClocks(2, 0xFF);
+	disable();
+	crcMode(0x00);
+	profRecord(PROF_BLOCK_WRITE, start, 1);
+	return returnCode;
+}
+
+uint8 sdWriteMultipleBlocksBegin(uint32 lba) {
+	uint8 returnCode;
+	writeStatus.start = profNow();
+	enable();
+	returnCode = sendCommand(CMD_WRITE_MULTIPLE_BLOCKS, address(lba));
+	if ( returnCode != TOKEN_SUCCESS ) {
+		sendClocks(2, 0xFF);
+		disable();
+		fprintf(
+			stderr, "sdWriteMultipleBlocksBegin() encountered SD_WRITEBLOCK_CMD_ERROR {\n  lba=0x%08X\n  returnCode=0x%02X\n}\n",
+			lba, returnCode
+		);
+		return SD_WRITEBLOCK_CMD_ERROR;
+	}
+	writeStatus.isMultiple = true;
+	writeStatus.blockNum = lba;
+	writeStatus.first = lba;
+	crcMode(CRC_TX);
+	return SD_SUCCESS;
+}
+
+uint8 sdWriteBlocks(const uint8 *buffer, uint32 numBlocks) {
+	cacheInvalidate(writeStatus.blockNum, numBlocks);
+	return writeBlocks(TOKEN_WRITE_MULTIPLE, buffer, numBlocks);
+}
+
+// Send the stop token, which is followed by one byte and then a busy period.
+//
+uint8 sdWriteBlocksEnd(void) {
+	const uint8 token = TOKEN_WRITE_FINISH;
+	const bool isMultiple = writeStatus.isMultiple;
+	uint8 busy = 0xFF;
+	if ( isMultiple ) {
+		sendClocks(1, 0xFF);
+		spiQueue(&token, 1, NULL);
+		sendClocks(1, 0xFF);
+		spiWaitFor(0xFF, 0xFF, WRITE_BUSY_MAX, &busy);
+		writeStatus.isMultiple = false;
+	}
+	sendClocks(2, 0xFF);
+	disable();
+	crcMode(0x00);
+	if ( isMultiple ) {
+		profRecord(PROF_BLOCK_WRITE, writeStatus.start, writeStatus.blockNum - writeStatus.first);
+	}
+	return (busy == 0xFF) ? SD_SUCCESS : SD_WRITEBLOCK_BUSY_ERROR;
+}
+
+bool sdIsHighCapacity(void) {
+	return isHighCapacity;
+}
+
+// Read the CSD register, which comes back like a data block, and work out the card's capacity:
+//   version 1.0: (C_SIZE+1) * 2^(C_SIZE_MULT+2) * 2^READ_BL_LEN bytes
+//   version 2.0: (C_SIZE+1) * 512KiB
+//
+uint8 sdReadCapacity(uint32 *numBlocks) {
+	uint8 csd[16], crc[2], token = 0x00;
+	uint32 cSize;
+	uint8 returnCode;
+	enable();
+	returnCode = sendCommand(CMD_SEND_CSD, 0);
+	if ( returnCode == TOKEN_SUCCESS ) {
+		spiWaitFor(0xFF, TOKEN_READ_CAPACITY, 0xFFFF, &token);
+		if ( token == TOKEN_READ_CAPACITY ) {
+			spiRecv(csd, 16);
+			spiRecv(crc, 2);
+		}
+	}
+	sendClocks(2, 0xFF);
+	disable();
+	if ( returnCode != TOKEN_SUCCESS || token != TOKEN_READ_CAPACITY ) {
+		fprintf(
+			stderr, "sdReadCapacity() encountered SD_READCAPACITY_ERROR {\n  returnCode=0x%02X\n  token=0x%02X\n}\n",
+			returnCode, token
+		);
+		return SD_READCAPACITY_ERROR;
+	}
+	if ( (csd[0] >> 6) == 0x01 ) {
+		cSize = ((uint32)(csd[7] & 0x3F) << 16) | ((uint32)csd[8] << 8) | csd[9];
+		*numBlocks = (cSize + 1) << 10;
+	} else {
+		cSize = ((uint32)(csd[6] & 0x03) << 10) | ((uint32)csd[7] << 2) | (csd[8] >> 6);
+		*numBlocks = (cSize + 1) <<
+			((((csd[9] & 0x03) << 1) | (csd[10] >> 7)) + 2 + (csd[5] & 0x0F) - LOG2_BYTES_PER_SECTOR);
+	}
+	return SD_SUCCESS;
+}
+
+bool sdIsCrcOn(void) {
+	return isCrcOn;
+}
+
+// CRC16 (CCITT, as used for SD data blocks).
+//
+static uint16 crc16(const uint8 *data, uint32 count) {
+	uint16 crc = 0x0000;
+	uint8 i;
+	while ( count-- ) {
+		crc ^= (uint16)(*data++ << 8);
+		for ( i = 0; i < 8; i++ ) {
+			crc = (crc & 0x8000) ? (uint16)((crc << 1) ^ 0x1021) : (uint16)(crc << 1);
+		}
+	}
+	return crc;
+}
+
+// Read one block with a single attempt at each step, and check its CRC16, which the card sends
+// even when CRC checking is off. Unlike sdReadSingleBlockBegin() this gives up at once if the
+// response is garbled, as it will be if the clock is too fast.
+//
+static bool readBlockChecked(uint32 lba, uint8 *buffer) {
+	uint8 returnCode, token, crc[2];
+	bool isGood = false;
+	enable();
+	returnCode = sendCommand(CMD_READ_SINGLE_BLOCK, address(lba));
+	if ( returnCode == TOKEN_SUCCESS ) {
+		spiWaitFor(0xFF, TOKEN_READ_SINGLE, 0xFFFF, &token);
+		if ( token == TOKEN_READ_SINGLE ) {
+			spiRecv(buffer, BYTES_PER_SECTOR);
+			spiRecv(crc, 2);
+			isGood = crc16(buffer, BYTES_PER_SECTOR) == (uint16)((crc[0] << 8) | crc[1]);
+		}
+	}
+	sendClocks(2, 0xFF);
+	disable();
+	spiFlush();
+	return isGood && !spiStatus(NULL);
+}
+
+// Step the TURBO clock up from NEGOTIATE_START towards sysClk/2, reading a block a few times at
+// each step and checking it against its CRC16 and against the copy read at the slowest step. Stop
+// at the first failure, and settle on the last divider which worked, after letting the card finish
+// any block it was part-way through sending when things went wrong.
+//
+#define NEGOTIATE_START 15  // 1.5MHz @48MHz
+#define NEGOTIATE_READS 4
+
+uint8 sdNegotiateClock(uint32 lba, uint8 *divider) {
+	uint8 reference[BYTES_PER_SECTOR], block[BYTES_PER_SECTOR];
+	uint8 best, i;
+	int div;
+	if ( !(spiFeatures() & FEATURE_CLKDIV) ) {
+		*divider = 0x00;
+		return SD_SUCCESS;  // fixed at sysClk/2
+	}
+	spiConfig(TURBO, TURBO);
+	spiSetDivider(NEGOTIATE_START);
+	if ( !readBlockChecked(lba, reference) ) {
+		fprintf(stderr, "sdNegotiateClock() encountered SD_CLOCK_ERROR {\n  divider=%d\n}\n", NEGOTIATE_START);
+		return SD_CLOCK_ERROR;
+	}
+	best = NEGOTIATE_START;
+	for ( div = NEGOTIATE_START - 1; div >= 0; div-- ) {
+		spiSetDivider((uint8)div);
+		for ( i = 0; i < NEGOTIATE_READS; i++ ) {
+			if ( !readBlockChecked(lba, block) || memcmp(block, reference, BYTES_PER_SECTOR) ) {
+				break;
+			}
+		}
+		if ( i < NEGOTIATE_READS ) {
+			spiSetDivider(best);
+			enable();
+			spiFill(0xFF, BYTES_PER_SECTOR + 4, NULL);
+			disable();
+			if ( !readBlockChecked(lba, block) ) {
+				fprintf(stderr, "sdNegotiateClock() encountered SD_CLOCK_ERROR {\n  divider=%d\n}\n", best);
+				return SD_CLOCK_ERROR;
+			}
+			break;
+		}
+		best = (uint8)div;
+	}
+	*divider = best;
+	return SD_SUCCESS;
+}
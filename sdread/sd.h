@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2013 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SD_H
+#define SD_H
+
+#include <makestuff.h>
+
+#define SD_SUCCESS               0
+#define SD_READBLOCK_CMD_ERROR   1
+#define SD_INIT_NOT_IDLE_ERROR   2
+#define SD_INIT_TIMEOUT_ERROR    3
+#define SD_READBLOCK_DATA_ERROR  4
+#define SD_WRITEBLOCK_CMD_ERROR  5
+#define SD_WRITEBLOCK_DATA_ERROR 6
+#define SD_WRITEBLOCK_BUSY_ERROR 7
+#define SD_INIT_VOLTAGE_ERROR    8
+#define SD_CLOCK_ERROR           9
+#define SD_READBLOCK_CRC_ERROR   10
+#define SD_READCAPACITY_ERROR    11
+
+#define LOG2_BYTES_PER_SECTOR    9
+#define BYTES_PER_SECTOR         (1<<LOG2_BYTES_PER_SECTOR)
+
+void sdSetDevice(uint8 dev);
+void sdCacheEnable(bool enable);
+uint8 sdInit(void);
+bool sdIsHighCapacity(void);
+bool sdIsCrcOn(void);
+uint8 sdReadCapacity(uint32 *numBlocks);
+uint8 sdNegotiateClock(uint32 lba, uint8 *divider);
+uint8 sdReadSingleBlockBegin(uint32 lba);
+uint8 sdReadMultipleBlocksBegin(uint32 lba);
+uint8 sdReadBlocks(uint8 *buffer, uint32 numBlocks);
+uint8 sdGetByte(void);
+uint16 sdGetWord(void);
+uint32 sdGetLong(void);
+void sdGetBytes(uint8 *buffer, uint16 numBytes);
+void sdSkip(uint16 numBytes);
+uint8 sdReadBlocksEnd(void);
+uint8 sdReadScattered(const uint32 *lbas, uint32 numLbas, uint8 *buffer, uint32 *numRuns);
+uint8 sdWriteSingleBlock(uint32 lba, const uint8 *buffer);
+uint8 sdWriteMultipleBlocksBegin(uint32 lba);
+uint8 sdWriteBlocks(const uint8 *buffer, uint32 numBlocks);
+uint8 sdWriteBlocksEnd(void);
+
+#endif
@@ -21,7 +21,9 @@ use ieee.numeric_std.all;
 
 entity top_level is
 	generic (
-		NUM_DEVS     : integer := 2
+		NUM_DEVS     : integer := 2;
+		FIFO_DEPTH   : integer := 11; -- receive FIFO holds 2**FIFO_DEPTH bytes
+		IO_WIDTH     : integer := 1   -- 2 to use MOSI and MISO as IO0 and IO1, for dual-output reads
 	);
 	port(
 		-- FX2LP interface ---------------------------------------------------------------------------
@@ -40,8 +42,8 @@ entity top_level is
 
 		-- Peripheral interface ----------------------------------------------------------------------
 		spiClk_out     : out   std_logic;
-		spiData_out    : out   std_logic;
-		spiData_in     : in    std_logic;
+		spiData_out    : inout std_logic;                    -- MOSI, or IO0
+		spiData_in     : inout std_logic;                    -- MISO, or IO1
 		spiCS_out      : out   std_logic_vector(NUM_DEVS-1 downto 0)
 	);
 end entity;
@@ -60,6 +62,11 @@ architecture structural of top_level is
 	signal f2hValid   : std_logic;                     -- channel logic can drive this low to say "I don't have data ready for you"
 	signal f2hReady   : std_logic;                     -- '1' means "on the next clock rising edge, put your next byte of data on f2hData"
 	-- ----------------------------------------------------------------------------------------------
+
+	-- SPI data lines: this board has no IO2 or IO3, so it can do no more than dual reads
+	signal spiIO      : std_logic_vector(3 downto 0);
+	signal spiIOEn    : std_logic_vector(3 downto 0);
+	signal spiIOIn    : std_logic_vector(3 downto 0);
 begin
 	-- CommFPGA module
 	comm_fpga_fx2 : entity work.comm_fpga_fx2
@@ -90,7 +97,9 @@ begin
 	-- Switches & LEDs application
 	spi_talk_app : entity work.spi_talk
       generic map (
-         NUM_DEVS     => NUM_DEVS
+         NUM_DEVS     => NUM_DEVS,
+         FIFO_DEPTH   => FIFO_DEPTH,
+         IO_WIDTH     => IO_WIDTH
 		)
 		port map(
 			clk_in       => fx2Clk_in,
@@ -106,8 +115,15 @@ begin
 			
 			-- Peripheral interface
 			spiClk_out   => spiClk_out,
-			spiData_out  => spiData_out,
+			spiData_out  => open,
 			spiData_in   => spiData_in,
-			spiCS_out    => spiCS_out
+			spiCS_out    => spiCS_out,
+			spiIO_out    => spiIO,
+			spiIOEn_out  => spiIOEn,
+			spiIO_in     => spiIOIn
 		);
+
+	spiData_out <= spiIO(0) when spiIOEn(0) = '1' else 'Z';
+	spiData_in <= spiIO(1) when spiIOEn(1) = '1' else 'Z';
+	spiIOIn <= "11" & spiData_in & spiData_out;
 end architecture;
@@ -23,7 +23,8 @@ use unisim.vcomponents.all;
 
 entity top_level is
 	generic (
-		NUM_DEVS     : integer := 1
+		NUM_DEVS     : integer := 1;
+		FIFO_DEPTH   : integer := 11  -- receive FIFO holds 2**FIFO_DEPTH bytes
 	);
 	port(
 		-- FX2LP interface ---------------------------------------------------------------------------
@@ -104,7 +105,8 @@ begin
 	-- Switches & LEDs application
 	spi_talk_app : entity work.spi_talk
       generic map (
-         NUM_DEVS     => NUM_DEVS
+         NUM_DEVS     => NUM_DEVS,
+         FIFO_DEPTH   => FIFO_DEPTH
 		)
 		port map(
 			clk_in       => fx2Clk_in,
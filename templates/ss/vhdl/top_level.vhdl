@@ -20,7 +20,8 @@ use ieee.numeric_std.all;
 
 entity top_level is
 	generic (
-		NUM_DEVS       : integer := 1
+		NUM_DEVS       : integer := 1;
+		FIFO_DEPTH     : integer := 11  -- receive FIFO holds 2**FIFO_DEPTH bytes
 	);
 	port(
 		sysClk_in      : in    std_logic;  -- system clock
@@ -77,7 +78,8 @@ begin
 	-- Switches & LEDs application
 	spi_talk_app : entity work.spi_talk
 		generic map (
-			NUM_DEVS     => NUM_DEVS
+			NUM_DEVS     => NUM_DEVS,
+			FIFO_DEPTH   => FIFO_DEPTH
 		)
 		port map(
 			clk_in       => sysClk_in,
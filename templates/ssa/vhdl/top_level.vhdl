@@ -23,7 +23,8 @@ use altera_mf.altera_mf_components.all;
 
 entity top_level is
 	generic (
-		NUM_DEVS       : integer := 1
+		NUM_DEVS       : integer := 1;
+		FIFO_DEPTH     : integer := 11  -- receive FIFO holds 2**FIFO_DEPTH bytes
 	);
 	port(
 		sysClk_in      : in    std_logic;  -- 50MHz system clock
@@ -100,7 +101,8 @@ begin
 	-- Switches & LEDs application
 	spi_talk_app : entity work.spi_talk
 		generic map (
-			NUM_DEVS     => NUM_DEVS
+			NUM_DEVS     => NUM_DEVS,
+			FIFO_DEPTH   => FIFO_DEPTH
 		)
 		port map(
 			clk_in       => sysClk_in,
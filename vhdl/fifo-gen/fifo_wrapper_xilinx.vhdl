@@ -20,6 +20,9 @@ use ieee.std_logic_1164.all;
 use ieee.numeric_std.all;
 
 entity fifo_wrapper is
+	generic (
+		DEPTH           : integer  -- log2 of the FIFO size; must match input_depth in fifo.batch
+	);
 	port(
 		-- Clock and depth
 		clk_in          : in  std_logic;
@@ -40,6 +43,12 @@ architecture structural of fifo_wrapper is
 	signal inputFull   : std_logic;
 	signal outputEmpty : std_logic;
 begin
+	-- The core is generated with input_depth=2048 in fifo.batch. The host clocks up to 2**DEPTH
+	-- bytes between reads, so a bigger DEPTH would overfill it and stall channel 0 for good.
+	assert DEPTH = 11
+		report "fifo_wrapper: DEPTH must be 11 to match the generated FIFO core (input_depth=2048)"
+		severity failure;
+
 	-- Invert "full/empty" signals to give "ready/valid" signals
 	inputReady_out <= not(inputFull);
 	outputValid_out <= not(outputEmpty);
@@ -20,6 +20,9 @@ use ieee.std_logic_1164.all;
 use ieee.numeric_std.all;
 
 entity fifo_wrapper is
+	generic (
+		DEPTH           : integer  -- log2 of the FIFO size
+	);
 	port(
 		-- Clock and depth
 		clk_in          : in  std_logic;
@@ -43,7 +46,7 @@ begin
 	fifo: entity work.fifo
 		generic map(
 			WIDTH => 8,
-			DEPTH => 7
+			DEPTH => DEPTH
 		)
 		port map(
 			clk_in          => clk_in,
@@ -0,0 +1,249 @@
+--
+-- Copyright (C) 2009-2012 Chris McClelland
+--
+-- This program is free software: you can redistribute it and/or modify
+-- it under the terms of the GNU Lesser General Public License as published by
+-- the Free Software Foundation, either version 3 of the License, or
+-- (at your option) any later version.
+--
+-- This program is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+-- GNU Lesser General Public License for more details.
+--
+-- You should have received a copy of the GNU Lesser General Public License
+-- along with this program.  If not, see <http://www.gnu.org/licenses/>.
+--
+library ieee;
+
+use ieee.std_logic_1164.all;
+use ieee.numeric_std.all;
+
+-- SPI master (mode 0) with the same pipes as makestuff's spi_master, but with the fast clock rate
+-- set at runtime rather than by a generic: when turbo_in is '1', each half-period of spiClk lasts
+-- fastCount_in+1 cycles of clk_in, so spiClk = sysClk/(2*(fastCount_in+1)). The rate is latched at
+-- the start of each byte, so it may be changed at any time.
+--
+-- MISO is sampled at the end of each high half-period rather than on the rising edge. That is
+-- still before the slave changes it on the falling edge, but it tolerates a round-trip delay of up
+-- to half a clock period, which helps with long leads.
+--
+-- Like the rate, the number of data lines is latched at the start of each byte. With width_in
+-- "01" or "10", the byte goes out two or four bits per clock on IO1..IO0 or IO3..IO0 (always MSB
+-- first), or, with wideIn_in set, the lines are released and the byte is sampled from them, as in
+-- the data phase of a dual- or quad-output flash read. With one data line, IO0 is MOSI, IO1 is
+-- MISO, and IO2 and IO3 (WP# and HOLD# on a flash) are held high. spiIOEn_out says which of
+-- spiIO_out the pads should drive.
+--
+entity spi_master_var is
+	generic (
+		SLOW_COUNT     : unsigned(7 downto 0) := x"3B";  -- spiClk = sysClk/120 (400kHz @48MHz)
+		BIT_ORDER      : std_logic := '1'                -- '1' for MSB first
+	);
+	port(
+		reset_in       : in  std_logic;
+		clk_in         : in  std_logic;
+
+		-- Send pipe
+		turbo_in       : in  std_logic;
+		fastCount_in   : in  std_logic_vector(7 downto 0);
+		suppress_in    : in  std_logic;
+		width_in       : in  std_logic_vector(1 downto 0);
+		wideIn_in      : in  std_logic;
+		sendData_in    : in  std_logic_vector(7 downto 0);
+		sendValid_in   : in  std_logic;
+		sendReady_out  : out std_logic;
+
+		-- Receive pipe
+		recvData_out   : out std_logic_vector(7 downto 0);
+		recvValid_out  : out std_logic;
+		recvReady_in   : in  std_logic;
+
+		-- SPI interface
+		spiClk_out     : out std_logic;
+		spiData_out    : out std_logic;
+		spiData_in     : in  std_logic;
+		spiIO_out      : out std_logic_vector(3 downto 0);
+		spiIOEn_out    : out std_logic_vector(3 downto 0);
+		spiIO_in       : in  std_logic_vector(3 downto 0)
+	);
+end entity;
+
+architecture rtl of spi_master_var is
+	type StateType is (
+		S_IDLE,   -- waiting for a byte to send
+		S_LOW,    -- spiClk low, data out
+		S_HIGH    -- spiClk high
+	);
+	signal state          : StateType := S_IDLE;
+	signal state_next     : StateType;
+	signal count          : unsigned(7 downto 0) := (others => '0');
+	signal count_next     : unsigned(7 downto 0);
+	signal period         : unsigned(7 downto 0) := (others => '0');
+	signal period_next    : unsigned(7 downto 0);
+	signal bitCount       : unsigned(2 downto 0) := (others => '0');
+	signal bitCount_next  : unsigned(2 downto 0);
+	signal shiftOut       : std_logic_vector(7 downto 0) := (others => '0');
+	signal shiftOut_next  : std_logic_vector(7 downto 0);
+	signal shiftIn        : std_logic_vector(7 downto 0) := (others => '0');
+	signal shiftIn_next   : std_logic_vector(7 downto 0);
+	signal suppress       : std_logic := '0';
+	signal suppress_next  : std_logic;
+	signal width          : std_logic_vector(1 downto 0) := "00";
+	signal width_next     : std_logic_vector(1 downto 0);
+	signal wideIn         : std_logic := '0';
+	signal wideIn_next    : std_logic;
+	signal recvData       : std_logic_vector(7 downto 0) := (others => '0');
+	signal recvData_next  : std_logic_vector(7 downto 0);
+	signal recvValid      : std_logic := '0';
+	signal recvValid_next : std_logic;
+	signal spiClk         : std_logic := '0';
+	signal spiClk_next    : std_logic;
+	signal sendReady      : std_logic;
+	constant WIDTH_X2     : std_logic_vector(1 downto 0) := "01";
+	constant WIDTH_X4     : std_logic_vector(1 downto 0) := "10";
+begin
+	-- Infer registers
+	process(clk_in)
+	begin
+		if ( rising_edge(clk_in) ) then
+			if ( reset_in = '1' ) then
+				state <= S_IDLE;
+				recvValid <= '0';
+				spiClk <= '0';
+			else
+				state <= state_next;
+				count <= count_next;
+				period <= period_next;
+				bitCount <= bitCount_next;
+				shiftOut <= shiftOut_next;
+				shiftIn <= shiftIn_next;
+				suppress <= suppress_next;
+				width <= width_next;
+				wideIn <= wideIn_next;
+				recvData <= recvData_next;
+				recvValid <= recvValid_next;
+				spiClk <= spiClk_next;
+			end if;
+		end if;
+	end process;
+
+	-- A byte is only accepted once the previous byte is complete and its response (if any) has been
+	-- taken, so there is never more than one byte in flight.
+	sendReady <=
+		'1' when state = S_IDLE and (recvValid = '0' or recvReady_in = '1')
+		else '0';
+
+	-- Next state logic
+	process(
+		state, count, period, bitCount, shiftOut, shiftIn, suppress, width, wideIn, recvData,
+		recvValid, spiClk, sendReady, sendValid_in, sendData_in, turbo_in, fastCount_in, suppress_in,
+		width_in, wideIn_in, recvReady_in, spiData_in, spiIO_in)
+		variable sampled : std_logic_vector(7 downto 0);
+		variable shifted : std_logic_vector(7 downto 0);
+		variable lastBit : unsigned(2 downto 0);
+	begin
+		state_next <= state;
+		count_next <= count;
+		period_next <= period;
+		bitCount_next <= bitCount;
+		shiftOut_next <= shiftOut;
+		shiftIn_next <= shiftIn;
+		suppress_next <= suppress;
+		width_next <= width;
+		wideIn_next <= wideIn;
+		recvData_next <= recvData;
+		recvValid_next <= recvValid;
+		spiClk_next <= spiClk;
+
+		if ( recvValid = '1' and recvReady_in = '1' ) then
+			recvValid_next <= '0';
+		end if;
+
+		-- Each clock moves one, two or four bits, so a byte takes eight, four or two clocks
+		if ( width = WIDTH_X4 ) then
+			sampled := shiftIn(3 downto 0) & spiIO_in;
+			shifted := shiftOut(3 downto 0) & "0000";
+			lastBit := "001";
+		elsif ( width = WIDTH_X2 ) then
+			sampled := shiftIn(5 downto 0) & spiIO_in(1 downto 0);
+			shifted := shiftOut(5 downto 0) & "00";
+			lastBit := "011";
+		elsif ( BIT_ORDER = '1' ) then
+			sampled := shiftIn(6 downto 0) & spiData_in;
+			shifted := shiftOut(6 downto 0) & '0';
+			lastBit := "111";
+		else
+			sampled := spiData_in & shiftIn(7 downto 1);
+			shifted := '0' & shiftOut(7 downto 1);
+			lastBit := "111";
+		end if;
+
+		case state is
+			when S_LOW =>
+				if ( count = 0 ) then
+					count_next <= period;
+					spiClk_next <= '1';
+					state_next <= S_HIGH;
+				else
+					count_next <= count - 1;
+				end if;
+
+			when S_HIGH =>
+				if ( count = 0 ) then
+					shiftIn_next <= sampled;
+					spiClk_next <= '0';
+					bitCount_next <= bitCount + 1;
+					if ( bitCount = lastBit ) then
+						if ( suppress = '0' ) then
+							recvData_next <= sampled;
+							recvValid_next <= '1';
+						end if;
+						state_next <= S_IDLE;
+					else
+						shiftOut_next <= shifted;
+						count_next <= period;
+						state_next <= S_LOW;
+					end if;
+				else
+					count_next <= count - 1;
+				end if;
+
+			-- S_IDLE
+			when others =>
+				if ( sendValid_in = '1' and sendReady = '1' ) then
+					if ( turbo_in = '1' ) then
+						period_next <= unsigned(fastCount_in);
+						count_next <= unsigned(fastCount_in);
+					else
+						period_next <= SLOW_COUNT;
+						count_next <= SLOW_COUNT;
+					end if;
+					shiftOut_next <= sendData_in;
+					suppress_next <= suppress_in;
+					width_next <= width_in;
+					wideIn_next <= wideIn_in;
+					bitCount_next <= (others => '0');
+					state_next <= S_LOW;
+				end if;
+		end case;
+	end process;
+
+	sendReady_out <= sendReady;
+	recvData_out <= recvData;
+	recvValid_out <= recvValid;
+	spiClk_out <= spiClk;
+	spiData_out <=
+		shiftOut(7) when BIT_ORDER = '1'
+		else shiftOut(0);
+	spiIO_out <=
+		shiftOut(7 downto 4) when width = WIDTH_X4
+		else "11" & shiftOut(7 downto 6) when width = WIDTH_X2
+		else "111" & shiftOut(7) when BIT_ORDER = '1'
+		else "111" & shiftOut(0);
+	spiIOEn_out <=
+		"0000" when width = WIDTH_X4 and wideIn = '1'
+		else "1100" when width = WIDTH_X2 and wideIn = '1'
+		else "1111" when width = WIDTH_X4 or width = WIDTH_X2
+		else "1101";
+end architecture;
@@ -21,7 +21,9 @@ use ieee.numeric_std.all;
 
 entity spi_talk is
 	generic (
-		NUM_DEVS     : integer
+		NUM_DEVS     : integer;
+		FIFO_DEPTH   : integer := 11; -- receive FIFO holds 2**FIFO_DEPTH bytes (see fifo-gen)
+		IO_WIDTH     : integer := 1   -- data lines wired to the peripherals: 1, 2 (IO1..IO0) or 4 (IO3..IO0)
 	);
 	port(
 		clk_in       : in  std_logic;
@@ -43,7 +45,13 @@ entity spi_talk is
 		spiClk_out   : out   std_logic;
 		spiData_out  : out   std_logic;
 		spiData_in   : in    std_logic;
-		spiCS_out    : out   std_logic_vector(NUM_DEVS-1 downto 0)
+		spiCS_out    : out   std_logic_vector(NUM_DEVS-1 downto 0);
+
+		-- Wide data lines, for boards built with IO_WIDTH > 1: IO0 is MOSI and IO1 is MISO, so
+		-- their pads must be bidirectional, driving spiIO_out(n) when spiIOEn_out(n) is '1'
+		spiIO_out    : out   std_logic_vector(3 downto 0);
+		spiIOEn_out  : out   std_logic_vector(3 downto 0);
+		spiIO_in     : in    std_logic_vector(3 downto 0) := (others => '1')
 	);
 end entity;
 
@@ -60,30 +68,396 @@ architecture rtl of spi_talk is
 	signal fifoValid   : std_logic;
 	signal fifoReady   : std_logic;
 
+	signal spiRecvData : std_logic_vector(7 downto 0);
+	signal spiRecvValid: std_logic;
+	signal spiRecvReady: std_logic;
+
+	signal suppress    : std_logic;
+
 	signal config      : std_logic_vector(NUM_DEVS+1 downto 0);
 	signal config_next : std_logic_vector(NUM_DEVS+1 downto 0);
 	constant TURBO     : integer := 0;
 	constant SUPPRESS  : integer := 1;
 	constant CHIPSEL   : integer := 2;
+
+	-- Clock divider (channel 3): in TURBO mode, spiClk = sysClk/(2*(fastCount+1))
+	signal fastCount      : std_logic_vector(7 downto 0) := (others => '0');
+	signal fastCount_next : std_logic_vector(7 downto 0);
+
+	-- Poll engine: the host writes six bytes to channel 2:
+	--   [pollByte] [mask] [match] [count(23:16)] [count(15:8)] [count(7:0)]
+	-- The pollByte is then clocked repeatedly until (spiData and mask) = match, or until count bytes
+	-- have been clocked. The last byte clocked in is pushed into the receive FIFO (regardless of
+	-- SUPPRESS), and commands on all channels are held off until then.
+	type PollStateType is (
+		S_IDLE,      -- not polling; the SPI master belongs to channel 0
+		S_SEND,      -- waiting for the SPI master to accept the poll byte
+		S_RECV,      -- waiting for the byte clocked in
+		S_PUSH       -- waiting for room in the receive FIFO for the result
+	);
+	signal pollState       : PollStateType := S_IDLE;
+	signal pollState_next  : PollStateType;
+	signal pollArgs        : std_logic_vector(47 downto 0) := (others => '0');
+	signal pollArgs_next   : std_logic_vector(47 downto 0);
+	signal pollIndex       : unsigned(2 downto 0) := (others => '0');
+	signal pollIndex_next  : unsigned(2 downto 0);
+	signal pollCount       : unsigned(23 downto 0) := (others => '0');
+	signal pollCount_next  : unsigned(23 downto 0);
+	signal pollResult      : std_logic_vector(7 downto 0) := (others => '0');
+	signal pollResult_next : std_logic_vector(7 downto 0);
+	alias pollByte         : std_logic_vector(7 downto 0) is pollArgs(47 downto 40);
+	alias pollMask         : std_logic_vector(7 downto 0) is pollArgs(39 downto 32);
+	alias pollMatch        : std_logic_vector(7 downto 0) is pollArgs(31 downto 24);
+
+	-- CRC engine: the host writes a mode byte to channel 5:
+	--   bit 0: check received data blocks: from each start token (FE) clocked in, run CRC16 over the
+	--          next 514 bytes (the data and its CRC) and count the block good if the result is zero;
+	--          the good count stops at the first bad block, so it says where the bad ones start
+	--   bit 1: insert the CRC of transmitted data blocks: from each start token (FE or FC) sent on
+	--          channel 0, run CRC16 over the next 512 bytes, and send the result in place of the two
+	--          bytes that follow
+	--   bit 7: push the good and bad block counts into the receive FIFO (regardless of SUPPRESS) and
+	--          reset them; commands on all channels are held off until then
+	-- Clearing bit 0 or bit 1 returns that direction to waiting for a start token; clearing bit 0
+	-- also resets the counts.
+	constant CRC_RX        : integer := 0;
+	constant CRC_TX        : integer := 1;
+	constant CRC_REPORT    : integer := 7;
+	constant BLOCK_SIZE    : integer := 512;
+	type RxCrcStateType is (
+		R_IDLE,      -- waiting for a start token
+		R_DATA       -- checking the data and CRC
+	);
+	type TxCrcStateType is (
+		T_IDLE,      -- waiting for a start token
+		T_DATA,      -- accumulating the CRC of the data
+		T_CRC_HI,    -- sending the high byte of the CRC
+		T_CRC_LO     -- sending the low byte of the CRC
+	);
+	type ReportStateType is (
+		C_IDLE,      -- not reporting
+		C_GOOD,      -- waiting for room in the receive FIFO for the good count
+		C_BAD        -- waiting for room in the receive FIFO for the bad count
+	);
+	signal crcMode         : std_logic_vector(1 downto 0) := (others => '0');
+	signal crcMode_next    : std_logic_vector(1 downto 0);
+	signal rxCrcState      : RxCrcStateType := R_IDLE;
+	signal rxCrcState_next : RxCrcStateType;
+	signal rxCrc           : std_logic_vector(15 downto 0) := (others => '0');
+	signal rxCrc_next      : std_logic_vector(15 downto 0);
+	signal rxCrcCount      : unsigned(9 downto 0) := (others => '0');
+	signal rxCrcCount_next : unsigned(9 downto 0);
+	signal txCrcState      : TxCrcStateType := T_IDLE;
+	signal txCrcState_next : TxCrcStateType;
+	signal txCrc           : std_logic_vector(15 downto 0) := (others => '0');
+	signal txCrc_next      : std_logic_vector(15 downto 0);
+	signal txCrcCount      : unsigned(9 downto 0) := (others => '0');
+	signal txCrcCount_next : unsigned(9 downto 0);
+	signal crcGood         : unsigned(7 downto 0) := (others => '0');
+	signal crcGood_next    : unsigned(7 downto 0);
+	signal crcBad          : unsigned(7 downto 0) := (others => '0');
+	signal crcBad_next     : unsigned(7 downto 0);
+	signal reportState     : ReportStateType := C_IDLE;
+	signal reportState_next: ReportStateType;
+	signal reportGood      : unsigned(7 downto 0) := (others => '0');
+	signal reportGood_next : unsigned(7 downto 0);
+	signal reportBad       : unsigned(7 downto 0) := (others => '0');
+	signal reportBad_next  : unsigned(7 downto 0);
+
+	-- CRC16 (CCITT, as used for SD data blocks) of one more byte
+	function crc16(crc : std_logic_vector(15 downto 0); data : std_logic_vector(7 downto 0))
+		return std_logic_vector is
+		variable result : std_logic_vector(15 downto 0);
+	begin
+		result := crc;
+		for i in 7 downto 0 loop
+			if ( (result(15) xor data(i)) = '1' ) then
+				result := (result(14 downto 0) & '0') xor x"1021";
+			else
+				result := result(14 downto 0) & '0';
+			end if;
+		end loop;
+		return result;
+	end function;
+
+	-- Channel 2 reads return FEATURE_ID or'd with the supported features. Older bitstreams return
+	-- the config register on every nonzero channel, so the top nibble is never set there.
+	constant FEATURE_ID    : std_logic_vector(7 downto 0) := x"A0";
+	constant FEATURE_POLL  : std_logic_vector(7 downto 0) := x"01";
+	constant FEATURE_CLKDIV: std_logic_vector(7 downto 0) := x"02";
+	constant FEATURE_FIFOSZ: std_logic_vector(7 downto 0) := x"04";
+	constant FEATURE_CRC   : std_logic_vector(7 downto 0) := x"08";
+	constant FEATURES      : std_logic_vector(7 downto 0) :=
+		FEATURE_ID or FEATURE_POLL or FEATURE_CLKDIV or FEATURE_FIFOSZ or FEATURE_CRC;
+
+	-- Channel 4 reads return FIFO_DEPTH, so the host knows how many bytes it may clock between reads
+	constant FIFO_SIZE     : std_logic_vector(7 downto 0) := std_logic_vector(to_unsigned(FIFO_DEPTH, 8));
+
+	-- Data lines (channel 6): the host writes a mode byte, which applies to the bytes clocked from
+	-- channel 0 after it (the poll engine always uses one line):
+	--   bits 1:0: "00" one data line (MOSI and MISO), "01" two (IO1..IO0), "10" four (IO3..IO0)
+	--   bit 2:    '1' to release the lines and clock the bytes in from the peripheral
+	-- Widths the board isn't wired for select one line. Channel 6 reads return IO_ID or'd with the
+	-- widths it is wired for. Older bitstreams return the config register, which with nothing
+	-- selected never has IO_ID set.
+	constant IO_IN         : integer := 2;
+	constant IO_ID         : std_logic_vector(7 downto 0) := x"C0";
+	function ioWidths(width : integer) return std_logic_vector is
+	begin
+		if ( width >= 4 ) then
+			return "11";
+		elsif ( width >= 2 ) then
+			return "01";
+		else
+			return "00";
+		end if;
+	end function;
+	constant IO_WIRED      : std_logic_vector(1 downto 0) := ioWidths(IO_WIDTH);
+	constant IO_MODES      : std_logic_vector(7 downto 0) := IO_ID or ("000000" & IO_WIRED);
+	signal ioMode          : std_logic_vector(2 downto 0) := (others => '0');
+	signal ioMode_next     : std_logic_vector(2 downto 0);
+	signal spiWidth        : std_logic_vector(1 downto 0);
+	signal spiWideIn       : std_logic;
 begin
 	-- Infer registers
 	process(clk_in)
 	begin
 		if ( rising_edge(clk_in) ) then
 			config <= config_next;
+			fastCount <= fastCount_next;
+			ioMode <= ioMode_next;
+			pollState <= pollState_next;
+			pollArgs <= pollArgs_next;
+			pollIndex <= pollIndex_next;
+			pollCount <= pollCount_next;
+			pollResult <= pollResult_next;
+			crcMode <= crcMode_next;
+			rxCrcState <= rxCrcState_next;
+			rxCrc <= rxCrc_next;
+			rxCrcCount <= rxCrcCount_next;
+			txCrcState <= txCrcState_next;
+			txCrc <= txCrc_next;
+			txCrcCount <= txCrcCount_next;
+			crcGood <= crcGood_next;
+			crcBad <= crcBad_next;
+			reportState <= reportState_next;
+			reportGood <= reportGood_next;
+			reportBad <= reportBad_next;
 		end if;
 	end process;
 	
 	config_next <=
-		h2fData_in(NUM_DEVS+1 downto 0) when h2fValid_in = '1' and chanAddr_in /= "0000000"
+		h2fData_in(NUM_DEVS+1 downto 0) when h2fValid_in = '1' and chanAddr_in = "0000001" and pollState = S_IDLE and reportState = C_IDLE
 		else config;
+	fastCount_next <=
+		h2fData_in when h2fValid_in = '1' and chanAddr_in = "0000011" and pollState = S_IDLE and reportState = C_IDLE
+		else fastCount;
 
-	sendData <= h2fData_in;
-	sendValid <= h2fValid_in when chanAddr_in = "0000000" else '0';
-	h2fReady_out <= sendReady;  -- wait until send complete before accepting more commands on ANY channel
+	-- The mode only changes between bytes, so the bytes before it are clocked as they were sent
+	ioMode_next <=
+		ioMode when h2fValid_in = '0' or chanAddr_in /= "0000110" or sendReady = '0' or pollState /= S_IDLE or reportState /= C_IDLE
+		else h2fData_in(2 downto 0) when (h2fData_in(1 downto 0) and not IO_WIRED) = "00" and h2fData_in(1 downto 0) /= "11"
+		else "000";
+	spiWidth <=
+		ioMode(1 downto 0) when pollState = S_IDLE
+		else "00";
+	spiWideIn <=
+		ioMode(IO_IN) when pollState = S_IDLE
+		else '0';
+
+	-- Poll engine next-state logic
+	process(
+		pollState, pollArgs, pollIndex, pollCount, pollResult,
+		chanAddr_in, h2fData_in, h2fValid_in, sendReady, spiRecvData, spiRecvValid, recvReady)
+	begin
+		pollState_next <= pollState;
+		pollArgs_next <= pollArgs;
+		pollIndex_next <= pollIndex;
+		pollCount_next <= pollCount;
+		pollResult_next <= pollResult;
+		case pollState is
+			when S_SEND =>
+				if ( sendReady = '1' ) then
+					pollState_next <= S_RECV;
+				end if;
+
+			when S_RECV =>
+				if ( spiRecvValid = '1' ) then
+					pollResult_next <= spiRecvData;
+					if ( (spiRecvData and pollMask) = pollMatch or pollCount <= 1 ) then
+						pollState_next <= S_PUSH;
+					else
+						pollCount_next <= pollCount - 1;
+						pollState_next <= S_SEND;
+					end if;
+				end if;
+
+			when S_PUSH =>
+				if ( recvReady = '1' ) then
+					pollState_next <= S_IDLE;
+				end if;
+
+			-- S_IDLE
+			when others =>
+				if ( h2fValid_in = '1' and chanAddr_in = "0000010" and sendReady = '1' and reportState = C_IDLE ) then
+					pollArgs_next <= pollArgs(39 downto 0) & h2fData_in;
+					if ( pollIndex = 5 ) then
+						pollIndex_next <= (others => '0');
+						pollCount_next <= unsigned(pollArgs(15 downto 0) & h2fData_in);
+						pollState_next <= S_SEND;
+					else
+						pollIndex_next <= pollIndex + 1;
+					end if;
+				end if;
+		end case;
+	end process;
+
+	-- CRC engine next-state logic. Received bytes are checked whoever asked for them, but only the
+	-- bytes sent on channel 0 are candidates for CRC insertion.
+	process(
+		crcMode, rxCrcState, rxCrc, rxCrcCount, txCrcState, txCrc, txCrcCount, crcGood, crcBad,
+		reportState, reportGood, reportBad, chanAddr_in, h2fData_in, h2fValid_in, sendReady,
+		sendData, sendValid, pollState, spiRecvData, spiRecvValid, spiRecvReady, recvReady)
+		variable good : unsigned(7 downto 0);
+		variable bad  : unsigned(7 downto 0);
+		variable crc  : std_logic_vector(15 downto 0);
+	begin
+		crcMode_next <= crcMode;
+		rxCrcState_next <= rxCrcState;
+		rxCrc_next <= rxCrc;
+		rxCrcCount_next <= rxCrcCount;
+		txCrcState_next <= txCrcState;
+		txCrc_next <= txCrc;
+		txCrcCount_next <= txCrcCount;
+		reportState_next <= reportState;
+		reportGood_next <= reportGood;
+		reportBad_next <= reportBad;
+		good := crcGood;
+		bad := crcBad;
+
+		-- Check received blocks
+		if ( crcMode(CRC_RX) = '1' and spiRecvValid = '1' and spiRecvReady = '1' ) then
+			if ( rxCrcState = R_IDLE ) then
+				if ( spiRecvData = x"FE" ) then
+					rxCrc_next <= (others => '0');
+					rxCrcCount_next <= to_unsigned(BLOCK_SIZE+1, 10);
+					rxCrcState_next <= R_DATA;
+				end if;
+			else
+				crc := crc16(rxCrc, spiRecvData);
+				rxCrc_next <= crc;
+				if ( rxCrcCount = 0 ) then
+					if ( crc = x"0000" and bad = 0 ) then
+						good := good + 1;
+					elsif ( bad /= 255 ) then
+						bad := bad + 1;
+					end if;
+					rxCrcState_next <= R_IDLE;
+				else
+					rxCrcCount_next <= rxCrcCount - 1;
+				end if;
+			end if;
+		end if;
+
+		-- Insert the CRC into transmitted blocks
+		if ( crcMode(CRC_TX) = '1' and pollState = S_IDLE and sendValid = '1' and sendReady = '1' ) then
+			case txCrcState is
+				when T_DATA =>
+					txCrc_next <= crc16(txCrc, sendData);
+					if ( txCrcCount = 0 ) then
+						txCrcState_next <= T_CRC_HI;
+					else
+						txCrcCount_next <= txCrcCount - 1;
+					end if;
+				when T_CRC_HI =>
+					txCrcState_next <= T_CRC_LO;
+				when T_CRC_LO =>
+					txCrcState_next <= T_IDLE;
+				when others =>
+					if ( sendData = x"FE" or sendData = x"FC" ) then
+						txCrc_next <= (others => '0');
+						txCrcCount_next <= to_unsigned(BLOCK_SIZE-1, 10);
+						txCrcState_next <= T_DATA;
+					end if;
+			end case;
+		end if;
+
+		-- Mode changes and reports
+		case reportState is
+			when C_GOOD =>
+				if ( recvReady = '1' ) then
+					reportState_next <= C_BAD;
+				end if;
+
+			when C_BAD =>
+				if ( recvReady = '1' ) then
+					reportState_next <= C_IDLE;
+				end if;
+
+			-- C_IDLE
+			when others =>
+				if ( h2fValid_in = '1' and chanAddr_in = "0000101" and sendReady = '1' and pollState = S_IDLE ) then
+					crcMode_next <= h2fData_in(CRC_TX downto CRC_RX);
+					if ( h2fData_in(CRC_REPORT) = '1' ) then
+						reportGood_next <= good;
+						reportBad_next <= bad;
+						reportState_next <= C_GOOD;
+					end if;
+					if ( h2fData_in(CRC_REPORT) = '1' or h2fData_in(CRC_RX) = '0' ) then
+						good := (others => '0');
+						bad := (others => '0');
+					end if;
+					if ( h2fData_in(CRC_RX) = '0' ) then
+						rxCrcState_next <= R_IDLE;
+					end if;
+					if ( h2fData_in(CRC_TX) = '0' ) then
+						txCrcState_next <= T_IDLE;
+					end if;
+				end if;
+		end case;
+
+		crcGood_next <= good;
+		crcBad_next <= bad;
+	end process;
+
+	-- The SPI master can only accept a new byte once the previous one is complete, so by the time
+	-- the last poll argument (or a CRC engine command) is accepted, nothing sent on channel 0 is
+	-- still in flight.
+	sendData <=
+		pollByte when pollState = S_SEND
+		else txCrc(15 downto 8) when txCrcState = T_CRC_HI
+		else txCrc(7 downto 0) when txCrcState = T_CRC_LO
+		else h2fData_in;
+	sendValid <=
+		'1' when pollState = S_SEND
+		else h2fValid_in when chanAddr_in = "0000000" and pollState = S_IDLE and reportState = C_IDLE
+		else '0';
+	h2fReady_out <=
+		sendReady when pollState = S_IDLE and reportState = C_IDLE  -- wait until send complete before accepting more commands on ANY channel
+		else '0';
+
+	-- Whilst polling, the bytes clocked in go to the poll engine rather than the receive FIFO
+	recvData <=
+		pollResult when pollState = S_PUSH
+		else std_logic_vector(reportGood) when reportState = C_GOOD
+		else std_logic_vector(reportBad) when reportState = C_BAD
+		else spiRecvData;
+	recvValid <=
+		'1' when pollState = S_PUSH or reportState /= C_IDLE
+		else spiRecvValid when pollState = S_IDLE
+		else '0';
+	spiRecvReady <=
+		'1' when pollState = S_RECV
+		else recvReady when pollState = S_IDLE and reportState = C_IDLE
+		else '0';
 
 	f2hData_out <=
 		fifoData when chanAddr_in = "0000000"
+		else FEATURES when chanAddr_in = "0000010"
+		else fastCount when chanAddr_in = "0000011"
+		else FIFO_SIZE when chanAddr_in = "0000100"
+		else std_logic_vector(resize(unsigned(crcMode), 8)) when chanAddr_in = "0000101"
+		else IO_MODES when chanAddr_in = "0000110"
 		else std_logic_vector(resize(unsigned(config), 8));
 	f2hValid_out <=
 		fifoValid when chanAddr_in = "0000000"
@@ -92,13 +466,17 @@ begin
 		f2hReady_in when chanAddr_in = "0000000"
 		else '0';
 
+	-- The poll engine needs to see every byte clocked in
+	suppress <=
+		config(SUPPRESS) when pollState = S_IDLE
+		else '0';
+
 	spiCS_out <= not config(CHIPSEL+NUM_DEVS-1 downto CHIPSEL);
 	
-	spi_master : entity work.spi_master
+	spi_master : entity work.spi_master_var
 		generic map(
-			SLOW_COUNT => "111011",  -- spiClk = sysClk/120 (400kHz @48MHz)
-			FAST_COUNT => "000000",  -- spiClk = sysClk/2 (24MHz @48MHz)
-			BIT_ORDER  => '1'        -- MSB first
+			SLOW_COUNT => x"3B",  -- spiClk = sysClk/120 (400kHz @48MHz)
+			BIT_ORDER  => '1'     -- MSB first
 		)
 		port map(
 			reset_in       => '0',
@@ -106,23 +484,32 @@ begin
 
 			-- Send pipe
 			turbo_in       => config(TURBO),
-			suppress_in    => config(SUPPRESS),
+			fastCount_in   => fastCount,        -- spiClk = sysClk/2 (24MHz @48MHz) by default
+			suppress_in    => suppress,
+			width_in       => spiWidth,
+			wideIn_in      => spiWideIn,
 			sendData_in    => sendData,
 			sendValid_in   => sendValid,
 			sendReady_out  => sendReady,
 
 			-- Receive pipe
-			recvData_out   => recvData,
-			recvValid_out  => recvValid,
-			recvReady_in   => recvReady,
+			recvData_out   => spiRecvData,
+			recvValid_out  => spiRecvValid,
+			recvReady_in   => spiRecvReady,
 
 			-- SPI interface
 			spiClk_out     => spiClk_out,
 			spiData_out    => spiData_out,
-			spiData_in     => spiData_in
+			spiData_in     => spiData_in,
+			spiIO_out      => spiIO_out,
+			spiIOEn_out    => spiIOEn_out,
+			spiIO_in       => spiIO_in
 		);
 
 	recv_fifo : entity work.fifo_wrapper
+		generic map(
+			DEPTH           => FIFO_DEPTH
+		)
 		port map(
 			clk_in          => clk_in,
 